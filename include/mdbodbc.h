@@ -37,6 +37,7 @@ extern "C" {
 
 struct _henv {
 	MdbSQL *sql;	
+	struct _hstmt *prepared; /* statement sql was last prepared for */
 };
 struct _hdbc {
 	struct _henv *henv;
@@ -48,6 +49,7 @@ struct _hstmt {
 	 */
 	char query[4096];
 	struct _sql_bind_info *bind_head;
+	struct _sql_param_info *param_head;
 	int rows_affected;
 	int icol; /* SQLGetData: last column */
 	int pos; /* SQLGetData: last position (truncated result) */
@@ -62,6 +64,15 @@ struct _sql_bind_info {
 	struct _sql_bind_info *next;
 };
 
+struct _sql_param_info {
+	int param_number;
+	int param_ctype;
+	SQLLEN param_len;
+	SQLLEN *param_lenbind;
+	SQLPOINTER varaddr;
+	struct _sql_param_info *next;
+};
+
 #ifdef __cplusplus
 }
 #endif
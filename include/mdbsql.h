@@ -10,6 +10,15 @@
 #include <glib.h>
 #include <mdbtools.h>
 
+#define MDB_SQL_INNER_JOIN 1
+#define MDB_SQL_LEFT_JOIN  2
+
+typedef struct {
+	int join_type;
+	GPtrArray *keys1;	/* ON column names, keys1[i] = keys2[i] */
+	GPtrArray *keys2;
+} MdbSQLJoin;
+
 typedef struct {
 	MdbHandle *mdb;
 	int all_columns;
@@ -24,9 +33,42 @@ typedef struct {
 	void *bound_values[256];
 	unsigned char *kludge_ttable_pg;
 	long max_rows;
+	long offset; /* rows the result leaves out first */
 	char error_msg[1024];
+	/* ? placeholders of a prepared statement, see mdb_sql_prepare() */
+	GPtrArray *params;
+	/* the text of the prepared statement, see mdb_sql_execute() */
+	gchar *query;
+	/* the join of the two tables, see mdb_sql_join() */
+	MdbSQLJoin *join;
+	/* GROUP BY column names, see mdb_sql_aggregate() */
+	GPtrArray *group_by;
+	/* MdbSQLOrder of the ORDER BY clause, see mdb_sql_order() */
+	GPtrArray *order_by;
+	/* MDB_SQL_EXPLAIN* while explaining a query, see mdb_sql_explain() */
+	int explain;
+	GList *plan_stack;
 } MdbSQL;
 
+#define MDB_SQL_EXPLAIN		1	/* only plan the query */
+#define MDB_SQL_EXPLAIN_ANALYZE	2	/* run it too, and count */
+/* operators shouldn't read their input when only planning */
+#define mdb_sql_plan_only(sql) ((sql)->explain == MDB_SQL_EXPLAIN)
+
+/* a step of the plan EXPLAIN prints */
+typedef struct MdbSQLPlanStep {
+	char *desc;
+	MdbTableStats stats;	/* of the table it reads or returns */
+	GPtrArray *children;	/* the steps it reads from */
+	gconstpointer table;	/* only compared, it may be freed first */
+} MdbSQLPlanStep;
+
+#define MDB_SQL_COUNT 1
+#define MDB_SQL_SUM   2
+#define MDB_SQL_MIN   3
+#define MDB_SQL_MAX   4
+#define MDB_SQL_AVG   5
+
 typedef struct {
 	char *name;
 	int  disp_size;
@@ -34,6 +76,8 @@ typedef struct {
 	int  bind_type;
 	int  *bind_len;
 	int  bind_max;
+	int  agg_func;     /* MDB_SQL_COUNT etc, 0 for a plain column */
+	char *agg_col;     /* what it aggregates, NULL for COUNT(*) */
 } MdbSQLColumn;
 
 typedef struct {
@@ -46,23 +90,33 @@ typedef struct {
 	MdbSarg *sarg;
 } MdbSQLSarg;
 
-extern char *g_input_ptr;
+typedef struct {
+	char *name;
+	int order;	/* MDB_ASC or MDB_DESC */
+} MdbSQLOrder;
 
-#undef YY_INPUT
-#define YY_INPUT(b, r, ms) (r = mdb_sql_yyinput(b, ms));
+typedef struct {
+	MdbSargNode *node;	/* the sarg the value goes into */
+	int bound;
+} MdbSQLParam;
 
 #define mdb_sql_has_error(sql) ((sql)->error_msg[0] ? 1 : 0)
 #define mdb_sql_last_error(sql) ((sql)->error_msg)
 
 void mdb_sql_error(MdbSQL* sql, char *fmt, ...);
-extern MdbSQL *_mdb_sql(MdbSQL *sql);
+extern int mdb_sql_parse(MdbSQL *sql, const char *query);
 extern MdbSQL *mdb_sql_init();
 extern MdbSQLSarg *mdb_sql_alloc_sarg();
 extern MdbHandle *mdb_sql_open(MdbSQL *sql, char *db_name);
 extern int mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant);
+extern int mdb_sql_add_in(MdbSQL *sql, char *col_name, GPtrArray *constants);
+extern int mdb_sql_add_between(MdbSQL *sql, char *col_name, char *low, char *high);
 extern void mdb_sql_all_columns(MdbSQL *sql);
 extern int mdb_sql_add_column(MdbSQL *sql, char *column_name);
-extern int mdb_sql_add_table(MdbSQL *sql, char *table_name);
+extern int mdb_sql_add_aggregate(MdbSQL *sql, int agg_func, char *column_name);
+extern int mdb_sql_add_group_col(MdbSQL *sql, char *column_name);
+extern char *mdb_sql_agg_name(int agg_func, char *column_name);
+extern int mdb_sql_add_table(MdbSQL *sql, char *table_name, char *alias);
 extern void mdb_sql_dump(MdbSQL *sql);
 extern void mdb_sql_exit(MdbSQL *sql);
 extern void mdb_sql_reset(MdbSQL *sql);
@@ -76,11 +130,42 @@ extern void mdb_sql_add_not(MdbSQL *sql);
 extern void mdb_sql_describe_table(MdbSQL *sql);
 extern MdbSQL* mdb_sql_run_query (MdbSQL*, const gchar*);
 extern void mdb_sql_set_maxrow(MdbSQL *sql, int maxrow);
+extern void mdb_sql_set_offset(MdbSQL *sql, long offset);
 extern int mdb_sql_eval_expr(MdbSQL *sql, char *const1, int op, char *const2);
+extern char *mdb_sql_fold_expr(MdbSQL *sql, char *const1, int op, char *const2);
+extern char *mdb_sql_negate_expr(MdbSQL *sql, char *const1);
 extern void mdb_sql_bind_all(MdbSQL *sql);
 extern int mdb_sql_fetch_row(MdbSQL *sql, MdbTableDef *table);
 extern int mdb_sql_add_temp_col(MdbSQL *sql, MdbTableDef *ttable, int col_num, char *name, int col_type, int col_size, int is_fixed);
 extern void mdb_sql_bind_column(MdbSQL *sql, int colnum, void *varaddr, int *len_ptr);
+extern MdbSQL *mdb_sql_prepare(MdbSQL *sql, const gchar *querystr);
+extern int mdb_sql_bind_param(MdbSQL *sql, int num, const char *value);
+extern MdbSQL *mdb_sql_execute(MdbSQL *sql);
+extern MdbSargNode *mdb_sql_alloc_node();
+extern void mdb_sql_set_sarg_col(MdbSargNode *node, MdbColumn *col);
+extern void mdb_sql_free_tree(MdbSargNode *tree);
+extern guint32 mdb_sql_hash(unsigned char *key, guint32 len);
+
+/* explain.c */
+extern void mdb_sql_plan_scan(MdbSQL *sql, MdbTableDef *table);
+extern void mdb_sql_plan_op(MdbSQL *sql, MdbTableDef *ttable, int num_inputs, gint64 start, char *fmt, ...);
+extern void mdb_sql_free_plan(MdbSQL *sql);
+extern void mdb_sql_explain(MdbSQL *sql, int mode);
+
+/* join.c */
+extern void mdb_sql_set_join_type(MdbSQL *sql, int join_type);
+extern void mdb_sql_add_join_key(MdbSQL *sql, char *col1, char *col2);
+extern int mdb_sql_join(MdbSQL *sql);
+extern void mdb_sql_free_join(MdbSQLJoin *join);
+
+/* aggregate.c */
+extern int mdb_sql_has_aggregates(MdbSQL *sql);
+extern int mdb_sql_aggregate(MdbSQL *sql, MdbTableDef *table);
+
+/* sort.c */
+extern int mdb_sql_add_order(MdbSQL *sql, int agg_func, char *column_name, int order);
+extern void mdb_sql_free_order(GPtrArray *order_by);
+extern int mdb_sql_order(MdbSQL *sql);
 
 #ifdef __cplusplus
   }
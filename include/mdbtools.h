@@ -47,6 +47,8 @@
 #define MDB_CATALOG_PG 18
 #define MDB_MEMO_OVERHEAD 12
 #define MDB_BIND_SIZE 16384
+/* row offsets on data pages carry flags in the top bits */
+#define OFFSET_MASK 0x1fff
 
 enum {
 	MDB_PAGE_DB = 0,
@@ -107,13 +109,15 @@ enum {
 	MDB_LTEQ,
 	MDB_LIKE,
 	MDB_ISNULL,
-	MDB_NOTNULL
+	MDB_NOTNULL,
+	MDB_IN
 };
 
 typedef enum {
 	MDB_TABLE_SCAN,
 	MDB_LEAF_SCAN,
-	MDB_INDEX_SCAN
+	MDB_INDEX_SCAN,
+	MDB_BITMAP_SCAN
 } MdbStrategy;
 
 typedef enum {
@@ -121,6 +125,11 @@ typedef enum {
 	MDB_WRITABLE = 0x01
 } MdbFileFlags;
 
+typedef enum {
+	MDB_SYNC_NONE,
+	MDB_SYNC_DATA	/* fdatasync() after each flush */
+} MdbSyncMode;
+
 enum {
 	MDB_DEBUG_LIKE = 0x0001,
 	MDB_DEBUG_WRITE = 0x0002,
@@ -130,6 +139,7 @@ enum {
 	MDB_DEBUG_PROPS = 0x0020,
 	MDB_USE_INDEX = 0x0040,
 	MDB_NO_MEMO = 0x0080, /* don't follow memo fields */
+	MDB_INDEX_BATCH = 0x0100, /* fetch index hits in page order */
 };
 
 #define mdb_is_logical_op(x) (x == MDB_OR || \
@@ -143,7 +153,8 @@ enum {
 				x == MDB_LTEQ || \
 				x == MDB_LIKE || \
 				x == MDB_ISNULL || \
-				x == MDB_NOTNULL )
+				x == MDB_NOTNULL || \
+				x == MDB_IN )
 
 enum {
 	MDB_ASC,
@@ -174,6 +185,7 @@ enum {
 /* forward declarations */
 typedef struct mdbindex MdbIndex;
 typedef struct mdbsargtree MdbSargNode;
+typedef struct mdbfield MdbField;
 
 typedef struct {
 	char *name;
@@ -200,6 +212,13 @@ typedef struct {
 typedef struct {
 	gboolean collect;
 	unsigned long pg_reads;
+	/* pg_reads by page type */
+	unsigned long data_pg_reads;
+	unsigned long index_pg_reads;	/* intermediate and leaf pages */
+	unsigned long lval_pg_reads;
+	unsigned long map_pg_reads;
+	/* pages found in memory: the page buffer, or not yet flushed */
+	unsigned long pg_hits;
 } MdbStatistics;
 
 typedef struct {
@@ -215,6 +234,21 @@ typedef struct {
 	/* free map */
 	int  map_sz;
 	unsigned char *free_map;
+	/* written pages not yet flushed to disk, see mdb_flush() */
+	GHashTable	*dirty;
+	guint32		dirty_end;	/* one past the highest dirty page */
+	MdbSyncMode	sync;
+	guint32		free_hint;	/* pages up to it aren't free */
+	/* rollback journal, see journal.c */
+	gboolean	journal;
+	int		journal_fd;	/* -1 when no journal is open */
+	GHashTable	*journaled;	/* pages saved to it */
+	guint32		journal_end;	/* pages in the file when it was started */
+	int		txn_depth;
+	/* snapshots of readers, see snapshot.c */
+	guint32		version;	/* commits so far */
+	GHashTable	*old_pgs;	/* pages overwritten since they began */
+	GSList		*snapshots;	/* handles reading one */
 	/* reference count */
 	int refs;
 } MdbFile; 
@@ -254,6 +288,7 @@ typedef struct {
 	char		*backend_name;
 	MdbFormatConstants *fmt;
 	MdbStatistics *stats;
+	guint32		snapshot;	/* see mdb_snapshot_begin(), 0 for none */
 #ifdef HAVE_ICONV
 	iconv_t	iconv_in;
 	iconv_t	iconv_out;
@@ -283,6 +318,12 @@ typedef union {
 } MdbAny;
 
 struct S_MdbTableDef; /* forward definition */
+/* what mdb_fetch_row() did for a table, see MdbTableDef.stats */
+typedef struct {
+	unsigned long rows_examined;	/* tested against the sargs */
+	unsigned long rows_returned;
+	gint64 usecs;	/* in mdb_fetch_row(), with the tables it reads */
+} MdbTableStats;
 typedef struct {
 	struct S_MdbTableDef *table;
 	char		name[MDB_MAX_OBJ_NAME+1];
@@ -322,7 +363,9 @@ struct mdbsargtree {
 	int       op;
 	MdbColumn *col;
 	MdbAny    value;
+	double    num;	/* a number literal, for floating point columns */
 	void      *parent;
+	GArray    *set;	/* sorted MdbAny values of an MDB_IN node */
 	MdbSargNode *left;
 	MdbSargNode *right;
 };
@@ -332,13 +375,33 @@ typedef struct {
 	int start_pos;
 	int offset;
 	int len;
-	guint16 idx_starts[2000];	
+	int bit;	/* bitmap position of the current entry */
+	guint16 *idx_starts;	/* only unpacked when rewriting the page */
 	unsigned char cache_value[256];
 } MdbIndexPage;
 
 typedef int (*MdbSargTreeFunc)(MdbSargNode *, gpointer data);
 
 #define MDB_MAX_INDEX_DEPTH 10
+#define MDB_INDEX_BATCH_SZ 1024
+
+/* rows on each data page, keyed by page number */
+typedef struct {
+	GHashTable *pages;
+	unsigned int num_rows;
+} MdbRowSet;
+
+/* an open sidecar index file, see sidecar.c */
+typedef struct {
+	char *path;
+	MdbColumn *col;
+	unsigned char *map;
+	size_t map_sz;
+	int mapped;
+	int key_len;
+	int rec_len;
+	guint32 num_recs;
+} MdbSidecar;
 
 typedef struct {
 	int cur_depth;
@@ -347,6 +410,11 @@ typedef struct {
 	MdbIndexPage pages[MDB_MAX_INDEX_DEPTH];
 } MdbIndexChain;
 
+/* sees the fields of each row mdb_fetch_row() returns, see row_func */
+typedef void (*MdbRowFunc)(struct S_MdbTableDef *table, MdbField *fields, int num_fields, gpointer data);
+/* fills in the fields of an operator table's next row, see fetch_func */
+typedef int (*MdbFetchFunc)(struct S_MdbTableDef *table, MdbField *fields, gpointer data);
+
 typedef struct S_MdbTableDef {
 	MdbCatalogEntry *entry;
 	char	name[MDB_MAX_OBJ_NAME+1];
@@ -370,12 +438,33 @@ typedef struct S_MdbTableDef {
 	guint32  freemap_base_pg;
 	size_t freemap_sz;
 	unsigned char *free_usage_map;
+	guint32  freemap_hint; /* where the last row was added */
+	guint32  lval_pg; /* LVAL page new long values are packed into */
 	/* query planner */
 	MdbSargNode *sarg_tree;
 	MdbStrategy strategy;
 	MdbIndex *scan_idx;
 	MdbHandle *mdbidx;
 	MdbIndexChain *chain;
+	/* index hits as (pg << 8 | row), sorted by page */
+	guint32 *batch;
+	unsigned int batch_sz;
+	unsigned int batch_pos;
+	int keep_order; /* index scans return rows in key order, unbatched */
+	/* mdb_fetch_row() skips skip_rows rows, then returns max_rows (-1: all) */
+	long skip_rows;
+	long max_rows;
+	long num_fetched; /* rows skipped or returned since the rewind */
+	/* called with the cracked row before its columns are bound */
+	MdbRowFunc row_func;
+	gpointer row_data;
+	/* an operator table's rows come from fetch_func instead of pages */
+	MdbFetchFunc fetch_func;
+	gpointer fetch_data;
+	GDestroyNotify fetch_free; /* frees fetch_data with the table */
+	MdbTableStats *stats; /* counted into if set, not freed with the table */
+	/* a flag per column, the only ones cracked if set, see mdb_need_column() */
+	unsigned char *col_needed;
 	MdbProperties	*props;
 	unsigned int num_var_cols;  /* to know if row has variable columns */
 	/* temp table */
@@ -388,6 +477,8 @@ struct mdbindex {
 	char		name[MDB_MAX_OBJ_NAME+1];
 	unsigned char	index_type;
 	guint32		first_pg;
+	guint32		first_pg_tdef;	/* where first_pg is stored in the */
+	int		first_pg_pos;	/* table definition, 0 if unknown */
 	int		num_rows;  /* number rows in index */
 	unsigned int	num_keys;
 	short	key_col_num[MDB_MAX_IDX_COLS];
@@ -400,7 +491,7 @@ typedef struct {
 	char		name[MDB_MAX_OBJ_NAME+1];
 } MdbColumnProp;
 
-typedef struct {
+struct mdbfield {
 	void *value;
 	int siz;
 	int start;
@@ -408,7 +499,35 @@ typedef struct {
 	unsigned char is_fixed;
 	int colnum;
 	int offset;
-} MdbField;
+};
+
+/* index entries collected for a bottom-up build, see mdb_index_build_new() */
+typedef struct {
+	MdbIndex *idx;
+	GByteArray *recs;	/* entries in memory, 2 byte length + entry */
+	GArray *offsets;	/* where each of them starts in recs */
+	GPtrArray *runs;	/* sorted runs spilled to temporary files */
+	guint32 num_entries;
+} MdbIndexBuild;
+
+/* a memo or OLE value being written, see lval.c */
+typedef struct {
+	MdbTableDef *table;
+	GByteArray *buf;	/* data not written to a page yet */
+	guint32 len;		/* length of the value so far */
+	guint32 first_pg_row;	/* start of the chain, once there is one */
+	guint32 last_pg_row;	/* its end, whose next pointer is still 0 */
+} MdbLvalWriter;
+
+/* state of a bulk load, see mdb_bulk_insert_begin() */
+typedef struct {
+	MdbTableDef *table;
+	void *pg_buf;		/* data page being filled */
+	guint32 pg;		/* and its page number */
+	unsigned int num_rows;
+	unsigned int num_pages;
+	GPtrArray *idx_builds;	/* per index, NULL where updated per row */
+} MdbBulkInsert;
 
 typedef struct {
 	int	op;
@@ -470,6 +589,8 @@ extern void mdb_date_to_tm(double td, struct tm *t);
 extern void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_ptr);
 extern int mdb_rewind_table(MdbTableDef *table);
 extern int mdb_fetch_row(MdbTableDef *table);
+extern void mdb_limit_rows(MdbTableDef *table, long skip_rows, long max_rows);
+extern void mdb_need_column(MdbTableDef *table, MdbColumn *col);
 extern int mdb_is_fixed_col(MdbColumn *col);
 extern char *mdb_col_to_string(MdbHandle *mdb, void *buf, int start, int datatype, int size);
 extern int mdb_find_pg_row(MdbHandle *mdb, int pg_row, void **buf, int *off, size_t *len);
@@ -482,6 +603,7 @@ extern size_t mdb_ole_read(MdbHandle *mdb, MdbColumn *col, void *ole_ptr, int ch
 extern void* mdb_ole_read_full(MdbHandle *mdb, MdbColumn *col, size_t *size);
 extern void mdb_set_date_fmt(const char *);
 extern int mdb_read_row(MdbTableDef *table, unsigned int row);
+extern int mdb_read_next_dpg(MdbTableDef *table);
 
 /* dump.c */
 extern void mdb_buffer_dump(const void *buf, int start, size_t len);
@@ -501,12 +623,17 @@ extern void mdb_print_schema(MdbHandle *mdb, FILE *outfile, char *tabname, char
 /* sargs.c */
 extern int mdb_test_sargs(MdbTableDef *table, MdbField *fields, int num_fields);
 extern int mdb_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, MdbField *field);
+extern int mdb_test_sarg_node(MdbHandle *mdb, MdbSargNode *node, MdbField *fields, int num_fields);
 extern void mdb_sql_walk_tree(MdbSargNode *node, MdbSargTreeFunc func, gpointer data);
 extern int mdb_find_indexable_sargs(MdbSargNode *node, gpointer data);
+extern int mdb_find_needed_cols(MdbSargNode *node, gpointer data);
 extern int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_sarg);
 extern int mdb_test_string(MdbSargNode *node, char *s);
 extern int mdb_test_int(MdbSargNode *node, gint32 i);
+extern int mdb_test_double(MdbSargNode *node, double d);
+extern void mdb_sort_sarg_set(MdbSargNode *node, int text);
 extern int mdb_add_sarg(MdbColumn *col, MdbSarg *in_sarg);
+extern void mdb_free_sargs(MdbColumn *col);
 
 
 
@@ -518,11 +645,28 @@ extern int mdb_index_find_next_on_page(MdbHandle *mdb, MdbIndexPage *ipg);
 extern int mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 *pg, guint16 *row);
 extern void mdb_index_hash_text(char *text, char *hash);
 extern void mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table);
+extern int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx);
+extern void mdb_index_scan_ordered(MdbHandle *mdb, MdbTableDef *table, MdbIndex *idx);
+extern int mdb_index_fill_batch(MdbTableDef *table);
+extern int mdb_index_count_sargs(MdbTableDef *table, MdbSargNode *node);
+extern MdbRowSet *mdb_index_collect_rows(MdbTableDef *table, MdbSargNode *node);
 extern int mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 pg, guint16 row);
+extern int mdb_index_seek_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len, guint32 pg, guint16 row);
+extern int mdb_index_encode_col(MdbHandle *mdb, MdbColumn *col, int order, MdbField *field, unsigned char *dest);
+extern int mdb_index_build_key(MdbTableDef *table, MdbIndex *idx, MdbField *idx_fields, unsigned char *key);
+extern int mdb_index_leaf_insert(MdbHandle *mdb, MdbIndexPage *ipg, unsigned char *entry, int len, int at_end);
+extern int mdb_index_is_writable(MdbIndex *idx);
 extern void mdb_index_swap_n(unsigned char *src, int sz, unsigned char *dest);
 extern void mdb_free_indices(GPtrArray *indices);
 void mdb_index_page_reset(MdbIndexPage *ipg);
 extern int mdb_index_pack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg);
+extern int mdb_index_unpack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg);
+extern MdbIndexBuild *mdb_index_build_new(MdbIndex *idx);
+extern int mdb_index_build_add(MdbIndexBuild *build, unsigned char *key, int key_len, guint32 pg, guint16 row);
+extern int mdb_index_build_finish(MdbIndexBuild *build);
+extern void mdb_index_build_free(MdbIndexBuild *build);
+extern int mdb_index_free_pages(MdbIndex *idx);
+extern int mdb_index_min_max(MdbTableDef *table, MdbColumn *col, int max, guint32 *pg, guint16 *row);
 
 /* stats.c */
 extern void mdb_stats_on(MdbHandle *mdb);
@@ -533,10 +677,15 @@ extern void mdb_dump_stats(MdbHandle *mdb);
 extern int mdb_like_cmp(char *s, char *r);
 
 /* write.c */
+extern ssize_t mdb_write_pg(MdbHandle *mdb, unsigned long pg);
+extern guint32 mdb_file_pages(MdbHandle *mdb);
+extern int mdb_flush(MdbHandle *mdb);
+extern void mdb_set_sync(MdbHandle *mdb, MdbSyncMode sync);
 extern void mdb_put_int16(void *buf, guint32 offset, guint32 value);
 extern void mdb_put_int32(void *buf, guint32 offset, guint32 value);
 extern void mdb_put_int32_msb(void *buf, guint32 offset, guint32 value);
 extern int mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields);
+extern int mdb_crack_cols(MdbTableDef *table, int row_start, int row_end, MdbField *fields, unsigned char *needed);
 extern guint16 mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_size);
 extern int mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum);
 extern int mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields);
@@ -545,10 +694,24 @@ extern int mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_r
 extern int mdb_pg_get_freespace(MdbHandle *mdb);
 extern int mdb_update_row(MdbTableDef *table);
 extern void *mdb_new_data_pg(MdbCatalogEntry *entry);
+extern MdbBulkInsert *mdb_bulk_insert_begin(MdbTableDef *table);
+extern int mdb_bulk_insert_append(MdbBulkInsert *bulk, int num_fields, MdbField *fields);
+extern int mdb_bulk_insert_end(MdbBulkInsert *bulk);
 
 /* map.c */
 extern guint32 mdb_map_find_next_freepage(MdbTableDef *table, int row_size);
 extern gint32 mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg);
+extern int mdb_map_set_page(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 pg, int used);
+extern int mdb_map_save(MdbTableDef *table);
+extern guint32 mdb_alloc_page(MdbTableDef *table);
+extern int mdb_map_use_page(MdbHandle *mdb, guint32 pg);
+extern int mdb_map_free_page(MdbHandle *mdb, guint32 pg);
+extern guint32 mdb_map_next_page(MdbHandle *mdb, unsigned char *tab_map, size_t tab_map_sz);
+extern guint32 mdb_map_used_pages(MdbHandle *mdb);
+
+/* compact.c */
+extern int mdb_compact_table(MdbTableDef *table);
+extern int mdb_compact(MdbHandle *mdb);
 
 /* props.c */
 extern void mdb_free_props(MdbProperties *props);
@@ -562,6 +725,7 @@ extern void mdb_temp_table_add_col(MdbTableDef *table, MdbColumn *col);
 extern void mdb_fill_temp_col(MdbColumn *tcol, char *col_name, int col_size, int col_type, int is_fixed);
 extern void mdb_fill_temp_field(MdbField *field, void *value, int siz, int is_fixed, int is_null, int start, int column);
 extern void mdb_temp_columns_end(MdbTableDef *table);
+extern MdbTableDef *mdb_create_op_table(MdbHandle *mdb, char *name, MdbFetchFunc fetch_func, gpointer data, GDestroyNotify free_func);
 
 /* options.c */
 extern int mdb_get_option(unsigned long optnum);
@@ -574,6 +738,51 @@ extern void mdb_iconv_init(MdbHandle *mdb);
 extern void mdb_iconv_close(MdbHandle *mdb);
 extern const char* mdb_target_charset(MdbHandle *mdb);
 
+/* rowset.c */
+extern MdbRowSet *mdb_rowset_new();
+extern void mdb_rowset_free(MdbRowSet *set);
+extern void mdb_rowset_add(MdbRowSet *set, guint32 pg, guint16 row);
+extern void mdb_rowset_and(MdbRowSet *set, MdbRowSet *other);
+extern void mdb_rowset_or(MdbRowSet *set, MdbRowSet *other);
+extern guint32 *mdb_rowset_to_array(MdbRowSet *set, unsigned int *count);
+extern int mdb_cmp_guint32(const void *a, const void *b);
+
+/* snapshot.c */
+extern void mdb_snapshot_begin(MdbHandle *mdb);
+extern void mdb_snapshot_end(MdbHandle *mdb);
+extern int mdb_snapshot_read_pg(MdbHandle *mdb, void *pg_buf, guint32 pg);
+extern int mdb_snapshot_save(MdbHandle *mdb, guint32 *pgs, unsigned int num_pgs);
+extern void mdb_snapshot_commit(MdbHandle *mdb);
+extern void mdb_snapshot_free(MdbFile *f);
+
+/* lval.c */
+extern MdbLvalWriter *mdb_lval_writer_new(MdbTableDef *table);
+extern int mdb_lval_write(MdbLvalWriter *w, void *data, size_t len);
+extern int mdb_lval_finish(MdbLvalWriter *w, unsigned char *dest, size_t inline_max);
+extern void mdb_lval_abort(MdbLvalWriter *w);
+extern void mdb_lval_delete(MdbTableDef *table, unsigned char *field);
+extern int mdb_lval_put(MdbTableDef *table, void *data, size_t len, unsigned char *dest, size_t inline_max);
+extern unsigned char *mdb_lval_get(MdbHandle *mdb, unsigned char *field, int siz, size_t *len, GHashTable *pages);
+
+/* journal.c */
+extern char *mdb_journal_path(const char *filename);
+extern int mdb_journal_recover(const char *filename);
+extern void mdb_set_journal(MdbHandle *mdb, gboolean journal);
+extern int mdb_journal_save(MdbHandle *mdb, guint32 *pgs, unsigned int num_pgs);
+extern int mdb_journal_end(MdbHandle *mdb);
+extern void mdb_journal_begin(MdbHandle *mdb);
+extern int mdb_journal_commit(MdbHandle *mdb);
+extern int mdb_journal_rollback(MdbHandle *mdb);
+
+/* sidecar.c */
+extern char *mdb_sidecar_path(MdbTableDef *table, MdbColumn *col);
+extern int mdb_sidecar_build(MdbTableDef *table, MdbColumn *col);
+extern MdbSidecar *mdb_sidecar_open(MdbTableDef *table, MdbColumn *col);
+extern void mdb_sidecar_close(MdbSidecar *sc);
+extern int mdb_sidecar_encode_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, unsigned char *dest);
+extern MdbRowSet *mdb_sidecar_lookup(MdbSidecar *sc, MdbHandle *mdb, MdbSargNode *node);
+extern int mdb_sidecar_usable(MdbTableDef *table, MdbSargNode *node);
+
 #ifdef __cplusplus
   }
 #endif
@@ -102,11 +102,7 @@ gchar *titles[256];
 	gtk_combo_set_popdown_strings(GTK_COMBO(sqlwin->combo), sqlwin->history);
 
 	/* ok now execute it */
-	g_input_ptr = buf;
-    /* begin unsafe */
-	_mdb_sql(sql);
-	if (yyparse()) {
-		/* end unsafe */
+	if (mdb_sql_parse(sql, buf)) {
 		gmdb_info_msg("Couldn't parse SQL");
 		mdb_sql_reset(sql);
 		return;
@@ -0,0 +1,425 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Compacting a table copies its live rows, with their long values, to a
+ * temporary file, gives its data, LVAL and index pages back to the global
+ * usage map, and loads the rows again with a bulk insert.  New pages are
+ * taken from the lowest free pages, so once every table has been through
+ * it the free pages gather at the end of the file, which is cut off.
+ *
+ * Rows in the temporary file are the number of fields followed by each
+ * field: flags (MDB_COMPACT_*), column number, size and value.  Long
+ * values are stored whole, without the memo field that pointed at them.
+ */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_COMPACT_NULL  0x01
+#define MDB_COMPACT_FIXED 0x02
+#define MDB_COMPACT_LONG  0x04
+
+static int
+mdb_compact_write(FILE *spool, void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, spool) != 1) {
+		perror("fwrite");
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Copy the row at row_start on the page in pg_buf to the spool.
+ */
+static int
+mdb_compact_spool_row(MdbTableDef *table, FILE *spool, int row_start, size_t row_size, GHashTable *lval_pgs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbField fields[256];
+	MdbColumn *col;
+	unsigned char hdr[7], *value;
+	size_t len;
+	int num_fields, i, ret = 1;
+	guint32 flags;
+
+	num_fields = mdb_crack_row(table, row_start, row_start + row_size - 1, fields);
+	mdb_put_int32(hdr, 0, num_fields);
+	if (!mdb_compact_write(spool, hdr, 4))
+		return 0;
+	for (i=0;ret && i<num_fields;i++) {
+		col = g_ptr_array_index(table->columns, fields[i].colnum);
+		value = fields[i].value;
+		len = fields[i].siz;
+		hdr[0] = (fields[i].is_null ? MDB_COMPACT_NULL : 0)
+			| (fields[i].is_fixed ? MDB_COMPACT_FIXED : 0);
+		if ((col->col_type == MDB_MEMO || col->col_type == MDB_OLE)
+		 && !fields[i].is_null && len >= MDB_MEMO_OVERHEAD) {
+			flags = mdb_get_int32(value, 0);
+			/* values in the row can stay there */
+			if (!(flags & 0x80000000)) {
+				value = mdb_lval_get(mdb, value, len, &len, lval_pgs);
+				if (!value) {
+					fprintf(stderr, "Can't read long value of column %s\n", col->name);
+					return 0;
+				}
+				hdr[0] |= MDB_COMPACT_LONG;
+			}
+		}
+		mdb_put_int16(hdr, 1, fields[i].colnum);
+		mdb_put_int32(hdr, 3, len);
+		ret = mdb_compact_write(spool, hdr, 7)
+			&& mdb_compact_write(spool, value, len);
+		if (hdr[0] & MDB_COMPACT_LONG)
+			g_free(value);
+	}
+	return ret;
+}
+/*
+ * Copy the live rows of table to the spool, noting the data pages in
+ * data_pgs and the rows read from LVAL pages in lval_pgs.
+ */
+static int
+mdb_compact_spool(MdbTableDef *table, FILE *spool, GArray *data_pgs, GHashTable *lval_pgs, guint32 *num_rows)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	int rco = mdb->fmt->row_count_offset;
+	int row_start, i, rows;
+	size_t row_size;
+	guint32 pg_row;
+	gint32 pg = 0;
+
+	while ((pg = mdb_map_find_next(mdb, table->usage_map, table->map_sz, pg)) > 0) {
+		if (!mdb_read_pg(mdb, pg))
+			return 0;
+		if (mdb->pg_buf[0] != MDB_PAGE_DATA
+		 || mdb_get_int32(mdb->pg_buf, 4) != entry->table_pg)
+			continue;
+		g_array_append_val(data_pgs, pg);
+		rows = mdb_get_int16(mdb->pg_buf, rco);
+		for (i=0;i<rows;i++) {
+			mdb_find_row(mdb, i, &row_start, &row_size);
+			/* deleted, or moved and reached through its pointer */
+			if (row_start & 0x4000)
+				continue;
+			if ((row_start & 0x8000) && row_size == 4) {
+				pg_row = mdb_get_int32(mdb->pg_buf, row_start & OFFSET_MASK);
+				if (!mdb_read_pg(mdb, pg_row >> 8))
+					return 0;
+				mdb_find_row(mdb, pg_row & 0xff, &row_start, &row_size);
+				if (!mdb_compact_spool_row(table, spool,
+				    row_start & OFFSET_MASK, row_size, lval_pgs))
+					return 0;
+				if (!mdb_read_pg(mdb, pg))
+					return 0;
+			} else if (!mdb_compact_spool_row(table, spool,
+			    row_start & OFFSET_MASK, row_size, lval_pgs)) {
+				return 0;
+			}
+			(*num_rows)++;
+		}
+	}
+	return pg == 0;
+}
+/*
+ * Free an LVAL page if all the rows left on it belong to values of the
+ * table that were read.
+ */
+static int
+mdb_compact_free_lval_pg(MdbHandle *mdb, guint32 pg, unsigned int num_read)
+{
+	int rco = mdb->fmt->row_count_offset;
+	int row_start, i, rows, live = 0;
+	size_t row_size;
+
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	rows = mdb_get_int16(mdb->pg_buf, rco);
+	for (i=0;i<rows;i++) {
+		mdb_find_row(mdb, i, &row_start, &row_size);
+		if (!(row_start & 0x4000))
+			live++;
+	}
+	if (live > (int) num_read)
+		return 1;
+	return mdb_map_free_page(mdb, pg);
+}
+/*
+ * Give the pages of table back, leaving it empty with no index pages.
+ */
+static int
+mdb_compact_free(MdbTableDef *table, GArray *data_pgs, GHashTable *lval_pgs)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	GHashTableIter iter;
+	gpointer key, value;
+	MdbIndex *idx;
+	guint32 pg;
+	unsigned int i;
+
+	for (i=0;i<data_pgs->len;i++) {
+		pg = g_array_index(data_pgs, guint32, i);
+		if (!mdb_map_set_page(mdb, table->usage_map, table->map_sz, pg, 0)
+		 || !mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz, pg, 0)
+		 || !mdb_map_free_page(mdb, pg))
+			return 0;
+	}
+	g_hash_table_iter_init(&iter, lval_pgs);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (!mdb_compact_free_lval_pg(mdb, GPOINTER_TO_UINT(key),
+		    GPOINTER_TO_UINT(value)))
+			return 0;
+	}
+	table->lval_pg = 0;
+	table->freemap_hint = 0;
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type != 2 && !mdb_index_free_pages(idx))
+			return 0;
+	}
+
+	table->num_rows = 0;
+	if (!mdb_map_save(table) || !mdb_read_pg(mdb, entry->table_pg))
+		return 0;
+	mdb_put_int32(mdb->pg_buf, mdb->fmt->tab_num_rows_offset, 0);
+	return mdb_write_pg(mdb, entry->table_pg) ? 1 : 0;
+}
+static int
+mdb_compact_read(FILE *spool, void *buf, size_t len)
+{
+	if (len && fread(buf, len, 1, spool) != 1) {
+		fprintf(stderr, "Short read on compaction spool\n");
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Load the rows in the spool back into table.
+ */
+static int
+mdb_compact_load(MdbTableDef *table, FILE *spool, guint32 num_rows)
+{
+	MdbBulkInsert *bulk;
+	MdbField fields[256];
+	unsigned char *values[256];
+	unsigned char hdr[7], *data;
+	guint32 row;
+	int num_fields, i, ret = 1;
+	size_t len;
+
+	if (!(bulk = mdb_bulk_insert_begin(table)))
+		return 0;
+	for (row=0;ret && row<num_rows;row++) {
+		if (!mdb_compact_read(spool, hdr, 4)) {
+			ret = 0;
+			break;
+		}
+		num_fields = mdb_get_int32(hdr, 0);
+		memset(values, 0, sizeof(values));
+		for (i=0;ret && i<num_fields;i++) {
+			if (!mdb_compact_read(spool, hdr, 7)) {
+				ret = 0;
+				break;
+			}
+			len = mdb_get_int32(hdr, 3);
+			data = g_malloc(len + MDB_MEMO_OVERHEAD);
+			if (!mdb_compact_read(spool, data, len)) {
+				g_free(data);
+				ret = 0;
+				break;
+			}
+			memset(&fields[i], 0, sizeof(MdbField));
+			fields[i].colnum = mdb_get_int16(hdr, 1);
+			fields[i].is_null = (hdr[0] & MDB_COMPACT_NULL) ? 1 : 0;
+			fields[i].is_fixed = (hdr[0] & MDB_COMPACT_FIXED) ? 1 : 0;
+			fields[i].siz = len;
+			fields[i].value = data;
+			values[i] = data;
+			if (hdr[0] & MDB_COMPACT_LONG) {
+				values[i] = g_malloc(MDB_MEMO_OVERHEAD);
+				fields[i].value = values[i];
+				fields[i].siz = mdb_lval_put(table, data, len, values[i], 0);
+				g_free(data);
+				if (fields[i].siz < 0)
+					ret = 0;
+			}
+		}
+		if (ret)
+			ret = mdb_bulk_insert_append(bulk, num_fields, fields);
+		for (i=0;i<num_fields;i++)
+			g_free(values[i]);
+	}
+	if (!mdb_bulk_insert_end(bulk))
+		ret = 0;
+	return ret;
+}
+/*
+ * an index without rows still needs its empty root leaf
+ */
+static int
+mdb_compact_empty_indexes(MdbTableDef *table)
+{
+	MdbIndexBuild *build;
+	unsigned int i;
+
+	for (i=0;i<table->num_idxs;i++) {
+		build = mdb_index_build_new(g_ptr_array_index(table->indices, i));
+		if (build && !mdb_index_build_finish(build))
+			return 0;
+	}
+	return 1;
+}
+/*
+ * Can every index of table be rebuilt from scratch with the keys Jet
+ * would write?  Indexes on text columns can't, see mdb_index_is_writable().
+ * A foreign key reference has no pages of its own, the index it shares
+ * has to be one of the table's.
+ */
+static int
+mdb_compact_can_rebuild(MdbTableDef *table)
+{
+	MdbIndex *idx, *real;
+	unsigned int i, j;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type == 2) {
+			for (j=0;j<table->num_idxs;j++) {
+				real = g_ptr_array_index(table->indices, j);
+				if (real->index_type != 2
+				 && real->index_num == idx->index_num)
+					break;
+			}
+			if (j < table->num_idxs)
+				continue;
+		} else if (mdb_index_is_writable(idx) && idx->first_pg_pos) {
+			continue;
+		}
+		fprintf(stderr, "Can't rebuild index %s of %s, skipping table\n",
+			idx->name, table->name);
+		return 0;
+	}
+	return 1;
+}
+/**
+ * mdb_compact_table:
+ * @table: the table, with its columns and indexes read
+ *
+ * Rewrites the live rows of @table onto as few pages as they fit, long
+ * values included, and rebuilds its indexes.  The pages it used before
+ * are freed.  Tables with indexes that can't be rebuilt yet are left as
+ * they are.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_compact_table(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	GArray *data_pgs;
+	GHashTable *lval_pgs;
+	FILE *spool;
+	guint32 num_rows = 0;
+	int ret;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	/* every row moves, so an index left as it was would be wrong */
+	if (!mdb_compact_can_rebuild(table))
+		return 1;
+	if (!(spool = tmpfile())) {
+		perror("tmpfile");
+		return 0;
+	}
+	data_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	lval_pgs = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	ret = mdb_compact_spool(table, spool, data_pgs, lval_pgs, &num_rows);
+	mdb_debug(MDB_DEBUG_WRITE, "compacting %s: %lu rows on %u pages",
+		table->name, (unsigned long) num_rows, data_pgs->len);
+	if (ret)
+		ret = mdb_compact_free(table, data_pgs, lval_pgs);
+	rewind(spool);
+	if (ret)
+		ret = num_rows ? mdb_compact_load(table, spool, num_rows) :
+			mdb_compact_empty_indexes(table);
+
+	g_hash_table_destroy(lval_pgs);
+	g_array_free(data_pgs, TRUE);
+	fclose(spool);
+
+	return ret;
+}
+/**
+ * mdb_compact:
+ * @mdb: Handle to a database open for writing
+ *
+ * Compacts every user table in one transaction, then cuts the free pages
+ * off the end of the file.  With the journal on (see mdb_set_journal())
+ * a crash or failure part way leaves the file as it was.
+ *
+ * Returns: the number of pages the file shrank by, or -1 on failure.
+ */
+int
+mdb_compact(MdbHandle *mdb)
+{
+	MdbCatalogEntry *entry;
+	MdbTableDef *table;
+	guint32 old_pgs, num_pgs;
+	unsigned int i;
+
+	if (!mdb_read_catalog(mdb, MDB_TABLE))
+		return -1;
+	old_pgs = mdb_file_pages(mdb);
+	mdb_journal_begin(mdb);
+	for (i=0;i<mdb->num_catalog;i++) {
+		entry = g_ptr_array_index(mdb->catalog, i);
+		if (entry->object_type != MDB_TABLE || mdb_is_system_table(entry))
+			continue;
+		table = mdb_read_table(entry);
+		if (!table) {
+			mdb_journal_rollback(mdb);
+			return -1;
+		}
+		mdb_read_columns(table);
+		mdb_read_indices(table);
+		if (!mdb_compact_table(table)) {
+			fprintf(stderr, "Compacting %s failed\n", table->name);
+			mdb_free_tabledef(table);
+			mdb_journal_rollback(mdb);
+			return -1;
+		}
+		mdb_free_tabledef(table);
+	}
+	if (!mdb_journal_commit(mdb))
+		return -1;
+	/* a rollback would need the freed pages, so only cut them off now */
+	num_pgs = mdb_map_used_pages(mdb);
+	if (num_pgs < old_pgs &&
+	    ftruncate(mdb->f->fd, (off_t) num_pgs * mdb->fmt->pg_size)) {
+		perror("ftruncate");
+		return -1;
+	}
+	return old_pgs - MIN(old_pgs, num_pgs);
+}
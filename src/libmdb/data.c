@@ -24,8 +24,6 @@
 #include "dmalloc.h"
 #endif
 
-#define OFFSET_MASK 0x1fff
-
 char *mdb_money_to_string(MdbHandle *mdb, int start);
 char *mdb_numeric_to_string(MdbHandle *mdb, int start, int prec, int scale);
 
@@ -48,7 +46,7 @@ void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_p
 {
 	MdbColumn *col;
 
-	/* 
+	/*
 	** the column arrary is 0 based, so decrement to get 1 based parameter 
 	*/
 	col=g_ptr_array_index(table->columns, col_num - 1);
@@ -58,6 +56,29 @@ void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_p
 	if (len_ptr)
 		col->len_ptr = len_ptr;
 }
+/**
+ * mdb_need_column:
+ * @table: Table being read
+ * @col: Column of @table whose values are looked at
+ *
+ * Tells mdb_fetch_row() that the column is used, by a sarg, a row_func or
+ * whoever reads its value after the fetch.  Once a column of a table has
+ * been named, the others are not cracked, unless they are bound, and their
+ * values, memos and OLE included, are never followed.  mdb_crack_row()
+ * itself always returns every column.
+ */
+void
+mdb_need_column(MdbTableDef *table, MdbColumn *col)
+{
+	unsigned int i;
+
+	if (!table->col_needed)
+		table->col_needed = g_malloc0(table->num_cols);
+	for (i=0;i<table->num_cols;i++) {
+		if (g_ptr_array_index(table->columns, i) == col)
+			table->col_needed[i] = 1;
+	}
+}
 int
 mdb_bind_column_by_name(MdbTableDef *table, gchar *col_name, void *bind_ptr, int *len_ptr)
 {
@@ -238,16 +259,100 @@ int ret;
 	}
 	return 0;
 }
-int mdb_read_row(MdbTableDef *table, unsigned int row)
+/*
+ * test the fields of a row in pg_buf against the sargs, pass over it if
+ * it is one of the first skip_rows, and bind its columns
+ */
+static int
+mdb_bind_fields(MdbTableDef *table, MdbField *fields, int num_fields)
 {
 	MdbHandle *mdb = table->entry->mdb;
 	MdbColumn *col;
 	unsigned int i;
+
+	if (table->stats)
+		table->stats->rows_examined++;
+	if (!mdb_test_sargs(table, fields, num_fields)) return 0;
+	if (table->num_fetched++ < table->skip_rows) return 0;
+	if (table->row_func)
+		table->row_func(table, fields, num_fields, table->row_data);
+
+	/* take advantage of mdb_crack_row() to clean up binding */
+	/* use num_cols instead of num_fields -- bsb 03/04/02 */
+	for (i = 0; i < table->num_cols; i++) {
+		col = g_ptr_array_index(table->columns,fields[i].colnum);
+		_mdb_attempt_bind(mdb, col, fields[i].is_null,
+			fields[i].start, fields[i].siz);
+	}
+
+	return 1;
+}
+/*
+ * crack the row at row_start in pg_buf, test it against the sargs and
+ * bind its columns
+ */
+static int
+mdb_bind_row(MdbTableDef *table, int row_start, size_t row_size)
+{
+	MdbField fields[256];
+	int num_fields;
+
+	num_fields = mdb_crack_cols(table, row_start, row_start + row_size - 1,
+		fields, table->col_needed);
+	if (!mdb_bind_fields(table, fields, num_fields)) return 0;
+
+#if MDB_DEBUG
+	fprintf(stdout,"sarg test passed row at %d \n", row_start);
+	mdb_buffer_dump(table->entry->mdb->pg_buf, row_start, row_size);
+#endif
+
+	return 1;
+}
+/*
+ * the next row of an operator table: fetch_func fills in its fields and
+ * their values are copied into pg_buf, so they are tested and bound just
+ * like those of a row read from a page
+ */
+static int
+mdb_fetch_op_row(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbField fields[256];
+	unsigned int i;
+	int pos;
+
+	do {
+		memset(fields, 0, table->num_cols * sizeof(MdbField));
+		if (!table->fetch_func(table, fields, table->fetch_data))
+			return 0;
+		for (i=0, pos=0;i<table->num_cols;i++) {
+			fields[i].colnum = i;
+			if (fields[i].is_null || !fields[i].siz)
+				continue;
+			if (pos + fields[i].siz > mdb->fmt->pg_size) {
+				fprintf(stderr, "error: row of %s is longer than a page\n",
+					table->name);
+				return 0;
+			}
+			memcpy(mdb->pg_buf + pos, fields[i].value, fields[i].siz);
+			fields[i].value = mdb->pg_buf + pos;
+			fields[i].start = pos;
+			pos += fields[i].siz;
+		}
+		/* pg_buf no longer holds a page of the file */
+		mdb->cur_pg = 0;
+	} while (!mdb_bind_fields(table, fields, table->num_cols));
+
+	return 1;
+}
+int mdb_read_row(MdbTableDef *table, unsigned int row)
+{
+	MdbHandle *mdb = table->entry->mdb;
 	int row_start;
 	size_t row_size;
 	int delflag, lookupflag;
-	MdbField fields[256];
-	int num_fields;
+	guint32 pg, pg_row;
+	int rc;
 
 	if (table->num_rows == 0) 
 		return 0;
@@ -272,27 +377,24 @@ int mdb_read_row(MdbTableDef *table, unsigned int row)
 		return 0;
 	}
 
-	num_fields = mdb_crack_row(table, row_start, row_start + row_size - 1,
-		fields);
-	if (!mdb_test_sargs(table, fields, num_fields)) return 0;
-	
-#if MDB_DEBUG
-	fprintf(stdout,"sarg test passed row %d \n", row);
-#endif 
-
-#if MDB_DEBUG
-	mdb_buffer_dump(mdb->pg_buf, row_start, row_size);
-#endif
-
-	/* take advantage of mdb_crack_row() to clean up binding */
-	/* use num_cols instead of num_fields -- bsb 03/04/02 */
-	for (i = 0; i < table->num_cols; i++) {
-		col = g_ptr_array_index(table->columns,fields[i].colnum);
-		_mdb_attempt_bind(mdb, col, fields[i].is_null,
-			fields[i].start, fields[i].siz);
+	/*
+	 * a lookup row holds a pointer to where the row was moved when
+	 * it outgrew its page, read it from there
+	 */
+	if (lookupflag && row_size == 4 && !table->is_temp_table) {
+		pg = mdb->cur_pg;
+		pg_row = mdb_get_int32(mdb->pg_buf, row_start);
+		if (!mdb_read_pg(mdb, pg_row >> 8)) {
+			mdb_read_pg(mdb, pg);
+			return 0;
+		}
+		mdb_find_row(mdb, pg_row & 0xff, &row_start, &row_size);
+		rc = mdb_bind_row(table, row_start & OFFSET_MASK, row_size);
+		mdb_read_pg(mdb, pg);
+		return rc;
 	}
 
-	return 1;
+	return mdb_bind_row(table, row_start, row_size);
 }
 static int _mdb_attempt_bind(MdbHandle *mdb, 
 	MdbColumn *col, 
@@ -350,7 +452,7 @@ int mdb_read_next_dpg(MdbTableDef *table)
 #endif 
 	/* can't do a fast read, go back to the old way */
 	do {
-		if (!mdb_read_pg(mdb, table->cur_phys_pg++))
+		if (!mdb_read_pg(mdb, ++table->cur_phys_pg))
 			return 0;
 	} while (mdb->pg_buf[0]!=MDB_PAGE_DATA || mdb_get_int32(mdb->pg_buf, 4)!=entry->table_pg);
 	/* fprintf(stderr,"returning new page %ld\n", table->cur_phys_pg); */
@@ -361,27 +463,77 @@ int mdb_rewind_table(MdbTableDef *table)
 	table->cur_pg_num=0;
 	table->cur_phys_pg=0;
 	table->cur_row=0;
+	table->num_fetched=0;
 
 	return 0;
 }
-int 
-mdb_fetch_row(MdbTableDef *table)
+/*
+ * have mdb_fetch_row() pass over the first skip_rows rows that satisfy the
+ * sargs and stop after returning max_rows more, -1 for no limit
+ */
+void
+mdb_limit_rows(MdbTableDef *table, long skip_rows, long max_rows)
+{
+	table->skip_rows = skip_rows;
+	table->max_rows = max_rows;
+}
+/*
+ * with rows left to skip and no sargs to test them against, every live row
+ * counts, so pass over whole data pages using their row offset tables
+ * instead of cracking the rows.  A moved row's new slot carries the delete
+ * flag, its lookup row is counted in its place.
+ */
+static int
+mdb_skip_data_pages(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned int rows, live, i;
+
+	while (table->num_fetched < table->skip_rows) {
+		rows = mdb_get_int16(mdb->pg_buf, fmt->row_count_offset);
+		for (i=0, live=0; i<rows; i++) {
+			if (!(mdb_get_int16(mdb->pg_buf,
+			  fmt->row_count_offset + 2 + i*2) & 0x4000))
+				live++;
+		}
+		if (table->num_fetched + live > table->skip_rows)
+			break;
+		table->num_fetched += live;
+		if (!mdb_read_next_dpg(table))
+			return 0;
+	}
+	return 1;
+}
+static int 
+_mdb_fetch_row(MdbTableDef *table)
 {
 	MdbHandle *mdb = table->entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
 	unsigned int rows;
-	int rc;
+	int rc, skip_pages;
 	guint32 pg;
 
+	if (table->max_rows >= 0 &&
+	  table->num_fetched >= table->skip_rows + table->max_rows)
+		return 0;
+	if (table->fetch_func)
+		return mdb_fetch_op_row(table);
 	if (table->num_rows==0)
 		return 0;
+	skip_pages = !table->is_temp_table && !table->sarg_tree &&
+		!table->noskip_del && table->strategy == MDB_TABLE_SCAN &&
+		table->num_fetched < table->skip_rows;
 
 	/* initialize */
 	if (!table->cur_pg_num) {
 		table->cur_pg_num=1;
 		table->cur_row=0;
-		if ((!table->is_temp_table)&&(table->strategy!=MDB_INDEX_SCAN))
+		table->batch_pos=0;
+		if ((!table->is_temp_table)&&(table->strategy!=MDB_INDEX_SCAN)
+		 &&(table->strategy!=MDB_BITMAP_SCAN))
 			if (!mdb_read_next_dpg(table)) return 0;
+		if (skip_pages && !mdb_skip_data_pages(table)) return 0;
 	}
 
 	do {
@@ -399,14 +551,36 @@ mdb_fetch_row(MdbTableDef *table)
 			memcpy(mdb->pg_buf,
 				g_ptr_array_index(pages, table->cur_pg_num-1),
 				fmt->pg_size);
+			mdb->cur_pg = 0;
+		} else if (table->strategy==MDB_BITMAP_SCAN) {
+			if (table->batch_pos >= table->batch_sz)
+				return 0;
+			pg = table->batch[table->batch_pos] >> 8;
+			table->cur_row = table->batch[table->batch_pos] & 0xff;
+			table->batch_pos++;
+			table->cur_phys_pg = pg;
+			mdb_read_pg(mdb, pg);
 		} else if (table->strategy==MDB_INDEX_SCAN) {
 		
-			if (!mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, (guint16 *) &(table->cur_row))) {
+			if (mdb_get_option(MDB_INDEX_BATCH) && !table->keep_order) {
+				if (table->batch_pos >= table->batch_sz &&
+				  !mdb_index_fill_batch(table)) {
+					mdb_index_scan_free(table);
+					return 0;
+				}
+				pg = table->batch[table->batch_pos] >> 8;
+				table->cur_row = table->batch[table->batch_pos] & 0xff;
+				table->batch_pos++;
+			} else if (!mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, (guint16 *) &(table->cur_row))) {
 				mdb_index_scan_free(table);
 				return 0;
 			}
+			table->cur_phys_pg = pg;
 			mdb_read_pg(mdb, pg);
 		} else {
+			/* pg_buf may have been used since, by another scan */
+			if (mdb->cur_pg != table->cur_phys_pg)
+				mdb_read_pg(mdb, table->cur_phys_pg);
 			rows = mdb_get_int16(mdb->pg_buf,fmt->row_count_offset);
 
 			/* if at end of page, find a new data page */
@@ -416,6 +590,8 @@ mdb_fetch_row(MdbTableDef *table)
 				if (!mdb_read_next_dpg(table)) {
 					return 0;
 				}
+				if (skip_pages && !mdb_skip_data_pages(table))
+					return 0;
 			}
 		}
 
@@ -426,6 +602,22 @@ mdb_fetch_row(MdbTableDef *table)
 
 	return 1;
 }
+int
+mdb_fetch_row(MdbTableDef *table)
+{
+	gint64 start;
+	int rc;
+
+	if (!table->stats)
+		return _mdb_fetch_row(table);
+	start = g_get_monotonic_time();
+	rc = _mdb_fetch_row(table);
+	table->stats->usecs += g_get_monotonic_time() - start;
+	if (rc)
+		table->stats->rows_returned++;
+
+	return rc;
+}
 void mdb_data_dump(MdbTableDef *table)
 {
 	unsigned int i;
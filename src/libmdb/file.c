@@ -183,12 +183,18 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 	mdb->f = (MdbFile *) g_malloc0(sizeof(MdbFile));
 	mdb->f->refs = 1;
 	mdb->f->fd = -1;
+	mdb->f->journal_fd = -1;
 	mdb->f->filename = mdb_find_file(filename);
 	if (!mdb->f->filename) { 
 		fprintf(stderr, "Can't alloc filename\n");
 		mdb_close(mdb);
 		return NULL; 
 	}
+	/* undo whatever a crash left half done, unless its writer is still at it */
+	if (!mdb_journal_recover(mdb->f->filename) && (flags & MDB_WRITABLE)) {
+		mdb_close(mdb);
+		return NULL;
+	}
 	if (flags & MDB_WRITABLE) {
 		mdb->f->writable = TRUE;
 		open_flags = O_RDWR;
@@ -284,15 +290,26 @@ mdb_close(MdbHandle *mdb)
 {
 	if (!mdb) return;	
 	mdb_free_catalog(mdb);
-	g_free(mdb->stats);
 	g_free(mdb->backend_name);
 
 	if (mdb->f) {
+		mdb_snapshot_end(mdb);
 		if (mdb->f->refs > 1) {
 			mdb->f->refs--;
 		} else {
+			/* a transaction that wasn't committed is undone */
+			if (mdb->f->txn_depth)
+				mdb_journal_rollback(mdb);
+			if (mdb->f->dirty) {
+				mdb_flush(mdb);
+				g_hash_table_destroy(mdb->f->dirty);
+			}
+			if (mdb->f->journal_fd != -1)
+				mdb_journal_end(mdb);
+			mdb_snapshot_free(mdb->f);
 			if (mdb->f->fd != -1) close(mdb->f->fd);
 			g_free(mdb->f->filename);
+			g_free(mdb->f->stats);
 			g_free(mdb->f);
 		}
 	}
@@ -316,8 +333,9 @@ MdbHandle *mdb_clone_handle(MdbHandle *mdb)
 	MdbCatalogEntry *entry, *data;
 	unsigned int i;
 
+	/* the statistics are the file's, so reads of clones are counted too */
 	newmdb = (MdbHandle *) g_memdup(mdb, sizeof(MdbHandle));
-	newmdb->stats = NULL;
+	newmdb->snapshot = 0;
 	newmdb->catalog = g_ptr_array_new();
 	for (i=0;i<mdb->num_catalog;i++) {
 		entry = g_ptr_array_index(mdb->catalog,i);
@@ -340,7 +358,11 @@ ssize_t mdb_read_pg(MdbHandle *mdb, unsigned long pg)
 {
 	ssize_t len;
 
-	if (pg && mdb->cur_pg == pg) return mdb->fmt->pg_size;
+	if (pg && mdb->cur_pg == pg) {
+		if (mdb->f->stats && mdb->f->stats->collect)
+			mdb->f->stats->pg_hits++;
+		return mdb->fmt->pg_size;
+	}
 
 	len = _mdb_read_pg(mdb, mdb->pg_buf, pg);
 	//fprintf(stderr, "read page %d type %02x\n", pg, mdb->pg_buf[0]);
@@ -361,14 +383,31 @@ static ssize_t _mdb_read_pg(MdbHandle *mdb, void *pg_buf, unsigned long pg)
 	ssize_t len;
 	struct stat status;
 	off_t offset = pg * mdb->fmt->pg_size;
+	void *dirty_pg;
+	MdbStatistics *stats = mdb->f->stats;
+
+	if (stats && !stats->collect)
+		stats = NULL;
+	/* pages written since the last flush, unless reading a snapshot */
+	if (mdb->snapshot) {
+		if (mdb_snapshot_read_pg(mdb, pg_buf, pg)) {
+			if (stats) stats->pg_hits++;
+			return mdb->fmt->pg_size;
+		}
+	} else if (mdb->f->dirty &&
+	    (dirty_pg = g_hash_table_lookup(mdb->f->dirty, GUINT_TO_POINTER(pg)))) {
+		memcpy(pg_buf, dirty_pg, mdb->fmt->pg_size);
+		if (stats) stats->pg_hits++;
+		return mdb->fmt->pg_size;
+	}
 
         fstat(mdb->f->fd, &status);
         if (status.st_size < offset) { 
                 fprintf(stderr,"offset %lu is beyond EOF\n",offset);
                 return 0;
         }
-	if (mdb->stats && mdb->stats->collect) 
-		mdb->stats->pg_reads++;
+	if (stats)
+		stats->pg_reads++;
 
 	lseek(mdb->f->fd, offset, SEEK_SET);
 	len = read(mdb->f->fd,pg_buf,mdb->fmt->pg_size);
@@ -391,6 +430,24 @@ static ssize_t _mdb_read_pg(MdbHandle *mdb, void *pg_buf, unsigned long pg)
 		RC4_set_key(&rc4_key, 4, (unsigned char *)&tmp_key);
 		RC4(&rc4_key, mdb->fmt->pg_size, pg_buf);
 	}
+	if (stats && pg) {
+		switch (((unsigned char *)pg_buf)[0]) {
+			case MDB_PAGE_DATA:
+				/* long values live on data pages of their own */
+				if (!memcmp((char *)pg_buf + 4, "LVAL", 4))
+					stats->lval_pg_reads++;
+				else
+					stats->data_pg_reads++;
+				break;
+			case MDB_PAGE_INDEX:
+			case MDB_PAGE_LEAF:
+				stats->index_pg_reads++;
+				break;
+			case MDB_PAGE_MAP:
+				stats->map_pg_reads++;
+				break;
+		}
+	}
 
 	return len;
 }
@@ -192,6 +192,12 @@ mdb_read_indices(MdbTableDef *table)
 
 		cur_pos += 4;
 		//fprintf(stderr, "pidx->unknown_pre_first_pg:0x%08x\n", read_pg_if_32(mdb, &cur_pos));
+		/* remember where first_pg lives so index builds can move it */
+		read_pg_if_n(mdb, NULL, &cur_pos, 0);
+		if (cur_pos + 4 <= fmt->pg_size) {
+			pidx->first_pg_tdef = mdb->cur_pg;
+			pidx->first_pg_pos = cur_pos;
+		}
 		pidx->first_pg = read_pg_if_32(mdb, &cur_pos);
 		pidx->flags = read_pg_if_8(mdb, &cur_pos);
 		//fprintf(stderr, "pidx->first_pg:%d pidx->flags:0x%02x\n",	pidx->first_pg, pidx->flags);
@@ -342,77 +348,82 @@ mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len)
 	return 1;
 }
 /*
- * pack the pages bitmap
+ * The entry bitmap of an index page has one bit per byte of the entry area,
+ * set where an entry begins (the first entry, at MDB_IDX_ENTRY_START, is
+ * implied).
+ */
+#define MDB_IDX_MAP_START 0x16
+#define MDB_IDX_ENTRY_START 0xf8
+#define MDB_IDX_MAP_SZ (MDB_IDX_ENTRY_START - MDB_IDX_MAP_START)
+
+/* entries can't run past what the entry bitmap covers */
+#define MDB_IDX_PG_END(mdb) \
+	MIN((mdb)->fmt->pg_size, MDB_IDX_ENTRY_START + MDB_IDX_MAP_SZ * 8)
+
+/*
+ * return the position of the first bit set after "bit" in the bitmap, or
+ * -1 if there is none.  Runs of empty bytes are skipped a word at a time.
+ */
+static int
+mdb_index_next_bit(unsigned char *map, int map_sz, int bit)
+{
+	int pos = bit + 1;
+	int byte = pos / 8;
+	guint32 word;
+
+	if (byte >= map_sz) return -1;
+	word = map[byte] >> (pos % 8);
+	if (word)
+		return pos + g_bit_nth_lsf(word, -1);
+
+	for (byte++; byte + 4 <= map_sz; byte += 4) {
+		word = (guint32) mdb_get_int32(map, byte);
+		if (word)
+			return byte * 8 + g_bit_nth_lsf(word, -1);
+	}
+	for (; byte < map_sz; byte++) {
+		if (map[byte])
+			return byte * 8 + g_bit_nth_lsf(map[byte], -1);
+	}
+	return -1;
+}
+/*
+ * pack the pages bitmap from ipg->idx_starts, up to the 0 that ends them.
+ * Entries that would fall outside the bitmap are dropped.
  */
 int
 mdb_index_pack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg)
 {
-	int mask_bit = 0;
-	int mask_pos = 0x16;
-	int mask_byte = 0;
-	int elem = 0;
-	int len, start, i;
-
-	start = ipg->idx_starts[elem++];
-
-	while (start) {
-		//fprintf(stdout, "elem %d is %d\n", elem, ipg->idx_starts[elem]);
-		len = ipg->idx_starts[elem] - start;
-		//fprintf(stdout, "len is %d\n", len);
-		for (i=0; i < len; i++) {
-			mask_bit++;
-			if (mask_bit==8) {
-				mask_bit=0;
-				mdb->pg_buf[mask_pos++] = mask_byte;
-				mask_byte = 0;
-			}
-			/* upon reaching the len, set the bit */
-		}
-		mask_byte = (1 << mask_bit) | mask_byte;
-		//fprintf(stdout, "mask byte is %02x at %d\n", mask_byte, mask_pos);
-		start = ipg->idx_starts[elem++];
-	}
-	/* flush the last byte if any */
-	mdb->pg_buf[mask_pos++] = mask_byte;
-	/* remember to zero the rest of the bitmap */
-	for (i = mask_pos; i < 0xf8; i++) {
-		mdb->pg_buf[mask_pos++] = 0;
+	unsigned char *map = &mdb->pg_buf[MDB_IDX_MAP_START];
+	int elem, bit;
+
+	memset(map, 0, MDB_IDX_MAP_SZ);
+	for (elem = 1; elem <= MDB_IDX_MAP_SZ * 8 && ipg->idx_starts[elem]; elem++) {
+		bit = ipg->idx_starts[elem] - MDB_IDX_ENTRY_START;
+		if (bit <= 0 || bit >= MDB_IDX_MAP_SZ * 8)
+			break;
+		map[bit / 8] |= 1 << (bit % 8);
 	}
 	return 0;
 }
 /*
- * unpack the pages bitmap
+ * unpack the pages bitmap into ipg->idx_starts, allocating it if needed.
+ * Only writers need this, readers walk the bitmap with
+ * mdb_index_find_next_on_page().  The caller frees idx_starts.
  */
 int
 mdb_index_unpack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg)
 {
-	int mask_bit = 0;
-	int mask_pos = 0x16;
-	int mask_byte;
-	int start = 0xf8;
+	unsigned char *map = &mdb->pg_buf[MDB_IDX_MAP_START];
 	int elem = 0;
-	int len = 0;
+	int bit = 0;
 
-	ipg->idx_starts[elem++]=start;
-
-	//fprintf(stdout, "Unpacking index page %lu\n", ipg->pg);
-	do {
-		len = 0;
-		do {
-			mask_bit++;
-			if (mask_bit==8) {
-				mask_bit=0;
-				mask_pos++;
-			}
-			mask_byte = mdb->pg_buf[mask_pos];
-			len++;
-		} while (mask_pos <= 0xf8 && !((1 << mask_bit) & mask_byte));
-		//fprintf(stdout, "%d %d %d %d\n", mask_pos, mask_bit, mask_byte, len);
+	if (!ipg->idx_starts)
+		ipg->idx_starts = g_malloc0(MDB_IDX_MAP_SZ * 8 * sizeof(guint16) + sizeof(guint16));
 
-		start += len;
-		if (mask_pos < 0xf8) ipg->idx_starts[elem++]=start;
-
-	} while (mask_pos < 0xf8);
+	ipg->idx_starts[elem++] = MDB_IDX_ENTRY_START;
+	while ((bit = mdb_index_next_bit(map, MDB_IDX_MAP_SZ, bit)) >= 0)
+		ipg->idx_starts[elem++] = MDB_IDX_ENTRY_START + bit;
 
 	/* if we zero the next element, so we don't pick up the last pages starts*/
 	ipg->idx_starts[elem]=0;
@@ -420,34 +431,31 @@ mdb_index_unpack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg)
 	return elem;
 }
 /*
- * find the next entry on a page (either index or leaf). Uses state information
- * stored in the MdbIndexPage across calls.
+ * step ipg to the next entry of the page in mdb->pg_buf, setting ipg->len.
+ * ipg->offset is left alone, callers advance it by ipg->len as they go.
  */
 int
 mdb_index_find_next_on_page(MdbHandle *mdb, MdbIndexPage *ipg)
 {
-	if (!ipg->pg) return 0;
+	int next;
 
-	/* if this page has not been unpacked to it */
-	if (!ipg->idx_starts[0]){
-		//fprintf(stdout, "Unpacking page %d\n", ipg->pg);
-		mdb_index_unpack_bitmap(mdb, ipg);
-	}
+	if (!ipg->pg) return 0;
 
-	
-	if (ipg->idx_starts[ipg->start_pos + 1]==0) return 0; 
-	ipg->len = ipg->idx_starts[ipg->start_pos+1] - ipg->idx_starts[ipg->start_pos];
+	next = mdb_index_next_bit(&mdb->pg_buf[MDB_IDX_MAP_START],
+		MDB_IDX_MAP_SZ, ipg->bit);
+	if (next < 0) return 0;
+	ipg->len = next - ipg->bit;
+	ipg->bit = next;
 	ipg->start_pos++;
-	//fprintf(stdout, "Start pos %d\n", ipg->start_pos);
 
 	return ipg->len;
 }
 void mdb_index_page_reset(MdbIndexPage *ipg)
 {
-	ipg->offset = 0xf8; /* start byte of the index entries */
+	ipg->offset = MDB_IDX_ENTRY_START; /* start byte of the index entries */
 	ipg->start_pos=0;
 	ipg->len = 0; 
-	ipg->idx_starts[0]=0;
+	ipg->bit = 0;
 }
 void mdb_index_page_init(MdbIndexPage *ipg)
 {
@@ -666,11 +674,10 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 	return ipg->len;
 }
 /*
- * XXX - FIX ME
  * This function is grossly inefficient.  It scans the entire index building 
- * an IndexChain to a specific row.  We should be checking the index pages 
- * for matches against the indexed fields to find the proper leaf page, but
- * getting it working first and then make it fast!
+ * an IndexChain to a specific row.  Callers which have the key values of the
+ * row should use mdb_index_seek_row() instead, which descends straight to
+ * the proper leaf page.  This is kept for key types we can't encode yet.
  */
 int 
 mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 pg, guint16 row)
@@ -717,6 +724,704 @@ mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 	return 1;
 }
 
+/*
+ * Encode one key column the way Jet stores it in index entries: a flag byte
+ * (0x7f ascending, 0x00 for a null value) followed by the value in an order
+ * preserving byte representation.  Descending columns are stored negated.
+ *
+ * Returns the number of bytes written to dest, or -1 if we don't know how to
+ * encode this column type yet.
+ */
+int
+mdb_index_encode_col(MdbHandle *mdb, MdbColumn *col, int order, MdbField *field, unsigned char *dest)
+{
+	unsigned char *src = field->value;
+	char tmpbuf[256], hash[256];
+	int len = 0, i;
+
+	if (field->is_null || !src) {
+		dest[len++] = 0x00;
+	} else {
+		dest[len++] = 0x7f;
+		switch (col->col_type) {
+			case MDB_BYTE:
+				dest[len++] = src[0];
+				break;
+			case MDB_INT:
+			case MDB_LONGINT:
+			case MDB_COMPLEX:
+			case MDB_MONEY:
+				/* little endian two's complement -> big endian, sign flipped */
+				mdb_index_swap_n(src, field->siz, &dest[len]);
+				dest[len] ^= 0x80;
+				len += field->siz;
+				break;
+			case MDB_FLOAT:
+			case MDB_DOUBLE:
+			case MDB_DATETIME:
+				mdb_index_swap_n(src, field->siz, &dest[len]);
+				if (dest[len] & 0x80) {
+					for (i=0; i<field->siz; i++)
+						dest[len+i] = ~dest[len+i];
+				} else {
+					dest[len] |= 0x80;
+				}
+				len += field->siz;
+				break;
+			case MDB_TEXT:
+				mdb_unicode2ascii(mdb, field->value, field->siz, tmpbuf, 256);
+				mdb_index_hash_text(tmpbuf, hash);
+				memcpy(&dest[len], hash, strlen(hash));
+				len += strlen(hash);
+				dest[len++] = 0x00;
+				break;
+			default:
+				return -1;
+		}
+	}
+	if (order == MDB_DESC) {
+		for (i=0; i<len; i++)
+			dest[i] = ~dest[i];
+	}
+	return len;
+}
+/*
+ * Build the complete key for an index entry.  idx_fields holds one field per
+ * key column, in key order.  key must hold at least 256 bytes per column.
+ *
+ * Returns the key length, or -1 if any key column can't be encoded.
+ */
+int
+mdb_index_build_key(MdbTableDef *table, MdbIndex *idx, MdbField *idx_fields, unsigned char *key)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbColumn *col;
+	unsigned int i;
+	int len = 0, col_len;
+
+	for (i=0;i<idx->num_keys;i++) {
+		col=g_ptr_array_index(table->columns,idx->key_col_num[i]-1);
+		col_len = mdb_index_encode_col(mdb, col, idx->key_col_order[i],
+			&idx_fields[i], &key[len]);
+		if (col_len < 0)
+			return -1;
+		len += col_len;
+	}
+	return len;
+}
+/*
+ * Copy the current entry of ipg into entry, restoring the shared prefix
+ * (taken from the first entry on the page) on compressed pages.
+ */
+static int
+mdb_index_get_entry(MdbHandle *mdb, MdbIndexPage *ipg, unsigned char *entry)
+{
+	int pref_len = mdb_get_int16(mdb->pg_buf, 0x14);
+	int len = 0;
+
+	if (pref_len && ipg->offset != MDB_IDX_ENTRY_START) {
+		memcpy(entry, &mdb->pg_buf[MDB_IDX_ENTRY_START], pref_len);
+		len = pref_len;
+	}
+	memcpy(&entry[len], &mdb->pg_buf[ipg->offset], ipg->len);
+	return len + ipg->len;
+}
+static int
+mdb_index_cmp_entry(unsigned char *entry, int entry_len, unsigned char *target, int target_len)
+{
+	int rc;
+
+	rc = memcmp(entry, target, MIN(entry_len, target_len));
+	if (rc) return rc;
+	return entry_len - target_len;
+}
+/*
+ * Key directed version of mdb_index_find_row.  Rather than walking every
+ * leaf, descend from the root following the first entry on each intermediate
+ * page which sorts at or after the key/page/row we are looking for.
+ *
+ * On return the bottom of "chain" is the leaf page that holds the entry, or
+ * the leaf it would be added to if it isn't present.  Tail leaves which
+ * haven't been hooked into the tree yet are reached through the next leaf
+ * pointers.
+ *
+ * Returns 1 if the entry was found, 0 otherwise.
+ */
+int
+mdb_index_seek_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len, guint32 pg, guint16 row)
+{
+	MdbIndexPage *ipg;
+	unsigned char target[MDB_MAX_IDX_COLS * 256 + 4];
+	unsigned char entry[MDB_PGSIZE];
+	guint32 next_pg, child, prev_pg = 0;
+	int target_len, entry_len, rc, first;
+
+	memcpy(target, key, key_len);
+	mdb_put_int32_msb(target, key_len, (pg << 8) | (row & 0xff));
+	target_len = key_len + 4;
+
+	memset(chain, 0, sizeof(MdbIndexChain));
+	next_pg = idx->first_pg;
+
+	/* intermediate pages */
+	while (1) {
+		ipg = mdb_chain_add_page(mdb, chain, next_pg);
+		mdb_read_pg(mdb, next_pg);
+		if (mdb->pg_buf[0] == MDB_PAGE_LEAF)
+			break;
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX)
+			return 0;
+
+		child = 0;
+		while (mdb_index_find_next_on_page(mdb, ipg)) {
+			entry_len = mdb_index_get_entry(mdb, ipg, entry);
+			child = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4) & 0xffffff;
+			ipg->offset += ipg->len;
+			/* intermediate entries carry a child page after pg/row */
+			if (mdb_index_cmp_entry(entry, entry_len - 4, target, target_len) >= 0)
+				break;
+		}
+		/* past the last entry, keep going right and rely on the tail */
+		if (!child)
+			return 0;
+		next_pg = child;
+	}
+
+	/* leaf pages */
+	while (1) {
+		first = 1;
+		while (mdb_index_find_next_on_page(mdb, ipg)) {
+			entry_len = mdb_index_get_entry(mdb, ipg, entry);
+			rc = mdb_index_cmp_entry(entry, entry_len, target, target_len);
+			if (!rc)
+				return 1;
+			if (rc > 0) {
+				/* 
+				 * the next leaf starts past our key, so it
+				 * belongs at the end of the previous one
+				 */
+				if (first && prev_pg) {
+					chain->cur_depth--;
+					mdb_chain_add_page(mdb, chain, prev_pg);
+					mdb_read_pg(mdb, prev_pg);
+				}
+				return 0;
+			}
+			first = 0;
+			ipg->offset += ipg->len;
+		}
+		next_pg = mdb_get_int32(mdb->pg_buf, 0x0c);
+		if (!next_pg)
+			return 0;
+		prev_pg = ipg->pg;
+		chain->cur_depth--;
+		ipg = mdb_chain_add_page(mdb, chain, next_pg);
+		mdb_read_pg(mdb, next_pg);
+	}
+}
+/*
+ * store an entry after the num ones whose ends are in ends, leaving out
+ * the prefix they share with the first
+ */
+static int
+mdb_index_leaf_put(MdbHandle *mdb, unsigned char *pg_buf, guint16 *ends, int *num, unsigned char *entry, int len, int pref_len)
+{
+	int skip = *num ? pref_len : 0;
+	int pos = ends[*num];
+
+	if (pos + len - skip > MDB_IDX_PG_END(mdb))
+		return 0;
+	memcpy(pg_buf + pos, entry + skip, len - skip);
+	ends[++(*num)] = pos + len - skip;
+	return 1;
+}
+/*
+ * Insert entry, a key followed by its pg/row, into the leaf page in
+ * mdb->pg_buf in key order.  The entries after it are shifted up and the
+ * bitmap is packed again from their new ends.  A page whose entries share
+ * a prefix keeps the part of it the new entry shares as well.
+ *
+ * Unless at_end is set the entry may not become the last one on the page,
+ * as the key the parent page holds for it would no longer cover it.
+ *
+ * Returns 1 if the entry was added or was there already, 0 if it doesn't
+ * fit on the page or would have to go at its end.  The page isn't written.
+ */
+int
+mdb_index_leaf_insert(MdbHandle *mdb, MdbIndexPage *ipg, unsigned char *entry, int len, int at_end)
+{
+	unsigned char cur[MDB_PGSIZE];
+	unsigned char *new_pg;
+	guint16 *starts, *ends;
+	int num_entries, pref_len, new_pref, cur_len, pos, rc, i, num = 0, ret = 0;
+
+	num_entries = mdb_index_unpack_bitmap(mdb, ipg) - 1;
+	starts = ipg->idx_starts;
+	pref_len = num_entries ? mdb_get_int16(mdb->pg_buf, 0x14) : 0;
+	new_pref = 0;
+
+	/* the first entry after it */
+	for (pos=0;pos<num_entries;pos++) {
+		ipg->offset = starts[pos];
+		ipg->len = starts[pos+1] - starts[pos];
+		cur_len = mdb_index_get_entry(mdb, ipg, cur);
+		if (pos == 0) {
+			for (i=0;i<MIN(cur_len, len) && cur[i] == entry[i];i++);
+			new_pref = MIN(pref_len, i);
+		}
+		rc = mdb_index_cmp_entry(cur, cur_len, entry, len);
+		if (!rc) {
+			ret = 1;
+			goto done;
+		}
+		if (rc > 0)
+			break;
+	}
+	if (pos == num_entries && !at_end)
+		goto done;
+
+	new_pg = g_malloc0(mdb->fmt->pg_size);
+	memcpy(new_pg, mdb->pg_buf, MDB_IDX_ENTRY_START);
+	ends = g_malloc0(MDB_IDX_MAP_SZ * 8 * sizeof(guint16) + sizeof(guint16));
+	ends[0] = MDB_IDX_ENTRY_START;
+	for (i=0,ret=1;ret && i<=num_entries;i++) {
+		if (i == pos)
+			ret = mdb_index_leaf_put(mdb, new_pg, ends, &num, entry, len, new_pref);
+		if (!ret || i == num_entries)
+			break;
+		ipg->offset = starts[i];
+		ipg->len = starts[i+1] - starts[i];
+		cur_len = mdb_index_get_entry(mdb, ipg, cur);
+		ret = mdb_index_leaf_put(mdb, new_pg, ends, &num, cur, cur_len, new_pref);
+	}
+	if (ret) {
+		mdb_put_int16(new_pg, 2, mdb->fmt->pg_size - ends[num]);
+		mdb_put_int16(new_pg, 0x14, new_pref);
+		memcpy(mdb->pg_buf, new_pg, mdb->fmt->pg_size);
+		g_free(ipg->idx_starts);
+		ipg->idx_starts = ends;
+		mdb_index_pack_bitmap(mdb, ipg);
+	} else {
+		g_free(ends);
+	}
+	g_free(new_pg);
+
+done:
+	g_free(ipg->idx_starts);
+	ipg->idx_starts = NULL;
+	mdb_index_page_reset(ipg);
+	return ret;
+}
+/**
+ * mdb_index_is_writable:
+ * @idx: an index of a table
+ *
+ * Tells if entries can be added to @idx: it has pages of its own, and we
+ * can encode every one of its key columns exactly as Jet does.  Text keys
+ * are only good for finding rows whose value is then checked, so indexes
+ * on text columns aren't writable.
+ *
+ * Returns: 1 if so, 0 otherwise.
+ */
+int
+mdb_index_is_writable(MdbIndex *idx)
+{
+	MdbColumn *col;
+	MdbField field;
+	unsigned char buf[256];
+	unsigned char key[256];
+	unsigned int i;
+
+	if (idx->index_type == 2 || !idx->num_keys)
+		return 0;
+	/* a non null value tells us if the type is supported */
+	memset(buf, 0, sizeof(buf));
+	for (i=0;i<idx->num_keys;i++) {
+		col = g_ptr_array_index(idx->table->columns, idx->key_col_num[i]-1);
+		if (col->col_type == MDB_TEXT)
+			return 0;
+		memset(&field, 0, sizeof(MdbField));
+		field.value = buf;
+		field.siz = col->is_fixed ? mdb_col_fixed_size(col) : 0;
+		if (mdb_index_encode_col(idx->table->entry->mdb, col, MDB_ASC,
+		    &field, key) < 0)
+			return 0;
+	}
+	return 1;
+}
+/*
+ * Find an index whose leading key column is col, preferring unique and
+ * narrower indexes.  Foreign key references don't have pages of their own.
+ */
+static MdbIndex *
+mdb_index_for_col(MdbTableDef *table, MdbColumn *col)
+{
+	MdbIndex *idx, *best = NULL;
+	unsigned int i;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index (table->indices, i);
+		if (idx->index_type == 2 || !idx->num_keys)
+			continue;
+		if (g_ptr_array_index(table->columns, idx->key_col_num[0]-1) != col)
+			continue;
+		if (!best || (idx->flags & MDB_IDX_UNIQUE && !(best->flags & MDB_IDX_UNIQUE))
+		  || idx->num_keys < best->num_keys)
+			best = idx;
+	}
+	return best;
+}
+/**
+ * mdb_index_min_max:
+ * @table: table to look in
+ * @col: column wanted
+ * @max: 1 for the largest value of @col, 0 for the smallest
+ * @pg: set to the page of the row holding it
+ * @row: set to its row number
+ *
+ * Finds the row with the smallest or largest value of @col from the first
+ * or last leaf entry of an index on it, rather than reading the table.
+ * Only columns whose index keys sort as their values do are handled.
+ *
+ * Returns: 1 if the row was found, 0 if the table has to be scanned: no
+ * usable index, an empty one, or only null values at the end wanted.
+ */
+int
+mdb_index_min_max(MdbTableDef *table, MdbColumn *col, int max, guint32 *pg, guint16 *row)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbIndex *idx;
+	MdbIndexPage ipg;
+	unsigned char entry[MDB_PGSIZE];
+	guint32 next_pg, child, pg_row = 0;
+	int last, depth = 0, found = 0;
+	unsigned char flag = 0;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+		case MDB_MONEY:
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			break;
+		default:
+			return 0;
+	}
+	if (!(idx = mdb_index_for_col(table, col)))
+		return 0;
+	/* descending keys are stored negated */
+	last = idx->key_col_order[0] == MDB_DESC ? !max : max;
+
+	/* intermediate pages, following their first or last child */
+	next_pg = idx->first_pg;
+	while (1) {
+		mdb_read_pg(mdb, next_pg);
+		if (mdb->pg_buf[0] == MDB_PAGE_LEAF)
+			break;
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX || ++depth > MDB_MAX_INDEX_DEPTH)
+			return 0;
+		mdb_index_page_init(&ipg);
+		ipg.pg = next_pg;
+		child = 0;
+		while (mdb_index_find_next_on_page(mdb, &ipg)) {
+			child = mdb_get_int32_msb(mdb->pg_buf, ipg.offset + ipg.len - 4) & 0xffffff;
+			ipg.offset += ipg.len;
+			if (!last)
+				break;
+		}
+		if (!child)
+			return 0;
+		next_pg = child;
+	}
+
+	/*
+	 * leaf pages.  Null keys sort first, so the smallest value is the
+	 * first entry that isn't null.  The last one is on the tail leaf,
+	 * which may not be in the upper tree yet.
+	 */
+	while (1) {
+		mdb_index_page_init(&ipg);
+		ipg.pg = next_pg;
+		while (mdb_index_find_next_on_page(mdb, &ipg)) {
+			mdb_index_get_entry(mdb, &ipg, entry);
+			flag = entry[0];
+			pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg.offset + ipg.len - 4);
+			ipg.offset += ipg.len;
+			found = 1;
+			if (!last && flag != 0x00 && flag != 0xff)
+				break;
+		}
+		if (found && !last && flag != 0x00 && flag != 0xff)
+			break;
+		if (!(next_pg = mdb_get_int32(mdb->pg_buf, 0x0c)))
+			break;
+		mdb_read_pg(mdb, next_pg);
+	}
+	/* 0x00 is a null ascending key, 0xff a null descending one */
+	if (!found || flag == 0x00 || flag == 0xff)
+		return 0;
+	*pg = pg_row >> 8;
+	*row = pg_row & 0xff;
+
+	return 1;
+}
+/*
+ * Encode the constant of a sarg node as the leading column of an index key.
+ * Text is only usable for equality, since the index collates differently
+ * from the sql engine.  Returns -1 if the node can't be used.
+ */
+static int
+mdb_index_encode_sarg(MdbHandle *mdb, MdbColumn *col, int order, MdbSargNode *node, unsigned char *dest)
+{
+	MdbField field;
+	unsigned char buf[4];
+	char hash[256];
+	int len, i;
+
+	switch (node->op) {
+		case MDB_EQUAL:
+		case MDB_GT:
+		case MDB_LT:
+		case MDB_GTEQ:
+		case MDB_LTEQ:
+			break;
+		default:
+			return -1;
+	}
+	memset(&field, 0, sizeof(MdbField));
+	field.value = buf;
+	switch (col->col_type) {
+		case MDB_BYTE:
+			buf[0] = node->value.i;
+			field.siz = 1;
+			break;
+		case MDB_INT:
+			mdb_put_int16(buf, 0, node->value.i);
+			field.siz = 2;
+			break;
+		case MDB_LONGINT:
+			mdb_put_int32(buf, 0, node->value.i);
+			field.siz = 4;
+			break;
+		case MDB_TEXT:
+			if (node->op != MDB_EQUAL)
+				return -1;
+			mdb_index_hash_text(node->value.s, hash);
+			len = 0;
+			dest[len++] = 0x7f;
+			memcpy(&dest[len], hash, strlen(hash));
+			len += strlen(hash);
+			dest[len++] = 0x00;
+			if (order == MDB_DESC) {
+				for (i=0; i<len; i++)
+					dest[i] = ~dest[i];
+			}
+			return len;
+		default:
+			return -1;
+	}
+	return mdb_index_encode_col(mdb, col, order, &field, dest);
+}
+/*
+ * The index of the table that can answer a relational node, if any.  Like
+ * the rest of the index scanning code this is only used with use_index.
+ */
+static MdbIndex *
+mdb_index_for_sarg(MdbTableDef *table, MdbSargNode *node)
+{
+	unsigned char key[256];
+	MdbIndex *idx;
+
+	if (!mdb_get_option(MDB_USE_INDEX))
+		return NULL;
+	if (!node->col || !(idx = mdb_index_for_col(table, node->col)))
+		return NULL;
+	if (mdb_index_encode_sarg(table->entry->mdb, node->col,
+	    idx->key_col_order[0], node, key) < 0)
+		return NULL;
+	return idx;
+}
+/*
+ * An IN list is looked up as one equality seek per value; all of its
+ * values have the same type, so the first one tells if that works.
+ */
+static void
+mdb_index_in_value(MdbSargNode *node, unsigned int i, MdbSargNode *eq)
+{
+	*eq = *node;
+	eq->op = MDB_EQUAL;
+	eq->set = NULL;
+	eq->value = g_array_index(node->set, MdbAny, i);
+}
+static int
+mdb_index_sarg_usable(MdbTableDef *table, MdbSargNode *node)
+{
+	MdbSargNode eq;
+
+	if (node->op == MDB_IN) {
+		mdb_index_in_value(node, 0, &eq);
+		return mdb_index_sarg_usable(table, &eq);
+	}
+	if (mdb_index_for_sarg(table, node))
+		return 1;
+	return mdb_sidecar_usable(table, node);
+}
+/*
+ * Count the relational nodes of the tree that can be answered from an
+ * index.  An OR is only usable if both of its sides are, an AND uses
+ * whichever sides it can and leaves the rest to the row test.
+ */
+int
+mdb_index_count_sargs(MdbTableDef *table, MdbSargNode *node)
+{
+	int l, r;
+
+	if (!node) return 0;
+	if (mdb_is_relational_op(node->op))
+		return mdb_index_sarg_usable(table, node);
+	switch (node->op) {
+		case MDB_AND:
+			return mdb_index_count_sargs(table, node->left) +
+				mdb_index_count_sargs(table, node->right);
+		case MDB_OR:
+			l = mdb_index_count_sargs(table, node->left);
+			r = mdb_index_count_sargs(table, node->right);
+			return (l && r) ? l + r : 0;
+	}
+	return 0;
+}
+/*
+ * Collect the rows matching a single relational node from the leaf pages of
+ * an index.  Where the index order allows, the scan starts at the key and
+ * stops as soon as it passes the last possible match.  Columns without an
+ * index are looked up in their sidecar index, and an IN list is the union
+ * of one seek per value.
+ */
+static MdbRowSet *
+mdb_index_collect_sarg(MdbTableDef *table, MdbSargNode *node)
+{
+	MdbHandle *mdb;
+	MdbIndex *idx;
+	MdbIndexChain *chain;
+	MdbIndexPage ipg;
+	MdbRowSet *set;
+	unsigned char key[256];
+	unsigned char entry[MDB_PGSIZE];
+	int key_len, entry_len, rc, asc, seek, stop = 0;
+	unsigned char null_flag;
+	guint32 leaf, pg_row;
+	MdbSidecar *sc;
+	MdbSargNode eq;
+	MdbRowSet *hits;
+	unsigned int i;
+
+	if (node->op == MDB_IN) {
+		set = mdb_rowset_new();
+		for (i=0;i<node->set->len;i++) {
+			mdb_index_in_value(node, i, &eq);
+			if (!(hits = mdb_index_collect_sarg(table, &eq))) {
+				mdb_rowset_free(set);
+				return NULL;
+			}
+			mdb_rowset_or(set, hits);
+			mdb_rowset_free(hits);
+		}
+		return set;
+	}
+	if (!(idx = mdb_index_for_sarg(table, node))) {
+		if (!(sc = mdb_sidecar_open(table, node->col)))
+			return NULL;
+		set = mdb_sidecar_lookup(sc, table->entry->mdb, node);
+		mdb_sidecar_close(sc);
+		return set;
+	}
+	asc = idx->key_col_order[0] != MDB_DESC;
+	null_flag = asc ? 0x00 : 0xff;
+	key_len = mdb_index_encode_sarg(table->entry->mdb, node->col,
+		idx->key_col_order[0], node, key);
+
+	if (asc)
+		seek = node->op == MDB_EQUAL || node->op == MDB_GT || node->op == MDB_GTEQ;
+	else
+		seek = node->op == MDB_EQUAL || node->op == MDB_LT || node->op == MDB_LTEQ;
+
+	mdb = mdb_clone_handle(table->entry->mdb);
+	chain = g_malloc0(sizeof(MdbIndexChain));
+	mdb_index_seek_row(mdb, idx, chain, key, seek ? key_len : 0, 0, 0);
+	leaf = chain->cur_depth ? chain->pages[chain->cur_depth-1].pg : 0;
+	g_free(chain);
+
+	set = mdb_rowset_new();
+	while (leaf && !stop) {
+		mdb_read_pg(mdb, leaf);
+		if (mdb->pg_buf[0] != MDB_PAGE_LEAF)
+			break;
+		mdb_index_page_init(&ipg);
+		ipg.pg = leaf;
+		while (mdb_index_find_next_on_page(mdb, &ipg)) {
+			entry_len = mdb_index_get_entry(mdb, &ipg, entry);
+			ipg.offset += ipg.len;
+			/* nulls never satisfy a comparison */
+			if (entry[0] == null_flag)
+				continue;
+			rc = mdb_index_cmp_entry(entry, MIN(entry_len - 4, key_len), key, key_len);
+			if (!asc) rc = -rc;
+			if ((rc == 0 && (node->op == MDB_EQUAL || node->op == MDB_GTEQ || node->op == MDB_LTEQ))
+			 || (rc > 0 && (node->op == MDB_GT || node->op == MDB_GTEQ))
+			 || (rc < 0 && (node->op == MDB_LT || node->op == MDB_LTEQ))) {
+				pg_row = mdb_get_int32_msb(entry, entry_len - 4);
+				mdb_rowset_add(set, pg_row >> 8, pg_row & 0xff);
+			} else if ((asc && rc > 0) || (!asc && rc < 0)) {
+				/* past the last match in index order? */
+				if (node->op == MDB_EQUAL ||
+				    node->op == (asc ? MDB_LT : MDB_GT) ||
+				    node->op == (asc ? MDB_LTEQ : MDB_GTEQ)) {
+					stop = 1;
+					break;
+				}
+			}
+		}
+		leaf = mdb_get_int32(mdb->pg_buf, 0x0c);
+	}
+	mdb_close(mdb);
+
+	return set;
+}
+/*
+ * Build the set of rows satisfying the indexable parts of a sarg tree, see
+ * mdb_index_count_sargs().  Returns NULL if no index applies (or a sidecar
+ * turned out to be stale), in which case every row is a candidate.
+ */
+MdbRowSet *
+mdb_index_collect_rows(MdbTableDef *table, MdbSargNode *node)
+{
+	MdbRowSet *left, *right;
+
+	if (!mdb_index_count_sargs(table, node))
+		return NULL;
+	if (mdb_is_relational_op(node->op))
+		return mdb_index_collect_sarg(table, node);
+
+	left = mdb_index_collect_rows(table, node->left);
+	right = mdb_index_collect_rows(table, node->right);
+	if (node->op == MDB_OR && (!left || !right)) {
+		mdb_rowset_free(left);
+		mdb_rowset_free(right);
+		return NULL;
+	}
+	if (!left) return right;
+	if (!right) return left;
+	if (node->op == MDB_AND)
+		mdb_rowset_and(left, right);
+	else
+		mdb_rowset_or(left, right);
+	mdb_rowset_free(right);
+
+	return left;
+}
+
 void mdb_index_walk(MdbTableDef *table, MdbIndex *idx)
 {
 /*
@@ -888,8 +1593,25 @@ mdb_choose_index(MdbTableDef *table, int *choice)
 void
 mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table)
 {
-	int i;
+	int i, count;
+	MdbRowSet *set;
 
+	/*
+	 * when more than one index applies, combine their row sets rather
+	 * than picking just one of them.  Sidecar indexes are always used
+	 * through row sets.
+	 */
+	count = mdb_index_count_sargs(table, table->sarg_tree);
+	if (count > 1 || (count == 1 && (!mdb_get_option(MDB_USE_INDEX) ||
+	    mdb_choose_index(table, &i) == MDB_TABLE_SCAN))) {
+		if ((set = mdb_index_collect_rows(table, table->sarg_tree))) {
+			table->strategy = MDB_BITMAP_SCAN;
+			table->batch = mdb_rowset_to_array(set, &table->batch_sz);
+			table->batch_pos = 0;
+			mdb_rowset_free(set);
+			return;
+		}
+	}
 	if (mdb_get_option(MDB_USE_INDEX) && mdb_choose_index(table, &i) == MDB_INDEX_SCAN) {
 		table->strategy = MDB_INDEX_SCAN;
 		table->scan_idx = g_ptr_array_index (table->indices, i);
@@ -900,9 +1622,58 @@ mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table)
 	}
 	//printf("TABLE SCAN? %d\n", table->strategy);
 }
+/**
+ * mdb_index_scan_ordered:
+ * @mdb: Database file handle
+ * @table: table to read
+ * @idx: one of its indexes
+ *
+ * Reads @table through @idx whatever mdb_index_scan_init() would choose,
+ * so mdb_fetch_row() returns the rows in key order.  The sargs are still
+ * tested on each row.
+ */
+void
+mdb_index_scan_ordered(MdbHandle *mdb, MdbTableDef *table, MdbIndex *idx)
+{
+	mdb_index_scan_free(table);
+	table->strategy = MDB_INDEX_SCAN;
+	table->scan_idx = idx;
+	table->keep_order = 1;
+	table->chain = g_malloc0(sizeof(MdbIndexChain));
+	table->mdbidx = mdb_clone_handle(mdb);
+	mdb_read_pg(table->mdbidx, idx->first_pg);
+}
+/*
+ * Pull the next MDB_INDEX_BATCH_SZ hits off the index and sort them by
+ * data page, so each page is read once per batch instead of once per hit.
+ * Returns the number of hits collected, 0 when the index is exhausted.
+ */
+int
+mdb_index_fill_batch(MdbTableDef *table)
+{
+	guint32 pg;
+	guint16 row;
+
+	if (!table->batch)
+		table->batch = g_malloc(MDB_INDEX_BATCH_SZ * sizeof(guint32));
+	table->batch_sz = 0;
+	table->batch_pos = 0;
+	while (table->batch_sz < MDB_INDEX_BATCH_SZ &&
+	  mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, &row)) {
+		table->batch[table->batch_sz++] = (pg << 8) | (row & 0xff);
+	}
+	qsort(table->batch, table->batch_sz, sizeof(guint32), mdb_cmp_guint32);
+
+	return table->batch_sz;
+}
 void 
 mdb_index_scan_free(MdbTableDef *table)
 {
+	if (table->batch) {
+		g_free(table->batch);
+		table->batch = NULL;
+		table->batch_sz = table->batch_pos = 0;
+	}
 	if (table->chain) {
 		g_free(table->chain);
 		table->chain = NULL;
@@ -922,3 +1693,514 @@ void mdb_free_indices(GPtrArray *indices)
 		g_free (g_ptr_array_index(indices, i));
 	g_ptr_array_free(indices, TRUE);
 }
+
+/*
+ * Bottom-up index builds.  Instead of adding each new row to its leaf,
+ * bulk loads collect the entries (key + pg/row) of every row, sort them,
+ * and write a new set of leaf and intermediate pages once at the end.
+ * The entries of the existing index are merged in, and the old pages are
+ * given back to the usage map once the new root is in place.  Entries are kept in memory up to
+ * MDB_IDX_BUILD_MEM bytes, then spilled to temporary files as sorted runs
+ * that are merged while the pages are written.
+ */
+#define MDB_IDX_BUILD_MEM (16 * 1024 * 1024)
+#define MDB_IDX_MAX_ENTRY (MDB_MAX_IDX_COLS * 256 + 4)
+
+typedef struct {
+	FILE *file;		/* NULL for the entries held in memory */
+	guint32 pos;		/* next in memory entry */
+	unsigned char buf[MDB_IDX_MAX_ENTRY];
+	unsigned char *entry;	/* current entry, NULL when done */
+	int len;
+} MdbIndexRun;
+
+/* one level of the tree being written */
+typedef struct {
+	unsigned char type;
+	unsigned char *pg_buf;
+	guint32 pg;
+	int offset;
+	unsigned char last[MDB_IDX_MAX_ENTRY];	/* goes up to the parent */
+	int last_len;
+	GByteArray *parents;	/* 2 byte length + entry + child page */
+	unsigned int num_pages;
+} MdbIndexLevel;
+
+/**
+ * mdb_index_build_new:
+ * @idx: the index to rebuild
+ *
+ * Starts collecting entries for @idx.  Returns NULL if the index can't be
+ * built this way, because mdb_index_is_writable() says no or its root
+ * page pointer wasn't found in the table definition.
+ */
+MdbIndexBuild *
+mdb_index_build_new(MdbIndex *idx)
+{
+	MdbIndexBuild *build;
+
+	if (!mdb_index_is_writable(idx) || !idx->first_pg_pos)
+		return NULL;
+	build = g_malloc0(sizeof(MdbIndexBuild));
+	build->idx = idx;
+	build->recs = g_byte_array_new();
+	build->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	build->runs = g_ptr_array_new();
+
+	return build;
+}
+void
+mdb_index_build_free(MdbIndexBuild *build)
+{
+	unsigned int i;
+
+	if (!build) return;
+	for (i=0;i<build->runs->len;i++)
+		fclose(g_ptr_array_index(build->runs, i));
+	g_ptr_array_free(build->runs, TRUE);
+	g_byte_array_free(build->recs, TRUE);
+	g_array_free(build->offsets, TRUE);
+	g_free(build);
+}
+static int
+mdb_index_build_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	unsigned char *recs = data;
+	unsigned char *x = recs + *(const guint32 *)a;
+	unsigned char *y = recs + *(const guint32 *)b;
+
+	return mdb_index_cmp_entry(x + 2, mdb_get_int16(x, 0),
+		y + 2, mdb_get_int16(y, 0));
+}
+static void
+mdb_index_build_sort(MdbIndexBuild *build)
+{
+	g_qsort_with_data(build->offsets->data, build->offsets->len,
+		sizeof(guint32), mdb_index_build_cmp, build->recs->data);
+}
+/*
+ * write the entries in memory to a temporary file as a sorted run
+ */
+static int
+mdb_index_build_spill(MdbIndexBuild *build)
+{
+	FILE *run;
+	unsigned char *rec;
+	unsigned int i;
+
+	if (!(run = tmpfile())) {
+		perror("tmpfile");
+		return 0;
+	}
+	mdb_index_build_sort(build);
+	for (i=0;i<build->offsets->len;i++) {
+		rec = build->recs->data + g_array_index(build->offsets, guint32, i);
+		if (fwrite(rec, mdb_get_int16(rec, 0) + 2, 1, run) != 1) {
+			perror("fwrite");
+			fclose(run);
+			return 0;
+		}
+	}
+	rewind(run);
+	g_ptr_array_add(build->runs, run);
+	g_byte_array_set_size(build->recs, 0);
+	g_array_set_size(build->offsets, 0);
+
+	return 1;
+}
+static int
+mdb_index_build_add_entry(MdbIndexBuild *build, unsigned char *entry, int len)
+{
+	unsigned char hdr[2];
+	guint32 offset = build->recs->len;
+
+	if (len > MDB_IDX_MAX_ENTRY) {
+		fprintf(stderr, "Index entry of %d bytes is too long\n", len);
+		return 0;
+	}
+	mdb_put_int16(hdr, 0, len);
+	g_byte_array_append(build->recs, hdr, 2);
+	g_byte_array_append(build->recs, entry, len);
+	g_array_append_val(build->offsets, offset);
+	build->num_entries++;
+
+	if (build->recs->len >= MDB_IDX_BUILD_MEM)
+		return mdb_index_build_spill(build);
+	return 1;
+}
+/**
+ * mdb_index_build_add:
+ * @build: build started with mdb_index_build_new()
+ * @key: the row's key, from mdb_index_build_key()
+ * @key_len: its length
+ * @pg: data page of the row
+ * @row: row number on the page
+ *
+ * Adds the entry of one row to the index build.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_index_build_add(MdbIndexBuild *build, unsigned char *key, int key_len, guint32 pg, guint16 row)
+{
+	unsigned char entry[MDB_IDX_MAX_ENTRY];
+
+	if (key_len < 0 || key_len + 4 > MDB_IDX_MAX_ENTRY)
+		return 0;
+	memcpy(entry, key, key_len);
+	mdb_put_int32_msb(entry, key_len, (pg << 8) | (row & 0xff));
+	return mdb_index_build_add_entry(build, entry, key_len + 4);
+}
+/*
+ * add the entries of the existing index, walking the leaves in order
+ */
+static int
+mdb_index_build_load(MdbIndexBuild *build)
+{
+	MdbIndex *idx = build->idx;
+	MdbHandle *mdb = idx->table->entry->mdb;
+	MdbIndexPage ipg;
+	unsigned char entry[MDB_PGSIZE];
+	guint32 pg = idx->first_pg;
+	int entry_len;
+
+	/* down the left edge to the first leaf */
+	while (pg) {
+		if (!mdb_read_pg(mdb, pg))
+			return 0;
+		if (mdb->pg_buf[0] == MDB_PAGE_LEAF)
+			break;
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX) {
+			fprintf(stderr, "Page %lu of index %s isn't an index page\n",
+				(unsigned long) pg, idx->name);
+			return 0;
+		}
+		mdb_index_page_init(&ipg);
+		ipg.pg = pg;
+		if (!mdb_index_find_next_on_page(mdb, &ipg))
+			return 1;
+		pg = mdb_get_int32_msb(mdb->pg_buf, ipg.offset + ipg.len - 4) & 0xffffff;
+	}
+	/* then along the leaves */
+	while (pg) {
+		if (!mdb_read_pg(mdb, pg))
+			return 0;
+		mdb_index_page_init(&ipg);
+		ipg.pg = pg;
+		while (mdb_index_find_next_on_page(mdb, &ipg)) {
+			entry_len = mdb_index_get_entry(mdb, &ipg, entry);
+			if (!mdb_index_build_add_entry(build, entry, entry_len))
+				return 0;
+			ipg.offset += ipg.len;
+		}
+		pg = mdb_get_int32(mdb->pg_buf, 0x0c);
+	}
+	return 1;
+}
+static void
+mdb_index_run_next(MdbIndexBuild *build, MdbIndexRun *run)
+{
+	unsigned char *rec;
+
+	run->entry = NULL;
+	if (!run->file) {
+		if (run->pos >= build->offsets->len)
+			return;
+		rec = build->recs->data + g_array_index(build->offsets, guint32, run->pos++);
+		run->len = mdb_get_int16(rec, 0);
+		run->entry = rec + 2;
+	} else {
+		if (fread(run->buf, 2, 1, run->file) != 1)
+			return;
+		run->len = mdb_get_int16(run->buf, 0);
+		if (fread(run->buf, run->len, 1, run->file) != 1) {
+			fprintf(stderr, "Short read on index build run\n");
+			return;
+		}
+		run->entry = run->buf;
+	}
+}
+/*
+ * write the page being filled on level, and note its last entry for the
+ * level above.  next_pg is the page that follows it, if any.
+ */
+static int
+mdb_index_level_write(MdbHandle *mdb, MdbIndexLevel *level, guint32 next_pg)
+{
+	unsigned char hdr[2], child[4];
+
+	mdb_put_int32(level->pg_buf, 0x0c, next_pg);
+	mdb_put_int16(level->pg_buf, 2, mdb->fmt->pg_size - level->offset);
+	memcpy(mdb->pg_buf, level->pg_buf, mdb->fmt->pg_size);
+	if (!mdb_write_pg(mdb, level->pg))
+		return 0;
+	mdb->cur_pg = level->pg;
+	if (!mdb_map_use_page(mdb, level->pg))
+		return 0;
+
+	mdb_put_int16(hdr, 0, level->last_len + 4);
+	mdb_put_int32_msb(child, 0, level->pg);
+	g_byte_array_append(level->parents, hdr, 2);
+	g_byte_array_append(level->parents, level->last, level->last_len);
+	g_byte_array_append(level->parents, child, 4);
+	level->num_pages++;
+
+	return 1;
+}
+/*
+ * start a new page on level, at the end of the file
+ */
+static int
+mdb_index_level_start(MdbTableDef *table, MdbIndexLevel *level)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 prev_pg = level->pg_buf ? level->pg : 0;
+	guint32 pg;
+
+	/*
+	 * claim the page number first: writing the old page may add a usage
+	 * map page at the end of the file
+	 */
+	if (!(pg = mdb_map_next_page(mdb, NULL, 0)))
+		return 0;
+	memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+	if (!mdb_write_pg(mdb, pg))
+		return 0;
+	mdb->cur_pg = pg;
+
+	if (level->pg_buf) {
+		if (!mdb_index_level_write(mdb, level, pg))
+			return 0;
+	} else {
+		level->pg_buf = g_malloc(mdb->fmt->pg_size);
+	}
+	memset(level->pg_buf, 0, mdb->fmt->pg_size);
+	level->pg_buf[0] = level->type;
+	level->pg_buf[1] = 0x01;
+	mdb_put_int32(level->pg_buf, 4, table->entry->table_pg);
+	mdb_put_int32(level->pg_buf, 0x08, prev_pg);
+	level->pg = pg;
+	level->offset = MDB_IDX_ENTRY_START;
+	level->last_len = 0;
+
+	return 1;
+}
+static int
+mdb_index_level_add(MdbTableDef *table, MdbIndexLevel *level, unsigned char *entry, int len)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int bit;
+
+	if (len > MDB_IDX_PG_END(mdb) - MDB_IDX_ENTRY_START) {
+		fprintf(stderr, "Index entry of %d bytes doesn't fit on a page\n", len);
+		return 0;
+	}
+	if (!level->pg_buf || level->offset + len > MDB_IDX_PG_END(mdb)) {
+		if (!mdb_index_level_start(table, level))
+			return 0;
+	}
+	memcpy(level->pg_buf + level->offset, entry, len);
+	level->offset += len;
+	/* the bitmap marks where each entry ends */
+	bit = level->offset - MDB_IDX_ENTRY_START;
+	level->pg_buf[MDB_IDX_MAP_START + bit/8] |= 1 << (bit%8);
+
+	/* parents get the key and pg/row of the last entry, not our child */
+	level->last_len = (level->type == MDB_PAGE_INDEX) ? len - 4 : len;
+	memcpy(level->last, entry, level->last_len);
+
+	return 1;
+}
+static void
+mdb_index_level_free(MdbIndexLevel *level)
+{
+	g_free(level->pg_buf);
+	if (level->parents)
+		g_byte_array_free(level->parents, TRUE);
+}
+/*
+ * point the table definition at the new root page and entry count
+ */
+static int
+mdb_index_build_set_root(MdbIndexBuild *build, guint32 root)
+{
+	MdbIndex *idx = build->idx;
+	MdbTableDef *table = idx->table;
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+
+	if (!mdb_read_pg(mdb, idx->first_pg_tdef))
+		return 0;
+	mdb_put_int32(mdb->pg_buf, idx->first_pg_pos, root);
+	if (!mdb_write_pg(mdb, idx->first_pg_tdef))
+		return 0;
+
+	if (!mdb_read_pg(mdb, table->entry->table_pg))
+		return 0;
+	mdb_put_int32(mdb->pg_buf, fmt->tab_cols_start_offset +
+		(idx->index_num * fmt->tab_ridx_entry_size), build->num_entries);
+	if (!mdb_write_pg(mdb, table->entry->table_pg))
+		return 0;
+
+	idx->first_pg = root;
+	idx->num_rows = build->num_entries;
+	return 1;
+}
+/*
+ * Give every page of the index tree with root first_pg back to the global
+ * usage map.
+ */
+static int
+mdb_index_free_tree(MdbHandle *mdb, guint32 first_pg)
+{
+	MdbIndexPage ipg;
+	GHashTable *seen;
+	GArray *todo;
+	guint32 pg;
+	int ret = 1;
+
+	seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	todo = g_array_new(FALSE, FALSE, sizeof(guint32));
+	if (first_pg)
+		g_array_append_val(todo, first_pg);
+	while (ret && todo->len) {
+		pg = g_array_index(todo, guint32, todo->len - 1);
+		g_array_set_size(todo, todo->len - 1);
+		if (!pg || g_hash_table_lookup(seen, GUINT_TO_POINTER(pg)))
+			continue;
+		g_hash_table_insert(seen, GUINT_TO_POINTER(pg), GUINT_TO_POINTER(1));
+		if (!mdb_read_pg(mdb, pg)) {
+			ret = 0;
+			break;
+		}
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX && mdb->pg_buf[0] != MDB_PAGE_LEAF)
+			continue;
+		/* leaves that aren't in the tree yet hang off the next pointers */
+		pg = mdb_get_int32(mdb->pg_buf, 0x0c);
+		g_array_append_val(todo, pg);
+		if (mdb->pg_buf[0] == MDB_PAGE_INDEX) {
+			mdb_index_page_init(&ipg);
+			ipg.pg = mdb->cur_pg;
+			while (mdb_index_find_next_on_page(mdb, &ipg)) {
+				pg = mdb_get_int32_msb(mdb->pg_buf,
+					ipg.offset + ipg.len - 4) & 0xffffff;
+				g_array_append_val(todo, pg);
+				ipg.offset += ipg.len;
+			}
+		}
+		ret = mdb_map_free_page(mdb, mdb->cur_pg);
+	}
+	g_array_free(todo, TRUE);
+	g_hash_table_destroy(seen);
+
+	return ret;
+}
+/**
+ * mdb_index_build_finish:
+ * @build: build started with mdb_index_build_new()
+ *
+ * Merges the collected entries with those of the existing index and
+ * writes the leaf pages, then each level of intermediate pages above them
+ * until one page, the new root, remains.  The table definition is updated
+ * to point at it, and the pages of the old index are freed.  @build is
+ * freed.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_index_build_finish(MdbIndexBuild *build)
+{
+	MdbTableDef *table = build->idx->table;
+	MdbHandle *mdb = table->entry->mdb;
+	MdbIndexRun *runs, *best;
+	MdbIndexLevel level;
+	GByteArray *entries;
+	unsigned int num_runs, i;
+	guint32 pos, root = 0, old_root = build->idx->first_pg;
+	int len, ret = 1;
+
+	if (!mdb_index_build_load(build)) {
+		mdb_index_build_free(build);
+		return 0;
+	}
+	mdb_index_build_sort(build);
+	mdb_debug(MDB_DEBUG_WRITE, "building index %s from %lu entries in %u runs",
+		build->idx->name, (unsigned long) build->num_entries,
+		build->runs->len + 1);
+
+	/* the leaves, merging the runs and what is still in memory */
+	num_runs = build->runs->len + 1;
+	runs = g_malloc0(num_runs * sizeof(MdbIndexRun));
+	for (i=0;i<num_runs;i++) {
+		if (i < build->runs->len)
+			runs[i].file = g_ptr_array_index(build->runs, i);
+		mdb_index_run_next(build, &runs[i]);
+	}
+	memset(&level, 0, sizeof(MdbIndexLevel));
+	level.type = MDB_PAGE_LEAF;
+	level.parents = g_byte_array_new();
+	while (ret) {
+		best = NULL;
+		for (i=0;i<num_runs;i++) {
+			if (runs[i].entry && (!best || mdb_index_cmp_entry(
+			    runs[i].entry, runs[i].len, best->entry, best->len) < 0))
+				best = &runs[i];
+		}
+		if (!best)
+			break;
+		ret = mdb_index_level_add(table, &level, best->entry, best->len);
+		mdb_index_run_next(build, best);
+	}
+	g_free(runs);
+	/* an empty index still needs its root leaf */
+	if (ret && !level.pg_buf)
+		ret = mdb_index_level_start(table, &level);
+
+	/* then intermediate levels until one page is left */
+	while (ret) {
+		ret = mdb_index_level_write(mdb, &level, 0);
+		if (!ret || level.num_pages == 1) {
+			root = level.pg;
+			break;
+		}
+		entries = level.parents;
+		level.parents = NULL;
+		mdb_index_level_free(&level);
+		memset(&level, 0, sizeof(MdbIndexLevel));
+		level.type = MDB_PAGE_INDEX;
+		level.parents = g_byte_array_new();
+		for (pos=0;ret && pos<entries->len;pos+=len+2) {
+			len = mdb_get_int16(entries->data, pos);
+			ret = mdb_index_level_add(table, &level, entries->data + pos + 2, len);
+		}
+		g_byte_array_free(entries, TRUE);
+	}
+	mdb_index_level_free(&level);
+
+	if (ret)
+		ret = mdb_index_build_set_root(build, root);
+	/* the old pages are only given back once nothing points at them */
+	if (ret && old_root)
+		ret = mdb_index_free_tree(mdb, old_root);
+	mdb_index_build_free(build);
+
+	return ret;
+}
+/**
+ * mdb_index_free_pages:
+ * @idx: the index
+ *
+ * Gives every page of the index back to the global usage map and leaves
+ * the index without a root, for when it is about to be rebuilt from
+ * scratch with mdb_index_build_new().
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_index_free_pages(MdbIndex *idx)
+{
+	if (!mdb_index_free_tree(idx->table->entry->mdb, idx->first_pg))
+		return 0;
+	idx->first_pg = 0;
+	return 1;
+}
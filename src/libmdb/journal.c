@@ -0,0 +1,445 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The journal makes changes that span several pages atomic.  Before
+ * mdb_flush() overwrites a page of the mdb file, the page as it was when
+ * the transaction started is appended to a journal file next to the
+ * database and the journal is synced.  Once all the pages of a
+ * transaction are on disk and synced the journal is deleted, which is
+ * what commits it.  If the journal is still there when the file is next
+ * opened, the saved pages are written back and the file is cut back to
+ * its old size, undoing the half finished transaction.
+ *
+ * Between mdb_journal_begin() and mdb_journal_commit() the dirty buffer
+ * may be flushed any number of times without syncing the mdb file; only
+ * the commit waits for the disk.  Without an explicit transaction each
+ * flush is one.
+ *
+ * Header layout (little endian):
+ *   0x00  "MDBJ"
+ *   0x04  version
+ *   0x08  page size
+ *   0x0c  size of the mdb file before the transaction (low, high)
+ *   0x14  checksum of the above
+ *
+ * followed by records of page number, checksum of the page number and
+ * image, and the page image.  A record that is cut short or doesn't match
+ * its checksum ends the journal; its page was never overwritten.
+ *
+ * From before the journal is created until after it is deleted the writer
+ * holds an exclusive flock() on the mdb file.  Another process finding
+ * the journal only undoes the transaction if it can take that lock, that
+ * is if the writer is gone; otherwise the journal belongs to a live
+ * transaction and is left alone.
+ */
+#include "mdbtools.h"
+#include "mdbprivate.h"
+#include <errno.h>
+
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync(fd) fsync(fd)
+#endif
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_JOURNAL_MAGIC "MDBJ"
+#define MDB_JOURNAL_VERSION 1
+#define MDB_JOURNAL_HDR_SZ 0x18
+
+char *
+mdb_journal_path(const char *filename)
+{
+	return g_strdup_printf("%s-journal", filename);
+}
+/*
+ * take the writer's lock on the mdb file open as fd, without waiting
+ */
+static int
+mdb_journal_lock(int fd)
+{
+#ifdef HAVE_FLOCK
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		if (errno != EWOULDBLOCK)
+			perror("flock");
+		return 0;
+	}
+#endif
+	return 1;
+}
+static void
+mdb_journal_unlock(int fd)
+{
+#ifdef HAVE_FLOCK
+	flock(fd, LOCK_UN);
+#endif
+}
+static guint32
+mdb_journal_checksum(guint32 sum, unsigned char *buf, int len)
+{
+	int i;
+
+	/* FNV-1a */
+	for (i=0;i<len;i++) {
+		sum ^= buf[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+static guint32
+mdb_journal_rec_checksum(unsigned char *rec, int pg_size)
+{
+	return mdb_journal_checksum(mdb_journal_checksum(2166136261U,
+		rec, 4), rec + 8, pg_size);
+}
+static int
+mdb_journal_read(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	n = read(fd, buf, len);
+	if (n == -1) {
+		perror("read");
+		return 0;
+	}
+	return (size_t) n == len;
+}
+static int
+mdb_journal_write(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	n = write(fd, buf, len);
+	if (n == -1) {
+		perror("write");
+		return 0;
+	}
+	return (size_t) n == len;
+}
+/*
+ * Write the pages saved in the journal back to the mdb file and cut it
+ * back to its size before the transaction.
+ */
+static int
+mdb_journal_replay(int jfd, int fd)
+{
+	unsigned char hdr[MDB_JOURNAL_HDR_SZ];
+	unsigned char *rec;
+	guint32 pg_size, num_pgs = 0;
+	guint64 size;
+	int ret = 1;
+
+	lseek(jfd, 0, SEEK_SET);
+	if (!mdb_journal_read(jfd, hdr, MDB_JOURNAL_HDR_SZ)
+	 || memcmp(hdr, MDB_JOURNAL_MAGIC, 4)
+	 || mdb_get_int32(hdr, 0x04) != MDB_JOURNAL_VERSION
+	 || mdb_get_int32(hdr, 0x14) != mdb_journal_checksum(2166136261U, hdr, 0x14)) {
+		/* never synced, so nothing was overwritten */
+		return 1;
+	}
+	pg_size = mdb_get_int32(hdr, 0x08);
+	size = mdb_get_int32(hdr, 0x0c) | ((guint64) mdb_get_int32(hdr, 0x10) << 32);
+
+	rec = g_malloc(pg_size + 8);
+	while (mdb_journal_read(jfd, rec, pg_size + 8)) {
+		if (mdb_get_int32(rec, 4) != mdb_journal_rec_checksum(rec, pg_size))
+			break;
+		if (lseek(fd, (off_t) mdb_get_int32(rec, 0) * pg_size, SEEK_SET) == -1
+		 || !mdb_journal_write(fd, rec + 8, pg_size)) {
+			ret = 0;
+			break;
+		}
+		num_pgs++;
+	}
+	g_free(rec);
+	mdb_debug(MDB_DEBUG_WRITE, "restored %lu pages from journal",
+		(unsigned long) num_pgs);
+
+	if (ret && ftruncate(fd, (off_t) size)) {
+		perror("ftruncate");
+		ret = 0;
+	}
+	if (ret && fdatasync(fd)) {
+		perror("fdatasync");
+		ret = 0;
+	}
+	return ret;
+}
+/**
+ * mdb_journal_recover:
+ * @filename: path to the mdb file
+ *
+ * Undoes the transaction a crash interrupted, if there is a journal left
+ * next to @filename.  A journal whose writer still holds its lock on the
+ * file is part of a live transaction and isn't touched.  Called by
+ * mdb_open().
+ *
+ * Return value: 1 if there was nothing to do or the file was restored,
+ * 0 on failure or if another process is writing the file.
+ */
+int
+mdb_journal_recover(const char *filename)
+{
+	char *path;
+	int jfd, fd, ret;
+
+	path = mdb_journal_path(filename);
+	if (access(path, F_OK)) {
+		g_free(path);
+		return 1;
+	}
+	if ((fd = open(filename, O_RDWR)) == -1) {
+		fprintf(stderr, "%s has an unfinished transaction and can't be opened for writing to undo it\n", filename);
+		g_free(path);
+		return 0;
+	}
+	if (!mdb_journal_lock(fd)) {
+		fprintf(stderr, "%s is being written by another process\n", filename);
+		close(fd);
+		g_free(path);
+		return 0;
+	}
+	/* the writer may have committed before we got the lock */
+	if ((jfd = open(path, O_RDONLY)) == -1) {
+		close(fd);
+		g_free(path);
+		return 1;
+	}
+	fprintf(stderr, "Undoing unfinished transaction on %s\n", filename);
+	ret = mdb_journal_replay(jfd, fd);
+	close(jfd);
+	if (ret && unlink(path)) {
+		perror("unlink");
+		ret = 0;
+	}
+	/* this drops the lock, once the journal is gone */
+	close(fd);
+	g_free(path);
+
+	return ret;
+}
+/**
+ * mdb_set_journal:
+ * @mdb: Handle to open MDB database file
+ * @journal: TRUE to journal flushes
+ *
+ * Turns the journal on or off for the file.  It should be turned on
+ * before anything is written.
+ */
+void
+mdb_set_journal(MdbHandle *mdb, gboolean journal)
+{
+	mdb->f->journal = journal;
+}
+/*
+ * Create the journal and write its header.
+ */
+static int
+mdb_journal_open(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	unsigned char hdr[MDB_JOURNAL_HDR_SZ];
+	struct stat status;
+	char *path;
+
+	/* held until the journal is deleted, see mdb_journal_recover() */
+	if (!mdb_journal_lock(f->fd)) {
+		fprintf(stderr, "%s is being written by another process\n", f->filename);
+		return 0;
+	}
+	if (fstat(f->fd, &status)) {
+		perror("fstat");
+		mdb_journal_unlock(f->fd);
+		return 0;
+	}
+	path = mdb_journal_path(f->filename);
+	f->journal_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (f->journal_fd == -1) {
+		fprintf(stderr, "Can't create %s\n", path);
+		g_free(path);
+		mdb_journal_unlock(f->fd);
+		return 0;
+	}
+	g_free(path);
+
+	memset(hdr, 0, MDB_JOURNAL_HDR_SZ);
+	memcpy(hdr, MDB_JOURNAL_MAGIC, 4);
+	mdb_put_int32(hdr, 0x04, MDB_JOURNAL_VERSION);
+	mdb_put_int32(hdr, 0x08, mdb->fmt->pg_size);
+	mdb_put_int32(hdr, 0x0c, (guint32) status.st_size);
+	mdb_put_int32(hdr, 0x10, (guint32) ((guint64) status.st_size >> 32));
+	mdb_put_int32(hdr, 0x14, mdb_journal_checksum(2166136261U, hdr, 0x14));
+	if (!mdb_journal_write(f->journal_fd, hdr, MDB_JOURNAL_HDR_SZ)) {
+		close(f->journal_fd);
+		f->journal_fd = -1;
+		/* a header that isn't synced undoes nothing, leave it to recovery */
+		mdb_journal_unlock(f->fd);
+		return 0;
+	}
+
+	f->journal_end = status.st_size / mdb->fmt->pg_size;
+	f->journaled = g_hash_table_new(g_direct_hash, g_direct_equal);
+	return 1;
+}
+/*
+ * Called by mdb_flush() before it writes pgs: save the pages of the mdb
+ * file that are about to be overwritten for the first time in this
+ * transaction, and sync the journal.
+ */
+int
+mdb_journal_save(MdbHandle *mdb, guint32 *pgs, unsigned int num_pgs)
+{
+	MdbFile *f = mdb->f;
+	ssize_t pg_size = mdb->fmt->pg_size;
+	unsigned char *rec;
+	unsigned int i;
+	int ret = 1;
+
+	if (!f->journal)
+		return 1;
+	if (f->journal_fd == -1 && !mdb_journal_open(mdb))
+		return 0;
+
+	rec = g_malloc(pg_size + 8);
+	for (i=0;ret && i<num_pgs;i++) {
+		/* pages past the old end of file go with the truncate */
+		if (pgs[i] >= f->journal_end ||
+		    g_hash_table_lookup(f->journaled, GUINT_TO_POINTER(pgs[i])))
+			continue;
+		lseek(f->fd, (off_t) pgs[i] * pg_size, SEEK_SET);
+		if (!mdb_journal_read(f->fd, rec + 8, pg_size)) {
+			fprintf(stderr, "Can't read page %lu for the journal\n",
+				(unsigned long) pgs[i]);
+			ret = 0;
+			break;
+		}
+		mdb_put_int32(rec, 0, pgs[i]);
+		mdb_put_int32(rec, 4, mdb_journal_rec_checksum(rec, pg_size));
+		if (!mdb_journal_write(f->journal_fd, rec, pg_size + 8)) {
+			ret = 0;
+			break;
+		}
+		g_hash_table_insert(f->journaled, GUINT_TO_POINTER(pgs[i]),
+			GUINT_TO_POINTER(1));
+	}
+	g_free(rec);
+	if (ret && fdatasync(f->journal_fd)) {
+		perror("fdatasync");
+		ret = 0;
+	}
+	return ret;
+}
+static void
+mdb_journal_close(MdbFile *f)
+{
+	char *path;
+
+	close(f->journal_fd);
+	f->journal_fd = -1;
+	g_hash_table_destroy(f->journaled);
+	f->journaled = NULL;
+	path = mdb_journal_path(f->filename);
+	if (unlink(path))
+		perror("unlink");
+	g_free(path);
+	mdb_journal_unlock(f->fd);
+}
+/*
+ * Called by mdb_flush() once the pages are written.  Outside of a
+ * transaction this commits them.
+ */
+int
+mdb_journal_end(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+
+	if (f->journal_fd == -1 || f->txn_depth)
+		return 1;
+	if (fdatasync(f->fd)) {
+		perror("fdatasync");
+		return 0;
+	}
+	mdb_journal_close(f);
+	return 1;
+}
+/**
+ * mdb_journal_begin:
+ * @mdb: Handle to open MDB database file
+ *
+ * Starts a transaction.  Nothing written until the matching
+ * mdb_journal_commit() survives a crash unless all of it does.
+ * Transactions nest; only the outermost commit counts.
+ */
+void
+mdb_journal_begin(MdbHandle *mdb)
+{
+	mdb->f->txn_depth++;
+}
+/**
+ * mdb_journal_commit:
+ * @mdb: Handle to open MDB database file
+ *
+ * Flushes the pages written in the transaction and makes them durable.
+ *
+ * Return value: 1 on success, 0 on failure.
+ */
+int
+mdb_journal_commit(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+
+	if (f->txn_depth && --f->txn_depth)
+		return 1;
+	return mdb_flush(mdb) && mdb_journal_end(mdb);
+}
+/**
+ * mdb_journal_rollback:
+ * @mdb: Handle to open MDB database file
+ *
+ * Throws away the pages written in the transaction and restores those
+ * already flushed.  Table definitions read since the transaction started
+ * may be out of date afterwards.
+ *
+ * Return value: 1 on success, 0 on failure.
+ */
+int
+mdb_journal_rollback(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	int ret = 1;
+
+	f->txn_depth = 0;
+	if (f->dirty)
+		g_hash_table_remove_all(f->dirty);
+	f->dirty_end = 0;
+	/* the page in pg_buf may be one we threw away */
+	mdb->cur_pg = 0;
+
+	if (f->journal_fd != -1) {
+		ret = mdb_journal_replay(f->journal_fd, f->fd);
+		if (ret)
+			mdb_journal_close(f);
+	}
+	return ret;
+}
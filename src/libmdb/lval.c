@@ -0,0 +1,387 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Writing memo and OLE values.  The 12 byte field stored in the row starts
+ * with the length of the value and a flag in the high byte:
+ *
+ *   0x80  the value follows the field in the row
+ *   0x40  the value is a single row on an LVAL page, pointed to by the
+ *         pg/row at offset 4
+ *   0x00  the value is a chain of LVAL rows, each starting with the pg/row
+ *         of the next one (0 for the last), the first at offset 4
+ *
+ * LVAL pages are data pages with "LVAL" where the table definition page
+ * would be.  Rows of several values are packed onto the same page, the
+ * one the table last wrote to, as long as they fit.
+ *
+ * Values are written through an MdbLvalWriter, so they can be handed over
+ * in pieces: at most one LVAL row worth of data is held in memory.  A
+ * value that can't be finished is given up with mdb_lval_abort().
+ */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/* room for one row on an empty page */
+#define MDB_LVAL_ROW_MAX(mdb) \
+	((mdb)->fmt->pg_size - (mdb)->fmt->row_count_offset - 4)
+/* the longest value the length field can describe */
+#define MDB_LVAL_MAX_LEN 0x00ffffff
+
+/*
+ * Add row to the table's current LVAL page, or a new one if it doesn't
+ * fit.  Returns its pg/row, or 0 on failure.
+ */
+static guint32
+mdb_lval_add_row(MdbTableDef *table, unsigned char *row, int len)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	int rco = mdb->fmt->row_count_offset;
+	guint32 pg = table->lval_pg;
+	void *new_pg;
+	int row_num;
+
+	if (!pg || !mdb_read_pg(mdb, pg)
+	 || mdb_get_int16(mdb->pg_buf, 2) < len + 2
+	 || mdb_get_int16(mdb->pg_buf, rco) >= 255) {
+		if (!(pg = mdb_map_next_page(mdb, NULL, 0)))
+			return 0;
+		new_pg = mdb_new_data_pg(entry);
+		memcpy(new_pg + 4, "LVAL", 4);
+		memcpy(mdb->pg_buf, new_pg, mdb->fmt->pg_size);
+		g_free(new_pg);
+		mdb->cur_pg = pg;
+		mdb_debug(MDB_DEBUG_WRITE, "new LVAL page %lu", (unsigned long) pg);
+	}
+	row_num = mdb_add_row_to_pg(table, row, len) - 1;
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	mdb->cur_pg = pg;
+	if (pg != table->lval_pg) {
+		if (!mdb_map_use_page(mdb, pg))
+			return 0;
+		table->lval_pg = pg;
+	}
+	return (pg << 8) | row_num;
+}
+/*
+ * Point the chain row at pg_row to next.  The row keeps its size, so
+ * nothing else on the page moves.
+ */
+static int
+mdb_lval_set_next(MdbHandle *mdb, guint32 pg_row, guint32 next)
+{
+	int row_start;
+	size_t row_size;
+
+	if (!mdb_read_pg(mdb, pg_row >> 8))
+		return 0;
+	mdb_find_row(mdb, pg_row & 0xff, &row_start, &row_size);
+	mdb_put_int32(mdb->pg_buf, row_start & OFFSET_MASK, next);
+	if (!mdb_write_pg(mdb, pg_row >> 8)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Write the first len bytes held by w as the next row of its chain.
+ */
+static int
+mdb_lval_write_chain_row(MdbLvalWriter *w, size_t len)
+{
+	MdbHandle *mdb = w->table->entry->mdb;
+	unsigned char *row;
+	guint32 pg_row;
+
+	row = g_malloc(len + 4);
+	mdb_put_int32(row, 0, 0);
+	memcpy(row + 4, w->buf->data, len);
+	pg_row = mdb_lval_add_row(w->table, row, len + 4);
+	g_free(row);
+	if (!pg_row)
+		return 0;
+	if (w->last_pg_row && !mdb_lval_set_next(mdb, w->last_pg_row, pg_row))
+		return 0;
+	if (!w->first_pg_row)
+		w->first_pg_row = pg_row;
+	w->last_pg_row = pg_row;
+	g_byte_array_remove_range(w->buf, 0, len);
+
+	return 1;
+}
+/**
+ * mdb_lval_writer_new:
+ * @table: table the value belongs to
+ *
+ * Starts writing a memo or OLE value for a row of @table.
+ *
+ * Returns: the writer, or NULL if long values can't be written to @table.
+ */
+MdbLvalWriter *
+mdb_lval_writer_new(MdbTableDef *table)
+{
+	MdbLvalWriter *w;
+
+	if (!table->entry->mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return NULL;
+	}
+	if (table->is_temp_table) {
+		fprintf(stderr, "Long values in temporary tables are not supported\n");
+		return NULL;
+	}
+	w = g_malloc0(sizeof(MdbLvalWriter));
+	w->table = table;
+	w->buf = g_byte_array_new();
+
+	return w;
+}
+/**
+ * mdb_lval_write:
+ * @w: writer from mdb_lval_writer_new()
+ * @data: the next part of the value
+ * @len: its length
+ *
+ * Adds to the value.  Full LVAL rows are written out as soon as the value
+ * is known to need a chain of them.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_lval_write(MdbLvalWriter *w, void *data, size_t len)
+{
+	MdbHandle *mdb = w->table->entry->mdb;
+	size_t chunk = MDB_LVAL_ROW_MAX(mdb) - 4;
+
+	if (w->len + len > MDB_LVAL_MAX_LEN) {
+		fprintf(stderr, "Long value of more than %d bytes\n", MDB_LVAL_MAX_LEN);
+		return 0;
+	}
+	g_byte_array_append(w->buf, data, len);
+	w->len += len;
+	/* a value that fits one row is kept for mdb_lval_finish() */
+	if (!w->first_pg_row && w->buf->len <= (guint) MDB_LVAL_ROW_MAX(mdb))
+		return 1;
+	while (w->buf->len > chunk) {
+		if (!mdb_lval_write_chain_row(w, chunk))
+			return 0;
+	}
+	return 1;
+}
+/**
+ * mdb_lval_finish:
+ * @w: writer from mdb_lval_writer_new(), freed on return
+ * @dest: where to put the field to store in the row, MDB_MEMO_OVERHEAD
+ * bytes plus @inline_max
+ * @inline_max: the longest value to store in the row itself
+ *
+ * Writes what is left of the value and builds the field pointing at it.
+ *
+ * Returns: the size of the field in @dest, or -1 on failure.
+ */
+int
+mdb_lval_finish(MdbLvalWriter *w, unsigned char *dest, size_t inline_max)
+{
+	guint32 pg_row;
+	int siz = MDB_MEMO_OVERHEAD;
+
+	memset(dest, 0, MDB_MEMO_OVERHEAD);
+	if (!w->first_pg_row && w->len <= inline_max) {
+		mdb_put_int32(dest, 0, w->len | 0x80000000);
+		memcpy(dest + MDB_MEMO_OVERHEAD, w->buf->data, w->len);
+		siz += w->len;
+	} else if (!w->first_pg_row) {
+		pg_row = mdb_lval_add_row(w->table, w->buf->data, w->len);
+		if (!pg_row)
+			siz = -1;
+		mdb_put_int32(dest, 0, w->len | 0x40000000);
+		mdb_put_int32(dest, 4, pg_row);
+	} else {
+		if (w->buf->len && !mdb_lval_write_chain_row(w, w->buf->len))
+			siz = -1;
+		mdb_put_int32(dest, 0, w->len);
+		mdb_put_int32(dest, 4, w->first_pg_row);
+	}
+	g_byte_array_free(w->buf, TRUE);
+	g_free(w);
+
+	return siz;
+}
+/*
+ * Flag the chain row at pg_row as deleted, and give its page back if
+ * nothing else is left on it.  next is set to the row after it.
+ */
+static int
+mdb_lval_delete_row(MdbTableDef *table, guint32 pg_row, guint32 *next)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int rco = mdb->fmt->row_count_offset;
+	guint32 pg = pg_row >> 8;
+	int row = pg_row & 0xff;
+	int row_start, num_rows, i;
+	size_t row_size;
+
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	mdb_find_row(mdb, row, &row_start, &row_size);
+	*next = mdb_get_int32(mdb->pg_buf, row_start & OFFSET_MASK);
+	mdb_put_int16(mdb->pg_buf, rco + 2 + row*2,
+		mdb_get_int16(mdb->pg_buf, rco + 2 + row*2) | 0x4000);
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	num_rows = mdb_get_int16(mdb->pg_buf, rco);
+	for (i=0;i<num_rows;i++) {
+		if (!(mdb_get_int16(mdb->pg_buf, rco + 2 + i*2) & 0x4000))
+			return 1;
+	}
+	mdb_debug(MDB_DEBUG_WRITE, "freeing LVAL page %lu", (unsigned long) pg);
+	if (pg == table->lval_pg)
+		table->lval_pg = 0;
+	return mdb_map_free_page(mdb, pg);
+}
+/**
+ * mdb_lval_abort:
+ * @w: writer from mdb_lval_writer_new(), freed on return
+ *
+ * Gives up on the value without building a field for it.  The rows
+ * already written for it are flagged as deleted, and LVAL pages left
+ * with nothing on them are given back to the usage map.
+ */
+void
+mdb_lval_abort(MdbLvalWriter *w)
+{
+	guint32 pg_row = w->first_pg_row, next;
+
+	while (pg_row && mdb_lval_delete_row(w->table, pg_row, &next))
+		pg_row = next;
+	g_byte_array_free(w->buf, TRUE);
+	g_free(w);
+}
+/**
+ * mdb_lval_delete:
+ * @table: table the value belongs to
+ * @field: a field built by mdb_lval_finish()
+ *
+ * Deletes the LVAL rows of a value that was finished but isn't kept after
+ * all, the way mdb_lval_abort() does for one that wasn't finished.
+ */
+void
+mdb_lval_delete(MdbTableDef *table, unsigned char *field)
+{
+	guint32 flags = mdb_get_int32(field, 0);
+	guint32 pg_row = mdb_get_int32(field, 4), next;
+
+	if (flags & 0x80000000)
+		return;
+	if (flags & 0x40000000) {
+		mdb_lval_delete_row(table, pg_row, &next);
+		return;
+	}
+	while (pg_row && mdb_lval_delete_row(table, pg_row, &next))
+		pg_row = next;
+}
+/**
+ * mdb_lval_put:
+ * @table: table the value belongs to
+ * @data: the value
+ * @len: its length
+ * @dest: where to put the field, see mdb_lval_finish()
+ * @inline_max: the longest value to store in the row itself
+ *
+ * Writes a value that is already in memory.
+ *
+ * Returns: the size of the field in @dest, or -1 on failure.
+ */
+int
+mdb_lval_put(MdbTableDef *table, void *data, size_t len, unsigned char *dest, size_t inline_max)
+{
+	MdbLvalWriter *w;
+
+	if (!(w = mdb_lval_writer_new(table)))
+		return -1;
+	if (!mdb_lval_write(w, data, len)) {
+		mdb_lval_abort(w);
+		return -1;
+	}
+	return mdb_lval_finish(w, dest, inline_max);
+}
+/**
+ * mdb_lval_get:
+ * @mdb: Database file handle
+ * @field: the memo or OLE field stored in the row
+ * @siz: its size
+ * @len: set to the length of the value
+ * @pages: if not NULL, counts the rows read from each LVAL page
+ *
+ * Reads a whole memo or OLE value, wherever it is stored.  pg_buf is left
+ * alone.
+ *
+ * Returns: the value, which the caller frees, or NULL on failure.
+ */
+unsigned char *
+mdb_lval_get(MdbHandle *mdb, unsigned char *field, int siz, size_t *len, GHashTable *pages)
+{
+	GByteArray *value;
+	guint32 flags, pg_row;
+	void *buf;
+	int row_start;
+	size_t row_size;
+
+	if (siz < MDB_MEMO_OVERHEAD)
+		return NULL;
+	flags = mdb_get_int32(field, 0) & 0xff000000;
+	pg_row = mdb_get_int32(field, 4);
+	value = g_byte_array_new();
+	if (flags & 0x80000000) {
+		g_byte_array_append(value, field + MDB_MEMO_OVERHEAD,
+			siz - MDB_MEMO_OVERHEAD);
+	} else if (flags == 0x40000000 || flags == 0) {
+		while (pg_row) {
+			if (mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &row_size)) {
+				g_byte_array_free(value, TRUE);
+				return NULL;
+			}
+			row_start &= OFFSET_MASK;
+			if (pages)
+				g_hash_table_insert(pages, GUINT_TO_POINTER(pg_row >> 8),
+					GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(
+					pages, GUINT_TO_POINTER(pg_row >> 8))) + 1));
+			if (flags) {
+				g_byte_array_append(value, buf + row_start, row_size);
+				break;
+			}
+			g_byte_array_append(value, buf + row_start + 4, row_size - 4);
+			pg_row = mdb_get_int32(buf, row_start);
+		}
+	} else {
+		fprintf(stderr, "Unhandled long value flags = %02x\n", flags >> 24);
+		g_byte_array_free(value, TRUE);
+		return NULL;
+	}
+	*len = value->len;
+	return g_byte_array_free(value, FALSE);
+}
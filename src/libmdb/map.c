@@ -97,11 +97,344 @@ mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint
 	fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
 	return -1;
 }
+/*
+ * append an empty usage bitmap (0x05) page to the file and mark it used
+ * in the global usage map, returns its page number or 0 on failure.
+ * pg_buf is left alone.
+ */
+static guint32
+mdb_map_new_map_pg(MdbHandle *mdb)
+{
+	guint32 pg, cur_pg = mdb->cur_pg;
+	int cur_pos = mdb->cur_pos;
+
+	pg = mdb_file_pages(mdb);
+	if (!pg)
+		return 0;
+	mdb_swap_pgbuf(mdb);
+	/* pg_buf doesn't hold cur_pg until it is swapped back */
+	mdb->cur_pg = 0;
+	memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+	mdb->pg_buf[0] = 0x05;
+	mdb->pg_buf[1] = 0x01;
+	if (!mdb_write_pg(mdb, pg) || !mdb_map_use_page(mdb, pg))
+		pg = 0;
+	mdb_swap_pgbuf(mdb);
+	mdb->cur_pg = cur_pg;
+	mdb->cur_pos = cur_pos;
+	mdb_debug(MDB_DEBUG_USAGE, "new usage map page %lu", (unsigned long) pg);
+
+	return pg;
+}
+/*
+ * does the usage map have room for page pg?  Type 1 maps grow new bitmap
+ * pages on demand as long as there is a slot for them.
+ */
+static int
+mdb_map_covers(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 pg)
+{
+	guint32 pgnum;
+
+	if (map[0] == 0) {
+		pgnum = mdb_get_int32(map, 1);
+		return pg >= pgnum && pg - pgnum < (map_sz - 5) * 8;
+	} else if (map[0] == 1) {
+		return pg / ((mdb->fmt->pg_size - 4) * 8) < (map_sz - 1) / 4;
+	}
+	return 0;
+}
+/*
+ * Mark page pg as used (or not) in a usage map.  Inline maps (type 0) are
+ * changed in memory only, see mdb_map_save().  Type 1 maps point at 0x05
+ * pages holding the bitmap, those are updated on disk, adding a bitmap
+ * page to the map when needed.
+ *
+ * returns 1 on success, 0 if the page isn't covered by the map.
+ */
+int
+mdb_map_set_page(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 pg, int used)
+{
+	guint32 pgnum, bit, usage_bitlen, map_ind, map_pg;
+	unsigned char *usage_bitmap;
+
+	if (map[0] == 0) {
+		pgnum = mdb_get_int32(map, 1);
+		usage_bitmap = map + 5;
+		usage_bitlen = (map_sz - 5) * 8;
+		if (pg < pgnum || pg - pgnum >= usage_bitlen) {
+			fprintf(stderr, "Page %lu is outside of the usage map\n",
+				(unsigned long) pg);
+			return 0;
+		}
+		bit = pg - pgnum;
+	} else if (map[0] == 1) {
+		usage_bitlen = (mdb->fmt->pg_size - 4) * 8;
+		map_ind = pg / usage_bitlen;
+		if (map_ind >= (map_sz - 1) / 4) {
+			fprintf(stderr, "No usage map page for page %lu\n",
+				(unsigned long) pg);
+			return 0;
+		}
+		if (!(map_pg = mdb_get_int32(map, (map_ind*4)+1))) {
+			/* nothing to clear in a bitmap page that isn't there */
+			if (!used)
+				return 1;
+			if (!(map_pg = mdb_map_new_map_pg(mdb)))
+				return 0;
+			mdb_put_int32(map, (map_ind*4)+1, map_pg);
+		}
+		if (mdb_read_alt_pg(mdb, map_pg) != mdb->fmt->pg_size) {
+			fprintf(stderr, "Oops! didn't get a full page at %d\n", map_pg);
+			return 0;
+		}
+		mdb_swap_pgbuf(mdb);
+		bit = pg % usage_bitlen;
+		if (used)
+			mdb->pg_buf[4 + bit/8] |= 1 << (bit%8);
+		else
+			mdb->pg_buf[4 + bit/8] &= ~(1 << (bit%8));
+		if (!mdb_write_pg(mdb, map_pg)) {
+			mdb_swap_pgbuf(mdb);
+			return 0;
+		}
+		mdb_swap_pgbuf(mdb);
+		return 1;
+	} else {
+		fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
+		return 0;
+	}
+	if (used)
+		usage_bitmap[bit/8] |= 1 << (bit%8);
+	else
+		usage_bitmap[bit/8] &= ~(1 << (bit%8));
+	return 1;
+}
+static int
+mdb_map_save_row(MdbTableDef *table, int map_offset, unsigned char *map, size_t map_sz)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 pg_row, pg;
+	int row_start;
+	size_t row_size;
+
+	if (!mdb_read_pg(mdb, table->entry->table_pg))
+		return 0;
+	pg_row = mdb_get_int32(mdb->pg_buf, map_offset);
+	pg = pg_row >> 8;
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	mdb_find_row(mdb, pg_row & 0xff, &row_start, &row_size);
+	row_start &= OFFSET_MASK;
+	if (row_size != map_sz) {
+		fprintf(stderr, "Usage map on page %lu changed size\n",
+			(unsigned long) pg);
+		return 0;
+	}
+	memcpy(mdb->pg_buf + row_start, map, map_sz);
+	return mdb_write_pg(mdb, pg) ? 1 : 0;
+}
+/*
+ * Write the table's usage and free space maps back to the rows they were
+ * read from.
+ */
+int
+mdb_map_save(MdbTableDef *table)
+{
+	MdbFormatConstants *fmt = table->entry->mdb->fmt;
+
+	if (!mdb_map_save_row(table, fmt->tab_usage_map_offset,
+	    table->usage_map, table->map_sz))
+		return 0;
+	return mdb_map_save_row(table, fmt->tab_free_map_offset,
+		table->free_usage_map, table->freemap_sz);
+}
+/*
+ * Take page pg out of the global usage map on page 1, where the bit of
+ * each free page is set, or put it back when is_free.
+ */
+static int
+mdb_map_claim_page(MdbHandle *mdb, unsigned char *map, size_t map_sz, int row_start, guint32 pg, int is_free)
+{
+	if (!mdb_map_covers(mdb, map, map_sz, pg))
+		return 1;
+	if (!is_free && map[0] == 1 && !mdb_get_int32(map,
+	    (pg / ((mdb->fmt->pg_size - 4) * 8))*4 + 1))
+		return 1;
+	if (!mdb_map_set_page(mdb, map, map_sz, pg, is_free))
+		return 0;
+	/* type 1 maps change too when they get a new bitmap page */
+	if (!mdb_read_pg(mdb, 1))
+		return 0;
+	memcpy(mdb->pg_buf + row_start, map, map_sz);
+	if (!mdb_write_pg(mdb, 1))
+		return 0;
+	return 1;
+}
+/*
+ * read the global usage map, returns a copy the caller frees
+ */
+static unsigned char *
+mdb_map_read_global(MdbHandle *mdb, int *row_start, size_t *map_sz)
+{
+	if (!mdb_read_pg(mdb, 1))
+		return NULL;
+	mdb_find_row(mdb, 0, row_start, map_sz);
+	*row_start &= OFFSET_MASK;
+	return g_memdup(mdb->pg_buf + *row_start, *map_sz);
+}
+static int
+mdb_map_mark_page(MdbHandle *mdb, guint32 pg, int is_free)
+{
+	unsigned char *map;
+	size_t map_sz;
+	int row_start, ret;
+
+	if (!(map = mdb_map_read_global(mdb, &row_start, &map_sz)))
+		return 0;
+	ret = mdb_map_claim_page(mdb, map, map_sz, row_start, pg, is_free);
+	g_free(map);
+
+	return ret;
+}
+/*
+ * Mark page pg as in use in the global usage map, for pages that were
+ * added to the end of the file, once they are written.
+ */
+int
+mdb_map_use_page(MdbHandle *mdb, guint32 pg)
+{
+	return mdb_map_mark_page(mdb, pg, 0);
+}
+/*
+ * Give page pg back to the global usage map, so it can be reused.  Pages
+ * the map doesn't cover are just left unused.
+ */
+int
+mdb_map_free_page(MdbHandle *mdb, guint32 pg)
+{
+	if (pg <= mdb->f->free_hint)
+		mdb->f->free_hint = pg ? pg - 1 : 0;
+	return mdb_map_mark_page(mdb, pg, 1);
+}
+/*
+ * Pick the page a new page should be written to: the first free page in
+ * the global usage map that map (a table's usage map, or NULL) covers,
+ * which is claimed right away, or else the page past the end of the file,
+ * which the caller claims with mdb_map_use_page() once it is written.
+ *
+ * returns the page number, 0 on failure.
+ */
+guint32
+mdb_map_next_page(MdbHandle *mdb, unsigned char *tab_map, size_t tab_map_sz)
+{
+	unsigned char *map;
+	size_t map_sz;
+	int row_start;
+	guint32 num_pgs, pg = 0;
+	gint32 next;
+
+	num_pgs = mdb_file_pages(mdb);
+	if (!num_pgs)
+		return 0;
+	if (!(map = mdb_map_read_global(mdb, &row_start, &map_sz)))
+		return 0;
+	/* pages up to free_hint are known to be in use */
+	next = mdb->f->free_hint;
+	while ((next = mdb_map_find_next(mdb, map, map_sz, next)) > 0) {
+		if ((guint32) next >= num_pgs)
+			break;
+		if (!tab_map || mdb_map_covers(mdb, tab_map, tab_map_sz, next)) {
+			pg = next;
+			break;
+		}
+	}
+	if (pg) {
+		if (!tab_map)
+			mdb->f->free_hint = pg;
+		if (!mdb_map_claim_page(mdb, map, map_sz, row_start, pg, 0))
+			pg = 0;
+	} else {
+		pg = num_pgs;
+	}
+	g_free(map);
+
+	return pg;
+}
+/*
+ * Returns the number of pages the file needs: one past the last page that
+ * isn't free in the global usage map.
+ */
+guint32
+mdb_map_used_pages(MdbHandle *mdb)
+{
+	unsigned char *map, *is_free;
+	size_t map_sz;
+	int row_start;
+	guint32 num_pgs;
+	gint32 next = 0;
+
+	num_pgs = mdb_file_pages(mdb);
+	if (!(map = mdb_map_read_global(mdb, &row_start, &map_sz)))
+		return num_pgs;
+	is_free = g_malloc0(num_pgs);
+	while ((next = mdb_map_find_next(mdb, map, map_sz, next)) > 0
+	 && (guint32) next < num_pgs)
+		is_free[next] = 1;
+	while (num_pgs > 1 && is_free[num_pgs - 1])
+		num_pgs--;
+	g_free(is_free);
+	g_free(map);
+
+	return num_pgs;
+}
+/*
+ * Allocate a new data page for table, reusing a free page from the global
+ * usage map if there is one and extending the file otherwise.  The page is
+ * registered in the table's usage and free space maps and left in pg_buf.
+ *
+ * returns the page number, 0 on failure.
+ */
 guint32
 mdb_alloc_page(MdbTableDef *table)
 {
-	printf("Allocating new page\n");
-	return 0;
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	guint32 num_pgs, pg;
+	void *new_pg;
+
+	num_pgs = mdb_file_pages(mdb);
+	if (!(pg = mdb_map_next_page(mdb, table->usage_map, table->map_sz)))
+		return 0;
+	if (pg == num_pgs &&
+	    !mdb_map_covers(mdb, table->usage_map, table->map_sz, pg)) {
+		fprintf(stderr, "Usage map of table %s is full\n", table->name);
+		return 0;
+	}
+	mdb_debug(MDB_DEBUG_USAGE, "allocating page %lu for %s",
+		(unsigned long) pg, table->name);
+
+	/* write the page before the maps, which may need pages of their own */
+	new_pg = mdb_new_data_pg(entry);
+	memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
+	if (!mdb_write_pg(mdb, pg) ||
+	    (pg == num_pgs && !mdb_map_use_page(mdb, pg))) {
+		g_free(new_pg);
+		return 0;
+	}
+	if (!mdb_map_set_page(mdb, table->usage_map, table->map_sz, pg, 1) ||
+	    !mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz, pg, 1) ||
+	    !mdb_map_save(table)) {
+		g_free(new_pg);
+		return 0;
+	}
+	memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
+	mdb->cur_pg = pg;
+	g_free(new_pg);
+
+	table->freemap_hint = pg;
+
+	return pg;
 }
 guint32 
 mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
@@ -109,14 +442,22 @@ mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
 	guint32 pgnum;
-	guint32 cur_pg = 0;
-	int free_space;
+	guint32 cur_pg;
+	int free_space = 0;
 
+	/* start where the last row went, pages before it are likely full */
+	cur_pg = table->freemap_hint ? table->freemap_hint - 1 : 0;
 	do {
 		pgnum = mdb_map_find_next(mdb, 
 				table->free_usage_map, 
 				table->freemap_sz, cur_pg);
 		//printf("looking at page %d\n", pgnum);
+		if (!pgnum && table->freemap_hint) {
+			/* wrap around once */
+			table->freemap_hint = 0;
+			cur_pg = 0;
+			continue;
+		}
 		if (!pgnum) {
 			/* allocate new page */
 			pgnum = mdb_alloc_page(table);
@@ -133,6 +474,7 @@ mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
 	} while (free_space < row_size);
 
 	//printf("page %d has %d bytes left\n", pgnum, free_space);
+	table->freemap_hint = pgnum;
 
 	return pgnum;
 }
@@ -50,33 +50,43 @@ mdb_debug(int klass, char *fmt, ...)
 #endif
 }
 
+/*
+ * Handles may be used from several threads, so the environment is left
+ * alone and opts is only set once it is complete.  Threads racing here
+ * all work out the same value.
+ */
 static void
 load_options()
 {
 	char *opt;
-	char *s;
+	char *s, *env, *save;
+	unsigned long found = 0;
 
-    if (!optset && (s=getenv("MDBOPTS"))) {
-		opt = strtok(s, ":");
+    if (!optset && (env=getenv("MDBOPTS"))) {
+		s = g_strdup(env);
+		opt = strtok_r(s, ":", &save);
 		while (opt) {
-        	if (!strcmp(opt, "use_index")) opts |= MDB_USE_INDEX;
-        	if (!strcmp(opt, "no_memo")) opts |= MDB_NO_MEMO;
-        	if (!strcmp(opt, "debug_like")) opts |= MDB_DEBUG_LIKE;
-        	if (!strcmp(opt, "debug_write")) opts |= MDB_DEBUG_WRITE;
-        	if (!strcmp(opt, "debug_usage")) opts |= MDB_DEBUG_USAGE;
-        	if (!strcmp(opt, "debug_ole")) opts |= MDB_DEBUG_OLE;
-        	if (!strcmp(opt, "debug_row")) opts |= MDB_DEBUG_ROW;
-        	if (!strcmp(opt, "debug_props")) opts |= MDB_DEBUG_PROPS;
+        	if (!strcmp(opt, "use_index")) found |= MDB_USE_INDEX;
+        	if (!strcmp(opt, "no_memo")) found |= MDB_NO_MEMO;
+        	if (!strcmp(opt, "index_batch")) found |= MDB_INDEX_BATCH;
+        	if (!strcmp(opt, "debug_like")) found |= MDB_DEBUG_LIKE;
+        	if (!strcmp(opt, "debug_write")) found |= MDB_DEBUG_WRITE;
+        	if (!strcmp(opt, "debug_usage")) found |= MDB_DEBUG_USAGE;
+        	if (!strcmp(opt, "debug_ole")) found |= MDB_DEBUG_OLE;
+        	if (!strcmp(opt, "debug_row")) found |= MDB_DEBUG_ROW;
+        	if (!strcmp(opt, "debug_props")) found |= MDB_DEBUG_PROPS;
         	if (!strcmp(opt, "debug_all")) {
-				opts |= MDB_DEBUG_LIKE;
-				opts |= MDB_DEBUG_WRITE;
-				opts |= MDB_DEBUG_USAGE;
-				opts |= MDB_DEBUG_OLE;
-				opts |= MDB_DEBUG_ROW;
-				opts |= MDB_DEBUG_PROPS;
+				found |= MDB_DEBUG_LIKE;
+				found |= MDB_DEBUG_WRITE;
+				found |= MDB_DEBUG_USAGE;
+				found |= MDB_DEBUG_OLE;
+				found |= MDB_DEBUG_ROW;
+				found |= MDB_DEBUG_PROPS;
 			}
-			opt = strtok(NULL,":");
+			opt = strtok_r(NULL, ":", &save);
 		}
+		g_free(s);
+		opts = found;
     }
 	optset = 1;
 }
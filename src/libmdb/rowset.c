@@ -0,0 +1,178 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Row sets are used to combine the hits from several indexes.  Each data
+ * page that has at least one hit gets a bitmap with one bit per row; a page
+ * can't hold more than 256 rows since index entries only store one byte for
+ * the row number.
+ */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_ROWSET_MAP_SZ 32
+
+MdbRowSet *
+mdb_rowset_new()
+{
+	MdbRowSet *set;
+
+	set = g_malloc0(sizeof(MdbRowSet));
+	set->pages = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+		NULL, g_free);
+
+	return set;
+}
+void
+mdb_rowset_free(MdbRowSet *set)
+{
+	if (!set) return;
+	g_hash_table_destroy(set->pages);
+	g_free(set);
+}
+void
+mdb_rowset_add(MdbRowSet *set, guint32 pg, guint16 row)
+{
+	unsigned char *map;
+
+	map = g_hash_table_lookup(set->pages, GUINT_TO_POINTER(pg));
+	if (!map) {
+		map = g_malloc0(MDB_ROWSET_MAP_SZ);
+		g_hash_table_insert(set->pages, GUINT_TO_POINTER(pg), map);
+	}
+	if (!(map[row/8] & (1 << (row%8)))) {
+		map[row/8] |= 1 << (row%8);
+		set->num_rows++;
+	}
+}
+static gboolean
+mdb_rowset_and_page(gpointer key, gpointer value, gpointer data)
+{
+	MdbRowSet *set = data;
+	unsigned char *map = value;
+	unsigned char *other;
+	int i, empty = 1;
+
+	other = g_hash_table_lookup(set->pages, key);
+	for (i=0;i<MDB_ROWSET_MAP_SZ;i++) {
+		map[i] = other ? map[i] & other[i] : 0;
+		if (map[i]) empty = 0;
+	}
+	/* remove pages with no rows left */
+	return empty;
+}
+static void
+mdb_rowset_or_page(gpointer key, gpointer value, gpointer data)
+{
+	MdbRowSet *set = data;
+	unsigned char *map = value;
+	unsigned char *dest;
+	int i;
+
+	dest = g_hash_table_lookup(set->pages, key);
+	if (!dest) {
+		dest = g_malloc0(MDB_ROWSET_MAP_SZ);
+		g_hash_table_insert(set->pages, key, dest);
+	}
+	for (i=0;i<MDB_ROWSET_MAP_SZ;i++)
+		dest[i] |= map[i];
+}
+static void
+mdb_rowset_count_page(gpointer key, gpointer value, gpointer data)
+{
+	unsigned char *map = value;
+	unsigned int *count = data;
+	int i, j;
+
+	for (i=0;i<MDB_ROWSET_MAP_SZ;i++)
+		for (j=0;j<8;j++)
+			if (map[i] & (1 << j)) (*count)++;
+}
+/*
+ * Intersect set with other, leaving the result in set.
+ */
+void
+mdb_rowset_and(MdbRowSet *set, MdbRowSet *other)
+{
+	g_hash_table_foreach_remove(set->pages, mdb_rowset_and_page, other);
+	set->num_rows = 0;
+	g_hash_table_foreach(set->pages, mdb_rowset_count_page, &set->num_rows);
+}
+/*
+ * Union set with other, leaving the result in set.
+ */
+void
+mdb_rowset_or(MdbRowSet *set, MdbRowSet *other)
+{
+	g_hash_table_foreach(other->pages, mdb_rowset_or_page, set);
+	set->num_rows = 0;
+	g_hash_table_foreach(set->pages, mdb_rowset_count_page, &set->num_rows);
+}
+static void
+mdb_rowset_get_page(gpointer key, gpointer value, gpointer data)
+{
+	GArray *pages = data;
+	guint32 pg = GPOINTER_TO_UINT(key);
+
+	g_array_append_val(pages, pg);
+}
+/*
+ * qsort() comparator for arrays of guint32: page numbers, or the pg/row
+ * pairs of index batches and row sets.
+ */
+int
+mdb_cmp_guint32(const void *a, const void *b)
+{
+	guint32 x = *(const guint32 *)a;
+	guint32 y = *(const guint32 *)b;
+
+	return (x > y) - (x < y);
+}
+/*
+ * Return the rows in the set as a newly allocated array of (pg << 8 | row)
+ * sorted by page and row, the same form used for batched index fetches.
+ */
+guint32 *
+mdb_rowset_to_array(MdbRowSet *set, unsigned int *count)
+{
+	GArray *pages;
+	guint32 *rows, pg;
+	unsigned char *map;
+	unsigned int i, j, n = 0;
+
+	pages = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_hash_table_foreach(set->pages, mdb_rowset_get_page, pages);
+	qsort(pages->data, pages->len, sizeof(guint32), mdb_cmp_guint32);
+
+	rows = g_malloc((set->num_rows + 1) * sizeof(guint32));
+	for (i=0;i<pages->len;i++) {
+		pg = g_array_index(pages, guint32, i);
+		map = g_hash_table_lookup(set->pages, GUINT_TO_POINTER(pg));
+		for (j=0;j<MDB_ROWSET_MAP_SZ*8;j++) {
+			if (map[j/8] & (1 << (j%8)))
+				rows[n++] = (pg << 8) | j;
+		}
+	}
+	g_array_free(pages, TRUE);
+	*count = n;
+
+	return rows;
+}
@@ -40,11 +40,46 @@ mdb_sql_walk_tree(MdbSargNode *node, MdbSargTreeFunc func, gpointer data)
 	if (node->left) mdb_sql_walk_tree(node->left, func, data);
 	if (node->right) mdb_sql_walk_tree(node->right, func, data);
 }
+static int
+mdb_sarg_int_cmp(const void *a, const void *b)
+{
+	gint32 x = ((const MdbAny *)a)->i;
+	gint32 y = ((const MdbAny *)b)->i;
+
+	return (x > y) - (x < y);
+}
+static int
+mdb_sarg_string_cmp(const void *a, const void *b)
+{
+	return strncmp(((const MdbAny *)a)->s, ((const MdbAny *)b)->s, 255);
+}
+/*
+ * Sort the values of an IN list so each row is tested with a binary
+ * search rather than one comparison per value.  text tells whether the
+ * list holds strings or numbers, which must match what the column's
+ * test function probes with.
+ */
+void
+mdb_sort_sarg_set(MdbSargNode *node, int text)
+{
+	g_array_sort(node->set, text ? mdb_sarg_string_cmp : mdb_sarg_int_cmp);
+}
+static int
+mdb_sarg_set_find(MdbSargNode *node, MdbAny *value, int text)
+{
+	return bsearch(value, node->set->data, node->set->len, sizeof(MdbAny),
+		text ? mdb_sarg_string_cmp : mdb_sarg_int_cmp) != NULL;
+}
 int 
 mdb_test_string(MdbSargNode *node, char *s)
 {
 int rc;
+MdbAny value;
 
+	if (node->op == MDB_IN) {
+		g_strlcpy(value.s, s, sizeof(value.s));
+		return mdb_sarg_set_find(node, &value, 1);
+	}
 	if (node->op == MDB_LIKE) {
 		return mdb_like_cmp(s,node->value.s);
 	}
@@ -73,7 +108,12 @@ int rc;
 }
 int mdb_test_int(MdbSargNode *node, gint32 i)
 {
+	MdbAny value;
+
 	switch (node->op) {
+		case MDB_IN:
+			value.i = i;
+			return mdb_sarg_set_find(node, &value, 0);
 		case MDB_EQUAL:
 			//fprintf(stderr, "comparing %ld and %ld\n", i, node->value.i);
 			if (node->value.i == i) return 1;
@@ -96,6 +136,52 @@ int mdb_test_int(MdbSargNode *node, gint32 i)
 	}
 	return 0;
 }
+/* a MONEY value, a 64 bit integer of 1/10000ths */
+static double
+mdb_sarg_money(void *buf)
+{
+	gint64 value;
+
+	value = (gint64) (gint32) mdb_get_int32(buf, 4) * ((gint64) 1 << 32)
+		+ (guint32) mdb_get_int32(buf, 0);
+	return value / 10000.0;
+}
+/*
+ * FLOAT, DOUBLE and MONEY values are tested against node->value.d.  The
+ * values of an IN list are integers, see mdb_sql_add_in().
+ */
+int
+mdb_test_double(MdbSargNode *node, double d)
+{
+	MdbAny value;
+
+	switch (node->op) {
+		case MDB_IN:
+			if (d != (gint32) d)
+				return 0;
+			value.i = (gint32) d;
+			return mdb_sarg_set_find(node, &value, 0);
+		case MDB_EQUAL:
+			if (node->value.d == d) return 1;
+			break;
+		case MDB_GT:
+			if (node->value.d < d) return 1;
+			break;
+		case MDB_LT:
+			if (node->value.d > d) return 1;
+			break;
+		case MDB_GTEQ:
+			if (node->value.d <= d) return 1;
+			break;
+		case MDB_LTEQ:
+			if (node->value.d >= d) return 1;
+			break;
+		default:
+			fprintf(stderr, "Calling mdb_test_sarg on unknown operator.  Add code to mdb_test_double() for operator %d\n",node->op);
+			break;
+	}
+	return 0;
+}
 
 int
 mdb_test_date(MdbSargNode *node, double td)
@@ -109,7 +195,20 @@ mdb_test_date(MdbSargNode *node, double td)
 	time_t asked_t;
 
 	double diff;
+	MdbSargNode eq;
+	unsigned int i;
 
+	if (node->op == MDB_IN) {
+		/* dates are few and compared as times, try them in turn */
+		eq = *node;
+		eq.op = MDB_EQUAL;
+		for (i=0;i<node->set->len;i++) {
+			eq.value = g_array_index(node->set, MdbAny, i);
+			if (mdb_test_date(&eq, td))
+				return 1;
+		}
+		return 0;
+	}
 	mdb_date_to_tm(td, &found);
 
 	asked_t = node->value.i;
@@ -160,8 +259,11 @@ mdb_find_indexable_sargs(MdbSargNode *node, gpointer data)
 	 * also, later we should support the NOT operator, but it's generally
 	 * a pretty worthless test for indexes, ie NOT col1 = 3, we are 
 	 * probably better off table scanning.
+	 *
+	 * IN lists don't fit a single MdbSarg; they are looked up in the
+	 * index by mdb_index_collect_rows() instead.
 	 */
-	if (mdb_is_relational_op(node->op) && node->col) {
+	if (mdb_is_relational_op(node->op) && node->op != MDB_IN && node->col) {
 		//printf("op = %d value = %s\n", node->op, node->value.s);
 		sarg.op = node->op;
 		sarg.value = node->value;
@@ -169,6 +271,17 @@ mdb_find_indexable_sargs(MdbSargNode *node, gpointer data)
 	}
 	return 0;
 }
+/*
+ * tree function marking the columns the sargs test as needed by the
+ * table passed as data, see mdb_need_column()
+ */
+int
+mdb_find_needed_cols(MdbSargNode *node, gpointer data)
+{
+	if (mdb_is_relational_op(node->op) && node->col)
+		mdb_need_column(data, node->col);
+	return 0;
+}
 int 
 mdb_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, MdbField *field)
 {
@@ -197,6 +310,12 @@ mdb_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, MdbField *field
 		case MDB_TEXT:
 			mdb_unicode2ascii(mdb, field->value, field->siz, tmpbuf, 256);
 			return mdb_test_string(node, tmpbuf);
+		case MDB_FLOAT:
+			return mdb_test_double(node, mdb_get_single(field->value, 0));
+		case MDB_DOUBLE:
+			return mdb_test_double(node, mdb_get_double(field->value, 0));
+		case MDB_MONEY:
+			return mdb_test_double(node, mdb_sarg_money(field->value));
 		case MDB_DATETIME:
 			return mdb_test_date(node, mdb_get_double(field->value, 0));
 		default:
@@ -294,6 +413,28 @@ MdbSarg *sarg;
 
 	return 1;
 }
+/*
+ * Drop the sargs added to col, so new ones can be added for the next
+ * query on the same table definition.
+ */
+void mdb_free_sargs(MdbColumn *col)
+{
+	unsigned int i;
+
+	if (col->sargs) {
+		for (i=0;i<col->sargs->len;i++)
+			g_free(g_ptr_array_index(col->sargs, i));
+		g_ptr_array_free(col->sargs, TRUE);
+		col->sargs = NULL;
+	}
+	if (col->idx_sarg_cache) {
+		for (i=0;i<col->idx_sarg_cache->len;i++)
+			g_free(g_ptr_array_index(col->idx_sarg_cache, i));
+		g_ptr_array_free(col->idx_sarg_cache, TRUE);
+		col->idx_sarg_cache = NULL;
+	}
+	col->num_sargs = 0;
+}
 int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_sarg)
 {
 	MdbColumn *col;
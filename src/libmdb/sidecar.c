@@ -0,0 +1,505 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Sidecar indexes live in a separate file next to the database, one file
+ * per table column, so columns can be indexed without modifying the mdb
+ * file itself.  The file is a header followed by fixed width records of
+ * key + (pg << 8 | row), sorted by key, which are searched in place.
+ *
+ * Header layout (little endian):
+ *   0x00  "MDBX"
+ *   0x04  version
+ *   0x08  size of the mdb file (low, high)
+ *   0x10  mtime of the mdb file (low, high)
+ *   0x18  column type
+ *   0x1c  key length
+ *   0x20  number of records
+ *   0x24  checksums of MDB_SIDECAR_SAMPLES pages spread over the file
+ *
+ * Keys are encoded like index keys (see mdb_index_encode_col) except text,
+ * which is stored as plain ascii so that it sorts the way the sql engine
+ * compares strings.  Null values aren't stored since no sarg matches them.
+ * A row that was moved to another page is stored under the slot that
+ * points at it, which is what scans and indexes return for it.
+ */
+#include "mdbtools.h"
+#include "mdbprivate.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_SIDECAR_MAGIC "MDBX"
+#define MDB_SIDECAR_VERSION 2
+#define MDB_SIDECAR_SAMPLES 8
+#define MDB_SIDECAR_HDR_SZ 0x44
+
+static int
+mdb_sidecar_key_len(MdbColumn *col)
+{
+	switch (col->col_type) {
+		case MDB_BYTE:
+			return 2;
+		case MDB_INT:
+			return 3;
+		case MDB_LONGINT:
+			return 5;
+		case MDB_TEXT:
+			return 1 + 256;
+	}
+	return -1;
+}
+/*
+ * Sidecar file name for a column: <mdb file>.<table>.<column>.mdbx
+ */
+char *
+mdb_sidecar_path(MdbTableDef *table, MdbColumn *col)
+{
+	return g_strdup_printf("%s.%s.%s.mdbx", table->entry->mdb->f->filename,
+		table->name, col->name);
+}
+static guint32
+mdb_sidecar_checksum(unsigned char *buf, int len)
+{
+	guint32 sum = 2166136261U;
+	int i;
+
+	/* FNV-1a */
+	for (i=0;i<len;i++) {
+		sum ^= buf[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+/*
+ * Are there written pages that aren't on disk yet?  The stamp only
+ * describes what is on disk.
+ */
+static int
+mdb_sidecar_unflushed(MdbHandle *mdb)
+{
+	return mdb->f->dirty && g_hash_table_size(mdb->f->dirty);
+}
+/*
+ * Fill in the part of the header that identifies the state of the mdb
+ * file: size, mtime and the checksums of a sample of its pages.
+ */
+static int
+mdb_sidecar_stamp(MdbHandle *mdb, unsigned char *hdr)
+{
+	MdbHandle *tmp;
+	struct stat status;
+	guint32 num_pgs, pg;
+	int i;
+
+	if (fstat(mdb->f->fd, &status)) {
+		fprintf(stderr, "Can't stat %s\n", mdb->f->filename);
+		return 0;
+	}
+	mdb_put_int32(hdr, 0x08, (guint32) status.st_size);
+	mdb_put_int32(hdr, 0x0c, (guint32) ((guint64) status.st_size >> 32));
+	mdb_put_int32(hdr, 0x10, (guint32) status.st_mtime);
+	mdb_put_int32(hdr, 0x14, (guint32) ((guint64) status.st_mtime >> 32));
+
+	num_pgs = status.st_size / mdb->fmt->pg_size;
+	tmp = mdb_clone_handle(mdb);
+	for (i=0;i<MDB_SIDECAR_SAMPLES;i++) {
+		pg = num_pgs ? (guint64) i * (num_pgs - 1) / (MDB_SIDECAR_SAMPLES - 1) : 0;
+		if (!mdb_read_pg(tmp, pg)) {
+			mdb_close(tmp);
+			return 0;
+		}
+		mdb_put_int32(hdr, 0x24 + i * 4,
+			mdb_sidecar_checksum(tmp->pg_buf, mdb->fmt->pg_size));
+	}
+	mdb_close(tmp);
+
+	return 1;
+}
+static int
+mdb_sidecar_encode_field(MdbHandle *mdb, MdbColumn *col, MdbField *field, unsigned char *dest)
+{
+	char tmpbuf[MDB_BIND_SIZE];
+
+	if (col->col_type == MDB_TEXT) {
+		dest[0] = 0x7f;
+		mdb_unicode2ascii(mdb, field->value, field->siz, tmpbuf, MDB_BIND_SIZE);
+		strncpy((char *)&dest[1], tmpbuf, 255);
+		return 1 + 256;
+	}
+	return mdb_index_encode_col(mdb, col, MDB_ASC, field, dest);
+}
+static int
+mdb_sidecar_cmp_rec(gconstpointer a, gconstpointer b, gpointer data)
+{
+	return memcmp(a, b, *(int *)data);
+}
+/*
+ * Add the record of the row at row_start on the page in pg_buf, keyed by
+ * pg_row, the slot the row is found through.
+ */
+static void
+mdb_sidecar_add_row(MdbTableDef *table, unsigned int colnum, int key_len, int row_start, size_t row_size, guint32 pg_row, GArray *recs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbColumn *col = g_ptr_array_index(table->columns, colnum);
+	MdbField fields[256];
+	unsigned char rec[1 + 256 + 4];
+
+	row_start &= OFFSET_MASK;
+	mdb_crack_row(table, row_start, row_start + row_size - 1, fields);
+	if (fields[colnum].is_null)
+		return;
+	memset(rec, 0, key_len + 4);
+	mdb_sidecar_encode_field(mdb, col, &fields[colnum], rec);
+	mdb_put_int32_msb(rec, key_len, pg_row);
+	g_array_append_vals(recs, rec, 1);
+}
+/*
+ * Build (or rebuild) the sidecar index for a column of table.  The columns
+ * of the table must have been read.
+ *
+ * Returns the number of rows indexed, -1 on failure.
+ */
+int
+mdb_sidecar_build(MdbTableDef *table, MdbColumn *col)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	GArray *recs;
+	unsigned char hdr[MDB_SIDECAR_HDR_SZ];
+	char *path, *tmp_path;
+	unsigned int i, colnum, rows;
+	int key_len, rec_len, row_start, fd, ret;
+	size_t row_size;
+	guint32 pg_row;
+	void *buf;
+
+	if ((key_len = mdb_sidecar_key_len(col)) < 0) {
+		fprintf(stderr, "Column %s can't be indexed, unsupported type %d\n",
+			col->name, col->col_type);
+		return -1;
+	}
+	if (mdb_sidecar_unflushed(mdb)) {
+		fprintf(stderr, "Flush the database before indexing %s\n", col->name);
+		return -1;
+	}
+	for (colnum=0;colnum<table->num_cols;colnum++)
+		if (g_ptr_array_index(table->columns, colnum) == col)
+			break;
+	rec_len = key_len + 4;
+
+	recs = g_array_new(FALSE, FALSE, rec_len);
+	mdb_rewind_table(table);
+	while (mdb_read_next_dpg(table)) {
+		rows = mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset);
+		for (i=0;i<rows;i++) {
+			if (mdb_find_row(mdb, i, &row_start, &row_size))
+				continue;
+			/* deleted rows, and moved rows, which are found through
+			 * the slot pointing at them */
+			if (row_start & 0x4000)
+				continue;
+			if ((row_start & 0x8000) && row_size == 4) {
+				pg_row = mdb_get_int32(mdb->pg_buf, row_start & OFFSET_MASK);
+				if (mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &row_size))
+					continue;
+				mdb_swap_pgbuf(mdb);
+				mdb_sidecar_add_row(table, colnum, key_len, row_start,
+					row_size, (table->cur_phys_pg << 8) | i, recs);
+				mdb_swap_pgbuf(mdb);
+				continue;
+			}
+			mdb_sidecar_add_row(table, colnum, key_len, row_start,
+				row_size, (table->cur_phys_pg << 8) | i, recs);
+		}
+	}
+	mdb_rewind_table(table);
+	g_qsort_with_data(recs->data, recs->len, rec_len, mdb_sidecar_cmp_rec, &rec_len);
+
+	memset(hdr, 0, MDB_SIDECAR_HDR_SZ);
+	memcpy(hdr, MDB_SIDECAR_MAGIC, 4);
+	mdb_put_int32(hdr, 0x04, MDB_SIDECAR_VERSION);
+	mdb_put_int32(hdr, 0x18, col->col_type);
+	mdb_put_int32(hdr, 0x1c, key_len);
+	mdb_put_int32(hdr, 0x20, recs->len);
+	if (!mdb_sidecar_stamp(mdb, hdr)) {
+		g_array_free(recs, TRUE);
+		return -1;
+	}
+
+	/* write to a temporary file so readers never see a partial index */
+	path = mdb_sidecar_path(table, col);
+	tmp_path = g_strdup_printf("%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Can't create %s\n", tmp_path);
+		ret = -1;
+	} else if (write(fd, hdr, MDB_SIDECAR_HDR_SZ) != MDB_SIDECAR_HDR_SZ ||
+	    write(fd, recs->data, recs->len * rec_len) != (ssize_t) (recs->len * rec_len)) {
+		fprintf(stderr, "Error writing %s\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		ret = -1;
+	} else {
+		close(fd);
+		if (rename(tmp_path, path)) {
+			fprintf(stderr, "Can't rename %s to %s\n", tmp_path, path);
+			unlink(tmp_path);
+			ret = -1;
+		} else {
+			ret = recs->len;
+		}
+	}
+	g_free(tmp_path);
+	g_free(path);
+	g_array_free(recs, TRUE);
+
+	return ret;
+}
+/*
+ * Open the sidecar index for a column if there is one and it still matches
+ * the mdb file.  Returns NULL otherwise.
+ */
+MdbSidecar *
+mdb_sidecar_open(MdbTableDef *table, MdbColumn *col)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbSidecar *sc;
+	unsigned char hdr[MDB_SIDECAR_HDR_SZ];
+	unsigned char cur[MDB_SIDECAR_HDR_SZ];
+	struct stat status;
+	char *path;
+	int fd;
+
+	path = mdb_sidecar_path(table, col);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		g_free(path);
+		return NULL;
+	}
+	if (fstat(fd, &status) || read(fd, hdr, MDB_SIDECAR_HDR_SZ) != MDB_SIDECAR_HDR_SZ
+	 || memcmp(hdr, MDB_SIDECAR_MAGIC, 4)
+	 || mdb_get_int32(hdr, 0x04) != MDB_SIDECAR_VERSION
+	 || mdb_get_int32(hdr, 0x18) != col->col_type
+	 || mdb_get_int32(hdr, 0x1c) != mdb_sidecar_key_len(col)) {
+		fprintf(stderr, "%s is not a sidecar index for %s, ignoring it\n",
+			path, col->name);
+		close(fd);
+		g_free(path);
+		return NULL;
+	}
+	/* it can't tell about changes that aren't on disk yet */
+	if (mdb_sidecar_unflushed(mdb)) {
+		close(fd);
+		g_free(path);
+		return NULL;
+	}
+	memcpy(cur, hdr, MDB_SIDECAR_HDR_SZ);
+	if (!mdb_sidecar_stamp(mdb, cur) || memcmp(hdr, cur, MDB_SIDECAR_HDR_SZ)) {
+		fprintf(stderr, "Sidecar index %s is out of date, ignoring it\n", path);
+		close(fd);
+		g_free(path);
+		return NULL;
+	}
+
+	sc = g_malloc0(sizeof(MdbSidecar));
+	sc->path = path;
+	sc->col = col;
+	sc->key_len = mdb_get_int32(hdr, 0x1c);
+	sc->rec_len = sc->key_len + 4;
+	sc->num_recs = mdb_get_int32(hdr, 0x20);
+	sc->map_sz = MDB_SIDECAR_HDR_SZ + (size_t) sc->num_recs * sc->rec_len;
+	if ((size_t) status.st_size < sc->map_sz) {
+		fprintf(stderr, "Sidecar index %s is truncated, ignoring it\n", path);
+		close(fd);
+		mdb_sidecar_close(sc);
+		return NULL;
+	}
+#ifdef HAVE_SYS_MMAN_H
+	sc->map = mmap(NULL, sc->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+	if (sc->map == MAP_FAILED)
+		sc->map = NULL;
+	else
+		sc->mapped = 1;
+#endif
+	if (!sc->map) {
+		sc->map = g_malloc(sc->map_sz);
+		if (lseek(fd, 0, SEEK_SET) == -1 ||
+		    read(fd, sc->map, sc->map_sz) != (ssize_t) sc->map_sz) {
+			fprintf(stderr, "Error reading %s\n", path);
+			close(fd);
+			mdb_sidecar_close(sc);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	return sc;
+}
+void
+mdb_sidecar_close(MdbSidecar *sc)
+{
+	if (!sc) return;
+	if (sc->map) {
+#ifdef HAVE_SYS_MMAN_H
+		if (sc->mapped)
+			munmap(sc->map, sc->map_sz);
+		else
+#endif
+		g_free(sc->map);
+	}
+	g_free(sc->path);
+	g_free(sc);
+}
+/*
+ * Encode the constant of a sarg node as a sidecar key.  Returns 0 if the
+ * node can't be answered from a sidecar index.
+ */
+int
+mdb_sidecar_encode_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, unsigned char *dest)
+{
+	MdbField field;
+	unsigned char buf[4];
+
+	switch (node->op) {
+		case MDB_EQUAL:
+		case MDB_GT:
+		case MDB_LT:
+		case MDB_GTEQ:
+		case MDB_LTEQ:
+			break;
+		default:
+			return 0;
+	}
+	memset(&field, 0, sizeof(MdbField));
+	field.value = buf;
+	switch (col->col_type) {
+		case MDB_BYTE:
+			buf[0] = node->value.i;
+			field.siz = 1;
+			break;
+		case MDB_INT:
+			mdb_put_int16(buf, 0, node->value.i);
+			field.siz = 2;
+			break;
+		case MDB_LONGINT:
+			mdb_put_int32(buf, 0, node->value.i);
+			field.siz = 4;
+			break;
+		case MDB_TEXT:
+			memset(dest, 0, 1 + 256);
+			dest[0] = 0x7f;
+			strncpy((char *)&dest[1], node->value.s, 255);
+			return 1;
+		default:
+			return 0;
+	}
+	mdb_index_encode_col(mdb, col, MDB_ASC, &field, dest);
+	return 1;
+}
+/* first record whose key is >= key, or > key if strict */
+static guint32
+mdb_sidecar_bound(MdbSidecar *sc, unsigned char *key, int strict)
+{
+	guint32 lo = 0, hi = sc->num_recs, mid;
+	int rc;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rc = memcmp(sc->map + MDB_SIDECAR_HDR_SZ + (size_t) mid * sc->rec_len,
+			key, sc->key_len);
+		if (rc < 0 || (strict && rc == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+/*
+ * Collect the rows matching a relational sarg node.  Returns NULL if the
+ * node can't be answered from the sidecar.
+ */
+MdbRowSet *
+mdb_sidecar_lookup(MdbSidecar *sc, MdbHandle *mdb, MdbSargNode *node)
+{
+	MdbRowSet *set;
+	unsigned char key[1 + 256];
+	unsigned char *rec;
+	guint32 start, end, i, pg_row;
+
+	if (!mdb_sidecar_encode_sarg(mdb, sc->col, node, key))
+		return NULL;
+
+	switch (node->op) {
+		case MDB_EQUAL:
+			start = mdb_sidecar_bound(sc, key, 0);
+			end = mdb_sidecar_bound(sc, key, 1);
+			break;
+		case MDB_GT:
+			start = mdb_sidecar_bound(sc, key, 1);
+			end = sc->num_recs;
+			break;
+		case MDB_GTEQ:
+			start = mdb_sidecar_bound(sc, key, 0);
+			end = sc->num_recs;
+			break;
+		case MDB_LT:
+			start = 0;
+			end = mdb_sidecar_bound(sc, key, 0);
+			break;
+		default: /* MDB_LTEQ */
+			start = 0;
+			end = mdb_sidecar_bound(sc, key, 1);
+			break;
+	}
+
+	set = mdb_rowset_new();
+	for (i=start;i<end;i++) {
+		rec = sc->map + MDB_SIDECAR_HDR_SZ + (size_t) i * sc->rec_len;
+		pg_row = mdb_get_int32_msb(rec, sc->key_len);
+		mdb_rowset_add(set, pg_row >> 8, pg_row & 0xff);
+	}
+	return set;
+}
+/*
+ * Cheap check used by the planner: is there a sidecar index file for the
+ * column of node, and could it answer the node?  The file is validated
+ * when it is opened.
+ */
+int
+mdb_sidecar_usable(MdbTableDef *table, MdbSargNode *node)
+{
+	unsigned char key[1 + 256];
+	char *path;
+	int rc;
+
+	if (!node->col || mdb_sidecar_key_len(node->col) < 0)
+		return 0;
+	if (!mdb_sidecar_encode_sarg(table->entry->mdb, node->col, node, key))
+		return 0;
+	path = mdb_sidecar_path(table, node->col);
+	rc = !access(path, R_OK);
+	g_free(path);
+
+	return rc;
+}
@@ -0,0 +1,239 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Snapshots let handles cloned from a writer keep reading the database as
+ * it was when they started, while the writer goes on changing it.
+ *
+ * Every flush outside of a transaction commits, and bumps f->version.  A
+ * handle reading a snapshot doesn't see the writer's dirty pages, and
+ * before mdb_flush() overwrites a page on disk for the first time since
+ * the last commit, the old page is kept in f->old_pgs, tagged with the
+ * version that replaces it.  A snapshot taken at version v reads, for each
+ * page, the oldest copy replaced after v, or the page on disk if there is
+ * none.  Copies are dropped once no snapshot is old enough to need them.
+ *
+ * Handles aren't safe to use from several threads at once; readers and
+ * the writer take turns within one thread, the way cloned handles are
+ * used elsewhere in libmdb.
+ */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+typedef struct {
+	guint32 until;		/* the version that replaced it */
+	unsigned char *pg_buf;
+} MdbPageCopy;
+
+static void
+mdb_page_copy_free(gpointer data)
+{
+	MdbPageCopy *copy = data;
+
+	g_free(copy->pg_buf);
+	g_free(copy);
+}
+static void
+mdb_page_copies_free(gpointer data)
+{
+	GSList *copies = data;
+
+	g_slist_foreach(copies, (GFunc) mdb_page_copy_free, NULL);
+	g_slist_free(copies);
+}
+/**
+ * mdb_snapshot_begin:
+ * @mdb: Handle to read the snapshot through, usually a clone of the writer
+ *
+ * From now on @mdb sees the database as it was last committed, until
+ * mdb_snapshot_end() is called.  Nothing @mdb writes is seen by it
+ * either, so it shouldn't be used to write.
+ */
+void
+mdb_snapshot_begin(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+
+	if (mdb->snapshot)
+		return;
+	/* 0 means no snapshot */
+	mdb->snapshot = f->version + 1;
+	f->snapshots = g_slist_prepend(f->snapshots, mdb);
+	/* the page in pg_buf may be newer */
+	mdb->cur_pg = 0;
+}
+/*
+ * drop the copies no snapshot reads any more
+ */
+static void
+mdb_snapshot_prune(MdbFile *f)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *l, *copies, *prev;
+	MdbPageCopy *copy;
+	guint32 oldest = G_MAXUINT32;
+
+	if (!f->old_pgs)
+		return;
+	for (l=f->snapshots;l;l=l->next)
+		oldest = MIN(oldest, ((MdbHandle *) l->data)->snapshot);
+
+	g_hash_table_iter_init(&iter, f->old_pgs);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		copies = value;
+		/* newest first, so the ones to go are at the end */
+		for (prev=NULL,l=copies;l;prev=l,l=l->next) {
+			copy = l->data;
+			if (copy->until < oldest)
+				break;
+		}
+		if (!l)
+			continue;
+		if (prev) {
+			prev->next = NULL;
+			mdb_page_copies_free(l);
+		} else {
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+/**
+ * mdb_snapshot_end:
+ * @mdb: Handle passed to mdb_snapshot_begin()
+ *
+ * Lets @mdb see the latest committed pages again.
+ */
+void
+mdb_snapshot_end(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+
+	if (!mdb->snapshot)
+		return;
+	f->snapshots = g_slist_remove(f->snapshots, mdb);
+	mdb->snapshot = 0;
+	mdb->cur_pg = 0;
+	mdb_snapshot_prune(f);
+}
+/*
+ * Called by _mdb_read_pg() for a handle reading a snapshot.  Copies the
+ * page as the snapshot saw it into pg_buf if it has been overwritten
+ * since, and returns 1, or returns 0 if the page on disk is the one.
+ */
+int
+mdb_snapshot_read_pg(MdbHandle *mdb, void *pg_buf, guint32 pg)
+{
+	MdbFile *f = mdb->f;
+	MdbPageCopy *copy, *found = NULL;
+	GSList *l;
+
+	if (!f->old_pgs)
+		return 0;
+	for (l=g_hash_table_lookup(f->old_pgs, GUINT_TO_POINTER(pg));l;l=l->next) {
+		copy = l->data;
+		if (copy->until < mdb->snapshot)
+			break;
+		found = copy;
+	}
+	if (!found)
+		return 0;
+	memcpy(pg_buf, found->pg_buf, mdb->fmt->pg_size);
+	return 1;
+}
+/*
+ * Called by mdb_flush() before it writes pgs: keep the pages on disk that
+ * snapshots may still need.
+ */
+int
+mdb_snapshot_save(MdbHandle *mdb, guint32 *pgs, unsigned int num_pgs)
+{
+	MdbFile *f = mdb->f;
+	ssize_t pg_size = mdb->fmt->pg_size;
+	ssize_t len;
+	struct stat status;
+	GSList *copies;
+	MdbPageCopy *copy;
+	guint32 disk_pgs;
+	unsigned int i;
+
+	if (!f->snapshots)
+		return 1;
+	if (fstat(f->fd, &status)) {
+		perror("fstat");
+		return 0;
+	}
+	disk_pgs = status.st_size / pg_size;
+	if (!f->old_pgs)
+		f->old_pgs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, mdb_page_copies_free);
+
+	for (i=0;i<num_pgs;i++) {
+		/* new pages aren't part of any snapshot */
+		if (pgs[i] >= disk_pgs)
+			continue;
+		copies = g_hash_table_lookup(f->old_pgs, GUINT_TO_POINTER(pgs[i]));
+		/* only the committed page matters, not what was flushed since */
+		if (copies && ((MdbPageCopy *) copies->data)->until == f->version + 1)
+			continue;
+		copy = g_malloc(sizeof(MdbPageCopy));
+		copy->until = f->version + 1;
+		copy->pg_buf = g_malloc(pg_size);
+#ifdef HAVE_PREAD
+		/* leaves the offset of the fd the handles share alone */
+		len = pread(f->fd, copy->pg_buf, pg_size, (off_t) pgs[i] * pg_size);
+#else
+		lseek(f->fd, (off_t) pgs[i] * pg_size, SEEK_SET);
+		len = read(f->fd, copy->pg_buf, pg_size);
+#endif
+		if (len != pg_size) {
+			fprintf(stderr, "Can't read page %lu for snapshots\n",
+				(unsigned long) pgs[i]);
+			mdb_page_copy_free(copy);
+			return 0;
+		}
+		/* steal the list so the old head isn't freed */
+		g_hash_table_steal(f->old_pgs, GUINT_TO_POINTER(pgs[i]));
+		g_hash_table_insert(f->old_pgs, GUINT_TO_POINTER(pgs[i]),
+			g_slist_prepend(copies, copy));
+	}
+	return 1;
+}
+/*
+ * Called when the changes flushed so far are committed.
+ */
+void
+mdb_snapshot_commit(MdbHandle *mdb)
+{
+	mdb->f->version++;
+}
+/*
+ * Called by mdb_close() when the last handle of the file goes.
+ */
+void
+mdb_snapshot_free(MdbFile *f)
+{
+	g_slist_free(f->snapshots);
+	f->snapshots = NULL;
+	if (f->old_pgs)
+		g_hash_table_destroy(f->old_pgs);
+	f->old_pgs = NULL;
+}
@@ -28,17 +28,22 @@
  *
  * Begins collection of statistics on an MDBHandle.
  *
- * Statistics in LibMDB will track the number of reads from the MDB file.  The
+ * Statistics in LibMDB will track the number of reads from the MDB file, by
+ * page type, and the pages found in memory instead.  The
  * collection of statistics is started and stopped with the mdb_stats_on and
  * mdb_stats_off functions.  Collected statistics are accessed by reading the
  * MdbStatistics structure or calling mdb_dump_stats.
+ *
+ * The statistics belong to the file, so they include the reads of handles
+ * cloned from @mdb, such as those index scans use.
  * 
  */
 void
 mdb_stats_on(MdbHandle *mdb)
 {
-	if (!mdb->stats) 
-		mdb->stats = g_malloc0(sizeof(MdbStatistics));
+	if (!mdb->f->stats) 
+		mdb->f->stats = g_malloc0(sizeof(MdbStatistics));
+	mdb->stats = mdb->f->stats;
 
 	mdb->stats->collect = TRUE;
 }
@@ -48,8 +53,8 @@ mdb_stats_on(MdbHandle *mdb)
  *
  * Turns off statistics collection.
  *
- * If mdb_stats_off is not called, statistics will be turned off when handle
- * is freed using mdb_close.
+ * If mdb_stats_off is not called, statistics will be turned off when the
+ * last handle of the file is freed using mdb_close.
  **/
 void
 mdb_stats_off(MdbHandle *mdb)
@@ -70,4 +75,9 @@ mdb_dump_stats(MdbHandle *mdb)
 	if (!mdb->stats) return;
 
 	fprintf(stdout, "Physical Page Reads: %lu\n", mdb->stats->pg_reads);
+	fprintf(stdout, "  Data Pages: %lu\n", mdb->stats->data_pg_reads);
+	fprintf(stdout, "  Index Pages: %lu\n", mdb->stats->index_pg_reads);
+	fprintf(stdout, "  LVAL Pages: %lu\n", mdb->stats->lval_pg_reads);
+	fprintf(stdout, "  Map Pages: %lu\n", mdb->stats->map_pg_reads);
+	fprintf(stdout, "Pages Found In Memory: %lu\n", mdb->stats->pg_hits);
 }
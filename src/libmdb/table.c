@@ -49,12 +49,15 @@ MdbTableDef *mdb_alloc_tabledef(MdbCatalogEntry *entry)
 	table = (MdbTableDef *) g_malloc0(sizeof(MdbTableDef));
 	table->entry=entry;
 	strcpy(table->name, entry->object_name);
+	table->max_rows = -1;
 
 	return table;	
 }
 void mdb_free_tabledef(MdbTableDef *table)
 {
 	if (!table) return;
+	if (table->fetch_free)
+		table->fetch_free(table->fetch_data);
 	if (table->is_temp_table) {
 		unsigned int i;
 		/* Temp table pages are being stored in memory */
@@ -68,6 +71,7 @@ void mdb_free_tabledef(MdbTableDef *table)
 	mdb_free_indices(table->indices);
 	g_free(table->usage_map);
 	g_free(table->free_usage_map);
+	g_free(table->col_needed);
 	g_free(table);
 }
 MdbTableDef *mdb_read_table(MdbCatalogEntry *entry)
@@ -23,8 +23,10 @@
 #endif
 
 /*
- * Temp table routines.  These are currently used to generate mock results for
- * commands like "list tables" and "describe table"
+ * Temp table routines.  A temp table either holds its rows in pages kept
+ * in memory, or is an operator whose rows are made as they are fetched,
+ * which is how query results like "list tables" and "describe table" and
+ * those of joins, aggregates and sorts are produced.
  */
 
 void
@@ -70,6 +72,25 @@ mdb_create_temp_table(MdbHandle *mdb, char *name)
 
 	return table;
 }
+/*
+ * Create a temp table whose rows are produced one at a time by fetch_func,
+ * with data, which is freed by free_func (if not NULL) with the table.
+ * fetch_func fills in the fields of the next row by column index, in the
+ * form mdb_crack_row() gives them, and returns 0 after the last row.  The
+ * values must stay valid until the next call, and not be in pg_buf.
+ */
+MdbTableDef *
+mdb_create_op_table(MdbHandle *mdb, char *name, MdbFetchFunc fetch_func, gpointer data, GDestroyNotify free_func)
+{
+	MdbTableDef *table;
+
+	table = mdb_create_temp_table(mdb, name);
+	table->fetch_func = fetch_func;
+	table->fetch_data = data;
+	table->fetch_free = free_func;
+
+	return table;
+}
 void
 mdb_temp_table_add_col(MdbTableDef *table, MdbColumn *col)
 {
@@ -17,16 +17,25 @@
  */
 
 #include "mdbtools.h"
+#include "mdbprivate.h"
 #include "time.h"
 #include "math.h"
 
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h>
+#endif
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync(fd) fsync(fd)
+#endif
+
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
 
 //static int mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg);
-static int mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum);
+static int mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len, guint32 pgnum, guint16 row);
 
 void
 mdb_put_int16(void *buf, guint32 offset, guint32 value)
@@ -70,28 +79,197 @@ __attribute__((alias("mdb_put_int32_msb")));
 { mdb_put_int32_msb(buf, offset, value); }
 #endif
 
-ssize_t
-mdb_write_pg(MdbHandle *mdb, unsigned long pg)
+/*
+ * Written pages are kept in mdb->f->dirty until mdb_flush() is called,
+ * so that a page changed by several row updates only goes to disk once.
+ * Reads look at the dirty pages first.  The buffer is flushed when it
+ * grows past MDB_DIRTY_MAX pages, and when the file is closed.
+ */
+#define MDB_DIRTY_MAX 1024
+#define MDB_FLUSH_RUN 64
+
+/*
+ * Return the number of pages in the file, counting pages added at the end
+ * that haven't been flushed yet.
+ */
+guint32
+mdb_file_pages(MdbHandle *mdb)
 {
-	ssize_t len;
 	struct stat status;
-	off_t offset = pg * mdb->fmt->pg_size;
+	guint32 num_pgs;
+
+	if (fstat(mdb->f->fd, &status)) {
+		perror("fstat");
+		return 0;
+	}
+	num_pgs = status.st_size / mdb->fmt->pg_size;
+	if (num_pgs < mdb->f->dirty_end)
+		num_pgs = mdb->f->dirty_end;
+
+	return num_pgs;
+}
+static ssize_t
+_mdb_write_pg(MdbHandle *mdb, void *pg_buf, unsigned long pg)
+{
+	MdbFile *f = mdb->f;
+	void *dirty_pg;
 
-	fstat(mdb->f->fd, &status);
 	/* is page beyond current size + 1 ? */
-	if (status.st_size < offset + mdb->fmt->pg_size) {
-		fprintf(stderr,"offset %lu is beyond EOF\n",offset);
+	if (pg > mdb_file_pages(mdb)) {
+		fprintf(stderr,"offset %lu is beyond EOF\n",
+			pg * mdb->fmt->pg_size);
+		return 0;
+	}
+	if (!f->dirty)
+		f->dirty = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	dirty_pg = g_hash_table_lookup(f->dirty, GUINT_TO_POINTER(pg));
+	if (!dirty_pg) {
+		dirty_pg = g_malloc(mdb->fmt->pg_size);
+		g_hash_table_insert(f->dirty, GUINT_TO_POINTER(pg), dirty_pg);
+	}
+	memcpy(dirty_pg, pg_buf, mdb->fmt->pg_size);
+	if (pg >= f->dirty_end)
+		f->dirty_end = pg + 1;
+
+	if (g_hash_table_size(f->dirty) > MDB_DIRTY_MAX && !mdb_flush(mdb))
 		return 0;
+
+	return mdb->fmt->pg_size;
+}
+static void
+mdb_get_dirty_pg(gpointer key, gpointer value, gpointer data)
+{
+	GArray *pages = data;
+	guint32 pg = GPOINTER_TO_UINT(key);
+
+	g_array_append_val(pages, pg);
+}
+/*
+ * Write num_pgs pages starting at pg, whose contents are in the dirty
+ * buffer, to the file.
+ */
+static int
+mdb_flush_run(MdbHandle *mdb, guint32 pg, unsigned int num_pgs)
+{
+	MdbFile *f = mdb->f;
+	ssize_t pg_size = mdb->fmt->pg_size;
+	ssize_t len;
+	unsigned int i;
+#ifdef HAVE_PWRITEV
+	struct iovec iov[MDB_FLUSH_RUN];
+
+	for (i=0;i<num_pgs;i++) {
+		iov[i].iov_base = g_hash_table_lookup(f->dirty,
+			GUINT_TO_POINTER(pg + i));
+		iov[i].iov_len = pg_size;
 	}
-	lseek(mdb->f->fd, offset, SEEK_SET);
-	len = write(mdb->f->fd,mdb->pg_buf,mdb->fmt->pg_size);
+	len = pwritev(f->fd, iov, num_pgs, (off_t) pg * pg_size);
 	if (len==-1) {
-		perror("write");
+		perror("pwritev");
 		return 0;
-	} else if (len<mdb->fmt->pg_size) {
-	/* fprintf(stderr,"EOF reached %d bytes returned.\n",len, mdb->pg_size); */
+	} else if (len < pg_size * num_pgs) {
+		return 0;
+	}
+#else
+	lseek(f->fd, (off_t) pg * pg_size, SEEK_SET);
+	for (i=0;i<num_pgs;i++) {
+		len = write(f->fd, g_hash_table_lookup(f->dirty,
+			GUINT_TO_POINTER(pg + i)), pg_size);
+		if (len==-1) {
+			perror("write");
+			return 0;
+		} else if (len<pg_size) {
+			return 0;
+		}
+	}
+#endif
+	return 1;
+}
+/**
+ * mdb_flush:
+ * @mdb: Handle to open MDB database file
+ *
+ * Writes the pages changed since the last flush to disk in page order,
+ * one write per run of consecutive pages, then syncs the file if asked to
+ * by mdb_set_sync().  Pages that couldn't be written stay in the buffer.
+ * With the journal on, the pages are saved to it first (see journal.c).
+ *
+ * Return value: 1 on success, 0 on failure.
+ */
+int
+mdb_flush(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	GArray *pages;
+	guint32 *pgs;
+	unsigned int i, j;
+	int ret = 1;
+
+	if (!f->dirty || !g_hash_table_size(f->dirty)) {
+		if (!f->txn_depth)
+			mdb_snapshot_commit(mdb);
+		return 1;
+	}
+
+	pages = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_hash_table_foreach(f->dirty, mdb_get_dirty_pg, pages);
+	qsort(pages->data, pages->len, sizeof(guint32), mdb_cmp_guint32);
+	pgs = (guint32 *) pages->data;
+	if (!mdb_journal_save(mdb, pgs, pages->len)
+	 || !mdb_snapshot_save(mdb, pgs, pages->len)) {
+		g_array_free(pages, TRUE);
 		return 0;
 	}
+	for (i=0;i<pages->len;i=j) {
+		for (j=i+1;j<pages->len && j-i<MDB_FLUSH_RUN;j++)
+			if (pgs[j] != pgs[j-1] + 1) break;
+		if (!mdb_flush_run(mdb, pgs[i], j - i)) {
+			fprintf(stderr, "write failed!\n");
+			ret = 0;
+			break;
+		}
+		mdb_debug(MDB_DEBUG_WRITE, "flushed %u pages at %lu",
+			j - i, (unsigned long) pgs[i]);
+	}
+	/* forget what made it to disk */
+	for (j=0;j<i;j++)
+		g_hash_table_remove(f->dirty, GUINT_TO_POINTER(pgs[j]));
+	g_array_free(pages, TRUE);
+
+	if (ret && f->sync == MDB_SYNC_DATA && fdatasync(f->fd)) {
+		perror("fdatasync");
+		ret = 0;
+	}
+	if (ret)
+		f->dirty_end = 0;
+	if (ret)
+		ret = mdb_journal_end(mdb);
+	/* readers taking a snapshot from now on see these pages */
+	if (ret && !f->txn_depth)
+		mdb_snapshot_commit(mdb);
+
+	return ret;
+}
+/**
+ * mdb_set_sync:
+ * @mdb: Handle to open MDB database file
+ * @sync: MDB_SYNC_NONE to leave flushed pages to the OS, MDB_SYNC_DATA
+ * to fdatasync() the file at the end of each flush
+ *
+ * Sets how durable mdb_flush() makes the changes written so far.
+ */
+void
+mdb_set_sync(MdbHandle *mdb, MdbSyncMode sync)
+{
+	mdb->f->sync = sync;
+}
+ssize_t
+mdb_write_pg(MdbHandle *mdb, unsigned long pg)
+{
+	ssize_t len;
+
+	len = _mdb_write_pg(mdb, mdb->pg_buf, pg);
 	mdb->cur_pos = 0;
 	return len;
 }
@@ -167,6 +345,15 @@ mdb_crack_row3(MdbHandle *mdb, int row_start, int row_end, unsigned int bitmask_
  */
 int
 mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields)
+{
+	return mdb_crack_cols(table, row_start, row_end, fields, NULL);
+}
+/*
+ * mdb_crack_row() for the columns with a flag set in needed (all of them if
+ * NULL) and those that are bound.  The others come back as nulls.
+ */
+int
+mdb_crack_cols(MdbTableDef *table, int row_start, int row_end, MdbField *fields, unsigned char *needed)
 {
 	MdbColumn *col;
 	MdbCatalogEntry *entry = table->entry;
@@ -225,6 +412,16 @@ mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields)
 		col = g_ptr_array_index(table->columns,i);
 		fields[i].colnum = i;
 		fields[i].is_fixed = col->is_fixed;
+		if (needed && !needed[i] && !col->bind_ptr && !col->len_ptr) {
+			/* still counted, to find the fixed columns after it */
+			if (col->is_fixed && fixed_cols_found < row_fixed_cols)
+				fixed_cols_found++;
+			fields[i].start = 0;
+			fields[i].value = NULL;
+			fields[i].siz = 0;
+			fields[i].is_null = 1;
+			continue;
+		}
 		byte_num = col->col_num / 8;
 		bit_num = col->col_num % 8;
 		/* logic on nulls is reverse, 1 is not null, 0 is null */
@@ -433,6 +630,45 @@ mdb_pack_row(MdbTableDef *table, unsigned char *row_buffer, int unsigned num_fie
 		return mdb_pack_row4(table, row_buffer, num_fields, fields);
 	}
 }
+/*
+ * Rows aren't necessarily stored in slot order, so the start of the lowest
+ * row on the page is found by looking at every slot.  An empty page
+ * starts at its end.
+ */
+static int
+mdb_pg_rows_start(MdbFormatConstants *fmt, void *pg_buf)
+{
+	int rco = fmt->row_count_offset;
+	int num_rows, start, lowest = fmt->pg_size;
+	int i;
+
+	num_rows = mdb_get_int16(pg_buf, rco);
+	for (i=0;i<num_rows;i++) {
+		start = mdb_get_int16(pg_buf, rco + 2 + i*2) & OFFSET_MASK;
+		if (start < lowest)
+			lowest = start;
+	}
+	return lowest;
+}
+/*
+ * The end of the row stored at row_start, which is where the next row
+ * above it starts, whatever its slot.
+ */
+static int
+mdb_pg_row_end(MdbFormatConstants *fmt, void *pg_buf, int row_start)
+{
+	int rco = fmt->row_count_offset;
+	int num_rows, start, end = fmt->pg_size;
+	int i;
+
+	num_rows = mdb_get_int16(pg_buf, rco);
+	for (i=0;i<num_rows;i++) {
+		start = mdb_get_int16(pg_buf, rco + 2 + i*2) & OFFSET_MASK;
+		if (start > row_start && start < end)
+			end = start;
+	}
+	return end;
+}
 int
 mdb_pg_get_freespace(MdbHandle *mdb)
 {
@@ -441,7 +677,7 @@ mdb_pg_get_freespace(MdbHandle *mdb)
 
 	rows = mdb_get_int16(mdb->pg_buf, row_count_offset);
 	free_start = row_count_offset + 2 + (rows * 2);
-	free_end = mdb_get_int16(mdb->pg_buf, row_count_offset + (rows * 2));
+	free_end = mdb_pg_rows_start(mdb->fmt, mdb->pg_buf);
 	mdb_debug(MDB_DEBUG_WRITE,"free space left on page = %d", free_end - free_start);
 	return (free_end - free_start);
 }
@@ -475,15 +711,18 @@ mdb_update_indexes(MdbTableDef *table, int num_fields, MdbField *fields, guint32
 {
 	unsigned int i;
 	MdbIndex *idx;
+	int ret = 1;
 	
 	for (i=0;i<table->num_idxs;i++) {
 		idx = g_ptr_array_index (table->indices, i);
 		mdb_debug(MDB_DEBUG_WRITE,"Updating %s (%d).", idx->name, idx->index_type);
-		if (idx->index_type==1) {
-			mdb_update_index(table, idx, num_fields, fields, pgnum, rownum);
+		/* foreign key references have no pages of their own */
+		if (idx->index_type!=2) {
+			if (!mdb_update_index(table, idx, num_fields, fields, pgnum, rownum))
+				ret = 0;
 		}
 	}
-	return 1;
+	return ret;
 }
 
 int
@@ -500,16 +739,14 @@ mdb_init_index_chain(MdbTableDef *table, MdbIndex *idx)
 	return 1;
 }
 
-/* could be static */
-int
-mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum)
+/*
+ * Pick the fields of the index's key columns out of the row, in key order.
+ */
+static void
+mdb_index_fields(MdbIndex *idx, unsigned int num_fields, MdbField *fields, MdbField *idx_fields)
 {
-	MdbCatalogEntry *entry = table->entry;
-	MdbHandle *mdb = entry->mdb;
 	/*int idx_xref[16];*/
 	unsigned int i, j;
-	MdbIndexChain *chain;
-	MdbField idx_fields[10];
 
 	for (i = 0; i < idx->num_keys; i++) {
 		for (j = 0; j < num_fields; j++) {
@@ -520,6 +757,19 @@ mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, Mdb
 			}
 		}
 	}
+}
+/* could be static */
+int
+mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbIndexChain *chain;
+	MdbField idx_fields[10];
+	unsigned char key[MDB_MAX_IDX_COLS * 256];
+	int key_len, ret = 1;
+
+	mdb_index_fields(idx, num_fields, fields, idx_fields);
 /*
 	for (i = 0; i < idx->num_keys; i++) {
 		fprintf(stdout, "key col %d (%d) is mapped to field %d (%d %d)\n",
@@ -533,16 +783,24 @@ mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, Mdb
 	}
 */
 
+	/* the entry goes where its key sorts, so we need to encode it */
+	key_len = mdb_index_build_key(table, idx, idx_fields, key);
+	if (key_len < 0) {
+		fprintf(stderr, "Can't encode the key of index %s\n", idx->name);
+		return 0;
+	}
+
 	chain = g_malloc0(sizeof(MdbIndexChain));
 
-	mdb_index_find_row(mdb, idx, chain, pgnum, rownum);
-	//printf("chain depth = %d\n", chain->cur_depth);
-	//printf("pg = %" G_GUINT32_FORMAT "\n",
-		//chain->pages[chain->cur_depth-1].pg);
-	//mdb_copy_index_pg(table, idx, &chain->pages[chain->cur_depth-1]);
-	mdb_add_row_to_leaf_pg(table, idx, &chain->pages[chain->cur_depth-1], idx_fields, pgnum, rownum);
+	/* 
+	 * rownum is the row count after the insert, the entry points at the
+	 * row index, rownum - 1.
+	 */
+	if (!mdb_index_seek_row(mdb, idx, chain, key, key_len, pgnum, rownum - 1))
+		ret = mdb_add_row_to_leaf_pg(table, idx, chain, key, key_len, pgnum, rownum - 1);
+	g_free(chain);
 	
-	return 1;
+	return ret;
 }
 
 int
@@ -553,13 +811,23 @@ mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields)
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
+	MdbIndex *idx;
 	guint32 pgnum;
 	guint16 rownum;
+	unsigned int i;
 
 	if (!mdb->f->writable) {
 		fprintf(stderr, "File is not open for writing\n");
 		return 0;
 	}
+	/* don't add a row its indexes can't be kept up with */
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type != 2 && !mdb_index_is_writable(idx)) {
+			fprintf(stderr, "Can't add entries to index %s\n", idx->name);
+			return 0;
+		}
+	}
 	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
 	if (mdb_get_option(MDB_DEBUG_WRITE)) {
 		mdb_buffer_dump(row_buffer, 0, new_row_size);
@@ -582,10 +850,215 @@ mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields)
 		return 0;
 	}
 
-	mdb_update_indexes(table, num_fields, fields, pgnum, rownum);
+	if (!mdb_update_indexes(table, num_fields, fields, pgnum, rownum))
+		return 0;
+
+	if (!mdb_read_pg(mdb, entry->table_pg))
+		return 0;
+	table->num_rows++;
+	mdb_put_int32(mdb->pg_buf, fmt->tab_num_rows_offset, table->num_rows);
+	if (!mdb_write_pg(mdb, entry->table_pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
  
 	return 1;
 }
+/*
+ * Bulk loading.  Rows are packed into fresh data pages in memory which are
+ * appended to the file as they fill up, so each page is written once.  The
+ * usage maps and the row count of the table are written once, when the
+ * load ends.  A page is given a number when it is started, a free page or
+ * the one past the end of the file, and an empty copy of it is written to
+ * hold that number, so indexes can be updated as rows are added and long
+ * values can be written in between.
+ *
+ * Indexes aren't touched row by row: their entries are collected and
+ * sorted, and each is rebuilt bottom-up once the rows are in (see
+ * mdb_index_build_new()).  Tables with an index that can't be built that
+ * way can't be bulk loaded.
+ *
+ * Usage:
+ *	bulk = mdb_bulk_insert_begin(table);
+ *	while (...)
+ *		mdb_bulk_insert_append(bulk, num_fields, fields);
+ *	mdb_bulk_insert_end(bulk);
+ */
+MdbBulkInsert *
+mdb_bulk_insert_begin(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbBulkInsert *bulk;
+	MdbIndexBuild *build;
+	MdbIndex *idx;
+	unsigned int i;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return NULL;
+	}
+	if (table->is_temp_table) {
+		fprintf(stderr, "Bulk inserts into temporary tables are not supported\n");
+		return NULL;
+	}
+	bulk = g_malloc0(sizeof(MdbBulkInsert));
+	bulk->table = table;
+	bulk->idx_builds = g_ptr_array_new();
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		build = mdb_index_build_new(idx);
+		g_ptr_array_add(bulk->idx_builds, build);
+		/* foreign key references have no pages of their own */
+		if (!build && idx->index_type != 2) {
+			fprintf(stderr, "Can't build index %s, bulk inserts into %s are not supported\n",
+				idx->name, table->name);
+			for (i=0;i<bulk->idx_builds->len;i++)
+				mdb_index_build_free(g_ptr_array_index(bulk->idx_builds, i));
+			g_ptr_array_free(bulk->idx_builds, TRUE);
+			g_free(bulk);
+			return NULL;
+		}
+	}
+
+	return bulk;
+}
+static int
+mdb_bulk_flush_pg(MdbBulkInsert *bulk)
+{
+	MdbTableDef *table = bulk->table;
+	MdbHandle *mdb = table->entry->mdb;
+
+	if (!bulk->pg_buf)
+		return 1;
+	mdb_debug(MDB_DEBUG_WRITE, "writing page %lu", (unsigned long) bulk->pg);
+	if (!_mdb_write_pg(mdb, bulk->pg_buf, bulk->pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	if (!mdb_map_use_page(mdb, bulk->pg))
+		return 0;
+	if (!mdb_map_set_page(mdb, table->usage_map, table->map_sz, bulk->pg, 1))
+		return 0;
+	/* only pages with room to spare go in the free space map */
+	if (mdb_get_int16(bulk->pg_buf, 2) > 0 &&
+	    !mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz, bulk->pg, 1))
+		return 0;
+	bulk->num_pages++;
+	g_free(bulk->pg_buf);
+	bulk->pg_buf = NULL;
+
+	return 1;
+}
+/*
+ * Add a row to the bulk load.  Returns 1 on success, 0 on failure.
+ */
+int
+mdb_bulk_insert_append(MdbBulkInsert *bulk, int num_fields, MdbField *fields)
+{
+	MdbTableDef *table = bulk->table;
+	MdbCatalogEntry *entry = table->entry;
+	MdbFormatConstants *fmt = entry->mdb->fmt;
+	unsigned char row_buffer[4096];
+	unsigned char key[MDB_MAX_IDX_COLS * 256];
+	MdbField idx_fields[10];
+	MdbIndexBuild *build;
+	MdbIndex *idx;
+	unsigned int i;
+	int new_row_size, num_rows, pos, key_len;
+
+	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
+	if (new_row_size + 2 > fmt->pg_size - fmt->row_count_offset - 2) {
+		fprintf(stderr, "Row of %d bytes doesn't fit on a page\n", new_row_size);
+		return 0;
+	}
+	if (bulk->pg_buf && mdb_get_int16(bulk->pg_buf, 2) < new_row_size + 2) {
+		if (!mdb_bulk_flush_pg(bulk))
+			return 0;
+	}
+	if (!bulk->pg_buf) {
+		bulk->pg_buf = mdb_new_data_pg(entry);
+		bulk->pg = mdb_map_next_page(entry->mdb, table->usage_map, table->map_sz);
+		/* claim the page number before long values take it */
+		if (!bulk->pg || !_mdb_write_pg(entry->mdb, bulk->pg_buf, bulk->pg)) {
+			fprintf(stderr, "write failed!\n");
+			return 0;
+		}
+	}
+
+	/* the page is ours, so rows go on it in slot order */
+	num_rows = mdb_get_int16(bulk->pg_buf, fmt->row_count_offset);
+	pos = (num_rows == 0) ? fmt->pg_size :
+		mdb_get_int16(bulk->pg_buf, fmt->row_count_offset + (num_rows*2)) & OFFSET_MASK;
+
+	/* add our new row */
+	pos -= new_row_size;
+	memcpy(bulk->pg_buf + pos, row_buffer, new_row_size);
+	mdb_put_int16(bulk->pg_buf, (fmt->row_count_offset + 2) + (num_rows*2), pos);
+	num_rows++;
+	mdb_put_int16(bulk->pg_buf, fmt->row_count_offset, num_rows);
+	mdb_put_int16(bulk->pg_buf, 2, pos - fmt->row_count_offset - 2 - (num_rows*2));
+	bulk->num_rows++;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		build = g_ptr_array_index(bulk->idx_builds, i);
+		if (build) {
+			mdb_index_fields(idx, num_fields, fields, idx_fields);
+			key_len = mdb_index_build_key(table, idx, idx_fields, key);
+			if (!mdb_index_build_add(build, key, key_len, bulk->pg, num_rows - 1))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+/*
+ * Finish a bulk load: write the last page, the usage maps and the new row
+ * count, and free bulk.  Returns 1 on success, 0 on failure.
+ */
+int
+mdb_bulk_insert_end(MdbBulkInsert *bulk)
+{
+	MdbTableDef *table = bulk->table;
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbIndexBuild *build;
+	unsigned int i;
+	int ret;
+
+	ret = mdb_bulk_flush_pg(bulk);
+	if (ret && bulk->num_pages) {
+		ret = mdb_map_save(table);
+	}
+	/* the index pages go after the data pages */
+	for (i=0;i<bulk->idx_builds->len;i++) {
+		build = g_ptr_array_index(bulk->idx_builds, i);
+		if (build && ret && bulk->num_pages)
+			ret = mdb_index_build_finish(build);
+		else
+			mdb_index_build_free(build);
+	}
+	g_ptr_array_free(bulk->idx_builds, TRUE);
+	if (ret && bulk->num_pages) {
+		ret = mdb_read_pg(mdb, entry->table_pg);
+	}
+	if (ret && bulk->num_pages) {
+		table->num_rows += bulk->num_rows;
+		mdb_put_int32(mdb->pg_buf, fmt->tab_num_rows_offset, table->num_rows);
+		if (!mdb_write_pg(mdb, entry->table_pg)) {
+			fprintf(stderr, "write failed!\n");
+			ret = 0;
+		}
+	}
+	/* the end of a load is a good point to get it onto disk */
+	if (ret)
+		ret = mdb_flush(mdb);
+	g_free(bulk->pg_buf);
+	g_free(bulk);
+
+	return ret;
+}
 /*
  * Assumes caller has verfied space is available on page and adds the new 
  * row to the current pg_buf.
@@ -594,8 +1067,7 @@ guint16
 mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_size)
 {
 	void *new_pg;
-	int num_rows, i, pos, row_start;
-	size_t row_size;
+	int num_rows, pos;
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
@@ -613,23 +1085,12 @@ mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_siz
 			}
 		}
 
-		num_rows = mdb_get_int16(new_pg, fmt->row_count_offset);
-		pos = (num_rows == 0) ? fmt->pg_size :
-			mdb_get_int16(new_pg, fmt->row_count_offset + (num_rows*2));
 	} else {  /* is not a temp table */
-		new_pg = mdb_new_data_pg(entry);
-
-		num_rows = mdb_get_int16(mdb->pg_buf, fmt->row_count_offset);
-		pos = fmt->pg_size;
-
-		/* copy existing rows */
-		for (i=0;i<num_rows;i++) {
-			mdb_find_row(mdb, i, &row_start, &row_size);
-			pos -= row_size;
-			memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-			mdb_put_int16(new_pg, (fmt->row_count_offset + 2) + (i*2), pos);
-		}
+		/* the new row goes below the lowest one, nothing else moves */
+		new_pg = mdb->pg_buf;
 	}
+	num_rows = mdb_get_int16(new_pg, fmt->row_count_offset);
+	pos = mdb_pg_rows_start(fmt, new_pg);
 
 	/* add our new row */
 	pos -= new_row_size;
@@ -644,14 +1105,107 @@ mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_siz
 	/* update the freespace */
 	mdb_put_int16(new_pg,2,pos - fmt->row_count_offset - 2 - (num_rows*2));
 
-	/* copy new page over old */
-	if (!table->is_temp_table) {
-		memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
-		g_free(new_pg);
+	return num_rows;
+}
+/*
+ * Put new_row in place of row on page pg, which is in mdb->pg_buf, and
+ * write the page.  Only the rows stored below it are moved, by the
+ * difference in size, and their offsets fixed up, whatever their slots.
+ * flags are the offset flags the row gets.
+ */
+static int
+mdb_resize_row(MdbTableDef *table, guint32 pg, int row, void *new_row, int new_row_size, guint16 flags)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	int pg_size = fmt->pg_size;
+	int rco = fmt->row_count_offset;
+	int num_rows, row_start, rows_start, delta, i;
+	guint16 offset;
+
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		mdb_buffer_dump(mdb->pg_buf, 0, 40);
+		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
 	}
+	mdb_debug(MDB_DEBUG_WRITE,"updating row %d on page %lu", row, (unsigned long) pg);
 
-	return num_rows;
+	row_start = mdb_get_int16(mdb->pg_buf, rco + 2 + row*2) & OFFSET_MASK;
+	delta = new_row_size -
+		(mdb_pg_row_end(fmt, mdb->pg_buf, row_start) - row_start);
+	if (delta > mdb_pg_get_freespace(mdb)) {
+		fprintf(stderr, "No space left on this page, update will not occur\n");
+		return 0;
+	}
+	if (delta) {
+		num_rows = mdb_get_int16(mdb->pg_buf, rco);
+		rows_start = mdb_pg_rows_start(fmt, mdb->pg_buf);
+		memmove(mdb->pg_buf + rows_start - delta,
+			mdb->pg_buf + rows_start, row_start - rows_start);
+		for (i=0;i<num_rows;i++) {
+			offset = mdb_get_int16(mdb->pg_buf, rco + 2 + i*2);
+			if (i == row || (offset & OFFSET_MASK) >= row_start)
+				continue;
+			mdb_put_int16(mdb->pg_buf, rco + 2 + i*2,
+				((offset & OFFSET_MASK) - delta) | (offset & ~OFFSET_MASK));
+		}
+	}
+	memcpy(mdb->pg_buf + row_start - delta, new_row, new_row_size);
+	mdb_put_int16(mdb->pg_buf, rco + 2 + row*2, (row_start - delta) | flags);
+
+	mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		mdb_buffer_dump(mdb->pg_buf, 0, 40);
+		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
+	}
+	/* drum roll, please */
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Move a row that has outgrown its page to a page with room for it, and
+ * leave a pointer to it, flagged as a lookup row, in the original slot
+ * (ptr_row on page ptr_pg) so that index entries stay valid.  The moved
+ * row is flagged as deleted so table scans only reach it through the
+ * pointer.
+ */
+static int
+mdb_move_row(MdbTableDef *table, guint32 ptr_pg, int ptr_row, void *new_row, int new_row_size)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int rco = mdb->fmt->row_count_offset;
+	unsigned char ptr[4];
+	guint32 pg;
+	int row;
+
+	/* this leaves the page in pg_buf */
+	pg = mdb_map_find_next_freepage(table, new_row_size);
+	if (!pg) {
+		fprintf(stderr, "Unable to allocate new page.\n");
+		return 0;
+	}
+	row = mdb_add_row_to_pg(table, new_row, new_row_size) - 1;
+	mdb_put_int16(mdb->pg_buf, rco + 2 + row*2,
+		mdb_get_int16(mdb->pg_buf, rco + 2 + row*2) | 0x4000);
+	mdb_debug(MDB_DEBUG_WRITE, "moving row %d on page %lu to row %d on page %lu",
+		ptr_row, (unsigned long) ptr_pg, row, (unsigned long) pg);
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+
+	if (!mdb_read_pg(mdb, ptr_pg))
+		return 0;
+	mdb_put_int32(ptr, 0, (pg << 8) | row);
+	return mdb_resize_row(table, ptr_pg, ptr_row, ptr, 4, 0x8000);
 }
+/*
+ * Write the values of the bound columns to the current row of the table
+ * scan, in place if the page has room for it, otherwise by moving it.
+ * Returns 1 on success, 0 on failure.
+ */
 int 
 mdb_update_row(MdbTableDef *table)
 {
@@ -664,17 +1218,33 @@ MdbField fields[256];
 unsigned char row_buffer[4096];
 	size_t old_row_size, new_row_size;
 unsigned int num_fields;
+	guint32 pg = table->cur_phys_pg, pg_row;
+	int row = table->cur_row-1;
+	int rco = mdb->fmt->row_count_offset;
+	int ret;
 
 	if (!mdb->f->writable) {
 		fprintf(stderr, "File is not open for writing\n");
 		return 0;
 	}
-	mdb_find_row(mdb, table->cur_row-1, &row_start, &old_row_size);
+	row_start = mdb_get_int16(mdb->pg_buf, rco + 2 + row*2);
+	old_row_size = mdb_pg_row_end(mdb->fmt, mdb->pg_buf,
+		row_start & OFFSET_MASK) - (row_start & OFFSET_MASK);
+	/* the row was moved before, update it where it is now */
+	if ((row_start & 0x8000) && old_row_size == 4) {
+		pg_row = mdb_get_int32(mdb->pg_buf, row_start & OFFSET_MASK);
+		pg = pg_row >> 8;
+		row = pg_row & 0xff;
+		if (!mdb_read_pg(mdb, pg))
+			return 0;
+		row_start = mdb_get_int16(mdb->pg_buf, rco + 2 + row*2);
+		old_row_size = mdb_pg_row_end(mdb->fmt, mdb->pg_buf,
+			row_start & OFFSET_MASK) - (row_start & OFFSET_MASK);
+	}
+	row_start &= OFFSET_MASK; /* remove flags */
 	row_end = row_start + old_row_size - 1;
 
-	row_start &= 0x0FFF; /* remove flags */
-
-	mdb_debug(MDB_DEBUG_WRITE,"page %lu row %d start %d end %d", (unsigned long) table->cur_phys_pg, table->cur_row-1, row_start, row_end);
+	mdb_debug(MDB_DEBUG_WRITE,"page %lu row %d start %d end %d", (unsigned long) pg, row, row_start, row_end);
 	if (mdb_get_option(MDB_DEBUG_LIKE))
 		mdb_buffer_dump(mdb->pg_buf, row_start, old_row_size);
 
@@ -701,15 +1271,22 @@ unsigned int num_fields;
 	}
 
 	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
-	if (mdb_get_option(MDB_DEBUG_WRITE)) 
+	if (mdb_get_option(MDB_DEBUG_WRITE))
 		mdb_buffer_dump(row_buffer, 0, new_row_size);
-	if (new_row_size > (old_row_size + mdb_pg_get_freespace(mdb))) {
-		fprintf(stderr, "No space left on this page, update will not occur\n");
-		return 0;
-	}
 	/* do it! */
-	mdb_replace_row(table, table->cur_row-1, row_buffer, new_row_size);
-	return 0; /* FIXME */
+	if (new_row_size <= (old_row_size + mdb_pg_get_freespace(mdb))) {
+		ret = mdb_resize_row(table, pg, row, row_buffer, new_row_size,
+			mdb_get_int16(mdb->pg_buf, rco + 2 + row*2) & ~OFFSET_MASK);
+	} else {
+		/* a copy moved here earlier is just left behind */
+		ret = mdb_move_row(table, table->cur_phys_pg, table->cur_row-1,
+			row_buffer, new_row_size);
+	}
+	/* the caller's scan expects its page to be current */
+	if (!mdb_read_pg(mdb, table->cur_phys_pg))
+		ret = 0;
+
+	return ret;
 }
 
 /* WARNING the return code is opposite to convention used elsewhere:
@@ -720,162 +1297,71 @@ unsigned int num_fields;
 int 
 mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_row_size)
 {
-MdbCatalogEntry *entry = table->entry;
-MdbHandle *mdb = entry->mdb;
-int pg_size = mdb->fmt->pg_size;
-int rco = mdb->fmt->row_count_offset;
-	void *new_pg;
-guint16 num_rows;
-	int row_start;
-	size_t row_size;
-int i, pos;
+	MdbHandle *mdb = table->entry->mdb;
+	guint16 flags;
 
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, 40);
-		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
-	}
-	mdb_debug(MDB_DEBUG_WRITE,"updating row %d on page %lu", row, (unsigned long) table->cur_phys_pg);
-	new_pg = mdb_new_data_pg(entry);
-
-	num_rows = mdb_get_int16(mdb->pg_buf, rco);
-	mdb_put_int16(new_pg, rco, num_rows);
-
-	pos = pg_size;
-
-	/* rows before */
-	for (i=0;i<row;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
-	}
-	
-	/* our row */
-	pos -= new_row_size;
-	memcpy(new_pg + pos, new_row, new_row_size);
-	mdb_put_int16(new_pg, rco + 2 + row*2, pos);
-	
-	/* rows after */
-	for (i=row+1;i<num_rows;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
-	}
-
-	/* almost done, copy page over current */
-	memcpy(mdb->pg_buf, new_pg, pg_size);
-
-	g_free(new_pg);
+	flags = mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 + row*2)
+		& ~OFFSET_MASK;
+	return mdb_resize_row(table, table->cur_phys_pg, row, new_row,
+		new_row_size, flags) ? 0 : 1;
+}
+/*
+ * Bump the entry count of idx kept in the table definition.
+ */
+static int
+mdb_index_count_entry(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
 
-	mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, 40);
-		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
-	}
-	/* drum roll, please */
-	if (!mdb_write_pg(mdb, table->cur_phys_pg)) {
+	if (!mdb_read_pg(mdb, table->entry->table_pg))
+		return 0;
+	idx->num_rows++;
+	mdb_put_int32(mdb->pg_buf, fmt->tab_cols_start_offset +
+		(idx->index_num * fmt->tab_ridx_entry_size), idx->num_rows);
+	if (!mdb_write_pg(mdb, table->entry->table_pg)) {
 		fprintf(stderr, "write failed!\n");
-		return 1;
+		return 0;
 	}
-	return 0;
+	return 1;
 }
+/*
+ * Add the entry of row on page pgnum to the leaf of idx at the bottom of
+ * chain, as left by mdb_index_seek_row(), and write the page.  If the leaf
+ * has no room for it, or it would become the last entry of a leaf below
+ * an intermediate page, whose key there we don't update, the index is
+ * rebuilt with the new entry instead.
+ */
 static int
-mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum) 
-/*,  guint32 pgnum, guint16 rownum) 
-static int
-mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
-*/
+mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len, guint32 pgnum, guint16 row)
 {
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
-	MdbColumn *col;
-	guint32 pg_row;
-	guint16 row = 0;
-	void *new_pg;
-	unsigned char key_hash[256];
-	int keycol;
-
-	new_pg = mdb_new_leaf_pg(entry);
-
-	/* reinitial ipg pointers to start of page */
-	mdb_index_page_reset(ipg);
-	mdb_read_pg(mdb, ipg->pg);
-
-	/* do we support this index type yet? */
-	if (idx->num_keys > 1) {
-		fprintf(stderr,"multikey indexes not yet supported, aborting\n");
-		return 0;
-	}
-	keycol = idx->key_col_num[0];
-	col = g_ptr_array_index (table->columns, keycol - 1);
-	if (!col->is_fixed) {
-		fprintf(stderr,"variable length key columns not yet supported, aborting\n");
-		return 0;
-	}
-
-	while (mdb_index_find_next_on_page(mdb, ipg)) {
-
-		/* check for compressed indexes.  */
-		if (ipg->len < col->col_size + 1) {
-			fprintf(stderr,"compressed indexes not yet supported, aborting\n");
+	MdbIndexPage *ipg = &chain->pages[chain->cur_depth-1];
+	MdbIndexBuild *build;
+	unsigned char new_entry[MDB_MAX_IDX_COLS * 256 + 4];
+
+	memcpy(new_entry, key, key_len);
+	mdb_put_int32_msb(new_entry, key_len, (pgnum << 8) | (row & 0xff));
+	if (mdb_read_pg(mdb, ipg->pg) && mdb->pg_buf[0] == MDB_PAGE_LEAF &&
+	    mdb_index_leaf_insert(mdb, ipg, new_entry, key_len + 4, chain->cur_depth == 1)) {
+		if (mdb_get_option(MDB_DEBUG_WRITE))
+			mdb_buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
+		if (!mdb_write_pg(mdb, ipg->pg)) {
+			fprintf(stderr, "write failed!\n");
 			return 0;
 		}
-
-		pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
-		/* guint32 pg = pg_row >> 8; */
-		row = pg_row & 0xff;
-		/* unsigned char iflag = mdb->pg_buf[ipg->offset]; */
-
-		/* turn the key hash back into a value */
-		mdb_index_swap_n(&mdb->pg_buf[ipg->offset + 1], col->col_size, key_hash);
-		key_hash[col->col_size - 1] &= 0x7f;
-
-		if (mdb_get_option(MDB_DEBUG_WRITE)) {
-			mdb_buffer_dump(mdb->pg_buf, ipg->offset, ipg->len);
-			mdb_buffer_dump(mdb->pg_buf, ipg->offset + 1, col->col_size);
-			mdb_buffer_dump(key_hash, 0, col->col_size);
-		}
-
-		memcpy(new_pg + ipg->offset, mdb->pg_buf + ipg->offset, ipg->len);
-		ipg->offset += ipg->len;
-		ipg->len = 0;
-
-		row++;
+		return mdb_index_count_entry(table, idx);
 	}
 
-	if (!row) {
-		fprintf(stderr,"missing indexes not yet supported, aborting\n");
+	mdb_debug(MDB_DEBUG_WRITE, "rebuilding index %s", idx->name);
+	if (!(build = mdb_index_build_new(idx))) {
+		fprintf(stderr, "No room for the new entry of index %s\n", idx->name);
 		return 0;
 	}
-	//mdb_put_int16(new_pg, mdb->fmt->row_count_offset, row);
-	/* free space left */
-	mdb_put_int16(new_pg, 2, mdb->fmt->pg_size - ipg->offset);
-	//printf("offset = %d\n", ipg->offset);
-
-	mdb_index_swap_n(idx_fields[0].value, col->col_size, key_hash);
-	key_hash[0] |= 0x080;
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		printf("key_hash\n");
-		mdb_buffer_dump(idx_fields[0].value, 0, col->col_size);
-		mdb_buffer_dump(key_hash, 0, col->col_size);
-		printf("--------\n");
-	}
-	((char *)new_pg)[ipg->offset] = 0x7f;
-	memcpy(new_pg + ipg->offset + 1, key_hash, col->col_size);
-	pg_row = (pgnum << 8) | ((rownum-1) & 0xff);
-	mdb_put_int32_msb(new_pg, ipg->offset + 5, pg_row);
-	ipg->idx_starts[row++] = ipg->offset + ipg->len;
-	//ipg->idx_starts[row] = ipg->offset + ipg->len;
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
-	}
-	memcpy(mdb->pg_buf, new_pg, mdb->fmt->pg_size);
-	mdb_index_pack_bitmap(mdb, ipg);
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
+	if (!mdb_index_build_add(build, key, key_len, pgnum, row)) {
+		mdb_index_build_free(build);
+		return 0;
 	}
-	g_free(new_pg);
-
-	return ipg->len;
+	return mdb_index_build_finish(build);
 }
@@ -397,7 +397,12 @@ SQLRETURN SQL_API SQLNumParams(
     SQLHSTMT           hstmt,
     SQLSMALLINT FAR   *pcpar)
 {
+	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+	struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+	struct _henv *env = (struct _henv *) dbc->henv;
+
 	TRACE("SQLNumParams");
+	*pcpar = env->prepared == stmt ? env->sql->params->len : 0;
 	return SQL_SUCCESS;
 }
 
@@ -510,10 +515,30 @@ SQLRETURN SQL_API SQLBindParameter(
     SQLLEN             cbValueMax,
     SQLLEN FAR        *pcbValue)
 {
-	/*struct _hstmt *stmt;*/
+	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+	struct _sql_param_info *cur, *newitem;
 
 	TRACE("SQLBindParameter");
-	/*stmt = (struct _hstmt *) hstmt;*/
+	if (fParamType != SQL_PARAM_INPUT) {
+		LogError("Only input parameters are supported");
+		return SQL_ERROR;
+	}
+	/* find available item in list */
+	for (cur = stmt->param_head; cur; cur = cur->next) {
+		if (cur->param_number == ipar)
+			break;
+	}
+	if (!cur) {
+		newitem = (struct _sql_param_info *) g_malloc0(sizeof(struct _sql_param_info));
+		newitem->param_number = ipar;
+		newitem->next = stmt->param_head;
+		stmt->param_head = cur = newitem;
+	}
+	cur->param_ctype = fCType;
+	cur->param_len = cbValueMax;
+	cur->param_lenbind = pcbValue;
+	cur->varaddr = rgbValue;
+
 	return SQL_SUCCESS;
 }
 
@@ -958,6 +983,9 @@ SQLRETURN SQL_API SQLDisconnect(
 
 	dbc = (struct _hdbc *) hdbc;
 	env = (struct _henv *) dbc->henv;
+	/* the prepared table goes with the database */
+	mdb_sql_reset(env->sql);
+	env->prepared = NULL;
 	mdb_sql_close(env->sql);
 
 	return SQL_SUCCESS;
@@ -1039,24 +1067,108 @@ SQLRETURN SQL_API SQLErrorW(
 }
 #endif // ENABLE_ODBC_W
 
-static SQLRETURN SQL_API _SQLExecute( SQLHSTMT hstmt)
+/*
+ * Parse the statement's query into the environment's MdbSQL, which keeps
+ * it until another statement is prepared or run.
+ */
+static SQLRETURN
+_odbc_prepare(struct _hstmt *stmt)
 {
-	struct _hstmt *stmt = (struct _hstmt *) hstmt;
 	struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
 	struct _henv *env = (struct _henv *) dbc->henv;
 
-	TRACE("_SQLExecute");
-   
 	/* fprintf(stderr,"query = %s\n",stmt->query); */
 	_odbc_fix_literals(stmt);
 
 	mdb_sql_reset(env->sql);
+	env->prepared = NULL;
 
-	mdb_sql_run_query(env->sql, stmt->query);
+	mdb_sql_prepare(env->sql, stmt->query);
 	if (mdb_sql_has_error(env->sql)) {
 		LogError("Couldn't parse SQL\n");
 		mdb_sql_reset(env->sql);
 		return SQL_ERROR;
+	}
+	env->prepared = stmt;
+	return SQL_SUCCESS;
+}
+/*
+ * Give the prepared statement the current values of the bound parameters.
+ */
+static SQLRETURN
+_odbc_bind_params(struct _hstmt *stmt)
+{
+	struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+	struct _henv *env = (struct _henv *) dbc->henv;
+	struct _sql_param_info *cur;
+	char buf[256];
+	SQLLEN len;
+
+	for (cur = stmt->param_head; cur; cur = cur->next) {
+		len = cur->param_lenbind ? *cur->param_lenbind : SQL_NTS;
+		if (len == SQL_NULL_DATA) {
+			LogError("NULL parameters are not supported");
+			return SQL_ERROR;
+		}
+		switch (cur->param_ctype) {
+			case SQL_C_CHAR:
+			case SQL_C_DEFAULT:
+				if (len == SQL_NTS)
+					len = strlen(cur->varaddr);
+				if (len >= (SQLLEN) sizeof(buf))
+					len = sizeof(buf) - 1;
+				memcpy(buf, cur->varaddr, len);
+				buf[len] = '\0';
+				break;
+			case SQL_C_LONG:
+			case SQL_C_SLONG:
+				snprintf(buf, sizeof(buf), "%ld", (long) *(SQLINTEGER *)cur->varaddr);
+				break;
+			case SQL_C_ULONG:
+				snprintf(buf, sizeof(buf), "%lu", (unsigned long) *(SQLUINTEGER *)cur->varaddr);
+				break;
+			case SQL_C_SHORT:
+			case SQL_C_SSHORT:
+				snprintf(buf, sizeof(buf), "%d", *(SQLSMALLINT *)cur->varaddr);
+				break;
+			case SQL_C_TINYINT:
+			case SQL_C_STINYINT:
+				snprintf(buf, sizeof(buf), "%d", *(SQLSCHAR *)cur->varaddr);
+				break;
+			case SQL_C_DOUBLE:
+				snprintf(buf, sizeof(buf), "%.17g", *(SQLDOUBLE *)cur->varaddr);
+				break;
+			default:
+				LogError("Unsupported parameter type");
+				return SQL_ERROR;
+		}
+		if (mdb_sql_bind_param(env->sql, cur->param_number, buf)) {
+			LogError("Couldn't bind parameter");
+			return SQL_ERROR;
+		}
+	}
+	return SQL_SUCCESS;
+}
+static SQLRETURN SQL_API _SQLExecute( SQLHSTMT hstmt)
+{
+	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+	struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+	struct _henv *env = (struct _henv *) dbc->henv;
+
+	TRACE("_SQLExecute");
+
+	/* the parsed query is reused until another statement needs sql */
+	if (env->prepared != stmt && _odbc_prepare(stmt) != SQL_SUCCESS)
+		return SQL_ERROR;
+	if (_odbc_bind_params(stmt) != SQL_SUCCESS)
+		return SQL_ERROR;
+
+	mdb_sql_execute(env->sql);
+	/* the columns are bound again on the first fetch */
+	stmt->rows_affected = 0;
+	if (mdb_sql_has_error(env->sql)) {
+		LogError("Couldn't run SQL\n");
+		return SQL_ERROR;
 	} else {
 		return SQL_SUCCESS;
 	}
@@ -1068,9 +1180,14 @@ SQLRETURN SQL_API SQLExecDirect(
     SQLINTEGER         cbSqlStr)
 {
 	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+	struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+	struct _henv *env = (struct _henv *) dbc->henv;
 
 	TRACE("SQLExecDirect");
 	strcpy(stmt->query, (char*)szSqlStr);
+	/* a new query, not the one prepared before */
+	if (env->prepared == stmt)
+		env->prepared = NULL;
 
 	return _SQLExecute(hstmt);
 }
@@ -1222,11 +1339,24 @@ static SQLRETURN SQL_API _SQLFreeStmt(
 	struct _henv *env = (struct _henv *) dbc->henv;
 	MdbSQL *sql = env->sql;
 
+	struct _sql_param_info *param;
+
 	TRACE("_SQLFreeStmt");
 	if (fOption==SQL_DROP) {
 		mdb_sql_reset(sql);
+		if (env->prepared == stmt)
+			env->prepared = NULL;
+		while ((param = stmt->param_head)) {
+			stmt->param_head = param->next;
+			g_free(param);
+		}
 		g_free(stmt);
 	} else if (fOption==SQL_CLOSE) {
+	} else if (fOption==SQL_RESET_PARAMS) {
+		while ((param = stmt->param_head)) {
+			stmt->param_head = param->next;
+			g_free(param);
+		}
 	} else {
 	}
 	return SQL_SUCCESS;
@@ -1286,7 +1416,7 @@ SQLRETURN SQL_API SQLPrepare(
 	strncpy(stmt->query, (char*)szSqlStr, sqllen);
 	stmt->query[sqllen]='\0';
 
-	return SQL_SUCCESS;
+	return _odbc_prepare(stmt);
 }
 
 SQLRETURN SQL_API SQLRowCount(
@@ -1428,6 +1558,7 @@ SQLRETURN SQL_API SQLColumns(
 		}
 		mdb_free_tabledef(table);
 	}
+	env->prepared = NULL;
 	sql->cur_table = ttable;
 
 	return SQL_SUCCESS;
@@ -2016,6 +2147,7 @@ SQLRETURN SQL_API SQLGetTypeInfo(
 		mdb_add_row_to_pg(ttable,row_buffer, row_size);
 		ttable->num_rows++;
 	}
+	env->prepared = NULL;
 	sql->cur_table = ttable;
 	
 	/* return _SQLExecute(hstmt); */
@@ -2154,6 +2286,7 @@ SQLRETURN SQL_API SQLTables( //sz* not used, so Unicode API not required.
 		mdb_add_row_to_pg(ttable, row_buffer, row_size);
 		ttable->num_rows++;
 	}
+	env->prepared = NULL;
 	sql->cur_table = ttable;
 
 	return SQL_SUCCESS;
@@ -0,0 +1,700 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * COUNT, SUM, MIN, MAX and AVG, with or without GROUP BY.
+ *
+ * The table is read once.  Each row is put in its group through a hash
+ * table on the GROUP BY columns, and the aggregates of the group are
+ * updated from the row's values as stored, without converting them to
+ * strings.  Text is grouped and compared ignoring case, as Access does.
+ *
+ * Without GROUP BY or WHERE some columns need no scan: COUNT(*) is the
+ * row count of the table definition, and MIN or MAX of an indexed column
+ * is the row at one end of the index.
+ *
+ * sql->cur_table becomes an operator table handing out a row per group.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/* how the values of a column are added up and compared */
+#define MDB_SQL_AGG_INT    1	/* byte, integer and long integer */
+#define MDB_SQL_AGG_MONEY  2	/* 64 bit count of 1/10000ths */
+#define MDB_SQL_AGG_DOUBLE 3	/* single, double and date */
+#define MDB_SQL_AGG_TEXT   4
+
+typedef struct {
+	int is_set;		/* a value has been seen */
+	int is_null;		/* of a GROUP BY column */
+	gint64 count;
+	gint64 i;		/* sum, min or max of an integer or money column */
+	double d;		/* of a floating point or date column */
+	char *s;		/* min or max of a text column */
+	unsigned char *raw;	/* min, max or GROUP BY value as stored */
+	int raw_len;
+} MdbSQLAggValue;
+
+typedef struct {
+	guint32 hash;
+	guint32 key_len;
+	unsigned char *key;
+	MdbSQLAggValue *values;	/* one per result column */
+} MdbSQLGroup;
+
+typedef struct {
+	MdbSQL *sql;
+	MdbTableDef *table;
+	MdbColumn **cols;	/* column of each result column, NULL for COUNT(*) */
+	int *done;		/* result columns answered without a scan */
+	int only;		/* if >= 0 the one result column to update */
+	GPtrArray *group_cols;	/* MdbColumn * of the GROUP BY columns */
+	GHashTable *hash;
+	GPtrArray *groups;	/* in the order they were first seen */
+	GByteArray *key;
+	/* what the result rows are made from once the table is read */
+	unsigned int num_columns;
+	int *funcs;		/* agg_func of each result column */
+	int *classes;		/* and how its column's values add up */
+	guint next;		/* the group of the next result row */
+	unsigned char bufs[MDB_MAX_COLS][8];
+} MdbSQLAggState;
+
+static unsigned char mdb_sql_agg_zero[1];
+
+static int
+mdb_sql_agg_class(int col_type)
+{
+	switch (col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+			return MDB_SQL_AGG_INT;
+		case MDB_MONEY:
+			return MDB_SQL_AGG_MONEY;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			return MDB_SQL_AGG_DOUBLE;
+		case MDB_TEXT:
+			return MDB_SQL_AGG_TEXT;
+	}
+	return 0;
+}
+static gint64
+mdb_sql_agg_get_int(MdbColumn *col, MdbField *f)
+{
+	unsigned char *v = f->value;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			return v[0];
+		case MDB_INT:
+			return (gint16) mdb_get_int16(v, 0);
+		case MDB_LONGINT:
+			return (gint32) mdb_get_int32(v, 0);
+		case MDB_MONEY:
+			return ((gint64) (gint32) mdb_get_int32(v, 4) << 32)
+				| (guint32) mdb_get_int32(v, 0);
+	}
+	return 0;
+}
+static double
+mdb_sql_agg_get_double(MdbColumn *col, MdbField *f)
+{
+	if (col->col_type == MDB_FLOAT)
+		return mdb_get_single(f->value, 0);
+	return mdb_get_double(f->value, 0);
+}
+static void
+mdb_sql_agg_put_double(unsigned char *buf, double d)
+{
+	union {guint64 g; double d;} u;
+
+	u.d = d;
+	u.g = GUINT64_TO_LE(u.g);
+	memcpy(buf, &u, 8);
+}
+static guint
+mdb_sql_group_hash(gconstpointer a)
+{
+	return ((MdbSQLGroup *) a)->hash;
+}
+static gboolean
+mdb_sql_group_equal(gconstpointer a, gconstpointer b)
+{
+	const MdbSQLGroup *g1 = a, *g2 = b;
+
+	return g1->key_len == g2->key_len && !memcmp(g1->key, g2->key, g1->key_len);
+}
+static void
+mdb_sql_agg_set_raw(MdbSQLAggValue *v, MdbField *f)
+{
+	g_free(v->raw);
+	v->raw = g_memdup(f->value, f->siz);
+	v->raw_len = f->siz;
+}
+/*
+ * Build the GROUP BY key of a row in st->key: for each column a byte
+ * telling whether it is null, then its value, text lower cased.
+ */
+static void
+mdb_sql_agg_key(MdbSQLAggState *st, MdbField *fields)
+{
+	MdbHandle *mdb = st->table->entry->mdb;
+	MdbColumn *col;
+	MdbField *f;
+	char buf[256], *s;
+	unsigned char flag;
+	unsigned int i;
+
+	g_byte_array_set_size(st->key, 0);
+	for (i=0;i<st->group_cols->len;i++) {
+		col = g_ptr_array_index(st->group_cols, i);
+		f = &fields[col->col_num];
+		/* a boolean's value is its null bit */
+		flag = f->is_null ? 0 : 1;
+		g_byte_array_append(st->key, &flag, 1);
+		if (f->is_null || col->col_type == MDB_BOOL)
+			continue;
+		if (col->col_type == MDB_TEXT) {
+			mdb_unicode2ascii(mdb, f->value, f->siz, buf, sizeof(buf));
+			s = g_ascii_strdown(buf, -1);
+			g_byte_array_append(st->key, (guint8 *) s, strlen(s) + 1);
+			g_free(s);
+		} else {
+			g_byte_array_append(st->key, f->value, f->siz);
+		}
+	}
+}
+static MdbSQLGroup *
+mdb_sql_agg_new_group(MdbSQLAggState *st, MdbField *fields)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLColumn *sqlcol;
+	MdbSQLGroup *group;
+	MdbField *f;
+	unsigned int i;
+
+	group = g_malloc0(sizeof(MdbSQLGroup));
+	group->values = g_malloc0(sql->num_columns * sizeof(MdbSQLAggValue));
+	for (i=0;fields && i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (sqlcol->agg_func)
+			continue;
+		f = &fields[st->cols[i]->col_num];
+		group->values[i].is_null = f->is_null;
+		if (!f->is_null)
+			mdb_sql_agg_set_raw(&group->values[i], f);
+	}
+	g_ptr_array_add(st->groups, group);
+	return group;
+}
+static MdbSQLGroup *
+mdb_sql_agg_find_group(MdbSQLAggState *st, MdbField *fields)
+{
+	MdbSQLGroup probe, *group;
+
+	if (!st->group_cols->len)
+		return g_ptr_array_index(st->groups, 0);
+
+	mdb_sql_agg_key(st, fields);
+	probe.key = st->key->data;
+	probe.key_len = st->key->len;
+	probe.hash = mdb_sql_hash(probe.key, probe.key_len);
+	if ((group = g_hash_table_lookup(st->hash, &probe)))
+		return group;
+
+	group = mdb_sql_agg_new_group(st, fields);
+	group->key = g_memdup(probe.key, probe.key_len);
+	group->key_len = probe.key_len;
+	group->hash = probe.hash;
+	g_hash_table_insert(st->hash, group, group);
+	return group;
+}
+/*
+ * Add the value of field f to v, the state of a result column.
+ */
+static void
+mdb_sql_agg_update(MdbSQLAggState *st, int agg_func, MdbColumn *col, MdbField *f, MdbSQLAggValue *v)
+{
+	MdbHandle *mdb = st->table->entry->mdb;
+	char buf[256];
+	gint64 n;
+	double d;
+	int cmp;
+
+	if (agg_func == MDB_SQL_COUNT) {
+		if (!col || col->col_type == MDB_BOOL || !f->is_null)
+			v->count++;
+		return;
+	}
+	if (f->is_null)
+		return;
+	v->count++;
+	switch (mdb_sql_agg_class(col->col_type)) {
+		case MDB_SQL_AGG_INT:
+		case MDB_SQL_AGG_MONEY:
+			n = mdb_sql_agg_get_int(col, f);
+			if (agg_func == MDB_SQL_SUM || agg_func == MDB_SQL_AVG) {
+				v->i += n;
+			} else if (!v->is_set || (agg_func == MDB_SQL_MIN ? n < v->i : n > v->i)) {
+				v->i = n;
+				mdb_sql_agg_set_raw(v, f);
+			}
+			break;
+		case MDB_SQL_AGG_DOUBLE:
+			d = mdb_sql_agg_get_double(col, f);
+			if (agg_func == MDB_SQL_SUM || agg_func == MDB_SQL_AVG) {
+				v->d += d;
+			} else if (!v->is_set || (agg_func == MDB_SQL_MIN ? d < v->d : d > v->d)) {
+				v->d = d;
+				mdb_sql_agg_set_raw(v, f);
+			}
+			break;
+		case MDB_SQL_AGG_TEXT:
+			mdb_unicode2ascii(mdb, f->value, f->siz, buf, sizeof(buf));
+			cmp = v->s ? g_ascii_strcasecmp(buf, v->s) : 0;
+			if (!v->s || (agg_func == MDB_SQL_MIN ? cmp < 0 : cmp > 0)) {
+				g_free(v->s);
+				v->s = g_strdup(buf);
+				mdb_sql_agg_set_raw(v, f);
+			}
+			break;
+	}
+	v->is_set = 1;
+}
+static void
+mdb_sql_agg_row(MdbTableDef *table, MdbField *fields, int num_fields, gpointer data)
+{
+	MdbSQLAggState *st = data;
+	MdbSQL *sql = st->sql;
+	MdbSQLColumn *sqlcol;
+	MdbSQLGroup *group;
+	MdbColumn *col;
+	unsigned int i;
+
+	group = mdb_sql_agg_find_group(st, fields);
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!sqlcol->agg_func || st->done[i])
+			continue;
+		if (st->only >= 0 && (int) i != st->only)
+			continue;
+		col = st->cols[i];
+		mdb_sql_agg_update(st, sqlcol->agg_func, col,
+			col ? &fields[col->col_num] : NULL, &group->values[i]);
+	}
+}
+static MdbColumn *
+mdb_sql_agg_find_col(MdbSQL *sql, MdbTableDef *table, char *name)
+{
+	MdbColumn *col;
+	unsigned int i;
+
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		if (!strcasecmp(col->name, name))
+			return col;
+	}
+	mdb_sql_error(sql, "Column %s not found", name);
+	return NULL;
+}
+/*
+ * Check each result column and add it to the temp table.
+ */
+static int
+mdb_sql_agg_columns(MdbSQLAggState *st, MdbTableDef *ttable)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLColumn *sqlcol;
+	MdbColumn *col, tcol;
+	unsigned int i, j;
+	int class, col_type, col_size, is_fixed;
+
+	for (i=0;i<sql->group_by->len;i++) {
+		if (!(col = mdb_sql_agg_find_col(sql, st->table,
+		    g_ptr_array_index(sql->group_by, i))))
+			return 0;
+		if (col->col_type == MDB_MEMO || col->col_type == MDB_OLE
+		 || col->col_type == MDB_NUMERIC) {
+			mdb_sql_error(sql, "Can't group by column %s", col->name);
+			return 0;
+		}
+		g_ptr_array_add(st->group_cols, col);
+		mdb_need_column(st->table, col);
+	}
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		col = NULL;
+		if (strlen(sqlcol->name) > MDB_MAX_OBJ_NAME) {
+			mdb_sql_error(sql, "Column name %s is too long", sqlcol->name);
+			return 0;
+		}
+		if (sqlcol->agg_col &&
+		    !(col = mdb_sql_agg_find_col(sql, st->table, sqlcol->agg_col)))
+			return 0;
+		if (!sqlcol->agg_func) {
+			if (!(col = mdb_sql_agg_find_col(sql, st->table, sqlcol->name)))
+				return 0;
+			for (j=0;j<st->group_cols->len;j++) {
+				if (g_ptr_array_index(st->group_cols, j) == col)
+					break;
+			}
+			if (j == st->group_cols->len) {
+				mdb_sql_error(sql, "Column %s is not in the GROUP BY clause", sqlcol->name);
+				return 0;
+			}
+		} else if (!col && sqlcol->agg_func != MDB_SQL_COUNT) {
+			mdb_sql_error(sql, "%s needs a column", sqlcol->name);
+			return 0;
+		}
+		st->cols[i] = col;
+		if (col)
+			mdb_need_column(st->table, col);
+
+		/* the type of the result */
+		class = col ? mdb_sql_agg_class(col->col_type) : 0;
+		is_fixed = 1;
+		col_size = 0;
+		switch (sqlcol->agg_func) {
+			case MDB_SQL_COUNT:
+				col_type = MDB_LONGINT;
+				break;
+			case MDB_SQL_SUM:
+			case MDB_SQL_AVG:
+				if (!class || class == MDB_SQL_AGG_TEXT ||
+				    col->col_type == MDB_DATETIME) {
+					mdb_sql_error(sql, "Can't compute %s of a column of this type", sqlcol->name);
+					return 0;
+				}
+				if (sqlcol->agg_func == MDB_SQL_AVG || class == MDB_SQL_AGG_DOUBLE)
+					col_type = MDB_DOUBLE;
+				else if (class == MDB_SQL_AGG_MONEY)
+					col_type = MDB_MONEY;
+				else
+					col_type = MDB_LONGINT;
+				break;
+			case MDB_SQL_MIN:
+			case MDB_SQL_MAX:
+				if (!class) {
+					mdb_sql_error(sql, "Can't compute %s of a column of this type", sqlcol->name);
+					return 0;
+				}
+				/* fall through */
+			default:
+				col_type = col->col_type;
+				col_size = col->col_size;
+				is_fixed = col->is_fixed;
+				break;
+		}
+		mdb_fill_temp_col(&tcol, sqlcol->name, col_size, col_type, is_fixed);
+		mdb_temp_table_add_col(ttable, &tcol);
+		sqlcol->disp_size = mdb_col_disp_size(&tcol);
+	}
+	mdb_temp_columns_end(ttable);
+
+	return 1;
+}
+/*
+ * Answer what can be answered without reading the table.
+ */
+static void
+mdb_sql_agg_shortcuts(MdbSQLAggState *st)
+{
+	MdbSQL *sql = st->sql;
+	MdbTableDef *table = st->table;
+	MdbSQLColumn *sqlcol;
+	MdbSQLAggValue *v;
+	guint32 pg;
+	guint16 row;
+	unsigned int i;
+
+	if (st->group_cols->len || table->sarg_tree)
+		return;
+	v = ((MdbSQLGroup *) g_ptr_array_index(st->groups, 0))->values;
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (sqlcol->agg_func == MDB_SQL_COUNT && !st->cols[i]) {
+			v[i].count = table->num_rows;
+			st->done[i] = 1;
+		} else if ((sqlcol->agg_func == MDB_SQL_MIN || sqlcol->agg_func == MDB_SQL_MAX)
+		    && mdb_index_min_max(table, st->cols[i],
+		    sqlcol->agg_func == MDB_SQL_MAX, &pg, &row)) {
+			st->only = i;
+			mdb_read_pg(table->entry->mdb, pg);
+			if (mdb_read_row(table, row) && v[i].is_set)
+				st->done[i] = 1;
+			st->only = -1;
+		}
+	}
+}
+/*
+ * Check that each SUM of integers fits the long integer it is returned as.
+ */
+static int
+mdb_sql_agg_check(MdbSQLAggState *st)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLGroup *group;
+	MdbSQLAggValue *v;
+	unsigned int g, i;
+
+	for (i=0;i<st->num_columns;i++) {
+		if (st->funcs[i] != MDB_SQL_SUM ||
+		    mdb_sql_agg_class(st->cols[i]->col_type) != MDB_SQL_AGG_INT)
+			continue;
+		for (g=0;g<st->groups->len;g++) {
+			group = g_ptr_array_index(st->groups, g);
+			v = &group->values[i];
+			if (v->is_set && (v->i > G_MAXINT32 || v->i < G_MININT32)) {
+				mdb_sql_error(sql, "%s is too large for a long integer",
+					((MdbSQLColumn *) g_ptr_array_index(sql->columns, i))->name);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+/*
+ * Fill in the result row of the next group.
+ */
+static int
+mdb_sql_agg_next_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLAggState *st = data;
+	MdbSQLGroup *group;
+	MdbSQLAggValue *v;
+	unsigned char *buf;
+	unsigned int i;
+	int class;
+
+	if (st->next >= st->groups->len)
+		return 0;
+	group = g_ptr_array_index(st->groups, st->next++);
+	for (i=0;i<st->num_columns;i++) {
+		v = &group->values[i];
+		class = st->classes[i];
+		buf = st->bufs[i];
+		fields[i].value = buf;
+		switch (st->funcs[i]) {
+			case 0:
+				fields[i].is_null = v->is_null;
+				fields[i].value = v->raw_len ? v->raw : mdb_sql_agg_zero;
+				fields[i].siz = v->raw_len;
+				break;
+			case MDB_SQL_COUNT:
+				mdb_put_int32(buf, 0, v->count);
+				fields[i].siz = 4;
+				break;
+			case MDB_SQL_SUM:
+				if (!v->is_set) {
+					fields[i].is_null = 1;
+				} else if (class == MDB_SQL_AGG_DOUBLE) {
+					mdb_sql_agg_put_double(buf, v->d);
+					fields[i].siz = 8;
+				} else if (class == MDB_SQL_AGG_MONEY) {
+					mdb_put_int32(buf, 0, v->i & 0xffffffff);
+					mdb_put_int32(buf, 4, v->i >> 32);
+					fields[i].siz = 8;
+				} else {
+					/* checked by mdb_sql_agg_check() */
+					mdb_put_int32(buf, 0, v->i);
+					fields[i].siz = 4;
+				}
+				break;
+			case MDB_SQL_AVG:
+				if (!v->count)
+					fields[i].is_null = 1;
+				else if (class == MDB_SQL_AGG_DOUBLE)
+					mdb_sql_agg_put_double(buf, v->d / v->count);
+				else if (class == MDB_SQL_AGG_MONEY)
+					mdb_sql_agg_put_double(buf, v->i / 10000.0 / v->count);
+				else
+					mdb_sql_agg_put_double(buf, (double) v->i / v->count);
+				fields[i].siz = 8;
+				break;
+			case MDB_SQL_MIN:
+			case MDB_SQL_MAX:
+				fields[i].is_null = !v->is_set;
+				fields[i].value = v->is_set && v->raw_len ? v->raw : mdb_sql_agg_zero;
+				fields[i].siz = v->raw_len;
+				break;
+		}
+	}
+	return 1;
+}
+static void
+mdb_sql_agg_free(gpointer data)
+{
+	MdbSQLAggState *st = data;
+	MdbSQLGroup *group;
+	unsigned int i, j;
+
+	for (i=0;i<st->groups->len;i++) {
+		group = g_ptr_array_index(st->groups, i);
+		for (j=0;j<st->num_columns;j++) {
+			g_free(group->values[j].s);
+			g_free(group->values[j].raw);
+		}
+		g_free(group->values);
+		g_free(group->key);
+		g_free(group);
+	}
+	g_ptr_array_free(st->groups, TRUE);
+	g_hash_table_destroy(st->hash);
+	g_ptr_array_free(st->group_cols, TRUE);
+	g_byte_array_free(st->key, TRUE);
+	g_free(st->cols);
+	g_free(st->done);
+	g_free(st->funcs);
+	g_free(st->classes);
+	g_free(st);
+}
+/**
+ * mdb_sql_has_aggregates:
+ * @sql: MDB SQL object with a parsed query
+ *
+ * Returns: 1 if the query selects COUNT, SUM, MIN, MAX or AVG, else 0.
+ */
+int
+mdb_sql_has_aggregates(MdbSQL *sql)
+{
+	MdbSQLColumn *sqlcol;
+	unsigned int i;
+
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (sqlcol->agg_func)
+			return 1;
+	}
+	return 0;
+}
+/**
+ * mdb_sql_aggregate:
+ * @sql: MDB SQL object with a parsed query
+ * @table: the table selected from, with the where clause columns resolved
+ *
+ * Computes the aggregates and groups of the query and makes
+ * sql->cur_table an operator table returning them.  @table and the where
+ * clause are freed.  Called by mdb_sql_select().
+ *
+ * Returns: 1 on success, 0 on failure with the error set in @sql.
+ */
+int
+mdb_sql_aggregate(MdbSQL *sql, MdbTableDef *table)
+{
+	MdbSQLAggState *st;
+	MdbSQLColumn *sqlcol;
+	MdbTableDef *ttable;
+	unsigned int i;
+	int ret = 1, scanned = 0;
+	gint64 start = g_get_monotonic_time();
+
+	table->sarg_tree = sql->sarg_tree;
+	sql->sarg_tree = NULL;
+	if (table->sarg_tree)
+		mdb_sql_walk_tree(table->sarg_tree, mdb_find_needed_cols, table);
+	if (sql->all_columns) {
+		mdb_sql_error(sql, "* can't be selected with aggregates or GROUP BY");
+		ret = 0;
+	} else if (sql->params->len) {
+		mdb_sql_error(sql, "Parameters can't be used with aggregates or GROUP BY");
+		ret = 0;
+	} else if (sql->num_columns > MDB_MAX_COLS) {
+		mdb_sql_error(sql, "Too many columns");
+		ret = 0;
+	}
+	if (!ret) {
+		if (table->sarg_tree)
+			mdb_sql_free_tree(table->sarg_tree);
+		mdb_free_tabledef(table);
+		return 0;
+	}
+
+	st = g_malloc0(sizeof(MdbSQLAggState));
+	st->sql = sql;
+	st->table = table;
+	st->cols = g_malloc0(sql->num_columns * sizeof(MdbColumn *));
+	st->done = g_malloc0(sql->num_columns * sizeof(int));
+	st->only = -1;
+	st->group_cols = g_ptr_array_new();
+	st->hash = g_hash_table_new(mdb_sql_group_hash, mdb_sql_group_equal);
+	st->groups = g_ptr_array_new();
+	st->key = g_byte_array_new();
+	st->num_columns = sql->num_columns;
+	st->funcs = g_malloc0(sql->num_columns * sizeof(int));
+	st->classes = g_malloc0(sql->num_columns * sizeof(int));
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		st->funcs[i] = sqlcol->agg_func;
+	}
+
+	ttable = mdb_create_op_table(sql->mdb, "#aggregate",
+		mdb_sql_agg_next_row, st, mdb_sql_agg_free);
+	ret = mdb_sql_agg_columns(st, ttable);
+	if (ret) {
+		/* without GROUP BY there is one result row, even for no rows */
+		if (!st->group_cols->len)
+			mdb_sql_agg_new_group(st, NULL);
+		table->row_func = mdb_sql_agg_row;
+		table->row_data = st;
+		mdb_sql_agg_shortcuts(st);
+		for (i=0;i<sql->num_columns && st->done[i];i++)
+			;
+		if (i < sql->num_columns) {
+			if (table->sarg_tree)
+				mdb_sql_walk_tree(table->sarg_tree, mdb_find_indexable_sargs, NULL);
+			mdb_rewind_table(table);
+			mdb_index_scan_init(sql->mdb, table);
+			mdb_sql_plan_scan(sql, table);
+			scanned = 1;
+			while (!mdb_sql_plan_only(sql) && mdb_fetch_row(table))
+				;
+			mdb_index_scan_free(table);
+		}
+		table->row_func = NULL;
+		ret = mdb_sql_agg_check(st);
+	}
+	if (ret && st->group_cols->len)
+		mdb_sql_plan_op(sql, ttable, scanned, start,
+			"Hash aggregate on %u columns", st->group_cols->len);
+	else if (ret)
+		mdb_sql_plan_op(sql, ttable, scanned, start, scanned ? "Aggregate"
+			: "Aggregate from table statistics and indexes");
+	/* the columns go with the table */
+	for (i=0;i<sql->num_columns;i++) {
+		if (st->cols[i])
+			st->classes[i] = mdb_sql_agg_class(st->cols[i]->col_type);
+		st->cols[i] = NULL;
+	}
+	st->table = NULL;
+	if (ret)
+		sql->cur_table = ttable;
+	else
+		mdb_free_tabledef(ttable);
+
+	if (table->sarg_tree)
+		mdb_sql_free_tree(table->sarg_tree);
+	mdb_free_tabledef(table);
+
+	return ret;
+}
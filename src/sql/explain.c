@@ -0,0 +1,326 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * EXPLAIN and EXPLAIN ANALYZE.
+ *
+ * While a query is explained, each table read and each operator records a
+ * step of the plan as it is set up.  Like the sarg tree, the plan builds
+ * bottom up on a stack: a table read pushes a step, and an operator pops
+ * the steps of its inputs and pushes its own.  The step's stats are
+ * counted into by mdb_fetch_row() for its table.
+ *
+ * Plain EXPLAIN sets the query up without reading anything the operators
+ * would have read while being set up, such as the rows to sort.  EXPLAIN
+ * ANALYZE runs the query to the end and adds what each step did, and the
+ * pages read.  Either way sql->cur_table becomes an operator table
+ * returning the lines of the plan.
+ */
+#include "mdbsql.h"
+#include <stdarg.h>
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+static MdbSQLPlanStep *
+mdb_sql_plan_top(MdbSQL *sql)
+{
+	GList *glist = g_list_last(sql->plan_stack);
+
+	return glist ? glist->data : NULL;
+}
+static void
+mdb_sql_plan_push(MdbSQL *sql, MdbSQLPlanStep *step)
+{
+	sql->plan_stack = g_list_append(sql->plan_stack, step);
+}
+static MdbSQLPlanStep *
+mdb_sql_plan_pop(MdbSQL *sql)
+{
+	MdbSQLPlanStep *step = mdb_sql_plan_top(sql);
+
+	if (step)
+		sql->plan_stack = g_list_remove(sql->plan_stack, step);
+	return step;
+}
+static void
+mdb_sql_plan_free_step(MdbSQLPlanStep *step)
+{
+	unsigned int i;
+
+	for (i=0;i<step->children->len;i++)
+		mdb_sql_plan_free_step(g_ptr_array_index(step->children, i));
+	g_ptr_array_free(step->children, TRUE);
+	g_free(step->desc);
+	g_free(step);
+}
+static MdbSQLPlanStep *
+mdb_sql_plan_new_step(gconstpointer table, char *desc)
+{
+	MdbSQLPlanStep *step;
+
+	step = g_malloc0(sizeof(MdbSQLPlanStep));
+	step->children = g_ptr_array_new();
+	step->table = table;
+	step->desc = desc;
+	return step;
+}
+/**
+ * mdb_sql_plan_scan:
+ * @sql: MDB SQL object explaining a query
+ * @table: a table whose index scan has been set up
+ *
+ * Records how @table will be read.  Called again for the same table, as
+ * when it is then read in index order, the step is described again.
+ */
+void
+mdb_sql_plan_scan(MdbSQL *sql, MdbTableDef *table)
+{
+	MdbSQLPlanStep *step;
+	GString *desc;
+	int cost;
+
+	if (!sql->explain)
+		return;
+	desc = g_string_new(NULL);
+	switch (table->strategy) {
+		case MDB_INDEX_SCAN:
+			g_string_printf(desc, "Index scan of %s using %s",
+				table->name, table->scan_idx->name);
+			if ((cost = mdb_index_compute_cost(table, table->scan_idx)))
+				g_string_append_printf(desc, ", cost %d", cost);
+			if (table->keep_order)
+				g_string_append(desc, ", in key order");
+			break;
+		case MDB_BITMAP_SCAN:
+			g_string_printf(desc, "Bitmap scan of %s, %u of %u rows",
+				table->name, table->batch_sz, table->num_rows);
+			break;
+		default:
+			g_string_printf(desc, "Table scan of %s, %u rows",
+				table->name, table->num_rows);
+			break;
+	}
+	if (table->sarg_tree)
+		g_string_append(desc, ", filtered");
+
+	step = mdb_sql_plan_top(sql);
+	if (step && step->table == table) {
+		g_free(step->desc);
+		step->desc = g_string_free(desc, FALSE);
+		return;
+	}
+	step = mdb_sql_plan_new_step(table, g_string_free(desc, FALSE));
+	table->stats = &step->stats;
+	mdb_sql_plan_push(sql, step);
+}
+/**
+ * mdb_sql_plan_op:
+ * @sql: MDB SQL object explaining a query
+ * @ttable: the operator table
+ * @num_inputs: how many of the last steps recorded it reads from
+ * @start: g_get_monotonic_time() when the operator began to be set up,
+ * so the work done then counts as its own
+ * @fmt: printf style description of the operator
+ *
+ * Records an operator reading from the last @num_inputs steps.
+ */
+void
+mdb_sql_plan_op(MdbSQL *sql, MdbTableDef *ttable, int num_inputs, gint64 start, char *fmt, ...)
+{
+	MdbSQLPlanStep *step, *input;
+	va_list ap;
+	int i;
+
+	if (!sql->explain)
+		return;
+	va_start(ap, fmt);
+	step = mdb_sql_plan_new_step(ttable, g_strdup_vprintf(fmt, ap));
+	va_end(ap);
+	g_ptr_array_set_size(step->children, num_inputs);
+	for (i=num_inputs-1;i>=0;i--) {
+		if (!(input = mdb_sql_plan_pop(sql))) {
+			g_ptr_array_remove_index(step->children, i);
+			continue;
+		}
+		g_ptr_array_index(step->children, i) = input;
+	}
+	step->stats.usecs = g_get_monotonic_time() - start;
+	ttable->stats = &step->stats;
+	mdb_sql_plan_push(sql, step);
+}
+void
+mdb_sql_free_plan(MdbSQL *sql)
+{
+	GList *glist;
+
+	for (glist = sql->plan_stack; glist; glist = glist->next)
+		mdb_sql_plan_free_step(glist->data);
+	g_list_free(sql->plan_stack);
+	sql->plan_stack = NULL;
+	sql->explain = 0;
+}
+static void
+mdb_sql_plan_lines(MdbSQLPlanStep *step, int depth, int analyze, GPtrArray *lines)
+{
+	GString *line;
+	unsigned int i;
+
+	line = g_string_new(NULL);
+	for (i=0;i<(unsigned int)depth;i++)
+		g_string_append(line, "  ");
+	if (depth)
+		g_string_append(line, "-> ");
+	g_string_append(line, step->desc);
+	if (analyze) {
+		g_string_append_printf(line, " (rows %lu, examined %lu, %.3f ms)",
+			step->stats.rows_returned, step->stats.rows_examined,
+			step->stats.usecs / 1000.0);
+	}
+	g_ptr_array_add(lines, g_string_free(line, FALSE));
+	for (i=0;i<step->children->len;i++)
+		mdb_sql_plan_lines(g_ptr_array_index(step->children, i),
+			depth + 1, analyze, lines);
+}
+/* the rows of an explained query, one per line of the plan */
+typedef struct {
+	MdbHandle *mdb;
+	GPtrArray *lines;
+	unsigned int i;
+	gchar line[1024];
+} MdbSQLExplainState;
+
+static int
+mdb_sql_explain_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLExplainState *st = data;
+
+	if (st->i >= st->lines->len)
+		return 0;
+	fields[0].siz = mdb_ascii2unicode(st->mdb,
+		g_ptr_array_index(st->lines, st->i++), 0, st->line, sizeof(st->line));
+	fields[0].value = st->line;
+	return 1;
+}
+static void
+mdb_sql_explain_free(gpointer data)
+{
+	MdbSQLExplainState *st = data;
+	unsigned int i;
+
+	for (i=0;i<st->lines->len;i++)
+		g_free(g_ptr_array_index(st->lines, i));
+	g_ptr_array_free(st->lines, TRUE);
+	g_free(st);
+}
+/**
+ * mdb_sql_explain:
+ * @sql: MDB SQL object with a parsed SELECT
+ * @mode: MDB_SQL_EXPLAIN or MDB_SQL_EXPLAIN_ANALYZE
+ *
+ * Sets up the query like mdb_sql_select() and replaces it with an
+ * operator table returning its plan.  With MDB_SQL_EXPLAIN_ANALYZE the
+ * query is run first, and the lines tell the rows each step returned and
+ * examined, the time spent in it (including its inputs), and the pages
+ * read.
+ */
+void
+mdb_sql_explain(MdbSQL *sql, int mode)
+{
+	MdbHandle *mdb = sql->mdb;
+	MdbSQLExplainState *st;
+	MdbSQLPlanStep *root;
+	MdbStatistics before, after;
+	MdbTableDef *ttable;
+	GString *limit;
+	gint64 start = 0, usecs = 0;
+	unsigned long rows = 0;
+	int analyze = mode == MDB_SQL_EXPLAIN_ANALYZE, collect = 0;
+
+	if (!mdb) {
+		mdb_sql_error(sql, "You must connect to a database first");
+		return;
+	}
+	if (sql->params->len) {
+		mdb_sql_error(sql, "Parameters can't be used with EXPLAIN");
+		mdb_sql_reset(sql);
+		return;
+	}
+	if (analyze) {
+		collect = mdb->f->stats && mdb->f->stats->collect;
+		mdb_stats_on(mdb);
+		before = *mdb->stats;
+		start = g_get_monotonic_time();
+	}
+	sql->explain = mode;
+	mdb_sql_select(sql);
+	if (sql->cur_table && analyze) {
+		while (mdb_fetch_row(sql->cur_table))
+			rows++;
+	}
+	if (analyze) {
+		usecs = g_get_monotonic_time() - start;
+		after = *mdb->stats;
+		if (!collect)
+			mdb_stats_off(mdb);
+	}
+	if (!sql->cur_table)
+		return;
+
+	root = mdb_sql_plan_pop(sql);
+	if (root && (sql->max_rows >= 0 || sql->offset)) {
+		limit = g_string_new(root->desc);
+		if (sql->max_rows >= 0)
+			g_string_append_printf(limit, ", limit %ld", sql->max_rows);
+		if (sql->offset)
+			g_string_append_printf(limit, ", offset %ld", sql->offset);
+		g_free(root->desc);
+		root->desc = g_string_free(limit, FALSE);
+	}
+	st = g_malloc0(sizeof(MdbSQLExplainState));
+	st->mdb = mdb;
+	st->lines = g_ptr_array_new();
+	if (root) {
+		mdb_sql_plan_lines(root, 0, analyze, st->lines);
+		mdb_sql_plan_free_step(root);
+	}
+	if (analyze) {
+		g_ptr_array_add(st->lines, g_strdup_printf("Rows returned: %lu", rows));
+		g_ptr_array_add(st->lines, g_strdup_printf(
+			"Pages read: %lu (data %lu, index %lu, LVAL %lu, map %lu)",
+			after.pg_reads - before.pg_reads,
+			after.data_pg_reads - before.data_pg_reads,
+			after.index_pg_reads - before.index_pg_reads,
+			after.lval_pg_reads - before.lval_pg_reads,
+			after.map_pg_reads - before.map_pg_reads));
+		g_ptr_array_add(st->lines, g_strdup_printf(
+			"Pages found in memory: %lu", after.pg_hits - before.pg_hits));
+		g_ptr_array_add(st->lines, g_strdup_printf("Total time: %.3f ms",
+			usecs / 1000.0));
+	}
+
+	/* the query's tables and columns are done with */
+	mdb_sql_reset(sql);
+
+	ttable = mdb_create_op_table(mdb, "#explain", mdb_sql_explain_row,
+		st, mdb_sql_explain_free);
+	mdb_sql_add_temp_col(sql, ttable, 0, "QUERY PLAN", MDB_TEXT, 100, 0);
+	mdb_temp_columns_end(ttable);
+	sql->cur_table = ttable;
+}
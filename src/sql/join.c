@@ -0,0 +1,958 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Joins of two tables on equal columns, run as hash joins.
+ *
+ * The conditions of the where clause that only use one table are moved
+ * into that table's sarg tree, so they are tested (and indexes used) while
+ * it is read.  For a left join the ones on the right table are tested on
+ * the joined rows instead, as the SQL standard wants.
+ *
+ * One side, the smaller table of an inner join or the right table of a
+ * left join, is read first and its rows are kept in memory in a hash
+ * table on the join columns.  The other side is then read as the joined
+ * rows are fetched, and each of its rows looked up.  When the kept rows
+ * grow past MDB_SQL_JOIN_MEM, both sides are split by hash into
+ * MDB_SQL_JOIN_PARTS temporary files instead, and each pair of files is
+ * joined in turn once the other side has been read.
+ *
+ * Each row is kept as a record:
+ *
+ *   4 bytes  size of the record
+ *   4 bytes  hash of the key
+ *   4 bytes  size of the key
+ *   key      the join columns, each a 4 byte size and the value as
+ *            mdb_sql_join_add_key() puts it
+ *   the columns kept, each a null flag, a 4 byte size and the data
+ *
+ * sql->cur_table becomes an operator table handing out the joined rows.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_SQL_JOIN_MEM (32 * 1024 * 1024)
+#define MDB_SQL_JOIN_PARTS 16
+#define MDB_SQL_JOIN_HDR 12
+
+/* where the probe records come from */
+#define MDB_SQL_JOIN_PROBE_TABLE 1
+#define MDB_SQL_JOIN_PROBE_PARTS 2
+#define MDB_SQL_JOIN_PROBE_DONE  3
+
+typedef struct {
+	MdbSQLTable *sql_tab;
+	MdbTableDef *table;
+	GPtrArray *keys;	/* MdbColumn * of the join columns */
+	GArray *cols;		/* indexes of the columns kept */
+	MdbSargNode *tree;	/* where clause conditions on this side */
+} MdbSQLJoinSide;
+
+typedef struct {
+	MdbSQL *sql;
+	MdbSQLJoinSide side[2];
+	int build;		/* the side kept in memory */
+	MdbSargNode *filter;	/* conditions tested on the joined rows */
+	int left;		/* a left join */
+	unsigned int num_out;
+	int *out_side;		/* side and kept column of each result column */
+	int *out_col;
+	/* the kept rows */
+	GByteArray *recs;
+	GArray *offsets;
+	guint32 *buckets;
+	guint32 *next;
+	guint32 mask;
+	FILE *parts[2][MDB_SQL_JOIN_PARTS];
+	int spilled;
+	GByteArray *rec;	/* the row being read */
+	/* the probe record being joined */
+	int phase;		/* 0 until the probe table is being read */
+	int part;
+	int pending;		/* st->rec is a probe record still to join */
+	int has_key;
+	guint32 match;		/* the next kept record to try, 0 for none */
+	int matched;
+	MdbField fields[2][256];
+	int failed;
+} MdbSQLJoinState;
+
+static unsigned char mdb_sql_join_zero[16];
+
+/**
+ * mdb_sql_set_join_type:
+ * @sql: MDB SQL object being parsed
+ * @join_type: MDB_SQL_INNER_JOIN or MDB_SQL_LEFT_JOIN
+ *
+ * Called by the parser for a join of the two tables added last.
+ */
+static MdbSQLJoin *
+mdb_sql_get_join(MdbSQL *sql)
+{
+	if (!sql->join) {
+		sql->join = g_malloc0(sizeof(MdbSQLJoin));
+		sql->join->keys1 = g_ptr_array_new();
+		sql->join->keys2 = g_ptr_array_new();
+	}
+	return sql->join;
+}
+void
+mdb_sql_set_join_type(MdbSQL *sql, int join_type)
+{
+	mdb_sql_get_join(sql)->join_type = join_type;
+}
+/**
+ * mdb_sql_add_join_key:
+ * @sql: MDB SQL object being parsed
+ * @col1: a column of one of the tables
+ * @col2: the column of the other table it has to equal
+ *
+ * Called by the parser for each condition of the ON clause.
+ */
+void
+mdb_sql_add_join_key(MdbSQL *sql, char *col1, char *col2)
+{
+	MdbSQLJoin *join = mdb_sql_get_join(sql);
+
+	g_ptr_array_add(join->keys1, g_strdup(col1));
+	g_ptr_array_add(join->keys2, g_strdup(col2));
+}
+void
+mdb_sql_free_join(MdbSQLJoin *join)
+{
+	unsigned int i;
+
+	if (!join) return;
+	for (i=0;i<join->keys1->len;i++) {
+		g_free(g_ptr_array_index(join->keys1, i));
+		g_free(g_ptr_array_index(join->keys2, i));
+	}
+	g_ptr_array_free(join->keys1, TRUE);
+	g_ptr_array_free(join->keys2, TRUE);
+	g_free(join);
+}
+/*
+ * Find the column name refers to, either table.column (table being the
+ * alias if there is one) or a column only one of the tables has.
+ */
+static MdbColumn *
+mdb_sql_join_find_col(MdbSQLJoinState *st, char *name, int *side)
+{
+	MdbSQLJoinSide *js;
+	MdbColumn *col, *found = NULL;
+	char *colname, *dot;
+	const char *tabname;
+	unsigned int i;
+	int s, len = 0;
+
+	colname = name;
+	if ((dot = strchr(name, '.'))) {
+		colname = dot + 1;
+		len = dot - name;
+	}
+	for (s=0;s<2;s++) {
+		js = &st->side[s];
+		tabname = js->sql_tab->alias ? js->sql_tab->alias : js->sql_tab->name;
+		if (dot && (strlen(tabname) != (size_t) len ||
+		    strncasecmp(tabname, name, len)))
+			continue;
+		for (i=0;i<js->table->num_cols;i++) {
+			col = g_ptr_array_index(js->table->columns, i);
+			if (strcasecmp(col->name, colname))
+				continue;
+			if (found) {
+				mdb_sql_error(st->sql, "Column %s is ambiguous", name);
+				return NULL;
+			}
+			found = col;
+			*side = s;
+		}
+	}
+	if (!found)
+		mdb_sql_error(st->sql, "Column %s not found", name);
+	return found;
+}
+/*
+ * Keep column col of side s, returning its place among the kept columns.
+ */
+static int
+mdb_sql_join_keep_col(MdbSQLJoinState *st, int s, MdbColumn *col)
+{
+	GArray *cols = st->side[s].cols;
+	unsigned int i;
+	int idx;
+
+	for (i=0;i<cols->len;i++) {
+		idx = g_array_index(cols, int, i);
+		if (g_ptr_array_index(st->side[s].table->columns, idx) == col)
+			return i;
+	}
+	for (i=0;i<st->side[s].table->num_cols;i++) {
+		if (g_ptr_array_index(st->side[s].table->columns, i) == col)
+			break;
+	}
+	idx = i;
+	g_array_append_val(cols, idx);
+	return cols->len - 1;
+}
+static MdbSargNode *
+mdb_sql_join_and(MdbSargNode *tree, MdbSargNode *node)
+{
+	MdbSargNode *and;
+
+	if (!tree)
+		return node;
+	and = mdb_sql_alloc_node();
+	and->op = MDB_AND;
+	and->left = tree;
+	and->right = node;
+	return and;
+}
+/*
+ * split the where clause at its top level ANDs
+ */
+static void
+mdb_sql_join_conjuncts(MdbSargNode *node, GPtrArray *conj)
+{
+	if (node->op == MDB_AND) {
+		mdb_sql_join_conjuncts(node->left, conj);
+		mdb_sql_join_conjuncts(node->right, conj);
+		g_free(node);
+	} else {
+		g_ptr_array_add(conj, node);
+	}
+}
+typedef struct {
+	MdbSQLJoinState *st;
+	int sides;
+} MdbSQLJoinResolve;
+
+static int
+mdb_sql_join_resolve(MdbSargNode *node, gpointer data)
+{
+	MdbSQLJoinResolve *res = data;
+	int s;
+
+	if (!mdb_is_relational_op(node->op) || !node->parent)
+		return 0;
+	mdb_sql_set_sarg_col(node, mdb_sql_join_find_col(res->st, node->parent, &s));
+	if (!node->col) {
+		res->st->failed = 1;
+		return 0;
+	}
+	res->sides |= 1 << s;
+	if (res->st->sql->join->join_type == MDB_SQL_LEFT_JOIN && s == 1)
+		mdb_sql_join_keep_col(res->st, s, node->col);
+	return 0;
+}
+/*
+ * Move each condition of the where clause to the side it is about.
+ */
+static int
+mdb_sql_join_split_sargs(MdbSQLJoinState *st)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLJoinResolve res;
+	MdbSargNode *node;
+	GPtrArray *conj;
+	unsigned int i;
+	int s;
+
+	if (!sql->sarg_tree)
+		return 1;
+	conj = g_ptr_array_new();
+	mdb_sql_join_conjuncts(sql->sarg_tree, conj);
+	sql->sarg_tree = NULL;
+	for (i=0;i<conj->len;i++) {
+		node = g_ptr_array_index(conj, i);
+		res.st = st;
+		res.sides = 0;
+		mdb_sql_walk_tree(node, mdb_sql_join_resolve, &res);
+		if (res.sides == 3 && !st->failed) {
+			mdb_sql_error(sql, "Conditions on both tables belong in the ON clause");
+			st->failed = 1;
+		}
+		s = res.sides == 2 ? 1 : 0;
+		if (s == 1 && sql->join->join_type == MDB_SQL_LEFT_JOIN)
+			st->filter = mdb_sql_join_and(st->filter, node);
+		else
+			st->side[s].tree = mdb_sql_join_and(st->side[s].tree, node);
+	}
+	g_ptr_array_free(conj, TRUE);
+
+	return !st->failed;
+}
+/*
+ * Work out the result columns and add them to ttable.
+ */
+static int
+mdb_sql_join_columns(MdbSQLJoinState *st, MdbTableDef *ttable)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLColumn *sqlcol;
+	MdbColumn *col, tcol;
+	MdbSQLJoinSide *js;
+	char *name;
+	unsigned int i;
+	int s, other;
+
+	if (sql->all_columns) {
+		for (s=0;s<2;s++) {
+			js = &st->side[s];
+			for (i=0;i<js->table->num_cols;i++) {
+				col = g_ptr_array_index(js->table->columns, i);
+				/* qualify the names both tables have */
+				if (mdb_sql_join_find_col(st, col->name, &other)) {
+					mdb_sql_add_column(sql, col->name);
+				} else {
+					name = g_strdup_printf("%s.%s", js->sql_tab->alias ?
+						js->sql_tab->alias : js->sql_tab->name, col->name);
+					mdb_sql_add_column(sql, name);
+					g_free(name);
+				}
+			}
+		}
+		sql->error_msg[0] = '\0';
+	}
+	st->num_out = sql->num_columns;
+	st->out_side = g_malloc(sql->num_columns * sizeof(int));
+	st->out_col = g_malloc(sql->num_columns * sizeof(int));
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!(col = mdb_sql_join_find_col(st, sqlcol->name, &s)))
+			return 0;
+		if (col->col_type == MDB_OLE) {
+			mdb_sql_error(sql, "OLE column %s can't be joined", sqlcol->name);
+			return 0;
+		}
+		st->out_side[i] = s;
+		st->out_col[i] = mdb_sql_join_keep_col(st, s, col);
+		mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size,
+			col->col_type, col->is_fixed);
+		mdb_temp_table_add_col(ttable, &tcol);
+		sqlcol->disp_size = mdb_col_disp_size(col);
+	}
+	mdb_temp_columns_end(ttable);
+
+	return 1;
+}
+/*
+ * The type a join column is compared as: numbers of any type are compared
+ * as numbers, other columns only with columns of their own type.
+ */
+static int
+mdb_sql_join_key_type(MdbColumn *col)
+{
+	switch (col->col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_MONEY:
+			return MDB_DOUBLE;
+		default:
+			return col->col_type;
+	}
+}
+/*
+ * Match the ON clause columns up with the tables.
+ */
+static int
+mdb_sql_join_keys(MdbSQLJoinState *st)
+{
+	MdbSQLJoin *join = st->sql->join;
+	MdbColumn *col1, *col2;
+	unsigned int i;
+	int s1, s2;
+
+	for (i=0;i<join->keys1->len;i++) {
+		col1 = mdb_sql_join_find_col(st, g_ptr_array_index(join->keys1, i), &s1);
+		col2 = mdb_sql_join_find_col(st, g_ptr_array_index(join->keys2, i), &s2);
+		if (!col1 || !col2)
+			return 0;
+		if (s1 == s2) {
+			mdb_sql_error(st->sql, "ON needs a column of each table");
+			return 0;
+		}
+		if (col1->col_type == MDB_MEMO || col1->col_type == MDB_OLE ||
+		    col1->col_type == MDB_BOOL || col2->col_type == MDB_MEMO ||
+		    col2->col_type == MDB_OLE || col2->col_type == MDB_BOOL) {
+			mdb_sql_error(st->sql, "Can't join on %s", col1->name);
+			return 0;
+		}
+		if (mdb_sql_join_key_type(col1) != mdb_sql_join_key_type(col2) ||
+		    (col1->col_type == MDB_NUMERIC && col1->col_scale != col2->col_scale)) {
+			mdb_sql_error(st->sql, "Can't join %s to %s, their types differ",
+				col1->name, col2->name);
+			return 0;
+		}
+		g_ptr_array_add(st->side[s1].keys, col1);
+		g_ptr_array_add(st->side[s2].keys, col2);
+	}
+	return 1;
+}
+/*
+ * Append the value of join column col to rec, in a form that is the same
+ * for equal values of the columns it can be joined to: numbers as doubles,
+ * text as it reads, and anything else as it is stored.
+ */
+static void
+mdb_sql_join_add_key(GByteArray *rec, MdbHandle *mdb, MdbColumn *col, MdbField *f)
+{
+	unsigned char size[4];
+	char text[MDB_BIND_SIZE];
+	void *value = f->value;
+	gint64 money;
+	double d = 0;
+	int len = f->siz;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			d = mdb_get_byte(f->value, 0);
+			break;
+		case MDB_INT:
+			d = (gint16) mdb_get_int16(f->value, 0);
+			break;
+		case MDB_LONGINT:
+			d = (gint32) mdb_get_int32(f->value, 0);
+			break;
+		case MDB_FLOAT:
+			d = mdb_get_single(f->value, 0);
+			break;
+		case MDB_DOUBLE:
+			d = mdb_get_double(f->value, 0);
+			break;
+		case MDB_MONEY:
+			/* a 64 bit integer of 1/10000ths */
+			money = (gint64) (gint32) mdb_get_int32(f->value, 4) * ((gint64) 1 << 32)
+				+ (guint32) mdb_get_int32(f->value, 0);
+			d = money / 10000.0;
+			break;
+		case MDB_TEXT:
+			len = mdb_unicode2ascii(mdb, f->value, f->siz, text, sizeof(text) - 1);
+			value = text;
+			break;
+	}
+	if (mdb_sql_join_key_type(col) == MDB_DOUBLE) {
+		/* so that -0 matches 0 */
+		if (d == 0)
+			d = 0;
+		value = &d;
+		len = sizeof(d);
+	}
+	mdb_put_int32(size, 0, len);
+	g_byte_array_append(rec, size, 4);
+	g_byte_array_append(rec, value, len);
+}
+/*
+ * Turn the row of side s into a record in st->rec.  Returns 0 if one of
+ * the join columns is null, so the row can't match anything.
+ */
+static int
+mdb_sql_join_encode(MdbSQLJoinState *st, int s, MdbField *fields)
+{
+	MdbSQLJoinSide *js = &st->side[s];
+	MdbHandle *mdb = js->table->entry->mdb;
+	GByteArray *rec = st->rec;
+	unsigned char hdr[MDB_SQL_JOIN_HDR], null;
+	MdbColumn *col;
+	MdbField *f;
+	unsigned int i;
+	int null_key = 0;
+
+	g_byte_array_set_size(rec, MDB_SQL_JOIN_HDR);
+	for (i=0;i<js->keys->len;i++) {
+		col = g_ptr_array_index(js->keys, i);
+		f = &fields[col->col_num];
+		if (f->is_null) {
+			null_key = 1;
+			continue;
+		}
+		mdb_sql_join_add_key(rec, mdb, col, f);
+	}
+	mdb_put_int32(hdr, 8, rec->len - MDB_SQL_JOIN_HDR);
+	mdb_put_int32(hdr, 4, mdb_sql_hash(rec->data + MDB_SQL_JOIN_HDR,
+		rec->len - MDB_SQL_JOIN_HDR));
+	for (i=0;i<js->cols->len;i++) {
+		f = &fields[g_array_index(js->cols, int, i)];
+		null = f->is_null;
+		g_byte_array_append(rec, &null, 1);
+		mdb_put_int32(hdr, 0, null ? 0 : f->siz);
+		g_byte_array_append(rec, hdr, 4);
+		if (!null)
+			g_byte_array_append(rec, f->value, f->siz);
+	}
+	mdb_put_int32(hdr, 0, rec->len);
+	memcpy(rec->data, hdr, MDB_SQL_JOIN_HDR);
+
+	return !null_key;
+}
+/*
+ * Unpack the kept columns of a record of side s into fields, by column
+ * index, with no record meaning a row of nulls.
+ */
+static void
+mdb_sql_join_decode(MdbSQLJoinState *st, int s, unsigned char *rec, MdbField *fields)
+{
+	MdbSQLJoinSide *js = &st->side[s];
+	MdbColumn *col;
+	unsigned char *p = NULL;
+	unsigned int i;
+	int idx;
+
+	if (rec)
+		p = rec + MDB_SQL_JOIN_HDR + mdb_get_int32(rec, 8);
+	for (i=0;i<js->cols->len;i++) {
+		idx = g_array_index(js->cols, int, i);
+		col = g_ptr_array_index(js->table->columns, idx);
+		memset(&fields[idx], 0, sizeof(MdbField));
+		fields[idx].colnum = col->col_num;
+		fields[idx].is_fixed = col->is_fixed;
+		if (!p || p[0]) {
+			fields[idx].is_null = 1;
+			fields[idx].value = mdb_sql_join_zero;
+		} else {
+			fields[idx].siz = mdb_get_int32(p, 1);
+			fields[idx].value = p + 5;
+		}
+		if (p)
+			p += 5 + mdb_get_int32(p, 1);
+	}
+}
+/*
+ * Fill in the joined row of the two records, build_rec being NULL for a
+ * left join row without a match.  Returns 0 if the filter rejects it.
+ */
+static int
+mdb_sql_join_row(MdbSQLJoinState *st, unsigned char *probe_rec, unsigned char *build_rec, MdbField *out)
+{
+	MdbField *f;
+	unsigned int i;
+	int b = st->build;
+
+	mdb_sql_join_decode(st, b, build_rec, st->fields[b]);
+	mdb_sql_join_decode(st, !b, probe_rec, st->fields[!b]);
+	if (st->filter && !mdb_test_sarg_node(st->side[1].table->entry->mdb,
+	    st->filter, st->fields[1], st->side[1].table->num_cols))
+		return 0;
+	for (i=0;i<st->num_out;i++) {
+		f = &st->fields[st->out_side[i]][g_array_index(st->side[st->out_side[i]].cols,
+			int, st->out_col[i])];
+		out[i].is_null = f->is_null;
+		out[i].value = f->value;
+		out[i].siz = f->siz;
+	}
+	return 1;
+}
+/*
+ * Index the records in st->recs by hash.
+ */
+static void
+mdb_sql_join_hash_recs(MdbSQLJoinState *st)
+{
+	guint32 i, n = 16, h;
+
+	g_array_set_size(st->offsets, 0);
+	for (i=0;i<st->recs->len;i+=mdb_get_int32(st->recs->data, i))
+		g_array_append_val(st->offsets, i);
+	while (n < st->offsets->len * 2)
+		n *= 2;
+	st->mask = n - 1;
+	g_free(st->buckets);
+	g_free(st->next);
+	st->buckets = g_malloc0(n * sizeof(guint32));
+	st->next = g_malloc(MAX(st->offsets->len, 1) * sizeof(guint32));
+	for (i=0;i<st->offsets->len;i++) {
+		h = mdb_get_int32(st->recs->data, g_array_index(st->offsets, guint32, i) + 4);
+		h = (h / MDB_SQL_JOIN_PARTS) & st->mask;
+		st->next[i] = st->buckets[h];
+		st->buckets[h] = i + 1;
+	}
+}
+/*
+ * Start joining the probe record in st->rec.
+ */
+static void
+mdb_sql_join_start_probe(MdbSQLJoinState *st)
+{
+	guint32 h = mdb_get_int32(st->rec->data, 4);
+
+	st->match = st->has_key ?
+		st->buckets[(h / MDB_SQL_JOIN_PARTS) & st->mask] : 0;
+	st->matched = 0;
+	st->pending = 1;
+}
+/*
+ * Join the probe record in st->rec with the next kept record it matches,
+ * or for a left join with nulls if it matches none.  Returns 0 when there
+ * are no more.
+ */
+static int
+mdb_sql_join_next_match(MdbSQLJoinState *st, MdbField *out)
+{
+	unsigned char *rec = st->rec->data, *build_rec;
+	guint32 h, key_len;
+
+	key_len = mdb_get_int32(rec, 8);
+	h = mdb_get_int32(rec, 4);
+	while (st->match) {
+		build_rec = st->recs->data + g_array_index(st->offsets, guint32, st->match-1);
+		st->match = st->next[st->match-1];
+		if (mdb_get_int32(build_rec, 4) != h ||
+		    mdb_get_int32(build_rec, 8) != key_len ||
+		    memcmp(build_rec + MDB_SQL_JOIN_HDR, rec + MDB_SQL_JOIN_HDR, key_len))
+			continue;
+		st->matched = 1;
+		if (mdb_sql_join_row(st, rec, build_rec, out))
+			return 1;
+	}
+	if (!st->matched && st->left) {
+		st->matched = 1;
+		return mdb_sql_join_row(st, rec, NULL, out);
+	}
+	return 0;
+}
+static int
+mdb_sql_join_write(MdbSQLJoinState *st, int s, unsigned char *rec)
+{
+	guint32 len = mdb_get_int32(rec, 0);
+	FILE *part;
+
+	part = st->parts[s][mdb_get_int32(rec, 4) % MDB_SQL_JOIN_PARTS];
+	if (fwrite(rec, len, 1, part) != 1) {
+		mdb_sql_error(st->sql, "Can't write join temp file");
+		st->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Too many rows to keep: move them to the partition files.
+ */
+static int
+mdb_sql_join_spill(MdbSQLJoinState *st)
+{
+	guint32 i;
+	int s, p;
+
+	for (s=0;s<2;s++) {
+		for (p=0;p<MDB_SQL_JOIN_PARTS;p++) {
+			if (!(st->parts[s][p] = tmpfile())) {
+				mdb_sql_error(st->sql, "Can't create join temp file");
+				st->failed = 1;
+				return 0;
+			}
+		}
+	}
+	st->spilled = 1;
+	for (i=0;i<st->recs->len;i+=mdb_get_int32(st->recs->data, i)) {
+		if (!mdb_sql_join_write(st, st->build, st->recs->data + i))
+			return 0;
+	}
+	g_byte_array_set_size(st->recs, 0);
+	return 1;
+}
+static void
+mdb_sql_join_build_row(MdbTableDef *table, MdbField *fields, int num_fields, gpointer data)
+{
+	MdbSQLJoinState *st = data;
+
+	if (st->failed || !mdb_sql_join_encode(st, st->build, fields))
+		return;
+	if (st->spilled) {
+		mdb_sql_join_write(st, st->build, st->rec->data);
+		return;
+	}
+	g_byte_array_append(st->recs, st->rec->data, st->rec->len);
+	if (st->recs->len > MDB_SQL_JOIN_MEM)
+		mdb_sql_join_spill(st);
+}
+static void
+mdb_sql_join_probe_row(MdbTableDef *table, MdbField *fields, int num_fields, gpointer data)
+{
+	MdbSQLJoinState *st = data;
+
+	if (st->failed)
+		return;
+	st->has_key = mdb_sql_join_encode(st, !st->build, fields);
+	if (st->spilled && st->has_key)
+		mdb_sql_join_write(st, !st->build, st->rec->data);
+	else
+		mdb_sql_join_start_probe(st);
+}
+/*
+ * Tell the table of side s which of its columns are looked at.
+ */
+static void
+mdb_sql_join_need_cols(MdbSQLJoinState *st, int s)
+{
+	MdbSQLJoinSide *js = &st->side[s];
+	unsigned int i;
+
+	for (i=0;i<js->keys->len;i++)
+		mdb_need_column(js->table, g_ptr_array_index(js->keys, i));
+	for (i=0;i<js->cols->len;i++)
+		mdb_need_column(js->table, g_ptr_array_index(js->table->columns,
+			g_array_index(js->cols, int, i)));
+	if (js->tree)
+		mdb_sql_walk_tree(js->tree, mdb_find_needed_cols, js->table);
+}
+/*
+ * Start reading side s, passing each of its rows that passes its sargs to
+ * func as it is fetched.
+ */
+static void
+mdb_sql_join_scan_begin(MdbSQLJoinState *st, int s, MdbRowFunc func)
+{
+	MdbTableDef *table = st->side[s].table;
+
+	table->sarg_tree = st->side[s].tree;
+	if (table->sarg_tree)
+		mdb_sql_walk_tree(table->sarg_tree, mdb_find_indexable_sargs, NULL);
+	mdb_sql_join_need_cols(st, s);
+	table->row_func = func;
+	table->row_data = st;
+	mdb_rewind_table(table);
+	mdb_index_scan_init(table->entry->mdb, table);
+	mdb_sql_plan_scan(st->sql, table);
+}
+static void
+mdb_sql_join_scan_end(MdbSQLJoinState *st, int s)
+{
+	MdbTableDef *table = st->side[s].table;
+
+	mdb_index_scan_free(table);
+	table->row_func = NULL;
+	table->sarg_tree = NULL;
+}
+/*
+ * Read all of side s.
+ */
+static int
+mdb_sql_join_scan(MdbSQLJoinState *st, int s, MdbRowFunc func)
+{
+	mdb_sql_join_scan_begin(st, s, func);
+	while (!st->failed && !mdb_sql_plan_only(st->sql) &&
+	    mdb_fetch_row(st->side[s].table))
+		;
+	mdb_sql_join_scan_end(st, s);
+
+	return !st->failed;
+}
+/*
+ * Move on to the next pair of partition files: keep the records of the
+ * build side's and start reading the probe side's.
+ */
+static int
+mdb_sql_join_next_part(MdbSQLJoinState *st)
+{
+	FILE *build;
+	long size;
+
+	if (++st->part >= MDB_SQL_JOIN_PARTS)
+		return 0;
+	build = st->parts[st->build][st->part];
+	size = ftell(build);
+	rewind(build);
+	g_byte_array_set_size(st->recs, size);
+	if (size && fread(st->recs->data, size, 1, build) != 1) {
+		mdb_sql_error(st->sql, "Can't read join temp file");
+		st->failed = 1;
+		return 0;
+	}
+	mdb_sql_join_hash_recs(st);
+	rewind(st->parts[!st->build][st->part]);
+	return 1;
+}
+/*
+ * Read the next probe record into st->rec: a row of the probe table, and
+ * once that is read, a record of each partition file in turn.  Returns 0
+ * when there are no more.
+ */
+static int
+mdb_sql_join_next_probe(MdbSQLJoinState *st)
+{
+	MdbTableDef *table = st->side[!st->build].table;
+	unsigned char hdr[4];
+	FILE *probe;
+	guint32 len;
+
+	while (st->phase == MDB_SQL_JOIN_PROBE_TABLE) {
+		if (!mdb_fetch_row(table)) {
+			mdb_sql_join_scan_end(st, !st->build);
+			st->phase = st->spilled ? MDB_SQL_JOIN_PROBE_PARTS
+				: MDB_SQL_JOIN_PROBE_DONE;
+			st->part = -1;
+		} else if (st->pending || st->failed) {
+			return !st->failed;
+		}
+	}
+	while (st->phase == MDB_SQL_JOIN_PROBE_PARTS) {
+		probe = st->part < 0 ? NULL : st->parts[!st->build][st->part];
+		if (!probe || fread(hdr, 4, 1, probe) != 1) {
+			if (!mdb_sql_join_next_part(st))
+				st->phase = MDB_SQL_JOIN_PROBE_DONE;
+			continue;
+		}
+		len = mdb_get_int32(hdr, 0);
+		g_byte_array_set_size(st->rec, len);
+		memcpy(st->rec->data, hdr, 4);
+		if (fread(st->rec->data + 4, len - 4, 1, probe) != 1) {
+			mdb_sql_error(st->sql, "Can't read join temp file");
+			st->failed = 1;
+			return 0;
+		}
+		st->has_key = 1;
+		mdb_sql_join_start_probe(st);
+		return 1;
+	}
+	return 0;
+}
+/*
+ * Fill in the next joined row.
+ */
+static int
+mdb_sql_join_next_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLJoinState *st = data;
+
+	while (!st->failed) {
+		if (st->pending && mdb_sql_join_next_match(st, fields))
+			return 1;
+		st->pending = 0;
+		if (!mdb_sql_join_next_probe(st))
+			return 0;
+	}
+	return 0;
+}
+static void
+mdb_sql_join_free(gpointer data)
+{
+	MdbSQLJoinState *st = data;
+	int s, p;
+
+	/* fetching may have stopped before the probe table was read */
+	if (st->phase == MDB_SQL_JOIN_PROBE_TABLE)
+		mdb_sql_join_scan_end(st, !st->build);
+
+	for (s=0;s<2;s++) {
+		for (p=0;p<MDB_SQL_JOIN_PARTS;p++) {
+			if (st->parts[s][p])
+				fclose(st->parts[s][p]);
+		}
+		if (st->side[s].tree)
+			mdb_sql_free_tree(st->side[s].tree);
+		if (st->side[s].table)
+			mdb_free_tabledef(st->side[s].table);
+		g_ptr_array_free(st->side[s].keys, TRUE);
+		g_array_free(st->side[s].cols, TRUE);
+	}
+	if (st->filter)
+		mdb_sql_free_tree(st->filter);
+	g_free(st->out_side);
+	g_free(st->out_col);
+	g_byte_array_free(st->recs, TRUE);
+	g_byte_array_free(st->rec, TRUE);
+	g_array_free(st->offsets, TRUE);
+	g_free(st->buckets);
+	g_free(st->next);
+	g_free(st);
+}
+/**
+ * mdb_sql_join:
+ * @sql: MDB SQL object with a parsed join
+ *
+ * Reads the table of the join of @sql that is kept in memory, and makes
+ * sql->cur_table an operator table that reads the other one and returns
+ * the joined rows as they are fetched.  Called by mdb_sql_select().
+ *
+ * Returns: 1 on success, 0 on failure with the error set in @sql.
+ */
+int
+mdb_sql_join(MdbSQL *sql)
+{
+	MdbSQLJoinState *st;
+	MdbSQLJoinSide *js;
+	MdbTableDef *ttable;
+	int s, ret;
+	gint64 start = g_get_monotonic_time();
+
+	st = g_malloc0(sizeof(MdbSQLJoinState));
+	st->sql = sql;
+	st->recs = g_byte_array_new();
+	st->rec = g_byte_array_new();
+	st->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	st->left = sql->join->join_type == MDB_SQL_LEFT_JOIN;
+	for (s=0;s<2;s++) {
+		js = &st->side[s];
+		js->keys = g_ptr_array_new();
+		js->cols = g_array_new(FALSE, FALSE, sizeof(int));
+	}
+	/* st is freed with the table */
+	ttable = mdb_create_op_table(sql->mdb, "#join", mdb_sql_join_next_row,
+		st, mdb_sql_join_free);
+	for (s=0;s<2;s++) {
+		js = &st->side[s];
+		js->sql_tab = g_ptr_array_index(sql->tables, s);
+		js->table = mdb_read_table_by_name(sql->mdb, js->sql_tab->name, MDB_TABLE);
+		if (!js->table) {
+			mdb_sql_error(sql, "%s is not a table in this database", js->sql_tab->name);
+			mdb_free_tabledef(ttable);
+			return 0;
+		}
+		mdb_read_columns(js->table);
+		mdb_read_indices(js->table);
+	}
+	if (sql->group_by->len || mdb_sql_has_aggregates(sql)) {
+		mdb_sql_error(sql, "Aggregates and GROUP BY can't be used in joins");
+		mdb_free_tabledef(ttable);
+		return 0;
+	}
+	if (sql->params->len) {
+		mdb_sql_error(sql, "Parameters can't be used in joins");
+		mdb_free_tabledef(ttable);
+		return 0;
+	}
+	/* the right table has to be kept for a left join */
+	st->build = 1;
+	if (!st->left &&
+	    st->side[0].table->num_rows < st->side[1].table->num_rows)
+		st->build = 0;
+
+	ret = mdb_sql_join_columns(st, ttable) && mdb_sql_join_keys(st)
+		&& mdb_sql_join_split_sargs(st)
+		&& mdb_sql_join_scan(st, st->build, mdb_sql_join_build_row);
+	if (!ret) {
+		mdb_free_tabledef(ttable);
+		return 0;
+	}
+	if (!st->spilled)
+		mdb_sql_join_hash_recs(st);
+	mdb_sql_join_scan_begin(st, !st->build, mdb_sql_join_probe_row);
+	st->phase = MDB_SQL_JOIN_PROBE_TABLE;
+	mdb_sql_plan_op(sql, ttable, 2, start, "Hash %s join, keeping %s%s",
+		st->left ? "left" : "inner", st->side[st->build].sql_tab->name,
+		st->spilled ? " in temporary files" : " in memory");
+	sql->cur_table = ttable;
+
+	return 1;
+}
@@ -18,6 +18,8 @@
 
 #include "mdbsql.h"
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -28,23 +30,6 @@
 #include <wordexp.h>
 #endif
 
-char *g_input_ptr;
-
-/* Prevent warnings from -Wmissing-prototypes.  */
-#ifdef YYPARSE_PARAM
-#if defined __STDC__ || defined __cplusplus
-int yyparse (void *YYPARSE_PARAM);
-#else
-int yyparse ();
-#endif
-#else /* ! YYPARSE_PARAM */
-#if defined __STDC__ || defined __cplusplus
-int yyparse (void);
-#else
-int yyparse ();
-#endif
-#endif /* ! YYPARSE_PARAM */
-
 void
 mdb_sql_error(MdbSQL* sql, char *fmt, ...)
 {
@@ -52,24 +37,12 @@ va_list ap;
 
 	va_start(ap, fmt);
 	vfprintf (stderr, fmt, ap);
-	vsprintf(sql->error_msg, fmt, ap);
+	va_end(ap);
+	va_start(ap, fmt);
+	vsnprintf(sql->error_msg, sizeof(sql->error_msg), fmt, ap);
 	va_end(ap);
 	fprintf(stderr,"\n");
 }
-
-int mdb_sql_yyinput(char *buf, int need)
-{
-int cplen, have;
-
-	have = strlen(g_input_ptr);
-	cplen = need > have ? have : need;
-	
-	if (cplen>0) {
-		memcpy(buf, g_input_ptr, cplen);
-		g_input_ptr += cplen;
-	} 
-	return cplen;
-}
 MdbSQL *mdb_sql_init()
 {
 MdbSQL *sql;
@@ -80,6 +53,9 @@ MdbSQL *sql;
 	sql->sarg_tree = NULL;
 	sql->sarg_stack = NULL;
 	sql->max_rows = -1;
+	sql->params = g_ptr_array_new();
+	sql->group_by = g_ptr_array_new();
+	sql->order_by = g_ptr_array_new();
 
 	return sql;
 }
@@ -93,7 +69,9 @@ MdbSQL *sql;
  * @sql: MDB SQL object to execute the query on.
  * @querystr: SQL query string to execute.
  *
- * Parses @querystr and executes it within the given @sql object.
+ * Parses @querystr and executes it within the given @sql object.  Each
+ * object parses with a scanner of its own, so queries on different
+ * objects can run in different threads at the same time.
  *
  * Returns: the updated MDB SQL object, or NULL on error
  **/
@@ -102,19 +80,17 @@ mdb_sql_run_query (MdbSQL* sql, const gchar* querystr) {
 	g_return_val_if_fail (sql, NULL);
 	g_return_val_if_fail (querystr, NULL);
 
-	g_input_ptr = (gchar*) querystr;
-
-	/* calls to yyparse should be serialized for thread safety */
-
-	/* begin unsafe */
-	_mdb_sql (sql);
 	sql->error_msg[0]='\0';
-	if (yyparse()) {
-		/* end unsafe */
+	if (mdb_sql_parse(sql, querystr)) {
 		mdb_sql_error (sql, _("Could not parse '%s' command"), querystr);
 		mdb_sql_reset (sql);
 		return NULL;
 	}
+	if (sql->params->len) {
+		mdb_sql_error (sql, _("'%s' has parameters, use mdb_sql_prepare()"), querystr);
+		mdb_sql_reset (sql);
+		return NULL;
+	}
 
 	if (sql->cur_table == NULL) {
 		/* Invalid column name? (should get caught by mdb_sql_select,
@@ -128,10 +104,175 @@ mdb_sql_run_query (MdbSQL* sql, const gchar* querystr) {
 	return sql;
 }
 
+/**
+ * mdb_sql_prepare:
+ * @sql: MDB SQL object to prepare the query on.
+ * @querystr: SQL query string, with ? in place of constants to be
+ * supplied later.
+ *
+ * Parses @querystr, looks up its table, columns and indexes and binds the
+ * result columns, like mdb_sql_run_query(), but doesn't start the query.
+ * Values for the parameters are set with mdb_sql_bind_param() and the
+ * query is run with mdb_sql_execute(), as many times as needed, until
+ * mdb_sql_reset() is called.
+ *
+ * Returns: the updated MDB SQL object, or NULL on error
+ **/
+MdbSQL*
+mdb_sql_prepare (MdbSQL* sql, const gchar* querystr) {
+	g_return_val_if_fail (sql, NULL);
+	g_return_val_if_fail (querystr, NULL);
+
+	sql->error_msg[0]='\0';
+	if (mdb_sql_parse(sql, querystr)) {
+		mdb_sql_error (sql, _("Could not parse '%s' command"), querystr);
+		mdb_sql_reset (sql);
+		return NULL;
+	}
+	if (sql->cur_table == NULL) {
+		mdb_sql_error (sql, _("Got no result for '%s' command"), querystr);
+		return NULL;
+	}
+
+	mdb_sql_bind_all (sql);
+	g_free(sql->query);
+	sql->query = g_strdup(querystr);
+
+	return sql;
+}
+/**
+ * mdb_sql_bind_param:
+ * @sql: MDB SQL object with a prepared statement
+ * @num: the parameter, counting the ? in the query from 1
+ * @value: the value, without quotes for text
+ *
+ * Sets the value of a parameter for the following mdb_sql_execute()
+ * calls.  @value is copied.
+ *
+ * Returns: 0 on success, 1 if there is no such parameter.
+ **/
+int
+mdb_sql_bind_param(MdbSQL *sql, int num, const char *value)
+{
+	MdbSQLParam *param;
+	MdbSargNode *node;
+
+	if (num < 1 || (unsigned int) num > sql->params->len) {
+		mdb_sql_error(sql, "No parameter %d", num);
+		return 1;
+	}
+	param = g_ptr_array_index(sql->params, num - 1);
+	node = param->node;
+	/* the same as a literal of the column's type would be */
+	switch (node->col ? node->col->col_type : MDB_LONGINT) {
+		case MDB_TEXT:
+		case MDB_MEMO:
+			g_strlcpy(node->value.s, value, sizeof(node->value.s));
+			break;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_MONEY:
+			node->value.d = strtod(value, NULL);
+			break;
+		case MDB_DATETIME:
+			/* compared as a time_t by mdb_test_date() */
+			node->value.i = (int) strtod(value, NULL);
+			break;
+		default:
+			node->value.i = atoi(value);
+			break;
+	}
+	param->bound = 1;
+
+	return 0;
+}
+/**
+ * mdb_sql_execute:
+ * @sql: MDB SQL object with a prepared statement
+ *
+ * Starts the statement prepared by mdb_sql_prepare() with the current
+ * parameter values.  The rows are read with mdb_fetch_row() on
+ * sql->cur_table into the bound columns as usual.  The table definition
+ * and columns looked up by mdb_sql_prepare() are reused; only the index
+ * scan is set up again for the new values.  A join, aggregate or ORDER BY
+ * reads its inputs while being set up, so its operator tables are built
+ * again from the query instead, and the columns bound again to the
+ * values of mdb_sql_bind_all(); other bindings must be made again.
+ *
+ * Returns: the MDB SQL object, or NULL on error
+ **/
+MdbSQL*
+mdb_sql_execute(MdbSQL *sql)
+{
+	MdbTableDef *table = sql->cur_table;
+	MdbSQLParam *param;
+	gchar *query;
+	long max_rows, offset;
+	unsigned int i;
+
+	g_return_val_if_fail (sql, NULL);
+
+	if (!table) {
+		mdb_sql_error(sql, "No statement has been prepared");
+		return NULL;
+	}
+	for (i=0;i<sql->params->len;i++) {
+		param = g_ptr_array_index(sql->params, i);
+		if (!param->bound) {
+			mdb_sql_error(sql, "Parameter %d has no value", i + 1);
+			return NULL;
+		}
+	}
+	sql->error_msg[0]='\0';
+
+	if (table->fetch_func) {
+		/* the operators have used up their inputs */
+		query = sql->query;
+		max_rows = sql->max_rows;
+		offset = sql->offset;
+		sql->query = NULL;
+		mdb_sql_reset(sql);
+		sql->max_rows = max_rows;
+		sql->offset = offset;
+		if (!query) {
+			mdb_sql_error(sql, "No statement has been prepared");
+			return NULL;
+		}
+		if (mdb_sql_parse(sql, query) || !sql->cur_table) {
+			mdb_sql_error(sql, _("Could not parse '%s' command"), query);
+			g_free(query);
+			mdb_sql_reset(sql);
+			return NULL;
+		}
+		sql->query = query;
+		/* into the values mdb_sql_bind_all() allocated the first time */
+		for (i=0;i<sql->num_columns;i++)
+			mdb_sql_bind_column(sql, i+1, sql->bound_values[i], NULL);
+		return sql;
+	}
+
+	mdb_index_scan_free(table);
+	table->strategy = MDB_TABLE_SCAN;
+	table->scan_idx = NULL;
+	for (i=0;i<table->num_cols;i++)
+		mdb_free_sargs(g_ptr_array_index(table->columns, i));
+	if (table->sarg_tree)
+		mdb_sql_walk_tree(table->sarg_tree, mdb_find_indexable_sargs, NULL);
+	mdb_rewind_table(table);
+	if (!table->is_temp_table)
+		mdb_index_scan_init(sql->mdb, table);
+
+	return sql;
+}
+
 void mdb_sql_set_maxrow(MdbSQL *sql, int maxrow)
 {
 	sql->max_rows = maxrow;
 }
+void mdb_sql_set_offset(MdbSQL *sql, long offset)
+{
+	sql->offset = offset;
+}
 
 static void mdb_sql_free_columns(GPtrArray *columns)
 {
@@ -140,10 +281,27 @@ static void mdb_sql_free_columns(GPtrArray *columns)
 	for (i=0; i<columns->len; i++) {
 		MdbSQLColumn *c = (MdbSQLColumn *)g_ptr_array_index(columns, i);
 		g_free(c->name);
+		g_free(c->agg_col);
 		g_free(c);
 	}
 	g_ptr_array_free(columns, TRUE);
 }
+static void mdb_sql_free_params(GPtrArray *params)
+{
+	unsigned int i;
+	if (!params) return;
+	for (i=0; i<params->len; i++)
+		g_free(g_ptr_array_index(params, i));
+	g_ptr_array_free(params, TRUE);
+}
+static void mdb_sql_free_names(GPtrArray *names)
+{
+	unsigned int i;
+	if (!names) return;
+	for (i=0; i<names->len; i++)
+		g_free(g_ptr_array_index(names, i));
+	g_ptr_array_free(names, TRUE);
+}
 static void mdb_sql_free_tables(GPtrArray *tables)
 {
 	unsigned int i;
@@ -151,6 +309,7 @@ static void mdb_sql_free_tables(GPtrArray *tables)
 	for (i=0; i<tables->len; i++) {
 		MdbSQLTable *t = (MdbSQLTable *)g_ptr_array_index(tables, i);
 		g_free(t->name);
+		g_free(t->alias);
 		g_free(t);
 	}
 	g_ptr_array_free(tables, TRUE);
@@ -197,6 +356,19 @@ MdbHandle *mdb_sql_open(MdbSQL *sql, char *db_name)
 
 	return sql->mdb;
 }
+/*
+ * FNV-1a hash of len bytes, for the hash tables of joins and GROUP BY
+ */
+guint32
+mdb_sql_hash(unsigned char *key, guint32 len)
+{
+	guint32 h = 2166136261U;
+	guint32 i;
+
+	for (i=0;i<len;i++)
+		h = (h ^ key[i]) * 16777619U;
+	return h;
+}
 MdbSargNode *
 mdb_sql_alloc_node()
 {
@@ -208,6 +380,7 @@ mdb_sql_free_tree(MdbSargNode *tree)
 
 	if (tree->left) mdb_sql_free_tree(tree->left);
 	if (tree->right) mdb_sql_free_tree(tree->right);
+	if (tree->set) g_array_free(tree->set, TRUE);
 	g_free(tree);
 }
 void
@@ -323,6 +496,9 @@ mdb_sql_dump_node(MdbSargNode *node, int level)
 		case MDB_EQUAL: 
 			printf(" = %d\n", node->value.i); 
 			break;
+		case MDB_IN: 
+			printf(" in (%d values)\n", node->set->len); 
+			break;
 	}
 	if (node->left) {
 		printf("left  ");
@@ -363,6 +539,11 @@ mdb_sql_eval_expr(MdbSQL *sql, char *const1, int op, char *const2)
 			case MDB_LTEQ: compar = (val1 <= val2); break;
 			default: illop = 1;
 		}
+	} else if (!strcmp(const1, "?") || !strcmp(const2, "?")) {
+		mdb_sql_error(sql, "Parameters can only be compared with columns.");
+		/* the column and table names are no good now */
+		mdb_sql_reset(sql);
+		return 1;
 	} else {
 		mdb_sql_error(sql, "Comparison of strings and numbers not allowed.");
 		/* the column and table names are no good now */
@@ -382,11 +563,28 @@ mdb_sql_eval_expr(MdbSQL *sql, char *const1, int op, char *const2)
 	mdb_sql_push_node(sql, node);
 	return 0;
 }
+/* store a literal from the grammar, quoted if it is a string */
+static void
+mdb_sql_set_constant(MdbAny *value, char *constant)
+{
+	int lastchar;
+
+	/* FIX ME -- we should probably just be storing the ascii value until the 
+	** column definition can be checked for validity
+	*/
+	if (constant[0]=='\'') {
+		lastchar = strlen(constant) > 256 ? 256 : strlen(constant);
+		strncpy(value->s, &constant[1], lastchar - 2);;
+		value->s[lastchar - 1]='\0';
+	} else {
+		value->i = atoi(constant);
+	}
+}
 int 
 mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant)
 {
-	int lastchar;
 	MdbSargNode *node;
+	MdbSQLParam *param;
 
 	node = mdb_sql_alloc_node();
 	node->op = op;
@@ -398,21 +596,174 @@ mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant)
 		mdb_sql_push_node(sql, node);
 		return 0;
 	}
-	/* FIX ME -- we should probably just be storing the ascii value until the 
-	** column definition can be checked for validity
-	*/
-	if (constant[0]=='\'') {
-		lastchar = strlen(constant) > 256 ? 256 : strlen(constant);
-		strncpy(node->value.s, &constant[1], lastchar - 2);;
-		node->value.s[lastchar - 1]='\0';
-	} else {
-		node->value.i = atoi(constant);
+	if (!strcmp(constant, "?")) {
+		/* filled in by mdb_sql_bind_param() */
+		param = g_malloc0(sizeof(MdbSQLParam));
+		param->node = node;
+		g_ptr_array_add(sql->params, param);
+		mdb_sql_push_node(sql, node);
+		return 0;
 	}
+	mdb_sql_set_constant(&node->value, constant);
+	if (constant[0]!='\'')
+		node->num = strtod(constant, NULL);
+	mdb_sql_push_node(sql, node);
 
+	return 0;
+}
+/*
+ * col IN (constants): the constants go into a sorted set that each row
+ * probes once, see mdb_sort_sarg_set().  The list is freed.
+ */
+int
+mdb_sql_add_in(MdbSQL *sql, char *col_name, GPtrArray *constants)
+{
+	MdbSargNode *node;
+	MdbAny value;
+	char *constant;
+	unsigned int i;
+	int text = -1, rc = 0;
+
+	node = mdb_sql_alloc_node();
+	node->op = MDB_IN;
+	node->parent = (void *) g_strdup(col_name);
+	node->set = g_array_sized_new(FALSE, TRUE, sizeof(MdbAny), constants->len);
+	for (i=0;i<constants->len;i++) {
+		constant = g_ptr_array_index(constants, i);
+		if (!strcmp(constant, "?")) {
+			mdb_sql_error(sql, "Parameters can't be used in IN lists.");
+			rc = 1;
+			break;
+		}
+		if (text != -1 && text != (constant[0]=='\'')) {
+			mdb_sql_error(sql, "Comparison of strings and numbers not allowed.");
+			rc = 1;
+			break;
+		}
+		text = (constant[0]=='\'');
+		memset(&value, 0, sizeof(MdbAny));
+		mdb_sql_set_constant(&value, constant);
+		g_array_append_val(node->set, value);
+	}
+	for (i=0;i<constants->len;i++)
+		free(g_ptr_array_index(constants, i));
+	g_ptr_array_free(constants, TRUE);
+	if (rc) {
+		g_free(node->parent);
+		mdb_sql_free_tree(node);
+		/* the column and table names are no good now */
+		mdb_sql_reset(sql);
+		return 1;
+	}
+	if (node->set->len == 1) {
+		/* nothing to search */
+		node->op = MDB_EQUAL;
+		node->value = g_array_index(node->set, MdbAny, 0);
+		g_array_free(node->set, TRUE);
+		node->set = NULL;
+	} else {
+		mdb_sort_sarg_set(node, text);
+	}
 	mdb_sql_push_node(sql, node);
 
 	return 0;
 }
+/*
+ * col BETWEEN low AND high is col >= low AND col <= high, which the index
+ * code already knows how to range scan.
+ */
+int
+mdb_sql_add_between(MdbSQL *sql, char *col_name, char *low, char *high)
+{
+	if (mdb_sql_add_sarg(sql, col_name, MDB_GTEQ, low))
+		return 1;
+	if (mdb_sql_add_sarg(sql, col_name, MDB_LTEQ, high))
+		return 1;
+	mdb_sql_add_and(sql);
+
+	return 0;
+}
+/*
+ * The value of an integer literal, false if it isn't one or doesn't fit
+ * in a long.
+ */
+static int
+mdb_sql_parse_integer(const char *s, long *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtol(s, &end, 10);
+	return end != s && !*end && errno != ERANGE;
+}
+/*
+ * Fold arithmetic on two integer literals into a new literal, so that
+ * col > 60 * 60 is tested like col > 3600.  Returns NULL on error.
+ */
+char *
+mdb_sql_fold_expr(MdbSQL *sql, char *const1, int op, char *const2)
+{
+	long val1, val2, value = 0;
+	int overflow = 0;
+	char buf[32];
+
+	if (!mdb_sql_parse_integer(const1, &val1) ||
+	    !mdb_sql_parse_integer(const2, &val2)) {
+		mdb_sql_error(sql, "Arithmetic is only supported on integers.");
+		mdb_sql_reset(sql);
+		return NULL;
+	}
+	switch (op) {
+		case '+': overflow = __builtin_add_overflow(val1, val2, &value); break;
+		case '-': overflow = __builtin_sub_overflow(val1, val2, &value); break;
+		case '*': overflow = __builtin_mul_overflow(val1, val2, &value); break;
+		default:
+			if (!val2) {
+				mdb_sql_error(sql, "Division by zero.");
+				mdb_sql_reset(sql);
+				return NULL;
+			}
+			/* the one quotient that doesn't fit */
+			if (val1 == LONG_MIN && val2 == -1)
+				overflow = 1;
+			else
+				value = (op == '/') ? val1 / val2 : val1 % val2;
+			break;
+	}
+	if (overflow) {
+		mdb_sql_error(sql, "Arithmetic overflow.");
+		mdb_sql_reset(sql);
+		return NULL;
+	}
+	/* freed by the grammar like the literals from the scanner */
+	snprintf(buf, sizeof(buf), "%ld", value);
+	return strdup(buf);
+}
+/*
+ * Negate a numeric literal, for the unary minus.  Decimal literals just
+ * change sign, integers are folded like 0 - const1.  Returns NULL on
+ * error.
+ */
+char *
+mdb_sql_negate_expr(MdbSQL *sql, char *const1)
+{
+	long value;
+	char *neg;
+
+	if (mdb_sql_parse_integer(const1, &value))
+		return mdb_sql_fold_expr(sql, "0", '-', const1);
+	if (const1[0]=='\'' || !strcmp(const1, "?")) {
+		mdb_sql_error(sql, "Arithmetic is only supported on numbers.");
+		mdb_sql_reset(sql);
+		return NULL;
+	}
+	if (const1[0] == '-')
+		return strdup(const1 + 1);
+	neg = malloc(strlen(const1) + 2);
+	neg[0] = '-';
+	strcpy(neg + 1, const1);
+	return neg;
+}
 void
 mdb_sql_all_columns(MdbSQL *sql)
 {
@@ -428,13 +779,40 @@ int mdb_sql_add_column(MdbSQL *sql, char *column_name)
 	sql->num_columns++;
 	return 0;
 }
-int mdb_sql_add_table(MdbSQL *sql, char *table_name)
+/*
+ * the name of an aggregate result column, such as "sum(amount)"
+ */
+char *mdb_sql_agg_name(int agg_func, char *column_name)
+{
+	static const char *names[] = { "", "count", "sum", "min", "max", "avg" };
+
+	return g_strdup_printf("%s(%s)", names[agg_func],
+		column_name ? column_name : "*");
+}
+int mdb_sql_add_aggregate(MdbSQL *sql, int agg_func, char *column_name)
+{
+	MdbSQLColumn *c;
+
+	c = (MdbSQLColumn *) g_malloc0(sizeof(MdbSQLColumn));
+	c->name = mdb_sql_agg_name(agg_func, column_name);
+	c->agg_func = agg_func;
+	c->agg_col = g_strdup(column_name);
+	g_ptr_array_add(sql->columns, c);
+	sql->num_columns++;
+	return 0;
+}
+int mdb_sql_add_group_col(MdbSQL *sql, char *column_name)
+{
+	g_ptr_array_add(sql->group_by, g_strdup(column_name));
+	return 0;
+}
+int mdb_sql_add_table(MdbSQL *sql, char *table_name, char *alias)
 {
 	MdbSQLTable *t;
 
 	t = (MdbSQLTable *) g_malloc0(sizeof(MdbSQLTable));
 	t->name = g_strdup(table_name);
-	t->alias = NULL;
+	t->alias = g_strdup(alias);
 	g_ptr_array_add(sql->tables, t);
 	sql->num_tables++;
 	return 0;
@@ -458,6 +836,11 @@ void mdb_sql_exit(MdbSQL *sql)
 {
 	mdb_sql_free_columns(sql->columns);
 	mdb_sql_free_tables(sql->tables);
+	mdb_sql_free_params(sql->params);
+	mdb_sql_free_join(sql->join);
+	sql->join = NULL;
+	mdb_sql_free_names(sql->group_by);
+	mdb_sql_free_order(sql->order_by);
 
 	if (sql->sarg_tree) {
 		mdb_sql_free_tree(sql->sarg_tree);
@@ -465,6 +848,9 @@ void mdb_sql_exit(MdbSQL *sql)
 	}
 	g_list_free(sql->sarg_stack);
 	sql->sarg_stack = NULL;
+	mdb_sql_free_plan(sql);
+	g_free(sql->query);
+	sql->query = NULL;
 
 	if (sql->mdb) {
 		mdb_close(sql->mdb);
@@ -488,6 +874,22 @@ void mdb_sql_reset(MdbSQL *sql)
 	sql->num_tables = 0;
 	sql->tables = g_ptr_array_new();
 
+	/* Reset parameters */
+	mdb_sql_free_params(sql->params);
+	sql->params = g_ptr_array_new();
+
+	/* Reset join */
+	mdb_sql_free_join(sql->join);
+	sql->join = NULL;
+
+	/* Reset grouping */
+	mdb_sql_free_names(sql->group_by);
+	sql->group_by = g_ptr_array_new();
+
+	/* Reset ordering */
+	mdb_sql_free_order(sql->order_by);
+	sql->order_by = g_ptr_array_new();
+
 	/* Reset sargs */
 	if (sql->sarg_tree) {
 		mdb_sql_free_tree(sql->sarg_tree);
@@ -495,9 +897,14 @@ void mdb_sql_reset(MdbSQL *sql)
 	}
 	g_list_free(sql->sarg_stack);
 	sql->sarg_stack = NULL;
+	mdb_sql_free_plan(sql);
+
+	g_free(sql->query);
+	sql->query = NULL;
 
 	sql->all_columns = 0;
 	sql->max_rows = -1;
+	sql->offset = 0;
 }
 static void print_break(int sz, int first)
 {
@@ -524,17 +931,35 @@ int vlen;
 	}
 	fprintf(stdout,"|");
 }
-void mdb_sql_listtables(MdbSQL *sql)
-{
+/* the rows of "list tables" */
+typedef struct {
+	MdbHandle *mdb;
 	unsigned int i;
+	gchar name[MDB_MAX_OBJ_NAME * 2 + 2];
+} MdbSQLListState;
+
+static int
+mdb_sql_listtables_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLListState *st = data;
 	MdbCatalogEntry *entry;
+
+ 	while (st->i < st->mdb->num_catalog) {
+ 		entry = g_ptr_array_index (st->mdb->catalog, st->i++);
+ 		if (mdb_is_user_table(entry)) {
+			fields[0].siz = mdb_ascii2unicode(st->mdb,
+				entry->object_name, 0, st->name, sizeof(st->name));
+			fields[0].value = st->name;
+			return 1;
+		}
+	}
+	return 0;
+}
+void mdb_sql_listtables(MdbSQL *sql)
+{
 	MdbHandle *mdb = sql->mdb;
-	MdbField fields[1];
-	unsigned char row_buffer[MDB_PGSIZE];
-	int row_size;
+	MdbSQLListState *st;
 	MdbTableDef *ttable;
-	gchar tmpstr[100];
-	int tmpsiz;
 
 	if (!mdb) {
 		mdb_sql_error(sql, "You must connect to a database first");
@@ -542,23 +967,14 @@ void mdb_sql_listtables(MdbSQL *sql)
 	}
 	mdb_read_catalog (mdb, MDB_TABLE);
 
-	ttable = mdb_create_temp_table(mdb, "#listtables");
+	st = g_malloc0(sizeof(MdbSQLListState));
+	st->mdb = mdb;
+	ttable = mdb_create_op_table(mdb, "#listtables", mdb_sql_listtables_row,
+		st, g_free);
 	mdb_sql_add_temp_col(sql, ttable, 0, "Tables", MDB_TEXT, 30, 0);
+	mdb_temp_columns_end(ttable);
 
- 	/* add all user tables in catalog to list */
- 	for (i=0; i < mdb->num_catalog; i++) {
- 		entry = g_ptr_array_index (mdb->catalog, i);
- 		if (mdb_is_user_table(entry)) {
-			//col = g_ptr_array_index(table->columns,0);
-			tmpsiz = mdb_ascii2unicode(mdb, entry->object_name, 0, tmpstr, 100);
-			mdb_fill_temp_field(&fields[0],tmpstr, tmpsiz, 0,0,0,0);
-			row_size = mdb_pack_row(ttable, row_buffer, 1, fields);
-			mdb_add_row_to_pg(ttable,row_buffer, row_size);
-			ttable->num_rows++;
-		}
-	}
 	sql->cur_table = ttable;
-
 }
 int
 mdb_sql_add_temp_col(MdbSQL *sql, MdbTableDef *ttable, int col_num, char *name, int col_type, int col_size, int is_fixed)
@@ -574,19 +990,56 @@ mdb_sql_add_temp_col(MdbSQL *sql, MdbTableDef *ttable, int col_num, char *name,
 
 	return 0;
 }
+/* the rows of "describe table", one per column */
+typedef struct {
+	MdbTableDef *table;
+	unsigned int i;
+	gchar col_name[MDB_MAX_OBJ_NAME * 2 + 2];
+	gchar col_type[100], col_size[100];
+} MdbSQLDescribeState;
+
+static int
+mdb_sql_describe_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLDescribeState *st = data;
+	MdbHandle *mdb = st->table->entry->mdb;
+	MdbColumn *col;
+	char tmpstr[256];
+
+	if (st->i >= st->table->num_cols)
+		return 0;
+	col = g_ptr_array_index(st->table->columns, st->i++);
+
+	fields[0].siz = mdb_ascii2unicode(mdb, col->name, 0, st->col_name,
+		sizeof(st->col_name));
+	fields[0].value = st->col_name;
+
+	strcpy(tmpstr, mdb_get_colbacktype_string(col));
+	fields[1].siz = mdb_ascii2unicode(mdb, tmpstr, 0, st->col_type,
+		sizeof(st->col_type));
+	fields[1].value = st->col_type;
+
+	sprintf(tmpstr,"%d",col->col_size);
+	fields[2].siz = mdb_ascii2unicode(mdb, tmpstr, 0, st->col_size,
+		sizeof(st->col_size));
+	fields[2].value = st->col_size;
+
+	return 1;
+}
+static void
+mdb_sql_describe_free(gpointer data)
+{
+	MdbSQLDescribeState *st = data;
+
+	mdb_free_tabledef(st->table);
+	g_free(st);
+}
 void mdb_sql_describe_table(MdbSQL *sql)
 {
 	MdbTableDef *ttable, *table = NULL;
 	MdbSQLTable *sql_tab;
 	MdbHandle *mdb = sql->mdb;
-	MdbColumn *col;
-	unsigned int i;
-	MdbField fields[3];
-	char tmpstr[256];
-	unsigned char row_buffer[MDB_PGSIZE];
-	int row_size;
-	gchar col_name[100], col_type[100], col_size[100];
-	int tmpsiz;
+	MdbSQLDescribeState *st;
 
 	if (!mdb) {
 		mdb_sql_error(sql, "You must connect to a database first");
@@ -605,36 +1058,40 @@ void mdb_sql_describe_table(MdbSQL *sql)
 
 	mdb_read_columns(table);
 
-	ttable = mdb_create_temp_table(mdb, "#describe");
+	st = g_malloc0(sizeof(MdbSQLDescribeState));
+	st->table = table;
+	ttable = mdb_create_op_table(mdb, "#describe", mdb_sql_describe_row,
+		st, mdb_sql_describe_free);
 
 	mdb_sql_add_temp_col(sql, ttable, 0, "Column Name", MDB_TEXT, 30, 0);
 	mdb_sql_add_temp_col(sql, ttable, 1, "Type", MDB_TEXT, 20, 0);
 	mdb_sql_add_temp_col(sql, ttable, 2, "Size", MDB_TEXT, 10, 0);
-
-	for (i=0;i<table->num_cols;i++) {
-
-		col = g_ptr_array_index(table->columns,i);
-		tmpsiz = mdb_ascii2unicode(mdb, col->name, 0, col_name, 100);
-		mdb_fill_temp_field(&fields[0],col_name, tmpsiz, 0,0,0,0);
-
-		strcpy(tmpstr, mdb_get_colbacktype_string(col));
-		tmpsiz = mdb_ascii2unicode(mdb, tmpstr, 0, col_type, 100);
-		mdb_fill_temp_field(&fields[1],col_type, tmpsiz, 0,0,0,1);
-
-		sprintf(tmpstr,"%d",col->col_size);
-		tmpsiz = mdb_ascii2unicode(mdb, tmpstr, 0, col_size, 100);
-		mdb_fill_temp_field(&fields[2],col_size, tmpsiz, 0,0,0,2);
-
-		row_size = mdb_pack_row(ttable, row_buffer, 3, fields);
-		mdb_add_row_to_pg(ttable,row_buffer, row_size);
-		ttable->num_rows++;
-	}
+	mdb_temp_columns_end(ttable);
 
 	/* the column and table names are no good now */
 	//mdb_sql_reset(sql);
 	sql->cur_table = ttable;
 }
 
+/*
+ * Point the sarg at the column it tests.  Number literals are stored as
+ * integers until then, floating point columns are tested against the
+ * number itself.
+ */
+void
+mdb_sql_set_sarg_col(MdbSargNode *node, MdbColumn *col)
+{
+	node->col = col;
+	if (!col || node->op == MDB_IN)
+		return;
+	switch (col->col_type) {
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_MONEY:
+			node->value.d = node->num;
+			break;
+	}
+}
 int mdb_sql_find_sargcol(MdbSargNode *node, gpointer data)
 {
 	MdbTableDef *table = data;
@@ -647,7 +1104,7 @@ int mdb_sql_find_sargcol(MdbSargNode *node, gpointer data)
 	for (i=0;i<table->num_cols;i++) {
 		col=g_ptr_array_index(table->columns,i);
 		if (!strcasecmp(col->name, (char *)node->parent)) {
-			node->col = col;
+			mdb_sql_set_sarg_col(node, col);
 			break;
 		}
 	}
@@ -669,6 +1126,12 @@ int found = 0;
 		return;
 	}
 
+	if (sql->join && sql->num_tables > 1) {
+		if (!mdb_sql_join(sql) || !mdb_sql_order(sql))
+			mdb_sql_reset(sql);
+		return;
+	}
+
 	sql_tab = g_ptr_array_index(sql->tables,0);
 
 	table = mdb_read_table_by_name(mdb, sql_tab->name, MDB_TABLE);
@@ -682,6 +1145,14 @@ int found = 0;
 	mdb_read_indices(table);
 	mdb_rewind_table(table);
 
+	if (sql->group_by->len || mdb_sql_has_aggregates(sql)) {
+		if (sql->sarg_tree)
+			mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_find_sargcol, table);
+		if (!mdb_sql_aggregate(sql, table) || !mdb_sql_order(sql))
+			mdb_sql_reset(sql);
+		return;
+	}
+
 	if (sql->all_columns) {
 		for (i=0;i<table->num_cols;i++) {
 			col = g_ptr_array_index(table->columns,i);
@@ -696,6 +1167,9 @@ int found = 0;
 			col=g_ptr_array_index(table->columns,j);
 			if (!strcasecmp(sqlcol->name, col->name)) {
 				sqlcol->disp_size = mdb_col_disp_size(col);
+				/* with * all of them are, without naming any */
+				if (!sql->all_columns)
+					mdb_need_column(table, col);
 				found=1;
 				break;
 			}
@@ -712,17 +1186,25 @@ int found = 0;
 	 */
 	if (sql->sarg_tree) {
 		mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_find_sargcol, table);
-		mdb_sql_walk_tree(sql->sarg_tree, mdb_find_indexable_sargs, NULL);
+		if (!sql->all_columns)
+			mdb_sql_walk_tree(sql->sarg_tree, mdb_find_needed_cols, table);
+		/* parameters get their values in mdb_sql_execute() */
+		if (!sql->params->len)
+			mdb_sql_walk_tree(sql->sarg_tree, mdb_find_indexable_sargs, NULL);
 	}
 	/* 
-	 * move the sarg_tree.  
-	 * XXX - this won't work when we implement joins 
+	 * move the sarg_tree.  joins share it out in mdb_sql_join()
 	 */
 	table->sarg_tree = sql->sarg_tree;
 	sql->sarg_tree = NULL;
 
 	sql->cur_table = table;
-	mdb_index_scan_init(mdb, table);
+	if (!sql->params->len) {
+		mdb_index_scan_init(mdb, table);
+		mdb_sql_plan_scan(sql, table);
+	}
+	if (!mdb_sql_order(sql))
+		mdb_sql_reset(sql);
 }
 
 void 
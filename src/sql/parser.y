@@ -17,99 +17,211 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include "mdbsql.h"
-
-int yylex(void);
-int yyerror(char *);
-
-MdbSQL *_mdb_sql(MdbSQL *sql)
-{
-static MdbSQL *g_sql;
-
-	if (sql) {
-		g_sql = sql;
-	}
-	return g_sql;
-}
-
 %}
 
+/*
+ * The parser and scanner keep no globals: the session being parsed and
+ * the scanner reading its query are passed down from mdb_sql_parse(), so
+ * separate MdbSQL objects can be used from different threads.
+ */
+%define api.pure
+%parse-param { MdbSQL *sql }
+%parse-param { void *scanner }
+%lex-param { void *scanner }
+
 %union {
 	char *name;
 	double dval;
 	int ival;
+	GPtrArray *list;
 }
 
+%{
+int yylex(YYSTYPE *lvalp, void *scanner);
+void yyerror(MdbSQL *sql, void *scanner, const char *s);
+%}
 
 
 %token <name> IDENT NAME PATH STRING NUMBER 
 %token SELECT FROM WHERE CONNECT DISCONNECT TO LIST TABLES AND OR NOT
 %token DESCRIBE TABLE
-%token LTEQ GTEQ LIKE IS NUL
+%token LTEQ GTEQ LIKE IS NUL IN BETWEEN
+%token JOIN INNER LEFT OUTER ON
+%token COUNT SUM MINIMUM MAXIMUM AVG GROUP BY
+%token ORDER ASC DESC LIMIT OFFSET TOP
+%token EXPLAIN ANALYZE
 
 %type <name> database
 %type <name> constant
+%type <name> value
+%type <list> value_list
 %type <ival> operator
 %type <ival> nulloperator
+%type <ival> join_type
+%type <ival> agg_func
+%type <name> agg_arg
+%type <ival> order_dir
 %type <name> identifier
 
+%left OR
+%left AND
+%right NOT
+%left '+' '-'
+%left '*' '/' '%'
+%right UMINUS
+
 %%
 
 stmt:
 	query
-	| error { yyclearin; mdb_sql_reset(_mdb_sql(NULL)); }
+	| error { yyclearin; mdb_sql_reset(sql); }
 	;
 
 query:
-	SELECT column_list FROM table where_clause {
-			mdb_sql_select(_mdb_sql(NULL));	
+	select {
+			mdb_sql_select(sql);	
+		}
+	|	EXPLAIN select {
+			mdb_sql_explain(sql, MDB_SQL_EXPLAIN);
+		}
+	|	EXPLAIN ANALYZE select {
+			mdb_sql_explain(sql, MDB_SQL_EXPLAIN_ANALYZE);
 		}
 	|	CONNECT TO database { 
-			mdb_sql_open(_mdb_sql(NULL), $3); free($3); 
+			mdb_sql_open(sql, $3); free($3); 
 		}
 	|	DISCONNECT { 
-			mdb_sql_close(_mdb_sql(NULL));
+			mdb_sql_close(sql);
 		}
 	|	DESCRIBE TABLE table { 
-			mdb_sql_describe_table(_mdb_sql(NULL)); 
+			mdb_sql_describe_table(sql); 
 		}
 	|	LIST TABLES { 
-			mdb_sql_listtables(_mdb_sql(NULL)); 
+			mdb_sql_listtables(sql); 
 		}
 	;
 
+select:
+	SELECT top_clause column_list FROM table_ref where_clause group_clause order_clause limit_clause
+	;
+
 where_clause:
 	/* empty */
 	| WHERE sarg_list
 	;
 
+group_clause:
+	/* empty */
+	| GROUP BY group_list
+	;
+
+group_list:
+	group_col
+	| group_list ',' group_col
+	;
+
+group_col:
+	identifier { mdb_sql_add_group_col(sql, $1); free($1); }
+	;
+
+order_clause:
+	/* empty */
+	| ORDER BY order_list
+	;
+
+order_list:
+	order_col
+	| order_list ',' order_col
+	;
+
+order_col:
+	identifier order_dir {
+				mdb_sql_add_order(sql, 0, $1, $2);
+				free($1);
+				}
+	| agg_func '(' agg_arg ')' order_dir {
+				mdb_sql_add_order(sql, $1, $3, $5);
+				free($3);
+				}
+	;
+
+order_dir:
+	/* empty */	{ $$ = MDB_ASC; }
+	| ASC	{ $$ = MDB_ASC; }
+	| DESC	{ $$ = MDB_DESC; }
+	;
+
+top_clause:
+	/* empty */
+	| TOP NUMBER { mdb_sql_set_maxrow(sql, atoi($2)); free($2); }
+	;
+
+limit_clause:
+	/* empty */
+	| LIMIT NUMBER { mdb_sql_set_maxrow(sql, atoi($2)); free($2); }
+	| LIMIT NUMBER OFFSET NUMBER {
+		mdb_sql_set_maxrow(sql, atoi($2));
+		mdb_sql_set_offset(sql, atol($4));
+		free($2);
+		free($4);
+	}
+	;
+
 sarg_list:
 	sarg 
 	| '(' sarg_list ')'
-	| NOT sarg_list { mdb_sql_add_not(_mdb_sql(NULL)); }
-	| sarg_list OR sarg_list { mdb_sql_add_or(_mdb_sql(NULL)); }
-	| sarg_list AND sarg_list { mdb_sql_add_and(_mdb_sql(NULL)); }
+	| NOT sarg_list { mdb_sql_add_not(sql); }
+	| sarg_list OR sarg_list { mdb_sql_add_or(sql); }
+	| sarg_list AND sarg_list { mdb_sql_add_and(sql); }
 	;
 
 sarg:
-	identifier operator constant	{ 
-				mdb_sql_add_sarg(_mdb_sql(NULL), $1, $2, $3);
+	identifier operator value	{ 
+				mdb_sql_add_sarg(sql, $1, $2, $3);
 				free($1);
 				free($3);
 				}
-	| constant operator identifier {
-				mdb_sql_add_sarg(_mdb_sql(NULL), $3, $2, $1);
+	| value operator identifier {
+				mdb_sql_add_sarg(sql, $3, $2, $1);
 				free($1);
 				free($3);
 				}
-	| constant operator constant {
-				mdb_sql_eval_expr(_mdb_sql(NULL), $1, $2, $3);
+	| value operator value {
+				mdb_sql_eval_expr(sql, $1, $2, $3);
 				free($1);
 				free($3);
 	}
 	| identifier nulloperator	{ 
-				mdb_sql_add_sarg(_mdb_sql(NULL), $1, $2, NULL);
+				mdb_sql_add_sarg(sql, $1, $2, NULL);
+				free($1);
+				}
+	| identifier IN '(' value_list ')' {
+				mdb_sql_add_in(sql, $1, $4);
+				free($1);
+				}
+	| identifier NOT IN '(' value_list ')' {
+				if (!mdb_sql_add_in(sql, $1, $5))
+					mdb_sql_add_not(sql);
 				free($1);
 				}
+	| identifier BETWEEN value AND value {
+				mdb_sql_add_between(sql, $1, $3, $5);
+				free($1);
+				free($3);
+				free($5);
+				}
+	| identifier NOT BETWEEN value AND value {
+				if (!mdb_sql_add_between(sql, $1, $4, $6))
+					mdb_sql_add_not(sql);
+				free($1);
+				free($4);
+				free($6);
+				}
+	;
+
+value_list:
+	value	{ $$ = g_ptr_array_new(); g_ptr_array_add($$, $1); }
+	| value_list ',' value	{ g_ptr_array_add($1, $3); $$ = $1; }
 	;
 
 identifier:
@@ -134,6 +246,17 @@ nulloperator:
 constant:
 	NUMBER { $$ = $1; }
 	| STRING { $$ = $1; }
+	| '?' { $$ = strdup("?"); }
+	;
+
+value:
+	constant
+	| value '+' value	{ $$ = mdb_sql_fold_expr(sql, $1, '+', $3); free($1); free($3); if (!$$) YYERROR; }
+	| value '-' value	{ $$ = mdb_sql_fold_expr(sql, $1, '-', $3); free($1); free($3); if (!$$) YYERROR; }
+	| value '*' value	{ $$ = mdb_sql_fold_expr(sql, $1, '*', $3); free($1); free($3); if (!$$) YYERROR; }
+	| value '/' value	{ $$ = mdb_sql_fold_expr(sql, $1, '/', $3); free($1); free($3); if (!$$) YYERROR; }
+	| value '%' value	{ $$ = mdb_sql_fold_expr(sql, $1, '%', $3); free($1); free($3); if (!$$) YYERROR; }
+	| '-' value %prec UMINUS	{ $$ = mdb_sql_negate_expr(sql, $2); free($2); if (!$$) YYERROR; }
 	;
 
 database:
@@ -141,18 +264,68 @@ database:
 	|	NAME 
 	;
 
+table_ref:
+	table
+	| table join_type JOIN table ON join_cond {
+			mdb_sql_set_join_type(sql, $2);
+		}
+	;
+
+join_type:
+	/* empty */	{ $$ = MDB_SQL_INNER_JOIN; }
+	| INNER	{ $$ = MDB_SQL_INNER_JOIN; }
+	| LEFT	{ $$ = MDB_SQL_LEFT_JOIN; }
+	| LEFT OUTER	{ $$ = MDB_SQL_LEFT_JOIN; }
+	;
+
+join_cond:
+	join_key
+	| join_cond AND join_key
+	| '(' join_cond ')'
+	;
+
+join_key:
+	identifier '=' identifier {
+				mdb_sql_add_join_key(sql, $1, $3);
+				free($1);
+				free($3);
+				}
+	;
+
 table:
-	identifier { mdb_sql_add_table(_mdb_sql(NULL), $1); free($1); }
+	identifier { mdb_sql_add_table(sql, $1, NULL); free($1); }
+	| identifier identifier {
+				mdb_sql_add_table(sql, $1, $2);
+				free($1);
+				free($2);
+				}
 	;
 
 column_list:
-	'*'	{ mdb_sql_all_columns(_mdb_sql(NULL)); }
+	'*'	{ mdb_sql_all_columns(sql); }
 	|	column  
 	|	column ',' column_list 
 	;
 	 
 column:
-	identifier { mdb_sql_add_column(_mdb_sql(NULL), $1); free($1); }
+	identifier { mdb_sql_add_column(sql, $1); free($1); }
+	| agg_func '(' agg_arg ')' {
+				mdb_sql_add_aggregate(sql, $1, $3);
+				free($3);
+				}
+	;
+
+agg_func:
+	COUNT	{ $$ = MDB_SQL_COUNT; }
+	| SUM	{ $$ = MDB_SQL_SUM; }
+	| MINIMUM	{ $$ = MDB_SQL_MIN; }
+	| MAXIMUM	{ $$ = MDB_SQL_MAX; }
+	| AVG	{ $$ = MDB_SQL_AVG; }
+	;
+
+agg_arg:
+	'*'	{ $$ = NULL; }
+	| identifier
 	;
 
 %%
@@ -0,0 +1,683 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ORDER BY, LIMIT and OFFSET.
+ *
+ * Each row read is turned into a record whose sort key compares with
+ * memcmp(): the ORDER BY values encoded the way index keys are, a null
+ * flag then the value in an order preserving form, with text lower cased
+ * and descending columns inverted.  Nulls come first when ascending.
+ *
+ *   4 bytes  size of the record
+ *   4 bytes  size of the key
+ *   key
+ *   the result columns, each a null flag, a 4 byte size and the data
+ *
+ * Records are sorted in memory up to MDB_SQL_SORT_MEM, past which each
+ * sorted run is written to a temporary file and the runs are merged at
+ * the end, as the rows are fetched.  With a LIMIT only the best rows seen
+ * so far are kept, in a heap.  sql->cur_table becomes an operator table
+ * handing out the rows in order.
+ *
+ * When a single table is read through no index, or through one whose
+ * keys are the ORDER BY columns in the same order, it is read in the
+ * order of that index instead and nothing is sorted.  Without sorting the
+ * LIMIT and OFFSET are left to mdb_fetch_row(), which stops reading once
+ * it has returned the rows wanted.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_SQL_SORT_MEM (32 * 1024 * 1024)
+#define MDB_SQL_SORT_HDR 8
+
+typedef struct {
+	MdbSQL *sql;
+	MdbTableDef *table;	/* the rows to sort */
+	MdbColumn **keys;	/* the ORDER BY columns */
+	int *orders;		/* MDB_ASC or MDB_DESC for each */
+	int num_keys;
+	MdbColumn **cols;	/* the column of each result column */
+	GByteArray *rec;	/* the row being read */
+	GByteArray *recs;	/* the rows kept in memory */
+	GArray *offsets;
+	GPtrArray *runs;	/* FILE * of sorted runs */
+	GPtrArray *heap;	/* with a LIMIT, the best rows, largest first */
+	size_t heap_size;
+	long limit;		/* -1 for all rows */
+	long offset;		/* rows to leave out first */
+	unsigned int num_columns;
+	guint next;		/* the next record to hand out */
+	GByteArray **cur;	/* the next record of each run */
+	int last;		/* the run of the record handed out last */
+	int failed;
+} MdbSQLSortState;
+
+/**
+ * mdb_sql_add_order:
+ * @sql: MDB SQL object being parsed
+ * @agg_func: the aggregate to sort on, 0 for a column
+ * @column_name: the column, or what the aggregate is of (NULL for *)
+ * @order: MDB_ASC or MDB_DESC
+ *
+ * Called by the parser for each column of the ORDER BY clause.
+ */
+int
+mdb_sql_add_order(MdbSQL *sql, int agg_func, char *column_name, int order)
+{
+	MdbSQLOrder *o;
+
+	o = g_malloc0(sizeof(MdbSQLOrder));
+	o->name = agg_func ? mdb_sql_agg_name(agg_func, column_name)
+		: g_strdup(column_name);
+	o->order = order;
+	g_ptr_array_add(sql->order_by, o);
+	return 0;
+}
+void
+mdb_sql_free_order(GPtrArray *order_by)
+{
+	unsigned int i;
+	MdbSQLOrder *o;
+
+	if (!order_by) return;
+	for (i=0;i<order_by->len;i++) {
+		o = g_ptr_array_index(order_by, i);
+		g_free(o->name);
+		g_free(o);
+	}
+	g_ptr_array_free(order_by, TRUE);
+}
+/*
+ * Find the column of the table being sorted called name.  The result of
+ * a join may name it with or without its table.
+ */
+static MdbColumn *
+mdb_sql_sort_find_col(MdbSQLSortState *st, char *name)
+{
+	MdbColumn *col, *found = NULL;
+	char *colname, *s;
+	unsigned int i;
+
+	for (i=0;i<st->table->num_cols;i++) {
+		col = g_ptr_array_index(st->table->columns, i);
+		if (!strcasecmp(col->name, name))
+			return col;
+	}
+	colname = (s = strrchr(name, '.')) ? s + 1 : name;
+	for (i=0;i<st->table->num_cols;i++) {
+		col = g_ptr_array_index(st->table->columns, i);
+		s = strrchr(col->name, '.');
+		if (strcasecmp(s ? s + 1 : col->name, colname))
+			continue;
+		if (found) {
+			mdb_sql_error(st->sql, "Column %s is ambiguous", name);
+			return NULL;
+		}
+		found = col;
+	}
+	if (!found)
+		mdb_sql_error(st->sql, "Column %s not found", name);
+	return found;
+}
+static int
+mdb_sql_sort_cmp(unsigned char *a, unsigned char *b)
+{
+	guint32 len_a = mdb_get_int32(a, 4), len_b = mdb_get_int32(b, 4);
+	int rc;
+
+	rc = memcmp(a + MDB_SQL_SORT_HDR, b + MDB_SQL_SORT_HDR, MIN(len_a, len_b));
+	if (rc) return rc;
+	return (len_a > len_b) - (len_a < len_b);
+}
+static gint
+mdb_sql_sort_cmp_offsets(gconstpointer a, gconstpointer b, gpointer data)
+{
+	unsigned char *recs = data;
+
+	return mdb_sql_sort_cmp(recs + *(const guint32 *) a, recs + *(const guint32 *) b);
+}
+/*
+ * Append the sort key of one ORDER BY value to rec.
+ */
+static void
+mdb_sql_sort_key(MdbSQLSortState *st, MdbColumn *col, int order, MdbField *f)
+{
+	MdbHandle *mdb = st->table->entry->mdb;
+	GByteArray *rec = st->rec;
+	unsigned char buf[256], flag;
+	char text[256], *s;
+	unsigned char *memo;
+	size_t len;
+	guint i, start = rec->len;
+	int key_len;
+
+	switch (col->col_type) {
+		case MDB_BOOL:
+			/* a boolean's value is its null bit */
+			flag = f->is_null ? 0 : 1;
+			g_byte_array_append(rec, &flag, 1);
+			break;
+		case MDB_TEXT:
+		case MDB_MEMO:
+			flag = f->is_null ? 0x00 : 0x7f;
+			g_byte_array_append(rec, &flag, 1);
+			if (f->is_null)
+				break;
+			text[0] = '\0';
+			if (col->col_type == MDB_TEXT) {
+				mdb_unicode2ascii(mdb, f->value, f->siz, text, sizeof(text));
+			} else if ((memo = mdb_lval_get(mdb, f->value, f->siz, &len, NULL))) {
+				/* like Access, only the start of a memo counts */
+				mdb_unicode2ascii(mdb, (char *) memo, MIN(len, 2 * sizeof(text)),
+					text, sizeof(text));
+				g_free(memo);
+			}
+			s = g_ascii_strdown(text, -1);
+			g_byte_array_append(rec, (guint8 *) s, strlen(s) + 1);
+			g_free(s);
+			break;
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+		case MDB_MONEY:
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			key_len = mdb_index_encode_col(mdb, col, MDB_ASC, f, buf);
+			g_byte_array_append(rec, buf, key_len);
+			break;
+		default:
+			flag = f->is_null ? 0x00 : 0x7f;
+			g_byte_array_append(rec, &flag, 1);
+			if (!f->is_null)
+				g_byte_array_append(rec, f->value, f->siz);
+			break;
+	}
+	if (order == MDB_DESC) {
+		for (i=start;i<rec->len;i++)
+			rec->data[i] = ~rec->data[i];
+	}
+}
+/*
+ * Turn a row into a record in st->rec.
+ */
+static void
+mdb_sql_sort_encode(MdbSQLSortState *st, MdbField *fields)
+{
+	MdbSQL *sql = st->sql;
+	GByteArray *rec = st->rec;
+	unsigned char hdr[4], null;
+	MdbField *f;
+	unsigned int i;
+	int k;
+
+	g_byte_array_set_size(rec, MDB_SQL_SORT_HDR);
+	for (k=0;k<st->num_keys;k++)
+		mdb_sql_sort_key(st, st->keys[k], st->orders[k], &fields[st->keys[k]->col_num]);
+	mdb_put_int32(rec->data, 4, rec->len - MDB_SQL_SORT_HDR);
+	for (i=0;i<sql->num_columns;i++) {
+		f = &fields[st->cols[i]->col_num];
+		null = f->is_null;
+		g_byte_array_append(rec, &null, 1);
+		mdb_put_int32(hdr, 0, null ? 0 : f->siz);
+		g_byte_array_append(rec, hdr, 4);
+		if (!null)
+			g_byte_array_append(rec, f->value, f->siz);
+	}
+	mdb_put_int32(rec->data, 0, rec->len);
+}
+/*
+ * Fill in fields from the result columns of a record.
+ */
+static void
+mdb_sql_sort_decode(MdbSQLSortState *st, unsigned char *rec, MdbField *fields)
+{
+	unsigned char *p;
+	unsigned int i;
+
+	p = rec + MDB_SQL_SORT_HDR + mdb_get_int32(rec, 4);
+	for (i=0;i<st->num_columns;i++) {
+		fields[i].is_null = p[0];
+		fields[i].siz = mdb_get_int32(p, 1);
+		fields[i].value = p + 5;
+		p += 5 + fields[i].siz;
+	}
+}
+static void
+mdb_sql_sort_heap_down(GPtrArray *heap, guint i)
+{
+	gpointer tmp;
+	guint child;
+
+	while ((child = 2 * i + 1) < heap->len) {
+		if (child + 1 < heap->len && mdb_sql_sort_cmp(
+		    g_ptr_array_index(heap, child + 1), g_ptr_array_index(heap, child)) > 0)
+			child++;
+		if (mdb_sql_sort_cmp(g_ptr_array_index(heap, i),
+		    g_ptr_array_index(heap, child)) >= 0)
+			break;
+		tmp = heap->pdata[i];
+		heap->pdata[i] = heap->pdata[child];
+		heap->pdata[child] = tmp;
+		i = child;
+	}
+}
+/*
+ * Keep the record if it is among the st->limit smallest seen so far.
+ */
+static void
+mdb_sql_sort_heap_add(MdbSQLSortState *st, unsigned char *rec)
+{
+	GPtrArray *heap = st->heap;
+	unsigned char *top;
+	gpointer tmp;
+	guint i, parent;
+
+	if (heap->len < (guint) (st->limit + st->offset)) {
+		g_ptr_array_add(heap, g_memdup(rec, mdb_get_int32(rec, 0)));
+		st->heap_size += mdb_get_int32(rec, 0);
+		for (i=heap->len-1;i;i=parent) {
+			parent = (i - 1) / 2;
+			if (mdb_sql_sort_cmp(g_ptr_array_index(heap, parent),
+			    g_ptr_array_index(heap, i)) >= 0)
+				break;
+			tmp = heap->pdata[i];
+			heap->pdata[i] = heap->pdata[parent];
+			heap->pdata[parent] = tmp;
+		}
+		return;
+	}
+	top = g_ptr_array_index(heap, 0);
+	if (mdb_sql_sort_cmp(rec, top) >= 0)
+		return;
+	st->heap_size += mdb_get_int32(rec, 0);
+	st->heap_size -= mdb_get_int32(top, 0);
+	g_free(top);
+	heap->pdata[0] = g_memdup(rec, mdb_get_int32(rec, 0));
+	mdb_sql_sort_heap_down(heap, 0);
+}
+/*
+ * Write the records in memory to a new run, sorted.
+ */
+static int
+mdb_sql_sort_spill(MdbSQLSortState *st)
+{
+	FILE *run;
+	guint32 off;
+	guint i;
+
+	if (!(run = tmpfile())) {
+		mdb_sql_error(st->sql, "Can't create sort temp file");
+		st->failed = 1;
+		return 0;
+	}
+	g_ptr_array_add(st->runs, run);
+	g_qsort_with_data(st->offsets->data, st->offsets->len, sizeof(guint32),
+		mdb_sql_sort_cmp_offsets, st->recs->data);
+	for (i=0;i<st->offsets->len;i++) {
+		off = g_array_index(st->offsets, guint32, i);
+		if (fwrite(st->recs->data + off, mdb_get_int32(st->recs->data, off), 1, run) != 1) {
+			mdb_sql_error(st->sql, "Can't write sort temp file");
+			st->failed = 1;
+			return 0;
+		}
+	}
+	g_byte_array_set_size(st->recs, 0);
+	g_array_set_size(st->offsets, 0);
+	return 1;
+}
+static void
+mdb_sql_sort_keep(MdbSQLSortState *st, unsigned char *rec)
+{
+	guint32 off = st->recs->len;
+
+	g_byte_array_append(st->recs, rec, mdb_get_int32(rec, 0));
+	g_array_append_val(st->offsets, off);
+	if (st->recs->len + st->offsets->len * sizeof(guint32) > MDB_SQL_SORT_MEM)
+		mdb_sql_sort_spill(st);
+}
+static void
+mdb_sql_sort_row(MdbTableDef *table, MdbField *fields, int num_fields, gpointer data)
+{
+	MdbSQLSortState *st = data;
+	guint i;
+
+	if (st->failed)
+		return;
+	mdb_sql_sort_encode(st, fields);
+	if (st->heap) {
+		mdb_sql_sort_heap_add(st, st->rec->data);
+		/* too big for a heap, sort them all after all */
+		if (st->heap_size > MDB_SQL_SORT_MEM) {
+			for (i=0;i<st->heap->len;i++) {
+				mdb_sql_sort_keep(st, g_ptr_array_index(st->heap, i));
+				g_free(g_ptr_array_index(st->heap, i));
+			}
+			g_ptr_array_free(st->heap, TRUE);
+			st->heap = NULL;
+		}
+	} else {
+		mdb_sql_sort_keep(st, st->rec->data);
+	}
+}
+/*
+ * Read the next record of a run into rec.  Returns 0 at its end.
+ */
+static int
+mdb_sql_sort_read(MdbSQLSortState *st, FILE *run, GByteArray *rec)
+{
+	unsigned char hdr[4];
+	guint32 len;
+
+	if (fread(hdr, 4, 1, run) != 1)
+		return 0;
+	len = mdb_get_int32(hdr, 0);
+	g_byte_array_set_size(rec, len);
+	memcpy(rec->data, hdr, 4);
+	if (fread(rec->data + 4, len - 4, 1, run) != 1) {
+		mdb_sql_error(st->sql, "Can't read sort temp file");
+		st->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Start merging the sorted runs, reading the first record of each.
+ */
+static void
+mdb_sql_sort_merge(MdbSQLSortState *st)
+{
+	guint i, num_runs = st->runs->len;
+
+	st->cur = g_malloc0(num_runs * sizeof(GByteArray *));
+	for (i=0;i<num_runs;i++) {
+		rewind(g_ptr_array_index(st->runs, i));
+		st->cur[i] = g_byte_array_new();
+		if (!mdb_sql_sort_read(st, g_ptr_array_index(st->runs, i), st->cur[i]))
+			g_byte_array_set_size(st->cur[i], 0);
+	}
+	st->last = -1;
+}
+/*
+ * Hand out the next row in order, from memory or by merging the runs.
+ */
+static int
+mdb_sql_sort_next_row(MdbTableDef *ttable, MdbField *fields, gpointer data)
+{
+	MdbSQLSortState *st = data;
+	guint i;
+	int best = -1;
+
+	if (st->failed)
+		return 0;
+	if (!st->runs->len) {
+		if (st->next >= st->offsets->len)
+			return 0;
+		mdb_sql_sort_decode(st, st->recs->data +
+			g_array_index(st->offsets, guint32, st->next++), fields);
+		return 1;
+	}
+	/* the record handed out last is done with */
+	if (st->last >= 0 && !mdb_sql_sort_read(st,
+	    g_ptr_array_index(st->runs, st->last), st->cur[st->last]))
+		g_byte_array_set_size(st->cur[st->last], 0);
+	for (i=0;!st->failed && i<st->runs->len;i++) {
+		if (st->cur[i]->len && (best < 0 ||
+		    mdb_sql_sort_cmp(st->cur[i]->data, st->cur[best]->data) < 0))
+			best = i;
+	}
+	st->last = best;
+	if (best < 0 || st->failed)
+		return 0;
+	mdb_sql_sort_decode(st, st->cur[best]->data, fields);
+	return 1;
+}
+/*
+ * Find an index that returns the rows in the order wanted: its leading
+ * keys are the ORDER BY columns, in the same directions, and of types
+ * whose index keys sort as our sort keys do.
+ */
+static MdbIndex *
+mdb_sql_sort_index(MdbSQLSortState *st)
+{
+	MdbTableDef *table = st->table;
+	MdbColumn *col;
+	MdbIndex *idx;
+	unsigned int i;
+	int k;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type == 2 || idx->num_keys < st->num_keys)
+			continue;
+		for (k=0;k<st->num_keys;k++) {
+			col = g_ptr_array_index(table->columns, idx->key_col_num[k]-1);
+			if (col != st->keys[k] || idx->key_col_order[k] != st->orders[k])
+				break;
+			if (col->col_type == MDB_TEXT || col->col_type == MDB_MEMO
+			 || col->col_type == MDB_BOOL || col->col_type == MDB_OLE
+			 || col->col_type == MDB_NUMERIC || col->col_type == MDB_REPID)
+				break;
+		}
+		if (k == st->num_keys)
+			return idx;
+	}
+	return NULL;
+}
+static int
+mdb_sql_sort_columns(MdbSQLSortState *st, MdbTableDef *ttable)
+{
+	MdbSQL *sql = st->sql;
+	MdbSQLColumn *sqlcol;
+	MdbSQLOrder *o;
+	MdbColumn *col, tcol;
+	unsigned int i;
+
+	for (i=0;i<sql->order_by->len;i++) {
+		o = g_ptr_array_index(sql->order_by, i);
+		if (!(col = mdb_sql_sort_find_col(st, o->name)))
+			return 0;
+		if (col->col_type == MDB_OLE || col->col_type == MDB_NUMERIC) {
+			mdb_sql_error(sql, "Can't sort on column %s", o->name);
+			return 0;
+		}
+		st->keys[i] = col;
+		st->orders[i] = o->order;
+		mdb_need_column(st->table, col);
+	}
+	st->num_keys = sql->order_by->len;
+
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!(col = mdb_sql_sort_find_col(st, sqlcol->name)))
+			return 0;
+		if (col->col_type == MDB_OLE) {
+			mdb_sql_error(sql, "OLE column %s can't be sorted", sqlcol->name);
+			return 0;
+		}
+		st->cols[i] = col;
+		mdb_need_column(st->table, col);
+		mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size,
+			col->col_type, col->is_fixed);
+		mdb_temp_table_add_col(ttable, &tcol);
+	}
+	mdb_temp_columns_end(ttable);
+
+	return 1;
+}
+static void
+mdb_sql_sort_free(gpointer data)
+{
+	MdbSQLSortState *st = data;
+	guint i;
+
+	for (i=0;i<st->runs->len;i++) {
+		fclose(g_ptr_array_index(st->runs, i));
+		if (st->cur)
+			g_byte_array_free(st->cur[i], TRUE);
+	}
+	g_ptr_array_free(st->runs, TRUE);
+	g_free(st->cur);
+	if (st->heap) {
+		for (i=0;i<st->heap->len;i++)
+			g_free(g_ptr_array_index(st->heap, i));
+		g_ptr_array_free(st->heap, TRUE);
+	}
+	g_byte_array_free(st->rec, TRUE);
+	g_byte_array_free(st->recs, TRUE);
+	g_array_free(st->offsets, TRUE);
+	g_free(st->keys);
+	g_free(st->orders);
+	g_free(st->cols);
+	g_free(st);
+}
+/**
+ * mdb_sql_order:
+ * @sql: MDB SQL object with its result in sql->cur_table
+ *
+ * Applies the ORDER BY, LIMIT and OFFSET of the query, either reading
+ * sql->cur_table through an index in the order wanted, or sorting its rows
+ * and replacing it with an operator table that returns them in order.
+ * Called by mdb_sql_select().
+ *
+ * Returns: 1 on success, 0 on failure with the error set in @sql.
+ */
+int
+mdb_sql_order(MdbSQL *sql)
+{
+	MdbSQLSortState *st;
+	MdbTableDef *ttable, *table = sql->cur_table;
+	MdbIndex *idx;
+	guint32 off, tmp;
+	guint i, n;
+	gint64 start = g_get_monotonic_time();
+
+	if (!sql->order_by->len) {
+		mdb_limit_rows(table, sql->offset, sql->max_rows);
+		return 1;
+	}
+	if (sql->params->len) {
+		mdb_sql_error(sql, "Parameters can't be used with ORDER BY");
+		return 0;
+	}
+	if (sql->num_columns > MDB_MAX_COLS || sql->order_by->len > MDB_MAX_COLS) {
+		mdb_sql_error(sql, "Too many columns");
+		return 0;
+	}
+
+	st = g_malloc0(sizeof(MdbSQLSortState));
+	st->sql = sql;
+	st->table = table;
+	st->keys = g_malloc0(sql->order_by->len * sizeof(MdbColumn *));
+	st->orders = g_malloc0(sql->order_by->len * sizeof(int));
+	st->cols = g_malloc0(sql->num_columns * sizeof(MdbColumn *));
+	st->rec = g_byte_array_new();
+	st->recs = g_byte_array_new();
+	st->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	st->runs = g_ptr_array_new();
+	st->limit = sql->max_rows;
+	st->offset = sql->offset;
+	st->num_columns = sql->num_columns;
+	/* st is freed with the table */
+	ttable = mdb_create_op_table(sql->mdb, "#sort", mdb_sql_sort_next_row,
+		st, mdb_sql_sort_free);
+
+	if (!mdb_sql_sort_columns(st, ttable)) {
+		mdb_free_tabledef(ttable);
+		return 0;
+	}
+
+	/* read through an index in the right order if the scan allows it */
+	if (!table->is_temp_table && (idx = mdb_sql_sort_index(st))
+	 && (table->strategy == MDB_TABLE_SCAN
+	  || (table->strategy == MDB_INDEX_SCAN && table->scan_idx == idx))) {
+		mdb_index_scan_ordered(sql->mdb, table, idx);
+		mdb_sql_plan_scan(sql, table);
+		mdb_limit_rows(table, sql->offset, sql->max_rows);
+		mdb_free_tabledef(ttable);
+		return 1;
+	}
+
+	if (st->limit >= 0)
+		st->heap = g_ptr_array_new();
+	table->row_func = mdb_sql_sort_row;
+	table->row_data = st;
+	mdb_rewind_table(table);
+	while (!st->failed && st->limit != 0 && !mdb_sql_plan_only(sql) &&
+	    mdb_fetch_row(table))
+		;
+	table->row_func = NULL;
+
+	if (st->heap && !st->failed) {
+		/* take the rows off the heap, largest first */
+		for (i=st->heap->len;i>0;i--) {
+			off = st->recs->len;
+			g_array_append_val(st->offsets, off);
+			g_byte_array_append(st->recs, g_ptr_array_index(st->heap, 0),
+				mdb_get_int32(g_ptr_array_index(st->heap, 0), 0));
+			g_free(g_ptr_array_index(st->heap, 0));
+			st->heap->pdata[0] = st->heap->pdata[i-1];
+			g_ptr_array_set_size(st->heap, i-1);
+			mdb_sql_sort_heap_down(st->heap, 0);
+		}
+		n = st->offsets->len;
+		for (i=0;i<n/2;i++) {
+			tmp = g_array_index(st->offsets, guint32, i);
+			g_array_index(st->offsets, guint32, i) =
+				g_array_index(st->offsets, guint32, n-1-i);
+			g_array_index(st->offsets, guint32, n-1-i) = tmp;
+		}
+	} else if (st->runs->len && !st->failed) {
+		if (st->offsets->len)
+			mdb_sql_sort_spill(st);
+		mdb_sql_sort_merge(st);
+	} else if (!st->failed) {
+		g_qsort_with_data(st->offsets->data, st->offsets->len,
+			sizeof(guint32), mdb_sql_sort_cmp_offsets, st->recs->data);
+	}
+
+	if (st->failed) {
+		mdb_free_tabledef(ttable);
+		return 0;
+	}
+	if (st->heap)
+		mdb_sql_plan_op(sql, ttable, 1, start, "Top %ld sort on %u columns",
+			st->limit + st->offset, sql->order_by->len);
+	else if (st->runs->len)
+		mdb_sql_plan_op(sql, ttable, 1, start,
+			"External merge sort on %u columns, %u runs",
+			sql->order_by->len, st->runs->len);
+	else
+		mdb_sql_plan_op(sql, ttable, 1, start, "Sort on %u columns",
+			sql->order_by->len);
+	mdb_index_scan_free(table);
+	if (table->sarg_tree)
+		mdb_sql_free_tree(table->sarg_tree);
+	mdb_free_tabledef(table);
+	st->table = NULL;
+	mdb_limit_rows(ttable, sql->offset, sql->max_rows);
+	sql->cur_table = ttable;
+
+	return 1;
+}
@@ -0,0 +1,98 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000-2004 Brian Bruns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* this utility repacks the tables of a database onto as few pages as it can */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+static int
+copy_file(char *from, char *to)
+{
+	FILE *in, *out;
+	char buf[4096];
+	size_t len;
+	int ret = 1;
+
+	if (!(in = fopen(from, "rb"))) {
+		perror(from);
+		return 0;
+	}
+	if (!(out = fopen(to, "wb"))) {
+		perror(to);
+		fclose(in);
+		return 0;
+	}
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, len, out) != len) {
+			perror(to);
+			ret = 0;
+			break;
+		}
+	}
+	if (ferror(in)) {
+		perror(from);
+		ret = 0;
+	}
+	fclose(in);
+	if (fclose(out)) {
+		perror(to);
+		ret = 0;
+	}
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	MdbHandle *mdb;
+	char *path;
+	guint32 num_pgs;
+	int freed;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <file> [<output file>]\n", argv[0]);
+		exit(1);
+	}
+	path = argv[1];
+	if (argc == 3) {
+		if (!copy_file(path, argv[2]))
+			exit(1);
+		path = argv[2];
+	}
+
+	if (!(mdb = mdb_open(path, MDB_WRITABLE))) {
+		fprintf(stderr, "Couldn't open database.\n");
+		exit(1);
+	}
+	/* the file is rewritten in place, all of it or none */
+	mdb_set_journal(mdb, TRUE);
+	num_pgs = mdb_file_pages(mdb);
+	if ((freed = mdb_compact(mdb)) < 0) {
+		fprintf(stderr, "Couldn't compact %s\n", path);
+		mdb_close(mdb);
+		exit(1);
+	}
+	printf("%s: %lu pages, %lu before\n", path,
+		(unsigned long) (num_pgs - freed), (unsigned long) num_pgs);
+	mdb_close(mdb);
+
+	return 0;
+}
@@ -19,82 +19,352 @@
 #include "mdbtools.h"
 
 #define MAX_ROW_SIZE 4096
+/* longer memo and OLE values go to LVAL pages */
+#define MEMO_INLINE_MAX 64
+#define CSV_BUF_SIZE 65536
 
-void
-free_values(MdbField *fields, int num_fields)
+/*
+ * The CSV file is read as RFC 4180 records: fields may be quoted with ",
+ * a "" in a quoted field is a quote, and quoted fields may hold delimiters
+ * and newlines.  Lines may end in \n or \r\n.  An empty unquoted field is
+ * a null, "" is an empty string.
+ */
+typedef struct {
+	GString *text;
+	int quoted;
+} CsvField;
+
+typedef struct {
+	FILE *in;
+	char buf[CSV_BUF_SIZE];
+	size_t len, pos;
+	char delim;
+	GPtrArray *fields;	/* reused for every record */
+	unsigned int num_fields;
+	unsigned long line;
+} CsvReader;
+
+static int
+csv_getc(CsvReader *csv)
+{
+	if (csv->pos >= csv->len) {
+		csv->len = fread(csv->buf, 1, CSV_BUF_SIZE, csv->in);
+		csv->pos = 0;
+		if (!csv->len)
+			return EOF;
+	}
+	return (unsigned char) csv->buf[csv->pos++];
+}
+static CsvField *
+csv_next_field(CsvReader *csv)
+{
+	CsvField *field;
+
+	if (csv->num_fields < csv->fields->len) {
+		field = g_ptr_array_index(csv->fields, csv->num_fields);
+		g_string_truncate(field->text, 0);
+	} else {
+		field = g_malloc(sizeof(CsvField));
+		field->text = g_string_new("");
+		g_ptr_array_add(csv->fields, field);
+	}
+	field->quoted = 0;
+	csv->num_fields++;
+
+	return field;
+}
+/*
+ * Read the next record into csv->fields.  Returns the number of fields,
+ * 0 at end of file or -1 on a format error.
+ */
+static int
+csv_read_record(CsvReader *csv)
+{
+	CsvField *field;
+	int c;
+
+	csv->num_fields = 0;
+	csv->line++;
+	c = csv_getc(csv);
+	if (c == EOF)
+		return 0;
+	for (;;) {
+		field = csv_next_field(csv);
+		if (c == '"') {
+			field->quoted = 1;
+			for (;;) {
+				c = csv_getc(csv);
+				if (c == EOF) {
+					fprintf(stderr, "Unterminated quoted field on line %lu\n", csv->line);
+					return -1;
+				} else if (c == '"') {
+					c = csv_getc(csv);
+					if (c != '"') break;
+				} else if (c == '\n') {
+					csv->line++;
+				}
+				g_string_append_c(field->text, c);
+			}
+		} else {
+			while (c != csv->delim && c != '\n' && c != '\r' && c != EOF) {
+				g_string_append_c(field->text, c);
+				c = csv_getc(csv);
+			}
+		}
+		if (c == '\r') {
+			c = csv_getc(csv);
+			if (c != '\n' && c != EOF)
+				csv->pos--;
+			return csv->num_fields;
+		} else if (c == '\n' || c == EOF) {
+			return csv->num_fields;
+		} else if (c != csv->delim) {
+			fprintf(stderr, "Unexpected character after quoted field on line %lu\n", csv->line);
+			return -1;
+		}
+		c = csv_getc(csv);
+	}
+}
+static void
+csv_free(CsvReader *csv)
+{
+	CsvField *field;
+	unsigned int i;
+
+	for (i=0;i<csv->fields->len;i++) {
+		field = g_ptr_array_index(csv->fields, i);
+		g_string_free(field->text, TRUE);
+		g_free(field);
+	}
+	g_ptr_array_free(csv->fields, TRUE);
+	g_free(csv);
+}
+
+/* days between 1970-01-01 and y-m-d in the proleptic gregorian calendar */
+static long
+days_from_civil(int y, int m, int d)
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+/*
+ * Parse yyyy-mm-dd[( |T)hh:mm[:ss]] or mm/dd/yy[yy] [hh:mm[:ss]] into the
+ * days since 12/30/1899 that Access stores.
+ */
+static int
+parse_date(char *s, double *td)
 {
-	int i;
+	int y, m, d, hr = 0, mi = 0, sec = 0, n;
+	long days;
+	double frac;
 
-	for (i=0;i<num_fields;i++) {
-		if (!fields[i].is_null)
-			g_free(fields[i].value);
+	if (sscanf(s, "%d-%d-%d%n", &y, &m, &d, &n) == 3) {
+		s += n;
+	} else if (sscanf(s, "%d/%d/%d%n", &m, &d, &y, &n) == 3) {
+		s += n;
+		if (y < 30)
+			y += 2000;
+		else if (y < 100)
+			y += 1900;
+	} else {
+		return 0;
 	}
+	if (*s == ' ' || *s == 'T') {
+		if (sscanf(s + 1, "%d:%d%n:%d%n", &hr, &mi, &n, &sec, &n) < 2
+		 || s[n + 1])
+			return 0;
+	} else if (*s) {
+		return 0;
+	}
+	if (m < 1 || m > 12 || d < 1 || d > 31 || hr > 23 || mi > 59 || sec > 59)
+		return 0;
+
+	days = days_from_civil(y, m, d) - days_from_civil(1899, 12, 30);
+	frac = (hr * 3600 + mi * 60 + sec) / 86400.0;
+	/* the time is added away from zero, like Access does */
+	*td = (days < 0) ? days - frac : days + frac;
+	return 1;
 }
+/*
+ * Parse a decimal number into an integer scaled by 10^scale, rounding
+ * away extra digits.  Returns 0 if it isn't a number or doesn't fit.
+ */
+static int
+parse_scaled(char *s, int scale, guint64 *value, int *neg)
+{
+	guint64 v = 0;
+	int digits = 0, frac = -1;
+
+	*neg = 0;
+	if (*s == '-' || *s == '+')
+		*neg = (*s++ == '-');
+	if (*s == '$')
+		s++;
+	for (;*s;s++) {
+		if (*s == '.' && frac < 0) {
+			frac = 0;
+			continue;
+		}
+		if (*s == ',' && frac < 0)
+			continue;
+		if (!isdigit((unsigned char) *s))
+			return 0;
+		if (frac >= 0 && frac == scale) {
+			/* round on the first digit we can't keep */
+			if (*s >= '5') v++;
+			while (isdigit((unsigned char) s[1])) s++;
+			if (s[1]) return 0;
+			frac++;
+			continue;
+		}
+		if (v > (G_MAXUINT64 - 9) / 10)
+			return 0;
+		v = v * 10 + (*s - '0');
+		digits++;
+		if (frac >= 0) frac++;
+	}
+	if (!digits)
+		return 0;
+	for (frac = (frac < 0) ? 0 : frac; frac < scale; frac++) {
+		if (v > G_MAXUINT64 / 10)
+			return 0;
+		v *= 10;
+	}
+	*value = v;
+	return 1;
+}
+/*
+ * store s in buf as the column's text encoding, returns the length
+ */
+static int
+convert_text(MdbHandle *mdb, char *s, size_t len, unsigned char *buf, size_t buf_sz)
+{
+	if (!len)
+		return 0;
+	return mdb_ascii2unicode(mdb, s, len, (char *) buf, buf_sz);
+}
+/*
+ * convert the csv field s to column col's on-disk format, using buf for
+ * the value.  Returns 0 on success.
+ */
 int
-convert_field(MdbColumn *col, char *s, MdbField *field)
+convert_field(MdbTableDef *table, MdbColumn *col, CsvField *f, MdbField *field, unsigned char *buf)
 {
+	MdbHandle *mdb = table->entry->mdb;
+	char *s = f->text->str;
+	unsigned char *tmp;
 	char *c;
-	MdbAny any;
+	long l;
+	guint64 v;
+	int neg, len;
+	union {guint32 g; float f;} sf;
+	union {guint64 g; double d;} df;
+	unsigned int uuid[8];
 
 	field->colnum = col->col_num;
 	field->is_fixed = col->is_fixed;
+	field->siz = col->is_fixed ? mdb_col_fixed_size(col) : 0;
+	field->value = buf;
+	field->is_null = 0;
+
+	if (col->col_type == MDB_BOOL) {
+		/* booleans live in the null mask, set means true */
+		if (!g_ascii_strcasecmp(s, "1") || !g_ascii_strcasecmp(s, "true")
+		 || !g_ascii_strcasecmp(s, "yes")) {
+			field->is_null = 0;
+		} else if (!*s || !g_ascii_strcasecmp(s, "0")
+		 || !g_ascii_strcasecmp(s, "false") || !g_ascii_strcasecmp(s, "no")) {
+			field->is_null = 1;
+		} else {
+			fprintf(stderr, "%s is not a valid value for type BOOLEAN\n", s);
+			return 1;
+		}
+		field->siz = 0;
+		return 0;
+	}
+	if (!*s && !f->quoted) {
+		field->is_null = 1;
+		return 0;
+	}
 	switch (col->col_type) {
 		case MDB_TEXT:
-			field->value = g_strdup(s);
-			field->siz = strlen(s);
+			len = convert_text(mdb, s, f->text->len, buf, MAX_ROW_SIZE);
+			if (len > col->col_size) {
+				fprintf(stderr, "Value too long for column %s\n", col->name);
+				return 1;
+			}
+			field->siz = len;
+			break;
+		case MDB_MEMO:
+			/* two bytes per input byte is enough for any text */
+			tmp = g_malloc(f->text->len * 2 + 2);
+			len = convert_text(mdb, s, f->text->len, tmp, f->text->len * 2 + 2);
+			field->siz = mdb_lval_put(table, tmp, len, buf, MEMO_INLINE_MAX);
+			g_free(tmp);
+			if (field->siz < 0) return 1;
+			break;
+		case MDB_OLE:
+			field->siz = mdb_lval_put(table, s, f->text->len, buf, MEMO_INLINE_MAX);
+			if (field->siz < 0) return 1;
 			break;
 		case MDB_BYTE:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			((unsigned char *)field->value)[0] = any.i;
+			l = strtol(s, &c, 10);
+			if (*c || l < 0 || l > 255) return 1;
+			buf[0] = l;
 			break;
 		case MDB_INT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			mdb_put_int16(field->value, 0, any.i);
+			l = strtol(s, &c, 10);
+			if (*c || l < G_MININT16 || l > G_MAXINT16) return 1;
+			mdb_put_int16(buf, 0, l);
 			break;
 		case MDB_LONGINT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			mdb_put_int32(field->value, 0, any.i);
+			l = strtol(s, &c, 10);
+			if (*c || l < G_MININT32 || l > G_MAXINT32) return 1;
+			mdb_put_int32(buf, 0, l);
 			break;
-		case MDB_BOOL:
-			if (*s == '1') {
-				field->is_null = 1;
-			} else if (*s == '0') {
-				field->is_null = 0;
-			} else {
-				fprintf(stderr, "%c is not a valid value for type BOOLEAN\n", *s);
-				return 1;
-			}
-			/*
 		case MDB_FLOAT:
-			any.d = strtod(s, &c);
+			sf.f = strtod(s, &c);
 			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			mdb_put_single(field.value, 0, any.i);
+			mdb_put_int32(buf, 0, sf.g);
 			break;
 		case MDB_DOUBLE:
-			any.d = strtod(s, &c);
+			df.d = strtod(s, &c);
 			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			mdb_put_double(field.value, 0, any.i);
+			mdb_put_int32(buf, 0, df.g & 0xffffffff);
+			mdb_put_int32(buf, 4, df.g >> 32);
+			break;
+		case MDB_DATETIME:
+			if (!parse_date(s, &df.d)) return 1;
+			mdb_put_int32(buf, 0, df.g & 0xffffffff);
+			mdb_put_int32(buf, 4, df.g >> 32);
 			break;
-		*/
-			/*
 		case MDB_MONEY:
-		case MDB_SDATETIME:
-		case MDB_OLE:
-		case MDB_MEMO:
-		case MDB_REPID:
+			if (!parse_scaled(s, 4, &v, &neg) || v > G_MAXINT64) return 1;
+			if (neg) v = -v;
+			mdb_put_int32(buf, 0, v & 0xffffffff);
+			mdb_put_int32(buf, 4, v >> 32);
+			break;
 		case MDB_NUMERIC:
-			*/
+			/* sign byte, then 32 bit words most significant first */
+			if (!parse_scaled(s, col->col_scale, &v, &neg)) return 1;
+			memset(buf, 0, 17);
+			buf[0] = neg ? 0x80 : 0;
+			mdb_put_int32(buf, 9, v >> 32);
+			mdb_put_int32(buf, 13, v & 0xffffffff);
+			break;
+		case MDB_REPID:
+			if (sscanf(s, "{%4x%4x-%4x-%4x-%4x-%4x%4x%4x}", &uuid[0], &uuid[1],
+			 &uuid[2], &uuid[3], &uuid[4], &uuid[5], &uuid[6], &uuid[7]) != 8)
+				return 1;
+			for (len=0;len<8;len++)
+				mdb_put_int16(buf, len*2, uuid[len]);
+			break;
 		default:
 			fprintf(stderr,"Conversion of type %02x not supported yet.\n", col->col_type);
 			return 1;
@@ -102,93 +372,108 @@ convert_field(MdbColumn *col, char *s, MdbField *field)
 	}
 	return 0;
 }
+/*
+ * Long values are written to LVAL pages as they are converted, so they go
+ * last, once the rest of the row is known to be good, and are deleted
+ * again if one of them fails.
+ */
 int
-prep_row(MdbTableDef *table, char *line, MdbField *fields, char *delim)
+prep_row(MdbTableDef *table, CsvReader *csv, MdbField *fields, unsigned char **values)
 {
 	MdbColumn *col;
-	char **sarray, *s;
-	unsigned int i;
+	unsigned int i, j;
+	int pass, is_lval;
 
-	/*
-	 * pull apart the row and turn it into something respectable
-	 */
-	g_strdelimit(line, delim, '\n');
-	sarray = g_strsplit (line, "\n", 0);
-	for (i=0; (s = sarray[i]); i++) {
-		if (!strlen(s)) continue;
-		if (i >= table->num_cols) {
-			fprintf(stderr, "Number of columns in file exceeds number in table.\n");
-			g_strfreev(sarray);
-			return 0;
-		}
-		if (s[0]=='"' && s[strlen(s)-1]=='"') {
-			s[strlen(s)-1] = '\0';
-			memmove(s+1, s, strlen(s));
-		}
-		printf("field = %s\n", s);
-		col = g_ptr_array_index (table->columns, i);
-		if (convert_field(col, s, &fields[i])) {
+	if (csv->num_fields != table->num_cols) {
+		fprintf(stderr, "Row has %d columns, but table has %d\n",
+			csv->num_fields, table->num_cols);
+		return 0;
+	}
+	for (pass=0;pass<2;pass++) {
+		for (i=0;i<table->num_cols;i++) {
+			col = g_ptr_array_index (table->columns, i);
+			is_lval = col->col_type == MDB_MEMO || col->col_type == MDB_OLE;
+			if (is_lval != pass)
+				continue;
+			if (!convert_field(table, col,
+			 g_ptr_array_index(csv->fields, i), &fields[i], values[i]))
+				continue;
 			fprintf(stderr, "Format error in column %d\n", i+1);
-			g_strfreev(sarray);
+			for (j=0;pass && j<i;j++) {
+				col = g_ptr_array_index (table->columns, j);
+				if ((col->col_type == MDB_MEMO || col->col_type == MDB_OLE)
+				 && !fields[j].is_null)
+					mdb_lval_delete(table, values[j]);
+			}
 			return 0;
 		}
 	}
-	g_strfreev(sarray);
-
-	/*
-	 * verify number of columns in table against number in row
-	 */
-	if (i < table->num_cols) {
-		fprintf(stderr, "Row has %d columns, but table has %d\n", i, table->num_cols);
-		free_values(fields, i);
-		return 0;
-	}
-	return i-1;
+	return table->num_cols;
 }
 int
 main(int argc, char **argv)
 {
-	int i, row;
+	int i, rc;
+	unsigned long row;
 	MdbHandle *mdb;
 	MdbTableDef *table;
 	MdbField fields[256];
-	char line[MAX_ROW_SIZE];
+	/* one buffer per column, reused for every row */
+	unsigned char *values[256];
+	MdbBulkInsert *bulk;
+	CsvReader *csv;
+	CsvField *field;
 	int num_fields;
 	/* doesn't handle tables > 256 columns.  Can that happen? */
 	int  opt;
-	FILE *in;
-	char delimiter[2] = ",";
-	char header_rows = 0;
+	char delimiter = ',';
+	int header_rows = 0;
+	int sync = 0;
+	int journal = 0;
 
-	while ((opt=getopt(argc, argv, "H:d:"))!=-1) {
+	while ((opt=getopt(argc, argv, "H:d:SJ"))!=-1) {
 		switch (opt) {
 		case 'H':
 			header_rows = atol(optarg);
 		break;
 		case 'd':
-			delimiter[0] = optarg[0];
+			delimiter = optarg[0];
+		break;
+		case 'S':
+			sync = 1;
+		break;
+		case 'J':
+			journal = 1;
 		break;
 		default:
 		break;
 		}
 	}
-	
-	/* 
-	** optind is now the position of the first non-option arg, 
-	** see getopt(3) 
+
+	/*
+	** optind is now the position of the first non-option arg,
+	** see getopt(3)
 	*/
 	if (argc-optind < 3) {
 		fprintf(stderr,"Usage: %s [options] <database> <table> <csv file>\n",argv[0]);
 		fprintf(stderr,"where options are:\n");
 		fprintf(stderr,"  -H <rows>      skip <rows> header rows\n");
 		fprintf(stderr,"  -d <delimiter> specify a column delimiter\n");
+		fprintf(stderr,"  -S             sync the database to disk when done\n");
+		fprintf(stderr,"  -J             import all rows or none, even after a crash\n");
 		exit(1);
 	}
 
 	if (!(mdb = mdb_open(argv[optind], MDB_WRITABLE))) {
 		exit(1);
 	}
-	
+	if (sync)
+		mdb_set_sync(mdb, MDB_SYNC_DATA);
+	if (journal) {
+		mdb_set_journal(mdb, TRUE);
+		mdb_journal_begin(mdb);
+	}
+
 	table = mdb_read_table_by_name(mdb, argv[argc-2], MDB_TABLE);
 	if (!table) {
 		fprintf(stderr,"Table %s not found in database\n", argv[argc-2]);
@@ -197,37 +482,70 @@ main(int argc, char **argv)
 	mdb_read_columns(table);
 	mdb_read_indices(table);
 	mdb_rewind_table(table);
+	if (table->num_cols > 256) {
+		fprintf(stderr,"Tables with more than 256 columns are not supported\n");
+		exit(1);
+	}
 
 	/*
 	 * open the CSV file and read any header rows
 	 */
-	in = fopen(argv[argc-1], "r");
-	if (!in) {
+	csv = g_malloc0(sizeof(CsvReader));
+	csv->delim = delimiter;
+	csv->fields = g_ptr_array_new();
+	csv->in = fopen(argv[argc-1], "r");
+	if (!csv->in) {
 		fprintf(stderr, "Can not open file %s\n", argv[argc-1]);
 		exit(1);
 	}
 	for (i=0;i<header_rows;i++)
-		if (!fgets(line, MAX_ROW_SIZE, in)) {
+		if (csv_read_record(csv) <= 0) {
 			fprintf(stderr, "Error while reading header column #%d. Check -H parameter.\n", i);
 			exit(1);
 		}
 
+	for (i=0;i<table->num_cols;i++)
+		values[i] = g_malloc(MAX_ROW_SIZE);
+	bulk = mdb_bulk_insert_begin(table);
+	if (!bulk)
+		exit(1);
+
 	row = 1;
-	while (fgets(line, MAX_ROW_SIZE, in)) {
-		num_fields = prep_row(table, line, fields, delimiter);
-		if (!num_fields) {
-			fprintf(stderr, "Aborting import at row %d\n", row);
-			exit(1);
-		}
+	while ((rc = csv_read_record(csv)) > 0) {
+		/* skip blank lines */
+		field = g_ptr_array_index(csv->fields, 0);
+		if (rc == 1 && table->num_cols > 1 && !field->quoted
+		 && !field->text->len)
+			continue;
+		num_fields = prep_row(table, csv, fields, values);
 		/*
 	 	* all the prep work is done, let's add the row
 	 	*/
-		mdb_insert_row(table, num_fields, fields);
+		if (!num_fields || !mdb_bulk_insert_append(bulk, num_fields, fields)) {
+			rc = -1;
+			break;
+		}
+		row++;
+	}
+	/* keep the rows loaded so far consistent even if we stopped early */
+	if (!mdb_bulk_insert_end(bulk) && rc == 0)
+		rc = -1;
+	if (journal && rc == 0 && !mdb_journal_commit(mdb))
+		rc = -1;
+	if (rc < 0) {
+		fprintf(stderr, "Aborting import at row %lu (line %lu)\n", row, csv->line);
+		/* with -J none of the rows are kept */
+		if (journal)
+			mdb_journal_rollback(mdb);
+		mdb_close(mdb);
+		exit(1);
 	}
 
+	for (i=0;i<table->num_cols;i++)
+		g_free(values[i]);
 	mdb_free_tabledef(table);
-	fclose(in);
+	fclose(csv->in);
+	csv_free(csv);
 	mdb_close(mdb);
 	return 0;
 }
-
@@ -0,0 +1,93 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000-2004 Brian Bruns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* this utility builds sidecar indexes for columns of an existing database */
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+int
+main(int argc, char **argv)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	MdbColumn *col;
+	unsigned int i;
+	int opt, j, rows;
+	int remove_idx = 0;
+	int ret = 0;
+	char *path;
+
+	while ((opt=getopt(argc, argv, "d"))!=-1) {
+		switch (opt) {
+		case 'd':
+			remove_idx = 1;
+			break;
+		}
+	}
+	if (argc - optind < 3) {
+		fprintf(stderr, "Usage: %s [-d] <file> <table> <column> [<column> ...]\n", argv[0]);
+		exit(1);
+	}
+
+	if (!(mdb = mdb_open(argv[optind], MDB_NOFLAGS))) {
+		fprintf(stderr, "Couldn't open database.\n");
+		exit(1);
+	}
+	table = mdb_read_table_by_name(mdb, argv[optind + 1], MDB_TABLE);
+	if (!table) {
+		fprintf(stderr, "Table %s not found in database\n", argv[optind + 1]);
+		mdb_close(mdb);
+		exit(1);
+	}
+	mdb_read_columns(table);
+
+	for (j = optind + 2; j < argc; j++) {
+		col = NULL;
+		for (i=0;i<table->num_cols;i++) {
+			col = g_ptr_array_index(table->columns, i);
+			if (!strcasecmp(col->name, argv[j]))
+				break;
+			col = NULL;
+		}
+		if (!col) {
+			fprintf(stderr, "Column %s not found in table %s\n", argv[j], table->name);
+			ret = 1;
+			continue;
+		}
+		path = mdb_sidecar_path(table, col);
+		if (remove_idx) {
+			if (unlink(path)) {
+				fprintf(stderr, "Couldn't remove %s\n", path);
+				ret = 1;
+			}
+		} else if ((rows = mdb_sidecar_build(table, col)) < 0) {
+			ret = 1;
+		} else {
+			printf("%s: %d rows\n", path, rows);
+		}
+		g_free(path);
+	}
+
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+
+	return ret;
+}
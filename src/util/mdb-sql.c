@@ -204,6 +204,8 @@ run_query(FILE *out, MdbSQL *sql, char *mybuf, char *delimiter)
 			if (table->sarg_tree) mdb_sql_dump_node(table->sarg_tree, 0);
 			if (sql->cur_table->strategy == MDB_TABLE_SCAN)
 				printf("Table scanning %s\n", table->name);
+			else if (sql->cur_table->strategy == MDB_BITMAP_SCAN)
+				printf("Bitmap scanning %s (%u rows)\n", table->name, table->batch_sz);
 			else 
 				printf("Index scanning %s using %s\n", table->name, table->scan_idx->name);
 		}
@@ -0,0 +1,159 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Regression tests for prepared statements.  Each query is prepared once
+ * and executed twice, and both runs must return the same rows:
+ *
+ *	sqltest Northwind.mdb Orders CustomerID
+ */
+#include "mdbtools.h"
+#include "mdbsql.h"
+
+/* the rows of the statement as one string per row */
+static GPtrArray *
+fetch_rows(MdbSQL *sql)
+{
+	GPtrArray *rows = g_ptr_array_new();
+	GString *row;
+	unsigned int j;
+
+	while (mdb_fetch_row(sql->cur_table)) {
+		row = g_string_new(NULL);
+		for (j=0;j<sql->num_columns;j++) {
+			g_string_append(row, (char *) sql->bound_values[j]);
+			g_string_append_c(row, '\t');
+		}
+		g_ptr_array_add(rows, g_string_free(row, FALSE));
+	}
+	return rows;
+}
+static void
+free_rows(GPtrArray *rows)
+{
+	unsigned int i;
+
+	if (!rows)
+		return;
+	for (i=0;i<rows->len;i++)
+		g_free(g_ptr_array_index(rows, i));
+	g_ptr_array_free(rows, TRUE);
+}
+static int
+same_rows(GPtrArray *rows1, GPtrArray *rows2)
+{
+	unsigned int i;
+
+	if (rows1->len != rows2->len) {
+		fprintf(stderr, "%u rows the first time, %u the second\n",
+			rows1->len, rows2->len);
+		return 0;
+	}
+	for (i=0;i<rows1->len;i++) {
+		if (strcmp(g_ptr_array_index(rows1, i), g_ptr_array_index(rows2, i))) {
+			fprintf(stderr, "row %u differs the second time\n", i);
+			return 0;
+		}
+	}
+	return 1;
+}
+/*
+ * Prepare query and execute it twice.  Joins, aggregates and sorts read
+ * their inputs while being set up, so the second run has to set them up
+ * again.
+ */
+static int
+test_execute_twice(MdbSQL *sql, char *query)
+{
+	GPtrArray *rows1 = NULL, *rows2 = NULL;
+	unsigned int j;
+	int ret = 0;
+
+	if (!mdb_sql_prepare(sql, query)) {
+		fprintf(stderr, "%s\n", mdb_sql_last_error(sql));
+		return 0;
+	}
+	if (!mdb_sql_execute(sql))
+		goto done;
+	rows1 = fetch_rows(sql);
+	if (!mdb_sql_execute(sql))
+		goto done;
+	rows2 = fetch_rows(sql);
+	if (!rows1->len)
+		fprintf(stderr, "%s returned no rows\n", query);
+	else
+		ret = same_rows(rows1, rows2);
+
+done:
+	if (mdb_sql_has_error(sql))
+		fprintf(stderr, "%s\n", mdb_sql_last_error(sql));
+	free_rows(rows1);
+	free_rows(rows2);
+	for (j=0;j<sql->num_columns;j++)
+		g_free(sql->bound_values[j]);
+	mdb_sql_reset(sql);
+	return ret;
+}
+
+static int
+run_test(const char *name, int ok)
+{
+	printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+	return ok;
+}
+int
+main(int argc, char **argv)
+{
+	MdbSQL *sql;
+	char *query;
+	int ok = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <file> <table> <column>\n", argv[0]);
+		exit(1);
+	}
+
+	sql = mdb_sql_init();
+	if (!mdb_sql_open(sql, argv[1])) {
+		mdb_sql_exit(sql);
+		exit(1);
+	}
+
+	query = g_strdup_printf("SELECT %s, COUNT(*) FROM %s GROUP BY %s",
+		argv[3], argv[2], argv[3]);
+	ok &= run_test("prepared aggregate executed twice",
+		test_execute_twice(sql, query));
+	g_free(query);
+
+	query = g_strdup_printf("SELECT %s FROM %s ORDER BY %s",
+		argv[3], argv[2], argv[3]);
+	ok &= run_test("prepared sort executed twice",
+		test_execute_twice(sql, query));
+	g_free(query);
+
+	query = g_strdup_printf("SELECT a.%s FROM %s a JOIN %s b ON a.%s = b.%s",
+		argv[3], argv[2], argv[2], argv[3], argv[3]);
+	ok &= run_test("prepared join executed twice",
+		test_execute_twice(sql, query));
+	g_free(query);
+
+	mdb_sql_exit(sql);
+	g_free(sql);
+
+	return ok ? 0 : 1;
+}
@@ -32,6 +32,7 @@ char *sargname = NULL;
 char *updstr = NULL;
 char data[255];
 int len;
+int rc = 0;
 
 
 	if (argc<4) {
@@ -58,12 +59,15 @@ int len;
 		printf("current value of %s is %s, changing to %s\n", colname, data, colval);
 		len = strlen(colval);
 		strcpy(data,colval);
-		mdb_update_row(table);
+		if (!mdb_update_row(table)) {
+			fprintf(stderr, "Update of %s failed\n", colname);
+			rc = 1;
+		}
 		mdb_free_tabledef(table);
 	}
 
 	mdb_close(mdb);
-	return 0;
+	return rc;
 }
 
 void read_to_row(MdbTableDef *table, char *sargname)
@@ -0,0 +1,1024 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Regression tests for the write paths.  Each test changes the file it is
+ * given, so run it on a scratch copy:
+ *
+ *	cp Northwind.mdb /tmp/test.mdb && writetest /tmp/test.mdb Orders
+ *
+ * After writing, each test closes the file, opens it again and checks the
+ * rows of the table and every one of its indexes, looking each row up by
+ * its key where we can encode it.  mdb-import is run from
+ * the directory writetest is in.
+ */
+#include "mdbtools.h"
+
+#undef MDB_BIND_SIZE
+#define MDB_BIND_SIZE 200000
+
+#define GROW_BY 16
+/* pages with less room than this have a row moved off them */
+#define MOVE_FREE_MAX 256
+
+static char *import_prog;
+
+typedef struct {
+	int start;
+	int size;
+	guint16 flags;
+} RowPos;
+
+/* where each row on the page in mdb->pg_buf is, whatever the slot order */
+static RowPos *
+read_rows(MdbHandle *mdb, int *num_rows)
+{
+	int rco = mdb->fmt->row_count_offset;
+	RowPos *rows;
+	int i, j, end;
+
+	*num_rows = mdb_get_int16(mdb->pg_buf, rco);
+	rows = g_malloc0(sizeof(RowPos) * (*num_rows + 1));
+	for (i=0;i<*num_rows;i++) {
+		rows[i].start = mdb_get_int16(mdb->pg_buf, rco + 2 + i*2);
+		rows[i].flags = rows[i].start & ~OFFSET_MASK;
+		rows[i].start &= OFFSET_MASK;
+	}
+	for (i=0;i<*num_rows;i++) {
+		end = mdb->fmt->pg_size;
+		for (j=0;j<*num_rows;j++)
+			if (rows[j].start > rows[i].start && rows[j].start < end)
+				end = rows[j].start;
+		rows[i].size = end - rows[i].start;
+	}
+	return rows;
+}
+static int
+check_row(MdbHandle *mdb, int row, RowPos *pos, unsigned char *data, int size)
+{
+	if (pos->size != size || memcmp(mdb->pg_buf + pos->start, data, size)) {
+		fprintf(stderr, "row %d doesn't hold what was written\n", row);
+		return 0;
+	}
+	return 1;
+}
+/*
+ * Check that the rows of page pg hold saved, apart from row, which holds
+ * data, and that the free space recorded on the page is right.
+ */
+static int
+check_page(MdbHandle *mdb, guint32 pg, unsigned char **saved, RowPos *was, int row, unsigned char *data, int size)
+{
+	RowPos *rows;
+	int num_rows, i, lowest, ret = 1;
+
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	rows = read_rows(mdb, &num_rows);
+	lowest = mdb->fmt->pg_size;
+	for (i=0;i<num_rows && ret;i++) {
+		if (rows[i].flags != was[i].flags) {
+			fprintf(stderr, "row %d lost its flags\n", i);
+			ret = 0;
+		} else if (i == row) {
+			ret = check_row(mdb, i, &rows[i], data, size);
+		} else {
+			ret = check_row(mdb, i, &rows[i], saved[i], was[i].size);
+		}
+		if (rows[i].start < lowest)
+			lowest = rows[i].start;
+	}
+	if (ret && mdb_get_int16(mdb->pg_buf, 2) !=
+	    lowest - mdb->fmt->row_count_offset - 2 - num_rows*2) {
+		fprintf(stderr, "free space of page %lu is wrong\n",
+			(unsigned long) pg);
+		ret = 0;
+	}
+	g_free(rows);
+	return ret;
+}
+/*
+ * Crack the row in slot row of page pg into fields, following it if it
+ * was moved.  Returns the number of fields, or 0 if there is no row.
+ */
+static int
+read_row(MdbTableDef *table, guint32 pg, int row, MdbField *fields)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	RowPos *rows;
+	guint32 pg_row;
+	int num_rows, ret = 0;
+
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	rows = read_rows(mdb, &num_rows);
+	if (row < num_rows && (rows[row].flags & 0x8000) && rows[row].size == 4) {
+		pg_row = mdb_get_int32(mdb->pg_buf, rows[row].start);
+		g_free(rows);
+		if (!mdb_read_pg(mdb, pg_row >> 8))
+			return 0;
+		rows = read_rows(mdb, &num_rows);
+		row = pg_row & 0xff;
+	} else if (row < num_rows && (rows[row].flags & 0x4000)) {
+		row = num_rows;
+	}
+	if (row < num_rows)
+		ret = mdb_crack_row(table, rows[row].start,
+			rows[row].start + rows[row].size - 1, fields);
+	g_free(rows);
+	return ret;
+}
+static int
+cmp_rows(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+/*
+ * Every row of table as a line of text, sorted so tables can be compared
+ * whatever order their rows are stored in.  OLE values are left out.  If
+ * csv is given, the rows are also written to it the way mdb-import reads
+ * them, nulls as empty fields.
+ */
+static GPtrArray *
+read_table(MdbTableDef *table, FILE *csv)
+{
+	GPtrArray *rows = g_ptr_array_new();
+	MdbColumn *col;
+	GString *line;
+	char **values, *c;
+	unsigned int i;
+
+	values = g_malloc(table->num_cols * sizeof(char *));
+	for (i=0;i<table->num_cols;i++) {
+		values[i] = g_malloc0(MDB_BIND_SIZE);
+		mdb_bind_column(table, i+1, values[i], NULL);
+	}
+	mdb_rewind_table(table);
+	while (mdb_fetch_row(table)) {
+		line = g_string_new(NULL);
+		for (i=0;i<table->num_cols;i++) {
+			col = g_ptr_array_index(table->columns, i);
+			if (col->col_type == MDB_OLE)
+				values[i][0] = '\0';
+			g_string_append(line, values[i]);
+			g_string_append_c(line, '\t');
+			if (!csv)
+				continue;
+			if (i)
+				fputc(',', csv);
+			if (!values[i][0])
+				continue;
+			fputc('"', csv);
+			for (c = values[i]; *c; c++) {
+				if (*c == '"')
+					fputc('"', csv);
+				fputc(*c, csv);
+			}
+			fputc('"', csv);
+		}
+		if (csv)
+			fputc('\n', csv);
+		g_ptr_array_add(rows, g_string_free(line, FALSE));
+	}
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		col->bind_ptr = NULL;
+		g_free(values[i]);
+	}
+	g_free(values);
+	g_ptr_array_sort(rows, cmp_rows);
+	return rows;
+}
+static void
+free_rows(GPtrArray *rows)
+{
+	unsigned int i;
+
+	if (!rows)
+		return;
+	for (i=0;i<rows->len;i++)
+		g_free(g_ptr_array_index(rows, i));
+	g_ptr_array_free(rows, TRUE);
+}
+/* rows with each of them in it twice */
+static GPtrArray *
+double_rows(GPtrArray *rows)
+{
+	GPtrArray *twice = g_ptr_array_new();
+	unsigned int i;
+
+	for (i=0;i<rows->len;i++) {
+		g_ptr_array_add(twice, g_strdup(g_ptr_array_index(rows, i)));
+		g_ptr_array_add(twice, g_strdup(g_ptr_array_index(rows, i)));
+	}
+	g_ptr_array_sort(twice, cmp_rows);
+	return twice;
+}
+/* the fields of the index's key columns, in key order */
+static void
+index_fields(MdbIndex *idx, int num_fields, MdbField *fields, MdbField *idx_fields)
+{
+	unsigned int i;
+	int j;
+
+	for (i=0;i<idx->num_keys;i++) {
+		for (j=0;j<num_fields;j++) {
+			if (fields[j].colnum == idx->key_col_num[i]-1)
+				idx_fields[i] = fields[j];
+		}
+	}
+}
+static int
+cmp_keys(unsigned char *key1, int len1, unsigned char *key2, int len2)
+{
+	int rc = memcmp(key1, key2, MIN(len1, len2));
+
+	return rc ? rc : len1 - len2;
+}
+/*
+ * Walk every index of table: each entry has to point at a row, the keys
+ * have to be in order, and there has to be an entry for every row.
+ */
+static int
+check_indexes(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb, *mdbidx;
+	MdbIndex *idx;
+	MdbIndexChain chain;
+	MdbField fields[256], idx_fields[MDB_MAX_IDX_COLS];
+	unsigned char key[MDB_MAX_IDX_COLS * 256], prev[MDB_MAX_IDX_COLS * 256];
+	unsigned long entries;
+	unsigned int i;
+	int num_fields, key_len, prev_len, ret = 1;
+	guint32 pg;
+	guint16 row;
+
+	for (i=0;i<table->num_idxs && ret;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		/* foreign key references have no pages of their own */
+		if (idx->index_type == 2)
+			continue;
+		memset(&chain, 0, sizeof(MdbIndexChain));
+		mdbidx = mdb_clone_handle(mdb);
+		mdb_read_pg(mdbidx, idx->first_pg);
+		entries = 0;
+		prev_len = -1;
+		while (ret && mdb_index_find_next(mdbidx, idx, &chain, &pg, &row)) {
+			entries++;
+			if (!(num_fields = read_row(table, pg, row, fields))) {
+				fprintf(stderr, "index %s points at page %lu row %d, which has no row\n",
+					idx->name, (unsigned long) pg, row);
+				ret = 0;
+				break;
+			}
+			index_fields(idx, num_fields, fields, idx_fields);
+			if ((key_len = mdb_index_build_key(table, idx, idx_fields, key)) < 0)
+				continue;
+			if (prev_len >= 0 && cmp_keys(prev, prev_len, key, key_len) > 0) {
+				fprintf(stderr, "index %s is out of order at page %lu row %d\n",
+					idx->name, (unsigned long) pg, row);
+				ret = 0;
+			}
+			memcpy(prev, key, key_len);
+			prev_len = key_len;
+		}
+		mdb_close(mdbidx);
+		if (ret && (entries > table->num_rows || (entries < table->num_rows
+		 && !(idx->flags & MDB_IDX_IGNORENULLS)))) {
+			fprintf(stderr, "index %s has %lu entries for %lu rows\n",
+				idx->name, entries, (unsigned long) table->num_rows);
+			ret = 0;
+		}
+	}
+	return ret;
+}
+/*
+ * Look every row of table up by its key in each index we can add entries
+ * to, the way inserts find where the entry goes.
+ */
+static int
+seek_rows(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb, *mdbidx;
+	MdbIndex *idx;
+	MdbIndexChain chain;
+	MdbField fields[256], idx_fields[MDB_MAX_IDX_COLS];
+	unsigned char key[MDB_MAX_IDX_COLS * 256];
+	unsigned int i, j;
+	int num_fields, key_len, is_null, ret = 1;
+	guint32 pg;
+	int row;
+
+	mdbidx = mdb_clone_handle(mdb);
+	mdb_rewind_table(table);
+	while (ret && mdb_fetch_row(table)) {
+		pg = table->cur_phys_pg;
+		row = table->cur_row - 1;
+		num_fields = read_row(table, pg, row, fields);
+		for (i=0;i<table->num_idxs && ret;i++) {
+			idx = g_ptr_array_index(table->indices, i);
+			if (!mdb_index_is_writable(idx))
+				continue;
+			index_fields(idx, num_fields, fields, idx_fields);
+			for (j=0,is_null=1;j<idx->num_keys;j++)
+				is_null &= idx_fields[j].is_null;
+			if (is_null && (idx->flags & MDB_IDX_IGNORENULLS))
+				continue;
+			if ((key_len = mdb_index_build_key(table, idx, idx_fields, key)) < 0)
+				continue;
+			if (!mdb_index_seek_row(mdbidx, idx, &chain, key, key_len, pg, row)) {
+				fprintf(stderr, "index %s has no entry for page %lu row %d\n",
+					idx->name, (unsigned long) pg, row);
+				ret = 0;
+			}
+		}
+	}
+	mdb_close(mdbidx);
+	return ret;
+}
+/*
+ * Open filename again and check that tabname holds the rows expected, or
+ * as many rows if only that is known, and that its indexes match them.
+ */
+static int
+check_table(const char *filename, const char *tabname, GPtrArray *expected, unsigned int num_rows)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	GPtrArray *rows;
+	unsigned int i;
+	int ret = 1;
+
+	if (!(mdb = mdb_open(filename, MDB_NOFLAGS)))
+		return 0;
+	table = mdb_read_table_by_name(mdb, (char *) tabname, MDB_TABLE);
+	if (!table) {
+		fprintf(stderr, "No table named %s\n", tabname);
+		mdb_close(mdb);
+		return 0;
+	}
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+	rows = read_table(table, NULL);
+	if (expected)
+		num_rows = expected->len;
+	if (rows->len != num_rows || table->num_rows != num_rows) {
+		fprintf(stderr, "%s has %u rows (%lu counted), expected %u\n",
+			tabname, rows->len, (unsigned long) table->num_rows, num_rows);
+		ret = 0;
+	}
+	for (i=0;ret && expected && i<rows->len;i++) {
+		if (strcmp(g_ptr_array_index(rows, i), g_ptr_array_index(expected, i))) {
+			fprintf(stderr, "%s doesn't hold the rows written: %s\n",
+				tabname, (char *) g_ptr_array_index(rows, i));
+			ret = 0;
+		}
+	}
+	if (ret)
+		ret = check_indexes(table) && seek_rows(table);
+	free_rows(rows);
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+	return ret;
+}
+/* can rows be added to table with its indexes kept up to date? */
+static int
+indexes_writable(MdbTableDef *table)
+{
+	MdbIndex *idx;
+	unsigned int i;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type != 2 && !mdb_index_is_writable(idx)) {
+			fprintf(stderr, "index %s can't be added to\n", idx->name);
+			return 0;
+		}
+	}
+	return 1;
+}
+static MdbTableDef *
+open_table(MdbHandle *mdb, const char *tabname)
+{
+	MdbTableDef *table;
+
+	table = mdb_read_table_by_name(mdb, (char *) tabname, MDB_TABLE);
+	if (!table) {
+		fprintf(stderr, "No table named %s\n", tabname);
+		return NULL;
+	}
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+	return table;
+}
+/*
+ * Store the rows of a data page of table in reverse slot order, then grow
+ * and shrink the last slot's row, which is stored above all the others.
+ */
+static int
+test_resize_unordered(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	RowPos *rows = NULL;
+	GPtrArray *before = NULL;
+	unsigned char *orig = NULL, **saved = NULL, *grown = NULL;
+	int rco, pg_size, num_rows = 0, pos, row, i, ret = 0;
+	guint32 pg = 0;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	rco = mdb->fmt->row_count_offset;
+	pg_size = mdb->fmt->pg_size;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	before = read_table(table, NULL);
+	mdb_rewind_table(table);
+	while (mdb_fetch_row(table)) {
+		if (mdb_get_int16(mdb->pg_buf, rco) >= 2
+		 && mdb_get_int16(mdb->pg_buf, 2) >= GROW_BY) {
+			pg = table->cur_phys_pg;
+			break;
+		}
+	}
+	if (!pg) {
+		fprintf(stderr, "%s has no page with two rows and room to grow\n",
+			tabname);
+		goto done;
+	}
+
+	orig = g_memdup(mdb->pg_buf, pg_size);
+	rows = read_rows(mdb, &num_rows);
+	saved = g_malloc0(sizeof(unsigned char *) * num_rows);
+	for (i=0;i<num_rows;i++)
+		saved[i] = g_memdup(orig + rows[i].start, rows[i].size);
+
+	/* the last slot's row goes highest, the first slot's lowest */
+	pos = pg_size;
+	for (i=num_rows-1;i>=0;i--) {
+		pos -= rows[i].size;
+		memcpy(mdb->pg_buf + pos, saved[i], rows[i].size);
+		mdb_put_int16(mdb->pg_buf, rco + 2 + i*2, pos | rows[i].flags);
+	}
+	mdb_put_int16(mdb->pg_buf, 2, pos - rco - 2 - num_rows*2);
+	if (!mdb_write_pg(mdb, pg))
+		goto done;
+
+	row = num_rows - 1;
+	grown = g_malloc(rows[row].size + GROW_BY);
+	memcpy(grown, saved[row], rows[row].size);
+	memset(grown + rows[row].size, 0xaa, GROW_BY);
+
+	table->cur_phys_pg = pg;
+	if (!mdb_read_pg(mdb, pg)
+	 || mdb_replace_row(table, row, grown, rows[row].size + GROW_BY)) {
+		fprintf(stderr, "growing row %d of page %lu failed\n",
+			row, (unsigned long) pg);
+		goto done;
+	}
+	if (!check_page(mdb, pg, saved, rows, row, grown, rows[row].size + GROW_BY))
+		goto done;
+	if (!mdb_read_pg(mdb, pg)
+	 || mdb_replace_row(table, row, saved[row], rows[row].size)) {
+		fprintf(stderr, "shrinking row %d of page %lu failed\n",
+			row, (unsigned long) pg);
+		goto done;
+	}
+	if (!mdb_flush(mdb))
+		goto done;
+	mdb_free_tabledef(table);
+	table = NULL;
+	mdb_close(mdb);
+	mdb = NULL;
+
+	/* what was written must be what is read back */
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		goto done;
+	if (!check_page(mdb, pg, saved, rows, -1, NULL, 0))
+		goto done;
+
+	/* put the page back the way it was */
+	memcpy(mdb->pg_buf, orig, pg_size);
+	if (!mdb_write_pg(mdb, pg) || !mdb_flush(mdb))
+		goto done;
+	mdb_close(mdb);
+	mdb = NULL;
+	ret = check_table(filename, tabname, before, 0);
+
+done:
+	if (table)
+		mdb_free_tabledef(table);
+	if (mdb)
+		mdb_close(mdb);
+	for (i=0;saved && i<num_rows;i++)
+		g_free(saved[i]);
+	free_rows(before);
+	g_free(saved);
+	g_free(rows);
+	g_free(orig);
+	g_free(grown);
+	return ret;
+}
+/*
+ * Grow a TEXT column no index uses past the room left on the row's page,
+ * so mdb_update_row() moves the row and leaves a pointer to it behind.
+ * Returns -1 if the table has no such column or no such page.
+ */
+static int
+test_move_row(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	MdbColumn *col = NULL;
+	MdbIndex *idx;
+	MdbField fields[256];
+	RowPos *rows = NULL;
+	GPtrArray *before = NULL;
+	unsigned char *grown = NULL;
+	unsigned int i, j, k, num_before = 0;
+	int colnum = 0, num_rows, num_fields, row = 0, free_space, len = 0, ret = 0;
+	int updated;
+	guint32 pg = 0, pg_row;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	for (i=0;i<table->num_cols && !col;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		/* mdb_update_row() checks the column numbered i as well */
+		for (j=0;j<table->num_idxs && col;j++) {
+			idx = g_ptr_array_index(table->indices, j);
+			for (k=0;k<idx->num_keys;k++) {
+				if (idx->key_col_num[k] == i || idx->key_col_num[k] == i+1)
+					col = NULL;
+			}
+		}
+		if (col && (col->col_type != MDB_TEXT || col->is_fixed))
+			col = NULL;
+		colnum = i;
+	}
+	before = read_table(table, NULL);
+	num_before = before->len;
+	mdb_rewind_table(table);
+	/*
+	 * a row that hasn't been moved yet, on a page with little room left,
+	 * with a value in the column to grow
+	 */
+	while (col && mdb_fetch_row(table)) {
+		if (mdb_get_int16(mdb->pg_buf, 2) < MOVE_FREE_MAX
+		 && !(mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 +
+		    (table->cur_row - 1) * 2) & 0x8000)
+		 && read_row(table, table->cur_phys_pg, table->cur_row - 1, fields) > colnum
+		 && !fields[colnum].is_null) {
+			pg = table->cur_phys_pg;
+			row = table->cur_row - 1;
+			break;
+		}
+	}
+	if (!pg) {
+		fprintf(stderr, "%s has no row to move\n", tabname);
+		ret = -1;
+		goto done;
+	}
+
+	free_space = mdb_get_int16(mdb->pg_buf, 2);
+	if ((num_fields = read_row(table, pg, row, fields)) <= colnum)
+		goto done;
+	/* text stays in the encoding it is in, a character at a time */
+	grown = g_malloc(fields[colnum].siz + (free_space + 2) * 2);
+	memcpy(grown, fields[colnum].value, fields[colnum].siz);
+	len = fields[colnum].siz;
+	while (len <= fields[colnum].siz + free_space) {
+		grown[len++] = 'x';
+		if (!IS_JET3(mdb) && !(fields[colnum].siz >= 2 &&
+		    grown[0] == 0xff && grown[1] == 0xfe))
+			grown[len++] = 0;
+	}
+
+	if (!mdb_read_pg(mdb, pg))
+		goto done;
+	table->cur_phys_pg = pg;
+	table->cur_row = row + 1;
+	col->bind_ptr = grown;
+	col->len_ptr = &len;
+	updated = mdb_update_row(table);
+	col->bind_ptr = NULL;
+	col->len_ptr = NULL;
+	if (!updated) {
+		fprintf(stderr, "moving row %d of page %lu failed\n",
+			row, (unsigned long) pg);
+		goto done;
+	}
+	if (!mdb_flush(mdb))
+		goto done;
+	mdb_free_tabledef(table);
+	table = NULL;
+	mdb_close(mdb);
+	mdb = NULL;
+
+	/* the slot points at the row, which holds the new value */
+	if (!(mdb = mdb_open(filename, MDB_NOFLAGS)) || !(table = open_table(mdb, tabname)))
+		goto done;
+	if (!mdb_read_pg(mdb, pg))
+		goto done;
+	rows = read_rows(mdb, &num_rows);
+	if (row >= num_rows || !(rows[row].flags & 0x8000) || rows[row].size != 4) {
+		fprintf(stderr, "row %d of page %lu wasn't moved\n", row, (unsigned long) pg);
+		goto done;
+	}
+	pg_row = mdb_get_int32(mdb->pg_buf, rows[row].start);
+	g_free(rows);
+	if (!mdb_read_pg(mdb, pg_row >> 8))
+		goto done;
+	rows = read_rows(mdb, &num_rows);
+	if ((int) (pg_row & 0xff) >= num_rows || !(rows[pg_row & 0xff].flags & 0x4000)) {
+		fprintf(stderr, "the moved row isn't flagged as deleted\n");
+		goto done;
+	}
+	if ((num_fields = read_row(table, pg, row, fields)) <= colnum
+	 || fields[colnum].siz != len || memcmp(fields[colnum].value, grown, len)) {
+		fprintf(stderr, "the moved row doesn't hold what was written\n");
+		goto done;
+	}
+	mdb_free_tabledef(table);
+	table = NULL;
+	mdb_close(mdb);
+	mdb = NULL;
+	ret = check_table(filename, tabname, NULL, num_before);
+
+done:
+	if (table)
+		mdb_free_tabledef(table);
+	if (mdb)
+		mdb_close(mdb);
+	free_rows(before);
+	g_free(rows);
+	g_free(grown);
+	return ret;
+}
+/*
+ * Copies of the fields of every row of table, as mdb_crack_row() gives
+ * them.  Long values aren't copied, the copies point at the same ones.
+ */
+static GPtrArray *
+copy_rows(MdbTableDef *table)
+{
+	GPtrArray *copies = g_ptr_array_new();
+	MdbField fields[256], *copy;
+	unsigned int i;
+	int num_fields;
+
+	mdb_rewind_table(table);
+	while (mdb_fetch_row(table)) {
+		num_fields = read_row(table, table->cur_phys_pg, table->cur_row - 1, fields);
+		if ((unsigned int) num_fields != table->num_cols) {
+			fprintf(stderr, "row %d of page %lu has %d of %u columns\n",
+				table->cur_row - 1, (unsigned long) table->cur_phys_pg,
+				num_fields, table->num_cols);
+			break;
+		}
+		copy = g_malloc0(sizeof(MdbField) * table->num_cols);
+		for (i=0;i<table->num_cols;i++) {
+			copy[i] = fields[i];
+			copy[i].value = (fields[i].value && fields[i].siz > 0) ?
+				g_memdup(fields[i].value, fields[i].siz) : NULL;
+		}
+		g_ptr_array_add(copies, copy);
+	}
+	return copies;
+}
+static void
+free_copies(GPtrArray *copies, unsigned int num_cols)
+{
+	MdbField *copy;
+	unsigned int i, j;
+
+	for (i=0;i<copies->len;i++) {
+		copy = g_ptr_array_index(copies, i);
+		for (j=0;j<num_cols;j++)
+			g_free(copy[j].value);
+		g_free(copy);
+	}
+	g_ptr_array_free(copies, TRUE);
+}
+/*
+ * Insert a copy of the first row with mdb_insert_row(), which puts the
+ * entry of the new row on the leaf of each index where its key goes.
+ * Returns -1 if the table has an index we can't add entries to.
+ */
+static int
+test_insert_row(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	GPtrArray *copies;
+	unsigned int num_cols, num_rows;
+	int ret;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	if (!indexes_writable(table)) {
+		mdb_free_tabledef(table);
+		mdb_close(mdb);
+		return -1;
+	}
+	num_cols = table->num_cols;
+	num_rows = table->num_rows;
+	copies = copy_rows(table);
+	ret = copies->len > 0
+	 && mdb_insert_row(table, num_cols, g_ptr_array_index(copies, 0))
+	 && mdb_flush(mdb);
+	free_copies(copies, num_cols);
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+
+	if (ret)
+		ret = check_table(filename, tabname, NULL, num_rows + 1);
+	return ret;
+}
+/*
+ * Bulk insert a copy of every row of the table, which rebuilds each index
+ * bottom-up.  Returns -1 if the table has an index that can't be built.
+ */
+static int
+test_bulk_insert(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	MdbBulkInsert *bulk;
+	GPtrArray *before, *expected, *copies;
+	unsigned int i, num_cols;
+	int ret = 1;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	if (!indexes_writable(table)) {
+		mdb_free_tabledef(table);
+		mdb_close(mdb);
+		return -1;
+	}
+	num_cols = table->num_cols;
+	before = read_table(table, NULL);
+	copies = copy_rows(table);
+	if (copies->len != before->len) {
+		ret = 0;
+	} else if (!(bulk = mdb_bulk_insert_begin(table))) {
+		ret = 0;
+	} else {
+		for (i=0;i<copies->len && ret;i++)
+			ret = mdb_bulk_insert_append(bulk, num_cols,
+				g_ptr_array_index(copies, i));
+		if (!mdb_bulk_insert_end(bulk))
+			ret = 0;
+	}
+	if (ret && !mdb_flush(mdb))
+		ret = 0;
+	free_copies(copies, num_cols);
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+
+	expected = double_rows(before);
+	if (ret)
+		ret = check_table(filename, tabname, expected, 0);
+	free_rows(expected);
+	free_rows(before);
+	return ret;
+}
+/*
+ * Write the rows of the table to a CSV file and load them again with
+ * mdb-import.  Returns -1 if the table has an index that can't be built.
+ */
+static int
+test_import(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	GPtrArray *before, *expected;
+	char *csvname, *cmd;
+	FILE *csv;
+	int ret = 0;
+
+	if (!(mdb = mdb_open(filename, MDB_NOFLAGS)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	/* mdb-import loads in bulk */
+	if (!indexes_writable(table)) {
+		mdb_free_tabledef(table);
+		mdb_close(mdb);
+		return -1;
+	}
+	csvname = g_strdup_printf("%s.csv", filename);
+	if (!(csv = fopen(csvname, "w"))) {
+		perror(csvname);
+		g_free(csvname);
+		mdb_free_tabledef(table);
+		mdb_close(mdb);
+		return 0;
+	}
+	before = read_table(table, csv);
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+	if (fclose(csv)) {
+		perror(csvname);
+		goto done;
+	}
+
+	cmd = g_strdup_printf("'%s' '%s' '%s' '%s'", import_prog, filename,
+		tabname, csvname);
+	if (system(cmd)) {
+		fprintf(stderr, "%s failed\n", cmd);
+		g_free(cmd);
+		goto done;
+	}
+	g_free(cmd);
+
+	expected = double_rows(before);
+	ret = check_table(filename, tabname, expected, 0);
+	free_rows(expected);
+
+done:
+	unlink(csvname);
+	g_free(csvname);
+	free_rows(before);
+	return ret;
+}
+/*
+ * Compact the file, which rewrites the table onto new pages and rebuilds
+ * its indexes.
+ */
+/*
+ * A clone reading a snapshot keeps seeing a data page of the table as it
+ * was while the writer changes and flushes it, and sees the change once
+ * the snapshot ends.  The byte changed is in the page's free space, and
+ * is put back afterwards.
+ */
+static int
+test_snapshot(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb, *reader = NULL;
+	MdbTableDef *table;
+	unsigned char *old_pg = NULL, *new_pg = NULL;
+	guint32 pg = 0;
+	int pg_size, pos = 0, ret = 0;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	pg_size = mdb->fmt->pg_size;
+	mdb_rewind_table(table);
+	while (mdb_fetch_row(table)) {
+		if (mdb_get_int16(mdb->pg_buf, 2) > 0) {
+			pg = table->cur_phys_pg;
+			break;
+		}
+	}
+	if (!pg) {
+		fprintf(stderr, "%s has no page with room left\n", tabname);
+		ret = -1;
+		goto done;
+	}
+	if (!mdb_read_pg(mdb, pg))
+		goto done;
+	pos = mdb->fmt->row_count_offset + 2 +
+		mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset) * 2;
+	old_pg = g_memdup(mdb->pg_buf, pg_size);
+	new_pg = g_memdup(mdb->pg_buf, pg_size);
+	new_pg[pos] ^= 0xff;
+
+	reader = mdb_clone_handle(mdb);
+	mdb_snapshot_begin(reader);
+	memcpy(mdb->pg_buf, new_pg, pg_size);
+	if (!mdb_write_pg(mdb, pg) || !mdb_flush(mdb))
+		goto done;
+	if (!mdb_read_pg(reader, pg))
+		goto done;
+	if (memcmp(reader->pg_buf, old_pg, pg_size)) {
+		fprintf(stderr, "the snapshot sees page %lu as the writer left it\n",
+			(unsigned long) pg);
+		goto done;
+	}
+	mdb_snapshot_end(reader);
+	if (!mdb_read_pg(reader, pg))
+		goto done;
+	if (memcmp(reader->pg_buf, new_pg, pg_size)) {
+		fprintf(stderr, "page %lu isn't what was written once the snapshot ended\n",
+			(unsigned long) pg);
+		goto done;
+	}
+	ret = 1;
+
+done:
+	mdb_close(reader);
+	/* put the page back the way it was */
+	if (old_pg && mdb_read_pg(mdb, pg)) {
+		memcpy(mdb->pg_buf, old_pg, pg_size);
+		if (!mdb_write_pg(mdb, pg) || !mdb_flush(mdb))
+			ret = 0;
+	}
+	mdb_free_tabledef(table);
+	mdb_close(mdb);
+	g_free(old_pg);
+	g_free(new_pg);
+	return ret;
+}
+static int
+test_compact(const char *filename, const char *tabname)
+{
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	GPtrArray *before;
+	int ret;
+
+	if (!(mdb = mdb_open(filename, MDB_WRITABLE)))
+		return 0;
+	if (!(table = open_table(mdb, tabname))) {
+		mdb_close(mdb);
+		return 0;
+	}
+	before = read_table(table, NULL);
+	mdb_free_tabledef(table);
+
+	mdb_set_journal(mdb, TRUE);
+	ret = mdb_compact(mdb) >= 0;
+	mdb_close(mdb);
+
+	if (ret)
+		ret = check_table(filename, tabname, before, 0);
+	free_rows(before);
+	return ret;
+}
+
+static int
+run_test(const char *name, int ok)
+{
+	printf("%s: %s\n", name, ok < 0 ? "skipped" : ok ? "ok" : "FAILED");
+	return ok != 0;
+}
+int
+main(int argc, char **argv)
+{
+	char *dir;
+	int ok = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <file> <table>\n", argv[0]);
+		exit(1);
+	}
+	dir = g_path_get_dirname(argv[0]);
+	import_prog = g_build_filename(dir, "mdb-import", NULL);
+	g_free(dir);
+	/* the format mdb-import reads dates in */
+	mdb_set_date_fmt("%Y-%m-%d %H:%M:%S");
+
+	ok &= run_test("resize row on an unordered page",
+		test_resize_unordered(argv[1], argv[2]));
+	ok &= run_test("insert a row into its indexes",
+		test_insert_row(argv[1], argv[2]));
+	ok &= run_test("move row off a full page",
+		test_move_row(argv[1], argv[2]));
+	ok &= run_test("bulk insert with bottom-up index builds",
+		test_bulk_insert(argv[1], argv[2]));
+	ok &= run_test("import a CSV file",
+		test_import(argv[1], argv[2]));
+	ok &= run_test("read a snapshot while the writer flushes",
+		test_snapshot(argv[1], argv[2]));
+	ok &= run_test("compact",
+		test_compact(argv[1], argv[2]));
+
+	g_free(import_prog);
+	return ok ? 0 : 1;
+}